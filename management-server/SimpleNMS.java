@@ -44,6 +44,11 @@ POSSIBILITY OF SUCH DAMAGE.
    the device with its SSH public key so that next time it won't have
    to use a password.  Lastly, after spending a few seconds sleeping,
    the NMS logs out of the device.
+
+   Connections go through admission control (see AdmissionControl below)
+   before any SSH work is done on them, so a fleet reconnecting at once
+   is let in as fast as the NMS can do handshakes, and the rest are
+   closed early so the devices back off and try again.
  *****************************************************************************/
 
 
@@ -51,13 +56,17 @@ POSSIBILITY OF SUCH DAMAGE.
    IMPORTS
  *****************************************************************************/
 
+import java.io.BufferedInputStream;
 import java.io.BufferedReader;
+import java.io.ByteArrayOutputStream;
 import java.io.Console;
+import java.io.File;
 import java.io.FileInputStream;
 import java.io.FileReader;
 import java.io.InputStream;
 import java.io.InputStreamReader;
 import java.io.IOException;
+import java.io.OutputStream;
 import java.lang.Exception;
 
 import javax.naming.ldap.LdapName;
@@ -68,16 +77,30 @@ import java.net.InetAddress;
 import java.net.InetSocketAddress;
 import java.net.Socket;
 import java.net.ServerSocket;
+import java.net.URLEncoder;
+import java.nio.file.Files;
+import java.nio.file.NoSuchFileException;
+import java.nio.file.StandardCopyOption;
 import java.security.cert.CertificateException;
 import java.security.cert.CertificateFactory;
 import java.security.cert.X509Certificate;
 import java.security.InvalidKeyException;
+import java.security.MessageDigest;
 import java.security.NoSuchAlgorithmException;
 import java.security.NoSuchProviderException;
 import java.security.PublicKey;
 import java.security.SignatureException;
+import java.util.ArrayDeque;
+import java.util.ArrayList;
 import java.util.Arrays;
+import java.util.HashMap;
+import java.util.HashSet;
+import java.util.Iterator;
+import java.util.LinkedHashMap;
+import java.util.Map;
 import java.util.Properties;
+import java.util.regex.Matcher;
+import java.util.regex.Pattern;
 
 import com.maverick.ssh.components.jce.SshX509RsaPublicKey;
 import com.maverick.ssh.components.SshKeyPair;
@@ -110,6 +133,10 @@ class DeviceHandler implements Runnable {
     // private vars
     Socket socket = null;
     Properties properties = null;
+    AdmissionControl admission = null;
+    RpcRouter router = null;
+    boolean handshaking = true;  // holds one of admission's handshake slots
+    String device_id = null;     // its serial number, once verified
 
     String client_hello = ""
                 + "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n"
@@ -122,27 +149,46 @@ class DeviceHandler implements Runnable {
                 + "</hello>\n"
                 + "]]>]]>\n";
 
+    // framed when sent, as the device's <hello> decides (our own
+    // message-ids are reserved, see DeviceSession.OWN_ID_PREFIX)
     String client_goodbye = ""
-                  + "<rpc message-id=\"101\"\n"
+                  + "<rpc message-id=\"" + DeviceSession.OWN_ID_PREFIX + "close-session\"\n"
                   + "     xmlns=\"urn:ietf:params:xml:ns:netconf:base:1.0\">\n"
                   + "  <close-session/>\n"
-                  + "</rpc>\n"
-                  + "]]>]]>\n";
+                  + "</rpc>";
 
     String set_public_key_preamble = ""
-                  + "<rpc message-id=\"101\"\n"
+                  + "<rpc message-id=\"" + DeviceSession.OWN_ID_PREFIX + "set-public-key\"\n"
                   + "     xmlns=\"urn:ietf:params:xml:ns:netconf:base:1.0\">\n"
                   + "  <set-public-key xmlns=\"example.com:1.0\">\n";
 
     String set_public_key_postamble = ""
                   + "\n  </set-public-key>\n"
-                  + "</rpc>\n"
-                  + "]]>]]>\n";
+                  + "</rpc>";
 
 
-    public DeviceHandler(Socket socket, Properties properties) {
+    public DeviceHandler(Socket socket, Properties properties,
+                         AdmissionControl admission, RpcRouter router) {
         this.socket = socket;
         this.properties = properties;  // does NOT require synchronization
+        this.admission = admission;
+        this.router = router;
+    }
+
+
+    // the SSH handshake and login are over (or failed), give back the
+    // handshake slot and its deadline, and stop timing the device out
+    private void handshakeDone() {
+        if (handshaking == false) {
+            return;
+        }
+        handshaking = false;
+        try {
+            socket.setSoTimeout(0);
+        } catch (IOException ex) {
+            // the socket's closed, nothing more will be read from it
+        }
+        admission.release(socket);
     }
 
 
@@ -166,6 +212,10 @@ class DeviceHandler implements Runnable {
         System.out.println("Starting SSH protocol...");
         try {
 
+            // the dispatcher closes the socket at the handshake's deadline;
+            // this catches a device that stalls a single read meanwhile
+            socket.setSoTimeout(admission.handshake_timeout_ms);
+
             // Create an SshConnector instance
             SshConnector con = SshConnector.createInstance();
 
@@ -277,6 +327,7 @@ class DeviceHandler implements Runnable {
                         String propname = "device." + i + ".serial_number";
                         String sn = properties.getProperty(propname);
                         if (sn.equals(CN_field)) {
+                            device_id = CN_field;
                             return true;
                         }
                     }
@@ -328,6 +379,7 @@ class DeviceHandler implements Runnable {
             }
 
             // ensure we're authenticated
+            handshakeDone();
             if(ssh2.isAuthenticated() == false) {
                 System.out.println("*** Error logging into this device!");
                 ssh2.disconnect();
@@ -338,16 +390,37 @@ class DeviceHandler implements Runnable {
             final Ssh2Session session = (Ssh2Session)ssh2.openSessionChannel();
             session.startSubsystem("netconf");
 
+            // routed RPCs (see RpcRouter) share the session with us
+            final DeviceSession device_session =
+                        new DeviceSession(device_id, session.getOutputStream());
+
             Thread t = new Thread() {
                 public void run() {
                     try {
-                        int read;
-                        while ((read = session.getInputStream().read()) > -1) {
-                            System.out.write(read);
-                            System.out.flush();
+                        NetconfReader reader =
+                                    new NetconfReader(session.getInputStream());
+
+                        // the device's <hello> says whether it frames in
+                        // chunks (NETCONF 1.1), as ours says we can
+                        String msg = reader.readMessage();
+                        if (msg == null) {
+                            return;
+                        }
+                        System.out.println("\nreceived: " + msg);
+                        System.out.flush();
+                        reader.chunked = msg.contains("urn:ietf:params:netconf:base:1.1");
+                        device_session.helloReceived(reader.chunked);
+
+                        // this instance now holds the device's session
+                        router.attach(device_id, device_session);
+                        while ((msg = reader.readMessage()) != null) {
+                            device_session.received(msg);
                         }
                     } catch (Exception ex) {
                         ex.printStackTrace();
+                    } finally {
+                        device_session.close();
+                        router.detach(device_id, device_session);
                     }
                 }
             };
@@ -356,26 +429,36 @@ class DeviceHandler implements Runnable {
             // send <hello>
             System.out.println("\nsending: " + client_hello);
             System.out.flush();
-            session.getOutputStream().write(client_hello.getBytes());
+            device_session.write(client_hello);
+
+            // our RPCs are framed as the device's <hello> says
+            if (device_session.awaitHello(router.rpc_timeout_ms) == false) {
+                System.out.println("*** Error: no <hello> from this device!");
+                session.close();
+                ssh2.disconnect();
+                return;
+            }
 
             // send <set-public-key>, if needed
             if (set_public_key == true) {
                 System.out.println("\nsending: " + set_public_key_rpc);
                 System.out.flush();
-                session.getOutputStream().write(set_public_key_rpc.getBytes());
+                device_session.send(set_public_key_rpc);
             }
 
             // in a real app, the logic would wait forever for there to
             // be data ready to send or receive but, to keep things simple,
-            // we'll just sleep 5 seconds and then disconnect...
-            System.out.println("\nsleeping 5 seconds...");
+            // we'll just hold the session for session.hold_secs (serving
+            // any RPCs routed to the device meanwhile) and then disconnect...
+            int hold_secs = SimpleNMS.intProperty(properties, "session.hold_secs", 5);
+            System.out.println("\nsleeping " + hold_secs + " seconds...");
             System.out.flush();
-            Thread.sleep(5000);
+            Thread.sleep(hold_secs * 1000L);
 
             // send <close-session>
             System.out.println("\nsending: " + client_goodbye);
             System.out.flush();
-            session.getOutputStream().write(client_goodbye.getBytes());
+            device_session.send(client_goodbye);
             Thread.sleep(100); // just to make sure its delivered
 
             // close out SSH session and connection
@@ -385,6 +468,1016 @@ class DeviceHandler implements Runnable {
         } catch(Throwable t) {
             System.out.println("\ncatch-all stacktrace catcher:");
             t.printStackTrace();
+        } finally {
+            handshakeDone();
+            if (socket.isClosed() == false) {
+                try {
+                    socket.close();
+                } catch (IOException ex) {
+                    // already gone
+                }
+            }
+        }
+    }
+}
+
+
+
+
+// Decides, for each accepted connection, whether the NMS takes it on now,
+// later or not at all, before any SSH work is done on it:
+//
+//   - each source address may connect admission.per_source_rate times a
+//     second (a token bucket, admission.per_source_burst deep), so one
+//     device retrying in a tight loop can't crowd out the rest
+//   - at most admission.max_handshakes connections are in their SSH
+//     handshake and login at once; the next ones wait in a queue of
+//     admission.queue_size, first come first served
+//   - a connection that has waited admission.queue_timeout_ms is
+//     dropped, as its device has likely given up on it by then
+//   - a connection still in its handshake and login
+//     admission.handshake_timeout_ms after it started is closed, however
+//     much the device trickles in meanwhile
+//
+// Connections over a limit are reset right away, so the device sees its
+// attempt fail and backs off instead of waiting out its own timeout.  A
+// value of 0 turns a limit off.  A dispatcher thread (run()) starts
+// queued connections as slots free up, drops the expired ones and closes
+// the handshakes that are over time.
+class AdmissionControl implements Runnable {
+
+    static final long REPORT_INTERVAL_MS = 10000;
+    static final int  MAX_SOURCES = 65536;   // buckets kept before pruning
+
+    // a connection waiting for a handshake slot
+    static class Waiting {
+        Socket socket;
+        long   deadline_ms;
+
+        Waiting(Socket socket, long deadline_ms) {
+            this.socket = socket;
+            this.deadline_ms = deadline_ms;
+        }
+    }
+
+    // a source address's token bucket
+    static class Bucket {
+        double tokens;
+        long   refilled_ms;
+
+        Bucket(double tokens, long refilled_ms) {
+            this.tokens = tokens;
+            this.refilled_ms = refilled_ms;
+        }
+    }
+
+    // settings
+    Properties properties = null;
+    RpcRouter  router = null;
+    int        max_handshakes;
+    int        queue_size;
+    int        queue_timeout_ms;
+    int        handshake_timeout_ms;
+    double     per_source_rate;
+    double     per_source_burst;
+
+    // state, guarded by `this`
+    int                          handshaking = 0;
+    LinkedHashMap<Socket, Long>  deadlines =   // of the handshakes, oldest first
+                                        new LinkedHashMap<Socket, Long>();
+    ArrayDeque<Waiting>          queue = new ArrayDeque<Waiting>();
+    HashMap<InetAddress, Bucket> buckets = new HashMap<InetAddress, Bucket>();
+
+    // counted since the last report
+    long admitted = 0;
+    long rate_limited = 0;
+    long queue_full = 0;
+    long expired = 0;
+    long timed_out = 0;
+
+
+    public AdmissionControl(Properties properties, RpcRouter router) {
+        this.properties = properties;
+        this.router = router;
+        max_handshakes = intProperty("admission.max_handshakes", 32);
+        queue_size = intProperty("admission.queue_size", 256);
+        queue_timeout_ms = intProperty("admission.queue_timeout_ms", 5000);
+        handshake_timeout_ms = intProperty("admission.handshake_timeout_ms", 30000);
+        per_source_rate = intProperty("admission.per_source_rate", 2);
+        per_source_burst = Math.max(1, intProperty("admission.per_source_burst", 5));
+    }
+
+
+    private int intProperty(String name, int dflt) {
+        return SimpleNMS.intProperty(properties, name, dflt);
+    }
+
+
+    // monotonic, unlike the wall clock
+    private static long nowMs() {
+        return System.nanoTime() / 1000000;
+    }
+
+
+    // take on, queue or reset a just-accepted connection
+    public synchronized void offer(Socket socket) {
+        long now = nowMs();
+
+        if (rateAllows(socket.getInetAddress(), now) == false) {
+            rate_limited++;
+            shed(socket);
+        } else if ((max_handshakes == 0 || handshaking < max_handshakes) &&
+                   queue.isEmpty()) {
+            start(socket);
+        } else if (queue_size == 0 || queue.size() < queue_size) {
+            queue.addLast(new Waiting(socket, (queue_timeout_ms == 0) ?
+                                              Long.MAX_VALUE : now + queue_timeout_ms));
+            notifyAll();
+        } else {
+            queue_full++;
+            shed(socket);
+        }
+    }
+
+
+    // a handshake slot is free again (called once per started connection)
+    public synchronized void release(Socket socket) {
+        handshaking--;
+        deadlines.remove(socket);
+        notifyAll();
+    }
+
+
+    // take a token from the source's bucket, if it has one
+    private boolean rateAllows(InetAddress source, long now) {
+        Bucket bucket;
+
+        if (per_source_rate == 0) {
+            return true;
+        }
+        bucket = buckets.get(source);
+        if (bucket == null) {
+            if (buckets.size() >= MAX_SOURCES) {
+                pruneBuckets(now);
+            }
+            bucket = new Bucket(per_source_burst, now);
+            buckets.put(source, bucket);
+        }
+        bucket.tokens = Math.min(per_source_burst, bucket.tokens +
+                                 (now - bucket.refilled_ms) * per_source_rate / 1000);
+        bucket.refilled_ms = now;
+        if (bucket.tokens < 1) {
+            return false;
+        }
+        bucket.tokens -= 1;
+        return true;
+    }
+
+
+    // forget sources whose bucket has filled up again, they're as new
+    private void pruneBuckets(long now) {
+        Iterator<Map.Entry<InetAddress, Bucket>> it = buckets.entrySet().iterator();
+
+        while (it.hasNext()) {
+            Bucket bucket = it.next().getValue();
+            if (bucket.tokens + (now - bucket.refilled_ms) * per_source_rate / 1000 >=
+                per_source_burst) {
+                it.remove();
+            }
+        }
+    }
+
+
+    // hand the connection to a DeviceHandler, in a thread of its own
+    private void start(Socket socket) {
+        handshaking++;
+        admitted++;
+        if (handshake_timeout_ms != 0) {
+            deadlines.put(socket, nowMs() + handshake_timeout_ms);
+            notifyAll();  // the dispatcher times it out
+        }
+        Thread thread = new Thread(new DeviceHandler(socket, properties, this, router));
+        thread.start();
+    }
+
+
+    // reset the connection: before any SSH has been spoken on it, or when
+    // its handshake is over time
+    private void shed(Socket socket) {
+        try {
+            socket.setSoLinger(true, 0);
+            socket.close();
+        } catch (IOException ex) {
+            // gone already, which is as good
+        }
+    }
+
+
+    // start queued connections as slots free up, drop the expired ones,
+    // close the handshakes over time, and report what admission control
+    // has been doing
+    @Override
+    public void run() {
+        long reported_ms = nowMs();
+
+        synchronized (this) {
+            while (true) {
+                long now = nowMs();
+                long wait_ms;
+
+                while (queue.isEmpty() == false && queue.peekFirst().deadline_ms <= now) {
+                    expired++;
+                    shed(queue.pollFirst().socket);
+                }
+                // their handlers fail and release() the slots
+                Iterator<Map.Entry<Socket, Long>> it = deadlines.entrySet().iterator();
+                while (it.hasNext()) {
+                    Map.Entry<Socket, Long> handshake = it.next();
+                    if (handshake.getValue() > now) {
+                        break;
+                    }
+                    timed_out++;
+                    shed(handshake.getKey());
+                    it.remove();
+                }
+                while (queue.isEmpty() == false &&
+                       (max_handshakes == 0 || handshaking < max_handshakes)) {
+                    start(queue.pollFirst().socket);
+                }
+
+                if (now - reported_ms >= REPORT_INTERVAL_MS) {
+                    if (admitted + rate_limited + queue_full + expired + timed_out > 0) {
+                        System.out.println("admission: " + handshaking + " handshaking, "
+                                           + queue.size() + " queued; "
+                                           + admitted + " admitted, "
+                                           + rate_limited + " rate-limited, "
+                                           + queue_full + " queue-full, "
+                                           + expired + " expired, "
+                                           + timed_out + " timed out");
+                    }
+                    admitted = rate_limited = queue_full = expired = timed_out = 0;
+                    pruneBuckets(now);
+                    reported_ms = now;
+                }
+                wait_ms = reported_ms + REPORT_INTERVAL_MS - now;
+                if (queue.isEmpty() == false) {
+                    wait_ms = Math.min(wait_ms, queue.peekFirst().deadline_ms - now);
+                }
+                if (deadlines.isEmpty() == false) {
+                    wait_ms = Math.min(wait_ms, deadlines.values().iterator().next() - now);
+                }
+                try {
+                    wait(Math.max(1, wait_ms));
+                } catch (InterruptedException ex) {
+                    return;
+                }
+            }
+        }
+    }
+}
+
+
+
+
+// Reads NETCONF messages off a stream, framed with ]]>]]> (NETCONF 1.0)
+// or, once `chunked` is set, in chunks (NETCONF 1.1, RFC 6242).
+class NetconfReader {
+
+    static final String EOM = "]]>]]>";
+    static final int    MAX_MESSAGE = 64 * 1024 * 1024;
+
+    InputStream in;
+    boolean     chunked = false;
+
+    public NetconfReader(InputStream in) {
+        this.in = new BufferedInputStream(in);
+    }
+
+
+    // `msg` with the framing given
+    static String frame(String msg, boolean chunked) throws IOException {
+        if (chunked) {
+            return "\n#" + msg.getBytes("UTF-8").length + "\n" + msg + "\n##\n";
+        }
+        return msg + "\n" + EOM + "\n";
+    }
+
+
+    // the next line, without its \n; null at the end of the stream
+    public String readLine() throws IOException {
+        ByteArrayOutputStream line = new ByteArrayOutputStream();
+        int c;
+
+        while ((c = in.read()) != -1 && c != '\n') {
+            if (line.size() == MAX_MESSAGE) {
+                throw new IOException("line too long");
+            }
+            line.write(c);
+        }
+        if (c == -1 && line.size() == 0) {
+            return null;
+        }
+        return line.toString("UTF-8");
+    }
+
+
+    // the next message, without its framing; null at the end of the stream
+    public String readMessage() throws IOException {
+        return chunked ? readChunks() : readToEom();
+    }
+
+
+    private String readToEom() throws IOException {
+        byte[] buf = new byte[4096];
+        int    len = 0;
+        int    c;
+
+        while ((c = in.read()) != -1) {
+            if (len == buf.length) {
+                if (len == MAX_MESSAGE) {
+                    throw new IOException("message too long");
+                }
+                buf = Arrays.copyOf(buf, len * 2);
+            }
+            buf[len++] = (byte)c;
+            if (c == '>' && len >= EOM.length() &&
+                new String(buf, len - EOM.length(), EOM.length(), "UTF-8").equals(EOM)) {
+                return new String(buf, 0, len - EOM.length(), "UTF-8").trim();
+            }
+        }
+        return null;
+    }
+
+
+    // "\n#<size>\n<chunk>" ... "\n##\n"
+    private String readChunks() throws IOException {
+        ByteArrayOutputStream msg = new ByteArrayOutputStream();
+
+        while (true) {
+            String header;
+            int    size;
+
+            do {
+                header = readLine();
+            } while (header != null && header.length() == 0);
+            if (header == null) {
+                return null;
+            }
+            if (header.equals("##")) {
+                return msg.toString("UTF-8");
+            }
+            try {
+                size = Integer.parseInt(header.substring(1));
+            } catch(NumberFormatException e) {
+                size = 0;
+            }
+            if (header.charAt(0) != '#' || size <= 0 || msg.size() + size > MAX_MESSAGE) {
+                throw new IOException("bad chunk header \"" + header + "\"");
+            }
+            byte[] chunk = new byte[size];
+            int    got = 0;
+            while (got < size) {
+                int n = in.read(chunk, got, size - got);
+                if (n == -1) {
+                    return null;
+                }
+                got += n;
+            }
+            msg.write(chunk, 0, size);
+        }
+    }
+}
+
+
+
+
+// A device's NETCONF session, held by this instance's DeviceHandler.  The
+// RpcRouter sends RPCs into it, one at a time, and gets their replies by
+// message-id; the device's other messages are printed, as before.  The
+// handler's own RPCs use message-ids starting with OWN_ID_PREFIX, which
+// routed RPCs can't, so a routed RPC is never handed their replies.
+class DeviceSession {
+
+    static final Pattern MESSAGE_ID =
+                    Pattern.compile("message-id\\s*=\\s*[\"']([^\"']*)[\"']");
+    static final String  OWN_ID_PREFIX = "simple-nms-";
+
+    String       device;
+    OutputStream out;
+    boolean      hello = false;         // the device's <hello> has been read
+    boolean      chunked = false;       // both hellos said base:1.1
+    boolean      closed = false;
+    Object       rpc_lock = new Object();
+    String       waiting_id = null;     // the routed RPC's message-id
+    String       reply = null;
+
+
+    public DeviceSession(String device, OutputStream out) {
+        this.device = device;
+        this.out = out;
+    }
+
+
+    // the message-id attribute of an <rpc> or <rpc-reply>, null if none
+    static String messageId(String msg) {
+        Matcher m = MESSAGE_ID.matcher(msg);
+        return m.find() ? m.group(1) : null;
+    }
+
+
+    // the device's <hello> has been read (called by DeviceHandler's reader)
+    public synchronized void helloReceived(boolean chunked) {
+        this.chunked = chunked;
+        hello = true;
+        notifyAll();
+    }
+
+
+    // wait up to timeout_ms for the device's <hello>, false if it didn't come
+    public synchronized boolean awaitHello(long timeout_ms) throws InterruptedException {
+        long deadline = System.nanoTime() / 1000000 + timeout_ms;
+
+        while (hello == false && closed == false) {
+            long left = deadline - System.nanoTime() / 1000000;
+            if (left <= 0) {
+                break;
+            }
+            wait(left);
+        }
+        return hello;
+    }
+
+
+    // send one of DeviceHandler's own messages, framed as the session is
+    public synchronized void send(String msg) throws IOException {
+        write(NetconfReader.frame(msg, chunked));
+    }
+
+
+    // write an already-framed message to the device
+    public synchronized void write(String framed) throws IOException {
+        out.write(framed.getBytes("UTF-8"));
+        out.flush();
+    }
+
+
+    // a message from the device (called by DeviceHandler's reader)
+    public synchronized void received(String msg) {
+        if (waiting_id != null && reply == null && waiting_id.equals(messageId(msg))) {
+            reply = msg;
+            notifyAll();
+            return;
+        }
+        System.out.println("\nreceived: " + msg);
+        System.out.flush();
+    }
+
+
+    // the session has ended, fail any RPC waiting on it
+    public synchronized void close() {
+        closed = true;
+        notifyAll();
+    }
+
+
+    // send `rpc` to the device and wait up to timeout_ms for its reply
+    public String rpc(String rpc, long timeout_ms) throws IOException {
+        String id = messageId(rpc);
+
+        if (id == null) {
+            throw new IOException("the <rpc> has no message-id");
+        }
+        synchronized (rpc_lock) {
+            synchronized (this) {
+                long deadline = System.nanoTime() / 1000000 + timeout_ms;
+
+                if (closed) {
+                    throw new IOException("the session with " + device + " has ended");
+                }
+                waiting_id = id;
+                reply = null;
+                try {
+                    write(NetconfReader.frame(rpc, chunked));
+                    while (reply == null && closed == false) {
+                        long left = deadline - System.nanoTime() / 1000000;
+                        if (left <= 0) {
+                            throw new IOException("no reply from " + device + " in " +
+                                                  timeout_ms + " ms");
+                        }
+                        wait(left);
+                    }
+                    if (reply == null) {
+                        throw new IOException("the session with " + device + " has ended");
+                    }
+                    return reply;
+                } catch (InterruptedException ex) {
+                    throw new IOException("interrupted");
+                } finally {
+                    waiting_id = null;
+                    reply = null;
+                }
+            }
+        }
+    }
+}
+
+
+
+
+// Where a device's call-home session is: the instance holding it, and the
+// address that instance's RpcRouter listens on.
+class RegistryEntry {
+    String instance;
+    String host;
+    int    port;
+
+    RegistryEntry(String instance, String host, int port) {
+        this.instance = instance;
+        this.host = host;
+        this.port = port;
+    }
+
+    public String toString() {
+        return instance + " " + host + " " + port;
+    }
+
+    // the inverse of toString(), null if `line` isn't one
+    static RegistryEntry parse(String line) {
+        String[] words = line.trim().split(" ");
+
+        if (words.length != 3) {
+            return null;
+        }
+        try {
+            return new RegistryEntry(words[0], words[1], Integer.parseInt(words[2]));
+        } catch(NumberFormatException e) {
+            return null;
+        }
+    }
+}
+
+
+
+
+// The device-session registry the NMS instances share.  The backend is
+// named by registry.backend: "local" (this instance only, the default),
+// "file" (see FileSessionRegistry), or the name of a class implementing
+// this interface with a no-argument constructor.
+interface SessionRegistry {
+
+    // called once, before anything else; `self` is this instance
+    void open(Properties properties, RegistryEntry self) throws IOException;
+
+    // the device's session is now with this instance
+    void register(String device) throws IOException;
+
+    // the device's session with this instance has ended
+    void unregister(String device) throws IOException;
+
+    // the instance holding the device's session, null if none does
+    RegistryEntry lookup(String device) throws IOException;
+}
+
+
+
+
+// A registry of this instance's sessions only, for an NMS running alone.
+class LocalSessionRegistry implements SessionRegistry {
+
+    RegistryEntry           self = null;
+    HashMap<String, String> devices = new HashMap<String, String>();
+
+    public void open(Properties properties, RegistryEntry self) {
+        this.self = self;
+    }
+
+    public synchronized void register(String device) {
+        devices.put(device, self.instance);
+    }
+
+    public synchronized void unregister(String device) {
+        devices.remove(device);
+    }
+
+    public synchronized RegistryEntry lookup(String device) {
+        return devices.containsKey(device) ? self : null;
+    }
+}
+
+
+
+
+// A registry in a directory the instances share (registry.path): a file
+// per device in sessions/, naming the instance that holds its session,
+// and a file per instance in instances/, rewritten every third of
+// registry.lease_ms as a heartbeat.  A device's entry counts only while
+// its instance's heartbeat is younger than the lease, so the sessions of
+// an instance that died are forgotten, and the devices' next call home,
+// to whichever instance, takes them over.  Files are replaced by rename,
+// so readers never see half an entry.
+//
+// The directory can be local, on /dev/shm as a shared-memory stand-in, or
+// on a file system several hosts share (whose clocks then need to agree
+// to well within the lease).
+class FileSessionRegistry implements SessionRegistry, Runnable {
+
+    File            sessions;
+    File            instances;
+    RegistryEntry   self;
+    long            lease_ms;
+    HashSet<String> local = new HashSet<String>();  // guarded by `this`
+
+
+    public void open(Properties properties, RegistryEntry self) throws IOException {
+        File dir = new File(properties.getProperty("registry.path", "nms-registry"));
+
+        this.self = self;
+        lease_ms = Math.max(3, SimpleNMS.intProperty(properties, "registry.lease_ms", 15000));
+        sessions = new File(dir, "sessions");
+        instances = new File(dir, "instances");
+        sessions.mkdirs();
+        instances.mkdirs();
+        if (sessions.isDirectory() == false || instances.isDirectory() == false) {
+            throw new IOException("can't create " + sessions + " and " + instances);
+        }
+        heartbeat();
+
+        Thread thread = new Thread(this);
+        thread.setDaemon(true);
+        thread.start();
+    }
+
+
+    // a file name for `name` that can't be "..", or contain a "/"
+    private static String fileName(String name) throws IOException {
+        return URLEncoder.encode(name, "UTF-8").replace(".", "%2E").replace("*", "%2A");
+    }
+
+
+    private String read(File file) throws IOException {
+        try {
+            return new String(Files.readAllBytes(file.toPath()), "UTF-8");
+        } catch (NoSuchFileException ex) {
+            return null;
+        }
+    }
+
+
+    private void write(File file, String content) throws IOException {
+        File tmp = new File(file.getPath() + ".tmp-" + fileName(self.instance) +
+                            "-" + Thread.currentThread().getId());
+
+        Files.write(tmp.toPath(), content.getBytes("UTF-8"));
+        Files.move(tmp.toPath(), file.toPath(), StandardCopyOption.ATOMIC_MOVE,
+                   StandardCopyOption.REPLACE_EXISTING);
+    }
+
+
+    // whether the instance's heartbeat is within the lease
+    private boolean alive(String instance) throws IOException {
+        long beat = new File(instances, fileName(instance)).lastModified();
+        return beat != 0 && System.currentTimeMillis() - beat < lease_ms;
+    }
+
+
+    public void register(String device) throws IOException {
+        synchronized (this) {
+            local.add(device);
+        }
+        write(new File(sessions, fileName(device)), self.toString());
+    }
+
+
+    public void unregister(String device) throws IOException {
+        File          file = new File(sessions, fileName(device));
+        String        content = read(file);
+        RegistryEntry entry = (content == null) ? null : RegistryEntry.parse(content);
+
+        synchronized (this) {
+            local.remove(device);
+        }
+        // not if the device has called home to another instance since
+        if (entry != null && entry.instance.equals(self.instance)) {
+            file.delete();
+        }
+    }
+
+
+    public RegistryEntry lookup(String device) throws IOException {
+        String        content = read(new File(sessions, fileName(device)));
+        RegistryEntry entry = (content == null) ? null : RegistryEntry.parse(content);
+
+        if (entry == null) {
+            return null;
+        }
+        if (entry.instance.equals(self.instance)) {
+            return self;
+        }
+        return alive(entry.instance) ? entry : null;
+    }
+
+
+    // renew this instance's lease, and put back the entries of its
+    // sessions that a racing unregister() (or an operator) removed
+    private void heartbeat() throws IOException {
+        ArrayList<String> devices;
+
+        write(new File(instances, fileName(self.instance)), self.toString());
+        synchronized (this) {
+            devices = new ArrayList<String>(local);
+        }
+        for (String device : devices) {
+            File          file = new File(sessions, fileName(device));
+            String        content = read(file);
+            RegistryEntry entry = (content == null) ? null : RegistryEntry.parse(content);
+
+            if (entry == null || (entry.instance.equals(self.instance) == false &&
+                                  alive(entry.instance) == false)) {
+                write(file, self.toString());
+            }
+        }
+    }
+
+
+    @Override
+    public void run() {
+        while (true) {
+            try {
+                Thread.sleep(lease_ms / 3);
+                heartbeat();
+            } catch (InterruptedException ex) {
+                return;
+            } catch (IOException ex) {
+                System.out.println("*** WARNING: registry heartbeat failed: " + ex);
+            }
+        }
+    }
+}
+
+
+
+
+// Routes RPCs to devices by name, to whichever instance holds their
+// call-home session.  It listens on registry.rpc_address (loopback unless
+// set) and registry.rpc_port for connections that start with
+//
+//     secret <the contents of registry.rpc_secret_file>\n
+//
+// and then make requests of the form
+//
+//     rpc <device-serial-number>\n<rpc message-id="..." ...>...</rpc>]]>]]>
+//
+// answering each with the device's <rpc-reply>, or one carrying an
+// <rpc-error> if the RPC couldn't be delivered, followed by ]]>]]>.  A
+// connection without the secret is refused before anything is routed;
+// RPCs like <set-public-key> go to every device.  A device whose session
+// is with another instance, per the registry, has its request forwarded
+// there as "forwarded <device>", with the same secret, which that
+// instance answers itself and never forwards again.
+class RpcRouter implements Runnable {
+
+    Properties                     properties;
+    SessionRegistry                registry;
+    RegistryEntry                  self;
+    int                            rpc_timeout_ms;
+    byte[]                         secret = null;   // from registry.rpc_secret_file
+    ServerSocket                   listener = null;
+    HashMap<String, DeviceSession> sessions =  // this instance's, guarded by `this`
+                                        new HashMap<String, DeviceSession>();
+
+
+    public RpcRouter(Properties properties, int server_port) throws IOException {
+        String backend = properties.getProperty("registry.backend", "local");
+
+        this.properties = properties;
+        rpc_timeout_ms = SimpleNMS.intProperty(properties, "registry.rpc_timeout_ms", 30000);
+        self = new RegistryEntry(
+            properties.getProperty("registry.instance",
+                                   InetAddress.getLocalHost().getHostName() + ":" + server_port),
+            properties.getProperty("registry.rpc_address", "127.0.0.1"),
+            SimpleNMS.intProperty(properties, "registry.rpc_port", 0));
+        if (self.instance.contains(" ") || self.host.contains(" ")) {
+            throw new IOException("registry.instance and registry.rpc_address " +
+                                  "can't contain spaces");
+        }
+
+        if (backend.equals("local")) {
+            registry = new LocalSessionRegistry();
+        } else if (backend.equals("file")) {
+            registry = new FileSessionRegistry();
+        } else {
+            try {
+                registry = (SessionRegistry)Class.forName(backend).getDeclaredConstructor()
+                                                     .newInstance();
+            } catch (Exception ex) {
+                throw new IOException("unknown registry.backend \"" + backend + "\": " + ex);
+            }
+        }
+        registry.open(properties, self);
+    }
+
+
+    // start listening for RPCs, if registry.rpc_port is set
+    public boolean listen() throws IOException {
+        String path = properties.getProperty("registry.rpc_secret_file");
+
+        if (self.port == 0) {
+            return false;
+        }
+        if (path == null) {
+            throw new IOException("registry.rpc_port needs a registry.rpc_secret_file");
+        }
+        secret = new String(Files.readAllBytes(new File(path).toPath()), "UTF-8")
+                     .trim().getBytes("UTF-8");
+        if (secret.length == 0) {
+            throw new IOException(path + " is empty");
+        }
+        listener = new ServerSocket(self.port, 50, InetAddress.getByName(self.host));
+        return true;
+    }
+
+
+    // true if a client's first line gives the secret, compared in
+    // constant time
+    private boolean authorized(String line) throws IOException {
+        if (line == null || line.startsWith("secret ") == false) {
+            return false;
+        }
+        return MessageDigest.isEqual(line.substring(7).trim().getBytes("UTF-8"), secret);
+    }
+
+
+    // the device's session is now with this instance
+    public void attach(String device, DeviceSession session) {
+        synchronized (this) {
+            sessions.put(device, session);
+        }
+        try {
+            registry.register(device);
+        } catch (IOException ex) {
+            System.out.println("*** WARNING: can't register " + device + ": " + ex);
+        }
+    }
+
+
+    // the device's session has ended (unless it has called home again)
+    public void detach(String device, DeviceSession session) {
+        synchronized (this) {
+            if (sessions.get(device) != session) {
+                return;
+            }
+            sessions.remove(device);
+        }
+        try {
+            registry.unregister(device);
+        } catch (IOException ex) {
+            System.out.println("*** WARNING: can't unregister " + device + ": " + ex);
+        }
+    }
+
+
+    // an <rpc-reply> saying why `rpc` went undelivered
+    private static String rpcError(String rpc, String message) {
+        String id = DeviceSession.messageId(rpc);
+
+        return "<rpc-reply"
+             + ((id == null) ? "" : " message-id=\"" + escape(id) + "\"")
+             + " xmlns=\"urn:ietf:params:xml:ns:netconf:base:1.0\">\n"
+             + "  <rpc-error>\n"
+             + "    <error-type>application</error-type>\n"
+             + "    <error-tag>operation-failed</error-tag>\n"
+             + "    <error-severity>error</error-severity>\n"
+             + "    <error-message>" + escape(message) + "</error-message>\n"
+             + "  </rpc-error>\n"
+             + "</rpc-reply>";
+    }
+
+
+    private static String escape(String text) {
+        return text.replace("&", "&amp;").replace("<", "&lt;").replace(">", "&gt;")
+                   .replace("\"", "&quot;");
+    }
+
+
+    // the device's reply to `rpc`, from wherever its session is
+    public String route(String device, String rpc, boolean forwarded) {
+        DeviceSession session;
+        String        id = DeviceSession.messageId(rpc);
+
+        if (id != null && id.startsWith(DeviceSession.OWN_ID_PREFIX)) {
+            return rpcError(rpc, "message-ids starting with \"" +
+                                 DeviceSession.OWN_ID_PREFIX + "\" are reserved");
+        }
+        synchronized (this) {
+            session = sessions.get(device);
+        }
+        try {
+            if (session != null) {
+                return session.rpc(rpc, rpc_timeout_ms);
+            }
+            if (forwarded) {
+                return rpcError(rpc, self.instance + " has no session with " + device);
+            }
+            RegistryEntry entry = registry.lookup(device);
+            if (entry == null || entry.instance.equals(self.instance)) {
+                return rpcError(rpc, device + " has no call-home session");
+            }
+            if (entry.port == 0) {
+                return rpcError(rpc, device + "'s session is with " + entry.instance +
+                                     ", which doesn't route RPCs");
+            }
+            return forward(entry, device, rpc);
+        } catch (IOException ex) {
+            return rpcError(rpc, ex.getMessage());
+        }
+    }
+
+
+    // hand the request to the instance holding the device's session
+    private String forward(RegistryEntry entry, String device, String rpc)
+                                                            throws IOException {
+        Socket socket = new Socket();
+
+        try {
+            socket.connect(new InetSocketAddress(entry.host, entry.port), rpc_timeout_ms);
+            socket.setSoTimeout(rpc_timeout_ms * 2);
+            OutputStream out = socket.getOutputStream();
+            out.write(("secret " + new String(secret, "UTF-8") + "\n" +
+                       "forwarded " + device + "\n" +
+                       NetconfReader.frame(rpc, false)).getBytes("UTF-8"));
+            out.flush();
+            String reply = new NetconfReader(socket.getInputStream()).readMessage();
+            if (reply == null) {
+                throw new IOException(entry.instance + " hung up");
+            }
+            return reply;
+        } finally {
+            socket.close();
+        }
+    }
+
+
+    // answer one client's requests, in turn
+    private void serve(Socket socket) {
+        try {
+            NetconfReader reader = new NetconfReader(socket.getInputStream());
+            OutputStream  out = socket.getOutputStream();
+            String        request;
+
+            if (authorized(reader.readLine()) == false) {
+                System.out.println("RPC client " + socket + " refused: no secret");
+                out.write(NetconfReader.frame(rpcError("", "expected \"secret <secret>\""),
+                                              false).getBytes("UTF-8"));
+                return;
+            }
+            while ((request = reader.readLine()) != null) {
+                String[] words = request.trim().split(" ");
+
+                if (words.length == 1 && words[0].length() == 0) {
+                    continue;  // the \n after the last ]]>]]>
+                }
+                if (words.length != 2 || (words[0].equals("rpc") == false &&
+                                          words[0].equals("forwarded") == false)) {
+                    out.write(NetconfReader.frame(rpcError("", "expected \"rpc <device>\""),
+                                                  false).getBytes("UTF-8"));
+                    break;
+                }
+                String rpc = reader.readMessage();
+                if (rpc == null) {
+                    break;
+                }
+                String reply = route(words[1], rpc, words[0].equals("forwarded"));
+                out.write(NetconfReader.frame(reply, false).getBytes("UTF-8"));
+                out.flush();
+            }
+        } catch (IOException ex) {
+            System.out.println("RPC client " + socket + " failed: " + ex);
+        } finally {
+            try {
+                socket.close();
+            } catch (IOException ex) {
+                // already gone
+            }
+        }
+    }
+
+
+    @Override
+    public void run() {
+        while (true) {
+            try {
+                final Socket socket = listener.accept();
+                Thread thread = new Thread() {
+                    public void run() {
+                        serve(socket);
+                    }
+                };
+                thread.setDaemon(true);
+                thread.start();
+            } catch (IOException ex) {
+                System.out.println("RPC accept() failed: " + ex);
+                return;
+            }
         }
     }
 }
@@ -394,9 +1487,30 @@ class DeviceHandler implements Runnable {
 
 public class SimpleNMS {
 
+    // a setting, `dflt` if it's missing or not a number
+    static int intProperty(Properties properties, String name, int dflt) {
+        String value = properties.getProperty(name);
+
+        if (value == null) {
+            return dflt;
+        }
+        try {
+            int number = Integer.parseInt(value.trim());
+            if (number >= 0) {
+                return number;
+            }
+        } catch(NumberFormatException e) {
+            // reported below
+        }
+        System.out.println("*** WARNING: " + name + " must be a number, using " + dflt);
+        return dflt;
+    }
+
+
     public static void main(String[] args) {
         String  file;
         Integer port;
+        Integer backlog = 1024;
 
 
         // determine which prop file to read from command line
@@ -417,6 +1531,15 @@ public class SimpleNMS {
             return;
         }
 
+        // settings can also be given on the command line, -Dserver.port=7778,
+        // so that several instances can share a property file
+        for (String name : System.getProperties().stringPropertyNames()) {
+            if (name.startsWith("server.") || name.startsWith("admission.") ||
+                name.startsWith("registry.") || name.startsWith("session.")) {
+                properties.setProperty(name, System.getProperty(name));
+            }
+        }
+
         try {
             port = Integer.parseInt(properties.getProperty("server.port"));
         } catch(NumberFormatException e) {
@@ -425,12 +1548,46 @@ public class SimpleNMS {
             return;
         }
 
+        // room for a fleet's worth of connects to wait for accept()
+        if (properties.getProperty("server.backlog") != null) {
+            try {
+                backlog = Integer.parseInt(properties.getProperty("server.backlog"));
+            } catch(NumberFormatException e) {
+                System.out.print("\n*** ERROR: invalid backlog specified, " +
+                                 "please check property file and try again.\n");
+                return;
+            }
+        }
+
+        // knows which instance holds each device's session, and routes
+        // RPCs to it
+        RpcRouter router;
+        try {
+            router = new RpcRouter(properties, port);
+            if (router.listen()) {
+                Thread listener = new Thread(router);
+                listener.setDaemon(true);
+                listener.start();
+                System.out.println("routing RPCs on port " + router.self.port + "...");
+            }
+        } catch (IOException ex) {
+            System.out.print("\n*** ERROR: can't start the session registry: " +
+                             ex.getMessage() + "\n");
+            return;
+        }
+
+        // decides which connections are taken on, and when
+        AdmissionControl admission = new AdmissionControl(properties, router);
+        Thread dispatcher = new Thread(admission);
+        dispatcher.setDaemon(true);
+        dispatcher.start();
+
 
         // start a server socket listening on port
         System.out.println("listening on port " + port + "...");
         ServerSocket serverSocket = null;
         try {
-            serverSocket = new ServerSocket(port);
+            serverSocket = new ServerSocket(port, backlog);
         } catch(Exception ex) {
             System.out.println("ServerSocket() failed: " + ex);
         }
@@ -443,10 +1600,7 @@ public class SimpleNMS {
                 Socket socket = serverSocket.accept();
                 System.out.println("Accepted connection from: " + 
                                                         socket.toString());
-                DeviceHandler deviceHandler = new DeviceHandler(socket, 
-                                                                properties);
-                Thread thread = new Thread(deviceHandler);
-                thread.start();
+                admission.offer(socket);
             } catch(Exception ex) {
                 System.out.println("accept() failed: " + ex);
                 System.exit(-1);
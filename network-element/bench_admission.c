@@ -0,0 +1,358 @@
+/*****************************************************************************
+Copyright (c) 2014-2016, Juniper Networks, Inc.
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions
+are met:
+
+1. Redistributions of source code must retain the above copyright 
+   notice, this list of conditions and the following disclaimer.
+
+2. Redistributions in binary form must reproduce the above copyright
+   notice, this list of conditions and the following disclaimer in the
+   documentation and/or other materials provided with the distribution.
+
+3. Neither the name of the copyright holder nor the names of its 
+   contributors may be used to endorse or promote products derived 
+   from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS 
+"AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT 
+LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS 
+FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE 
+COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, 
+INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, 
+BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; 
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER 
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT 
+LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN 
+ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE 
+POSSIBILITY OF SUCH DAMAGE.
+ *****************************************************************************/
+
+
+
+
+/*****************************************************************************
+   OVERVIEW
+
+   This file measures how ncchd's admission control shapes the connects
+   of a big config coming up, as seen by the NMSs.
+
+   It runs ncchd (see bench_util.c) with relay-mode apps that call home
+   to fake NMSs in this process: one for the apps given <priority>, one
+   for the rest.  Each NMS timestamps every connection it accepts and
+   resets it; the apps
+   then sit out a long interval-secs, so each shows up once.  ncchd is
+   run twice, once with no limits and once with the given connect rate,
+   burst and handshake cap, until every app has called home.
+
+   For each run it prints, as JSON, how long it took from the first
+   connect until all apps were in (and until all priority apps were),
+   the busiest 100ms, and the curve of apps connected over time, one
+   point per CURVE_STEP_MSECS, ready to plot.  Usage:
+
+       bench_admission [num-apps [rate [burst [max-handshakes [path-to-ncchd]]]]]
+ *****************************************************************************/
+
+
+/*****************************************************************************
+   INCLUDES AND EXTERNS
+ *****************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <string.h>
+#include <limits.h>
+#include <pthread.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include "bench_util.h"
+
+
+/*****************************************************************************
+   MACROS
+ *****************************************************************************/
+
+#define DEFAULT_APPS           10000
+#define DEFAULT_RATE           2000
+#define DEFAULT_BURST          200
+#define DEFAULT_MAX_HANDSHAKES 64
+#define DEFAULT_NCCHD          "./ncchd"
+#define PRIORITY_EVERY         10      // every 10th app has <priority>
+#define CURVE_STEP_MSECS       250
+#define PEAK_WINDOW_MSECS      100
+#define SLACK_SECONDS          30      // on top of num-apps/rate, before giving up
+
+
+/*****************************************************************************
+   LOCAL/STATIC DEFINITIONS
+ *****************************************************************************/
+
+// a fake NMS, recording when each connection came in
+typedef struct Nms Nms;
+struct Nms {
+    int               listen_fd;
+    uint16_t          port;
+    int64_t*          accepted_ns;    // capacity is the number of apps
+    uint32_t          capacity;
+    _Atomic uint32_t  num_accepted;
+};
+
+static Nms      priority_nms;
+static Nms      normal_nms;
+static int      local_listen_fd = -1;
+static uint16_t local_port;
+
+
+static void*
+nms_main(void* arg) {
+    Nms* nms = (Nms*)arg;
+
+    for (;;) {
+        int64_t  when;
+        uint32_t idx;
+
+        if (bench_accept_and_reset(nms->listen_fd) != 0) {
+            continue;
+        }
+        when = bench_now_ns();
+        idx = atomic_load(&nms->num_accepted);
+        if (idx < nms->capacity) {
+            nms->accepted_ns[idx] = when;
+            atomic_store(&nms->num_accepted, idx + 1);
+        }
+    }
+    return NULL;
+}
+
+
+// the NETCONF server the relays connect to
+static void*
+local_server(void* arg) {
+    for (;;) {
+        bench_accept_and_reset(local_listen_fd);
+    }
+    return NULL;
+}
+
+
+static int // 0=OK, 1=ERROR
+nms_start(Nms* nms, uint32_t capacity) {
+    pthread_t thread;
+
+    nms->accepted_ns = (int64_t*)calloc(capacity, sizeof(int64_t));
+    nms->capacity = capacity;
+    nms->listen_fd = bench_listen_loopback(&nms->port);
+    if (nms->accepted_ns == NULL || nms->listen_fd == -1 ||
+        pthread_create(&thread, NULL, nms_main, nms) != 0) {
+        return 1;
+    }
+    return 0;
+}
+
+
+// a config.xml of `num_apps` relay-mode apps, every PRIORITY_EVERY-th
+// one with a priority and its own NMS
+static int // 0=OK, 1=ERROR
+write_config(uint32_t num_apps) {
+    FILE*    file = bench_config_open();
+    uint32_t idx;
+
+    if (file == NULL) {
+        return 1;
+    }
+    for (idx=0; idx<num_apps; idx++) {
+        int priority = (idx % PRIORITY_EVERY) == 0;
+
+        fprintf(file,
+                "      <application>\n"
+                "        <name>app-%u</name>\n"
+                "        <servers><server><address>127.0.0.1</address><port>%u</port></server></servers>\n"
+                "        <transport><ssh><host-keys/>"
+                "<relay-to><address>127.0.0.1</address><port>%u</port></relay-to>"
+                "</ssh></transport>\n"
+                "        <reconnect-strategy>\n"
+                "           <interval-secs>255</interval-secs>\n"
+                "           <count-max>3</count-max>\n"
+                "        </reconnect-strategy>\n"
+                "        <priority>%d</priority>\n"
+                "      </application>\n",
+                idx, priority ? priority_nms.port : normal_nms.port, local_port,
+                priority ? 10 : 0);
+    }
+    return bench_config_close(file);
+}
+
+
+/*****************************************************************************
+   BENCHMARK
+ *****************************************************************************/
+
+// run ncchd with the given limits (0 for none) until every app has called
+// home, and print its curve
+static int // 0=OK, 1=ERROR
+bench_run(const char* name, const char* ncchd, uint32_t num_apps, uint32_t rate,
+          uint32_t burst, uint32_t max_handshakes, int first) {
+    uint32_t num_priority = (num_apps + PRIORITY_EVERY - 1) / PRIORITY_EVERY;
+    int64_t  deadline;
+    int64_t* all;
+    uint32_t num_all;
+    uint32_t idx;
+    uint32_t peak = 0;
+    uint32_t lo = 0;
+    int64_t  priority_last = 0;
+    int64_t  step;
+    char     rate_value[16];
+    char     burst_value[16];
+    char     max_handshakes_value[16];
+    pid_t    pid;
+
+    if (bench_clear_state() != 0) {
+        return 1;
+    }
+    atomic_store(&priority_nms.num_accepted, 0);
+    atomic_store(&normal_nms.num_accepted, 0);
+
+    snprintf(rate_value, sizeof(rate_value), "%u", rate);
+    snprintf(burst_value, sizeof(burst_value), "%u", burst);
+    snprintf(max_handshakes_value, sizeof(max_handshakes_value), "%u", max_handshakes);
+    pid = bench_start_ncchd(ncchd, "NCCHD_CONNECT_RATE", rate_value,
+                            "NCCHD_CONNECT_BURST", burst_value,
+                            "NCCHD_MAX_HANDSHAKES", max_handshakes_value,
+                            "NCCHD_LOG_LEVEL", "error",  // not 2 lines per app
+                            (char*)NULL);
+    if (pid == -1) {
+        return 1;
+    }
+
+    deadline = bench_now_ns() + (int64_t)(SLACK_SECONDS + (rate ? num_apps / rate : 0)) * 1000000000;
+    while (atomic_load(&priority_nms.num_accepted) + atomic_load(&normal_nms.num_accepted) < num_apps &&
+           bench_now_ns() < deadline) {
+        usleep(10000);
+    }
+    if (bench_stop_ncchd(pid) != 0) {
+        return 1;
+    }
+
+    // every connection, in order
+    num_all = atomic_load(&priority_nms.num_accepted) + atomic_load(&normal_nms.num_accepted);
+    if (num_all < num_apps) {
+        printf("%s\n    {\"run\": \"%s\", \"error\": \"only %u of %u apps called home\"}",
+               first ? "" : ",", name, num_all, num_apps);
+        return 1;
+    }
+    all = (int64_t*)malloc(num_all * sizeof(int64_t));
+    if (all == NULL) {
+        return 1;
+    }
+    memcpy(all, priority_nms.accepted_ns,
+           atomic_load(&priority_nms.num_accepted) * sizeof(int64_t));
+    memcpy(all + atomic_load(&priority_nms.num_accepted), normal_nms.accepted_ns,
+           atomic_load(&normal_nms.num_accepted) * sizeof(int64_t));
+    for (idx=0; idx<atomic_load(&priority_nms.num_accepted); idx++) {
+        if (priority_nms.accepted_ns[idx] > priority_last) {
+            priority_last = priority_nms.accepted_ns[idx];
+        }
+    }
+    qsort(all, num_all, sizeof(int64_t), bench_compare_ns);
+
+    // busiest PEAK_WINDOW_MSECS, with a sliding window
+    for (idx=0; idx<num_all; idx++) {
+        while (all[idx] - all[lo] >= (int64_t)PEAK_WINDOW_MSECS * 1000000) {
+            lo++;
+        }
+        if (idx - lo + 1 > peak) {
+            peak = idx - lo + 1;
+        }
+    }
+
+    printf("%s\n    {\"run\": \"%s\", \"apps\": %u, \"priority_apps\": %u, "
+           "\"rate\": %u, \"burst\": %u, \"max_handshakes\": %u, "
+           "\"secs_to_all\": %.3f, \"secs_to_all_priority\": %.3f, "
+           "\"peak_per_100ms\": %u,\n     \"curve_ms_connected\": [",
+           first ? "" : ",", name, num_apps, num_priority, rate, burst, max_handshakes,
+           (all[num_all-1] - all[0]) / 1e9, (priority_last - all[0]) / 1e9, peak);
+    idx = 0;
+    for (step=0; ; step+=CURVE_STEP_MSECS) {
+        while (idx < num_all && all[idx] - all[0] <= step * 1000000) {
+            idx++;
+        }
+        printf("%s[%lld, %u]", step == 0 ? "" : ", ", (long long)step, idx);
+        if (idx == num_all) {
+            break;
+        }
+    }
+    printf("]}");
+    fflush(stdout);
+    free(all);
+    return 0;
+}
+
+
+/*****************************************************************************
+   MAIN
+ *****************************************************************************/
+
+int main(int argc, char* argv[]) {
+    uint32_t    num_apps = DEFAULT_APPS;
+    uint32_t    rate = DEFAULT_RATE;
+    uint32_t    burst = DEFAULT_BURST;
+    uint32_t    max_handshakes = DEFAULT_MAX_HANDSHAKES;
+    const char* ncchd_arg = DEFAULT_NCCHD;
+    char        ncchd[PATH_MAX];
+    char        dir[] = "/tmp/bench_admission.XXXXXX";
+    pthread_t   thread;
+    int         result;
+
+    if (argc > 1) {
+        num_apps = strtoul(argv[1], NULL, 10);
+    }
+    if (argc > 2) {
+        rate = strtoul(argv[2], NULL, 10);
+    }
+    if (argc > 3) {
+        burst = strtoul(argv[3], NULL, 10);
+    }
+    if (argc > 4) {
+        max_handshakes = strtoul(argv[4], NULL, 10);
+    }
+    if (argc > 5) {
+        ncchd_arg = argv[5];
+    }
+    if (num_apps == 0 || rate == 0) {
+        printf("usage: %s [num-apps [rate [burst [max-handshakes [path-to-ncchd]]]]]\n", argv[0]);
+        return 1;
+    }
+    if (bench_find_ncchd("admission", ncchd_arg, ncchd) != 0) {
+        return 1;
+    }
+    signal(SIGPIPE, SIG_IGN);
+
+    local_listen_fd = bench_listen_loopback(&local_port);
+    if (nms_start(&priority_nms, num_apps) != 0 ||
+        nms_start(&normal_nms, num_apps) != 0 ||
+        local_listen_fd == -1 ||
+        pthread_create(&thread, NULL, local_server, NULL) != 0) {
+        printf("{\"benchmark\": \"admission\", \"error\": \"could not start the fake NMSs\"}\n");
+        return 1;
+    }
+    if (bench_scratch_open(dir) != 0 || write_config(num_apps) != 0) {
+        printf("{\"benchmark\": \"admission\", \"error\": \"could not set up a scratch directory\"}\n");
+        return 1;
+    }
+
+    printf("{\"benchmark\": \"admission\", \"results\": [");
+    fflush(stdout);
+    result = bench_run("unlimited", ncchd, num_apps, 0, 0, 0, 1);
+    if (result == 0) {
+        result = bench_run("admitted", ncchd, num_apps, rate, burst, max_handshakes, 0);
+    }
+    printf("\n]}\n");
+    bench_scratch_close(dir, result == 0);
+    return result == 0 ? 0 : 1;
+}
@@ -0,0 +1,443 @@
+/*****************************************************************************
+Copyright (c) 2014-2016, Juniper Networks, Inc.
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions
+are met:
+
+1. Redistributions of source code must retain the above copyright 
+   notice, this list of conditions and the following disclaimer.
+
+2. Redistributions in binary form must reproduce the above copyright
+   notice, this list of conditions and the following disclaimer in the
+   documentation and/or other materials provided with the distribution.
+
+3. Neither the name of the copyright holder nor the names of its 
+   contributors may be used to endorse or promote products derived 
+   from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS 
+"AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT 
+LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS 
+FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE 
+COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, 
+INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, 
+BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; 
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER 
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT 
+LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN 
+ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE 
+POSSIBILITY OF SUCH DAMAGE.
+ *****************************************************************************/
+
+
+
+/*****************************************************************************
+   OVERVIEW
+
+   This file is a benchmark of ncchd's application table at large scale
+   (100,000 apps by default).  It builds the table twice, each in its own
+   process so the resident-set sizes don't mix:
+
+     - "inline": the former layout, with fixed 64-byte strings in every
+       app and server, 8-bit counts, and each app's runtime embedded in
+       its config
+     - "compact": the current layout from ncchd.h, with interned strings
+       and the runtime in a separate dense array
+
+   and then times the event loop's per-pass scan over all apps, counting
+   cache misses where perf events are available.  Results are printed as
+   JSON.  Usage:  bench_app_table [num-apps [passes]]
+ *****************************************************************************/
+
+
+/*****************************************************************************
+   INCLUDES AND EXTERNS
+ *****************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <netdb.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#ifdef __linux__
+#include <linux/perf_event.h>
+#endif
+#include "ncchd.h"
+#include "bench_util.h"
+
+
+/*****************************************************************************
+   MACROS
+ *****************************************************************************/
+
+#define DEFAULT_APPS   100000
+#define DEFAULT_PASSES 50
+
+// every app uses 2 of NUM_NMS servers and both host keys, as a fleet
+// managed by a few NMS clusters would
+#define NUM_NMS        4
+#define NUM_HOST_KEYS  2
+
+
+/*****************************************************************************
+   INLINE LAYOUT (as ncchd.h had it before strings were interned)
+ *****************************************************************************/
+
+typedef struct InlineServer InlineServer;
+struct InlineServer {
+  char     addr[64];
+  uint16_t port;
+};
+
+typedef struct InlineHostKey InlineHostKey;
+struct InlineHostKey {
+  char name[64];
+};
+
+typedef struct InlineRuntime InlineRuntime;
+struct InlineRuntime {
+  int              phase;
+  uint8_t          svr_idx;
+  uint8_t          retry_count;
+  uint8_t          start_over;
+  uint8_t          probe_idx;
+  uint8_t          probe_backoff;
+  uint8_t          drain_signal;
+  unsigned int     seed;
+  int64_t          wakeup_ms;
+  int64_t          next_probe_ms;
+  int64_t          drain_deadline_ms;
+  Connector        connector;
+  Connector        probe;
+  Child            sshd;
+  Child            draining;
+};
+
+typedef struct InlineApplication InlineApplication;
+struct InlineApplication {
+  char                 name[64];
+  uint8_t              num_servers;
+  InlineServer        *servers;
+  enum TRANSPORT_TYPE  transport_type;
+  uint8_t              num_host_keys;
+  InlineHostKey       *host_keys;
+  enum CONNECT_TYPE    connection_type;
+  KeepAliveStrategy    keep_alive_strategy;
+  PeriodicConnectInfo  periodic_connect_info;
+  ReconnectStrategy    reconnect_strategy;
+  InlineRuntime        runtime;
+  int                  status_slot;
+};
+
+
+/*****************************************************************************
+   LOCAL/STATIC DEFINITIONS
+ *****************************************************************************/
+
+static const char* nms_addrs[NUM_NMS] = {
+    "nms-east-1.example.net", "nms-east-2.example.net",
+    "nms-west-1.example.net", "nms-west-2.example.net"
+};
+static const char* host_key_names[NUM_HOST_KEYS] = {
+    "ssh_hostkey.pem", "ssh_hostkey_rsa.pem"
+};
+
+
+// resident set size in KB, from /proc
+static long
+rss_kb(void) {
+    FILE* file = fopen("/proc/self/statm", "r");
+    long  size = 0;
+    long  resident = 0;
+
+    if (file == NULL) {
+        return -1;
+    }
+    if (fscanf(file, "%ld %ld", &size, &resident) != 2) {
+        resident = -1;
+    }
+    fclose(file);
+    return resident < 0 ? -1 : resident * (sysconf(_SC_PAGESIZE) / 1024);
+}
+
+
+// a user-space hardware cache counter, -1 if perf events are unavailable
+static int
+counter_open(uint32_t type, uint64_t config) {
+#ifdef __linux__
+    struct perf_event_attr attr;
+
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = type;
+    attr.config = config;
+    attr.disabled = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    return (int)syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+#else
+    return -1;
+#endif
+}
+
+
+static void
+counter_start(int fd) {
+#ifdef __linux__
+    if (fd != -1) {
+        ioctl(fd, PERF_EVENT_IOC_RESET, 0);
+        ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+    }
+#endif
+}
+
+
+static void
+counter_print(const char* label, int fd, int passes) {
+    long long count = -1;
+
+#ifdef __linux__
+    if (fd != -1) {
+        ioctl(fd, PERF_EVENT_IOC_DISABLE, 0);
+        if (read(fd, &count, sizeof(count)) != sizeof(count)) {
+            count = -1;
+        }
+        close(fd);
+    }
+#endif
+    if (count < 0) {
+        printf(", \"%s_per_pass\": null", label);
+    } else {
+        printf(", \"%s_per_pass\": %lld", label, count / passes);
+    }
+}
+
+
+// runtime of an app with an established session, like most apps at scale
+static void
+connected_runtime(Connector* connector, Connector* probe, Child* sshd,
+                  Child* draining, uint32_t app_idx) {
+    connector->fd = -1;
+    probe->fd = -1;
+    sshd->pid = 10000 + app_idx;
+    sshd->pidfd = 100 + app_idx;
+    draining->pid = -1;
+    draining->pidfd = -1;
+}
+
+
+/*****************************************************************************
+   BENCHMARKS
+ *****************************************************************************/
+
+static void
+bench_inline(uint32_t num_apps, int passes) {
+    InlineApplication* apps;
+    long               rss_before = rss_kb();
+    uint32_t           app_idx;
+    int64_t            start;
+    int64_t            checksum = 0;
+    int                pass;
+    int                misses;
+    int                l1d_misses;
+
+    apps = (InlineApplication*)calloc(num_apps, sizeof(InlineApplication));
+    if (apps == NULL) {
+        printf("{\"layout\": \"inline\", \"error\": \"out of memory\"}");
+        return;
+    }
+    for (app_idx=0; app_idx<num_apps; app_idx++) {
+        InlineApplication* app = &apps[app_idx];
+        uint32_t           idx;
+
+        snprintf(app->name, sizeof(app->name), "device-%06u", app_idx);
+        app->num_servers = 2;
+        app->servers = (InlineServer*)calloc(2, sizeof(InlineServer));
+        app->num_host_keys = NUM_HOST_KEYS;
+        app->host_keys = (InlineHostKey*)calloc(NUM_HOST_KEYS, sizeof(InlineHostKey));
+        if (app->servers == NULL || app->host_keys == NULL) {
+            printf("{\"layout\": \"inline\", \"error\": \"out of memory\"}");
+            return;
+        }
+        for (idx=0; idx<2; idx++) {
+            snprintf(app->servers[idx].addr, sizeof(app->servers[idx].addr),
+                     "%s", nms_addrs[(app_idx + idx) % NUM_NMS]);
+            app->servers[idx].port = 4334;
+        }
+        for (idx=0; idx<NUM_HOST_KEYS; idx++) {
+            snprintf(app->host_keys[idx].name, sizeof(app->host_keys[idx].name),
+                     "%s", host_key_names[idx]);
+        }
+        app->reconnect_strategy.probe_interval_secs = 60;
+        app->runtime.phase = PHASE_CONNECTED;
+        app->runtime.svr_idx = app_idx % 2;
+        app->runtime.next_probe_ms = INT64_MAX - app_idx;
+        connected_runtime(&app->runtime.connector, &app->runtime.probe,
+                          &app->runtime.sshd, &app->runtime.draining, app_idx);
+    }
+    printf("{\"layout\": \"inline\", \"bytes_per_app\": %zu, \"rss_kb\": %ld",
+           sizeof(InlineApplication) + 2 * sizeof(InlineServer) +
+                                       NUM_HOST_KEYS * sizeof(InlineHostKey),
+           rss_kb() - rss_before);
+
+    // the scan ncchd's event loop made over every app on every pass
+    misses = counter_open(PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES);
+    l1d_misses = counter_open(PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_L1D |
+                                                  (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+                                                  (PERF_COUNT_HW_CACHE_RESULT_MISS << 16));
+    counter_start(misses);
+    counter_start(l1d_misses);
+    start = bench_now_ns();
+    for (pass=0; pass<passes; pass++) {
+        for (app_idx=0; app_idx<num_apps; app_idx++) {
+            InlineApplication* app = &apps[app_idx];
+            InlineRuntime*     rt = &app->runtime;
+            int64_t            next = INT64_MAX;
+
+            checksum += rt->connector.fd + rt->probe.fd + rt->sshd.pidfd + rt->draining.pidfd;
+            if (rt->phase == PHASE_CONNECTED && rt->probe.fd == -1 && rt->svr_idx > 0 &&
+                app->reconnect_strategy.start_with == FIRST_LISTED &&
+                app->reconnect_strategy.probe_interval_secs != 0) {
+                next = rt->next_probe_ms;
+            }
+            checksum ^= next;
+        }
+    }
+    printf(", \"ns_per_pass\": %lld", (long long)(bench_now_ns() - start) / passes);
+    counter_print("cache_misses", misses, passes);
+    counter_print("l1d_misses", l1d_misses, passes);
+    printf(", \"checksum\": %lld}", (long long)(checksum & 0xffff));
+}
+
+
+static void
+bench_compact(uint32_t num_apps, int passes) {
+    Configuration config;
+    long          rss_before = rss_kb();
+    uint32_t      app_idx;
+    int64_t       start;
+    int64_t       checksum = 0;
+    int           pass;
+    int           misses;
+    int           l1d_misses;
+
+    config.num_apps = num_apps;
+    config.apps = (Application*)calloc(num_apps, sizeof(Application));
+    config.runtime = (AppRuntime*)calloc(num_apps, sizeof(AppRuntime));
+    if (config.apps == NULL || config.runtime == NULL) {
+        printf("{\"layout\": \"compact\", \"error\": \"out of memory\"}");
+        return;
+    }
+    for (app_idx=0; app_idx<num_apps; app_idx++) {
+        Application* app = &config.apps[app_idx];
+        AppRuntime*  rt = &config.runtime[app_idx];
+        char         name[32];
+        uint32_t     idx;
+
+        snprintf(name, sizeof(name), "device-%06u", app_idx);
+        app->name = intern_string(name);
+        app->num_servers = 2;
+        app->servers = (Server*)calloc(2, sizeof(Server));
+        app->num_host_keys = NUM_HOST_KEYS;
+        app->host_keys = (HostKey*)calloc(NUM_HOST_KEYS, sizeof(HostKey));
+        if (app->name == NULL || app->servers == NULL || app->host_keys == NULL) {
+            printf("{\"layout\": \"compact\", \"error\": \"out of memory\"}");
+            return;
+        }
+        for (idx=0; idx<2; idx++) {
+            app->servers[idx].addr = intern_string(nms_addrs[(app_idx + idx) % NUM_NMS]);
+            app->servers[idx].port = 4334;
+        }
+        for (idx=0; idx<NUM_HOST_KEYS; idx++) {
+            app->host_keys[idx].name = intern_string(host_key_names[idx]);
+        }
+        app->reconnect_strategy.probe_interval_secs = 60;
+        rt->phase = PHASE_CONNECTED;
+        rt->svr_idx = app_idx % 2;
+        rt->next_timer_ms = INT64_MAX - app_idx;
+        connected_runtime(&rt->connector, &rt->probe, &rt->sshd, &rt->draining, app_idx);
+    }
+    printf("{\"layout\": \"compact\", \"bytes_per_app\": %zu, \"rss_kb\": %ld",
+           sizeof(Application) + sizeof(AppRuntime) + 2 * sizeof(Server) +
+                                 NUM_HOST_KEYS * sizeof(HostKey) + sizeof("device-000000"),
+           rss_kb() - rss_before);
+
+    // the scan ncchd's event loop makes over every app on every pass
+    misses = counter_open(PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES);
+    l1d_misses = counter_open(PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_L1D |
+                                                  (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+                                                  (PERF_COUNT_HW_CACHE_RESULT_MISS << 16));
+    counter_start(misses);
+    counter_start(l1d_misses);
+    start = bench_now_ns();
+    for (pass=0; pass<passes; pass++) {
+        for (app_idx=0; app_idx<num_apps; app_idx++) {
+            AppRuntime* rt = &config.runtime[app_idx];
+
+            checksum += rt->connector.fd + rt->probe.fd + rt->sshd.pidfd + rt->draining.pidfd;
+            checksum ^= rt->next_timer_ms;
+        }
+    }
+    printf(", \"ns_per_pass\": %lld", (long long)(bench_now_ns() - start) / passes);
+    counter_print("cache_misses", misses, passes);
+    counter_print("l1d_misses", l1d_misses, passes);
+    printf(", \"checksum\": %lld}", (long long)(checksum & 0xffff));
+}
+
+
+// run one layout's benchmark in a child, so each starts from a fresh heap
+static void
+run_isolated(void (*bench)(uint32_t, int), uint32_t num_apps, int passes) {
+    pid_t pid;
+    int   status;
+
+    fflush(stdout);
+    pid = fork();
+    if (pid == 0) {
+        bench(num_apps, passes);
+        fflush(stdout);
+        _exit(0);
+    }
+    if (pid == -1) {
+        printf("{\"error\": \"fork() failed\"}");
+        return;
+    }
+    waitpid(pid, &status, 0);
+}
+
+
+/*****************************************************************************
+   MAIN
+ *****************************************************************************/
+
+int main(int argc, char* argv[]) {
+    uint32_t num_apps = DEFAULT_APPS;
+    int      passes = DEFAULT_PASSES;
+
+    if (argc > 1) {
+        num_apps = (uint32_t)strtoul(argv[1], NULL, 10);
+    }
+    if (argc > 2) {
+        passes = atoi(argv[2]);
+    }
+    if (num_apps == 0 || passes <= 0) {
+        printf("usage: %s [num-apps [passes]]\n", argv[0]);
+        return 1;
+    }
+
+    printf("{\"benchmark\": \"app_table\", \"apps\": %u, \"passes\": %d, \"results\": [",
+           num_apps, passes);
+    run_isolated(bench_inline, num_apps, passes);
+    printf(", ");
+    run_isolated(bench_compact, num_apps, passes);
+    printf("]}\n");
+    return 0;
+}
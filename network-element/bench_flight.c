@@ -0,0 +1,202 @@
+/*****************************************************************************
+Copyright (c) 2014-2016, Juniper Networks, Inc.
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions
+are met:
+
+1. Redistributions of source code must retain the above copyright 
+   notice, this list of conditions and the following disclaimer.
+
+2. Redistributions in binary form must reproduce the above copyright
+   notice, this list of conditions and the following disclaimer in the
+   documentation and/or other materials provided with the distribution.
+
+3. Neither the name of the copyright holder nor the names of its 
+   contributors may be used to endorse or promote products derived 
+   from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS 
+"AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT 
+LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS 
+FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE 
+COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, 
+INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, 
+BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; 
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER 
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT 
+LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN 
+ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE 
+POSSIBILITY OF SUCH DAMAGE.
+ *****************************************************************************/
+
+
+
+
+/*****************************************************************************
+   OVERVIEW
+
+   This file is a benchmark of ncchd's flight recorder (see flight.h).
+   It records connect attempts shaped like a successful sshd session's
+   (16 events each) into one shard's recorder, and measures:
+
+     - "off": the cost of the same calls with no recorder
+       (NCCHD_TRACE_ATTEMPTS=0), the floor
+     - "recording": the cost per event with a recorder
+     - "recording_while_dumping": the same with another thread dumping
+       the recorder over and over, as `ncchctl trace` would, and how
+       long each of those dumps took
+
+   Results are printed as JSON.  Usage:
+   bench_flight [attempts [recorder-attempts]]
+ *****************************************************************************/
+
+
+/*****************************************************************************
+   INCLUDES AND EXTERNS
+ *****************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "flight.h"
+#include "bench_util.h"
+
+
+/*****************************************************************************
+   MACROS
+ *****************************************************************************/
+
+#define DEFAULT_ATTEMPTS          1000000
+#define EVENTS_PER_ATTEMPT        16
+
+
+/*****************************************************************************
+   LOCAL/STATIC DEFINITIONS
+ *****************************************************************************/
+
+static FlightRecorder* dumped = NULL;
+static volatile int    dumping = 0;
+static uint32_t        dumps = 0;
+static int64_t         dump_ns = 0;
+static char            dump_path[64];
+
+
+// one attempt, as app_connect() through app_session_ended() record it
+static void
+record_attempt(FlightRecorder* recorder, const char* app, uint32_t idx) {
+    uint64_t attempt = flight_begin(recorder, app);
+
+    flight_server(recorder, attempt, "nms-east-1.example.net", 4334);
+    flight_event(recorder, attempt, FLIGHT_DNS, 'B', 0);
+    flight_event(recorder, attempt, FLIGHT_DNS, 'E', 0);
+    flight_event(recorder, attempt, FLIGHT_TCP, 'B', 0);
+    flight_event(recorder, attempt, FLIGHT_TCP, 'E', 0);
+    flight_event(recorder, attempt, FLIGHT_FORK, 'B', 0);
+    flight_event(recorder, attempt, FLIGHT_FORK, 'E', (int32_t)idx);
+    flight_event(recorder, attempt, FLIGHT_SSHD, 'B', (int32_t)idx);
+    flight_event(recorder, attempt, FLIGHT_EXEC, 'B', 0);
+    flight_event(recorder, attempt, FLIGHT_EXEC, 'E', 0);
+    flight_event(recorder, attempt, FLIGHT_SSH_KEX, 'B', 0);
+    flight_event(recorder, attempt, FLIGHT_SSH_KEX, 'E', 0);
+    flight_event(recorder, attempt, FLIGHT_SSH_AUTH, 'B', 0);
+    flight_event(recorder, attempt, FLIGHT_SSH_AUTH, 'E', 0);
+    flight_event(recorder, attempt, FLIGHT_SUBSYSTEM, 'i', 0);
+    flight_end(recorder, attempt, (idx % 16) ? NULL : "session ended after 12ms");
+}
+
+
+static void*
+dump_loop(void* arg) {
+    FlightRecorder* recorders[1] = { dumped };
+    uint32_t        count;
+
+    while (dumping) {
+        int64_t start = bench_now_ns();
+        if (flight_dump(recorders, 1, NULL, 0, dump_path, &count) != 0) {
+            break;
+        }
+        dump_ns += bench_now_ns() - start;
+        dumps++;
+    }
+    return NULL;
+}
+
+
+// record `attempts` attempts, returning the ns per event
+static double
+run(FlightRecorder* recorder, uint32_t attempts) {
+    char     apps[64][32];
+    uint32_t idx;
+    int64_t  start;
+
+    for (idx=0; idx<64; idx++) {
+        snprintf(apps[idx], sizeof(apps[idx]), "device-%06u", idx);
+    }
+    start = bench_now_ns();
+    for (idx=0; idx<attempts; idx++) {
+        record_attempt(recorder, apps[idx % 64], idx);
+    }
+    return (double)(bench_now_ns() - start) / ((double)attempts * EVENTS_PER_ATTEMPT);
+}
+
+
+/*****************************************************************************
+   MAIN
+ *****************************************************************************/
+
+int main(int argc, char* argv[]) {
+    uint32_t        attempts = DEFAULT_ATTEMPTS;
+    uint32_t        kept = FLIGHT_ATTEMPTS;
+    FlightRecorder* recorder;
+    pthread_t       thread;
+    double          off, recording, concurrent;
+
+    if (argc > 1) {
+        attempts = (uint32_t)strtoul(argv[1], NULL, 10);
+    }
+    if (argc > 2) {
+        kept = (uint32_t)strtoul(argv[2], NULL, 10);
+    }
+    if (attempts == 0 || kept == 0) {
+        printf("usage: %s [attempts [recorder-attempts]]\n", argv[0]);
+        return 1;
+    }
+    recorder = flight_create(kept);
+    if (recorder == NULL) {
+        printf("{\"benchmark\": \"flight\", \"error\": \"out of memory\"}\n");
+        return 1;
+    }
+    snprintf(dump_path, sizeof(dump_path), "/tmp/bench_flight.%d.json", (int)getpid());
+
+    off = run(NULL, attempts);
+    recording = run(recorder, attempts);
+
+    dumped = recorder;
+    dumping = 1;
+    if (pthread_create(&thread, NULL, dump_loop, NULL) != 0) {
+        printf("{\"benchmark\": \"flight\", \"error\": \"could not start a thread\"}\n");
+        return 1;
+    }
+    concurrent = run(recorder, attempts);
+    dumping = 0;
+    pthread_join(thread, NULL);
+    unlink(dump_path);
+
+    printf("{\"benchmark\": \"flight\", \"attempts\": %u, \"recorder_attempts\": %u, "
+           "\"recorder_bytes\": %zu, \"results\": ["
+           "{\"mode\": \"off\", \"ns_per_event\": %.1f}, "
+           "{\"mode\": \"recording\", \"ns_per_event\": %.1f}, "
+           "{\"mode\": \"recording_while_dumping\", \"ns_per_event\": %.1f, "
+           "\"dumps\": %u, \"ms_per_dump\": %.2f}]}\n",
+           attempts, kept, sizeof(FlightRecorder) + kept * sizeof(FlightAttempt),
+           off, recording, concurrent, dumps,
+           dumps ? (double)dump_ns / dumps / 1000000 : 0.0);
+    flight_destroy(recorder);
+    return 0;
+}
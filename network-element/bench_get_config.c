@@ -0,0 +1,337 @@
+/*****************************************************************************
+Copyright (c) 2014-2016, Juniper Networks, Inc.
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions
+are met:
+
+1. Redistributions of source code must retain the above copyright 
+   notice, this list of conditions and the following disclaimer.
+
+2. Redistributions in binary form must reproduce the above copyright
+   notice, this list of conditions and the following disclaimer in the
+   documentation and/or other materials provided with the distribution.
+
+3. Neither the name of the copyright holder nor the names of its 
+   contributors may be used to endorse or promote products derived 
+   from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS 
+"AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT 
+LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS 
+FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE 
+COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, 
+INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, 
+BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; 
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER 
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT 
+LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN 
+ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE 
+POSSIBILITY OF SUCH DAMAGE.
+ *****************************************************************************/
+
+
+
+/*****************************************************************************
+   OVERVIEW
+
+   This file benchmarks netconf.c's <get-config> replies on a generated
+   config.xml of many apps (50k by default), read back through a pipe by
+   a thread that discards them, as a client would have to take them:
+
+     - "cold": the first reply after config.xml changes, which reads the
+       file again
+     - "cached": later replies, served from the cached copy
+     - "one-buffer": for comparison, the same reply assembled in a single
+       malloc()ed buffer and written with write(), which is what serving
+       it without iovecs would take
+
+   each with end-of-message (base:1.0) and chunked (base:1.1) framing.
+   For each it reports the average latency of a reply (from the request
+   to its last byte going into the pipe) and the throughput that gives.
+   Results are printed as JSON.  Usage:
+
+       bench_get_config [num-apps [replies]]
+ *****************************************************************************/
+
+
+/*****************************************************************************
+   INCLUDES AND EXTERNS
+ *****************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include "netconf.h"
+#include "bench_util.h"
+
+
+/*****************************************************************************
+   MACROS
+ *****************************************************************************/
+
+#define DEFAULT_APPS     50000
+#define DEFAULT_REPLIES  20
+
+
+/*****************************************************************************
+   LOCAL/STATIC DEFINITIONS
+ *****************************************************************************/
+
+static const char hello_1_0[] =
+    "<hello xmlns=\"urn:ietf:params:xml:ns:netconf:base:1.0\">\n"
+    "<capabilities><capability>urn:ietf:params:netconf:base:1.0</capability></capabilities>\n"
+    "</hello>\n"
+    "]]>]]>\n";
+
+static const char hello_1_1[] =
+    "<hello xmlns=\"urn:ietf:params:xml:ns:netconf:base:1.0\">\n"
+    "<capabilities><capability>urn:ietf:params:netconf:base:1.1</capability></capabilities>\n"
+    "</hello>\n"
+    "]]>]]>\n";
+
+static const char get_config[] =
+    "<rpc message-id=\"1\" xmlns=\"urn:ietf:params:xml:ns:netconf:base:1.0\">\n"
+    "<get-config><source><running/></source></get-config>\n"
+    "</rpc>\n";
+
+static int pipe_fds[2];
+
+
+// the client: take whatever comes, and throw it away
+static void*
+drain(void* arg) {
+    static char buf[1 << 20];
+
+    (void)arg;
+    while (read(pipe_fds[0], buf, sizeof(buf)) > 0) {
+        ;
+    }
+    return NULL;
+}
+
+
+// NetconfWrite into the pipe, all of it
+static ssize_t // -1 on error
+write_pipe(void* ctx, const struct iovec* iov, int iovcnt) {
+    ssize_t written;
+
+    do {
+        written = writev(pipe_fds[1], iov, iovcnt);
+    } while (written == -1 && errno == EINTR);
+    return written;
+}
+
+
+// a session that has had its hellos
+static int // 0=OK, 1=ERROR
+open_session(NetconfSession* session, const char* path, const char* hello) {
+    size_t used;
+
+    netconf_init(session, 1, write_pipe, NULL);
+    session->datastore = path;
+    if (netconf_start(session) != 0 ||
+        netconf_input(session, hello, strlen(hello), &used) != 0) {
+        return 1;
+    }
+    return 0;
+}
+
+
+// request and take one reply
+static int // 0=OK, 1=ERROR
+request(NetconfSession* session) {
+    char   framed[sizeof(get_config) + 32];
+    size_t used;
+
+    if (session->chunked) {
+        snprintf(framed, sizeof(framed), "\n#%zu\n%s\n##\n", strlen(get_config), get_config);
+    } else {
+        snprintf(framed, sizeof(framed), "%s]]>]]>\n", get_config);
+    }
+    if (netconf_input(session, framed, strlen(framed), &used) != 0 || used != strlen(framed)) {
+        return 1;
+    }
+    while (netconf_pending(session)) {
+        if (netconf_output(session) != 0) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+
+// the same reply, built in one buffer
+static int // 0=OK, 1=ERROR
+request_one_buffer(const char* path, int chunked) {
+    static const char head[] = "<rpc-reply message-id=\"1\"\n"
+        "           xmlns=\"urn:ietf:params:xml:ns:netconf:base:1.0\">\n<data>\n";
+    static const char tail[] = "</data>\n</rpc-reply>\n";
+    struct stat st;
+    char*       text;
+    char*       reply;
+    size_t      len = 0;
+    size_t      offset;
+    ssize_t     got;
+    ssize_t     written;
+    int         fd;
+
+    if ((fd = open(path, O_RDONLY)) == -1 || fstat(fd, &st) != 0 ||
+        (text = (char*)malloc((size_t)st.st_size)) == NULL) {
+        return 1;
+    }
+    got = read(fd, text, (size_t)st.st_size);
+    close(fd);
+    reply = (char*)malloc((size_t)st.st_size + (size_t)st.st_size / 1024 + 256);
+    if (got != (ssize_t)st.st_size || reply == NULL) {
+        free(text);
+        free(reply);
+        return 1;
+    }
+    if (chunked) {
+        len += (size_t)sprintf(reply + len, "\n#%zu\n%s", strlen(head), head);
+        for (offset=0; offset<(size_t)got; offset+=NETCONF_CHUNK_SIZE) {
+            size_t piece = ((size_t)got - offset < NETCONF_CHUNK_SIZE) ? (size_t)got - offset
+                                                                        : NETCONF_CHUNK_SIZE;
+            len += (size_t)sprintf(reply + len, "\n#%zu\n", piece);
+            memcpy(reply + len, text + offset, piece);
+            len += piece;
+        }
+        len += (size_t)sprintf(reply + len, "\n#%zu\n%s\n##\n", strlen(tail), tail);
+    } else {
+        len += (size_t)sprintf(reply + len, "%s", head);
+        memcpy(reply + len, text, (size_t)got);
+        len += (size_t)got;
+        len += (size_t)sprintf(reply + len, "%s]]>]]>\n", tail);
+    }
+    for (offset=0; offset<len; offset+=(size_t)written) {
+        written = write(pipe_fds[1], reply + offset, len - offset);
+        if (written <= 0) {
+            break;
+        }
+    }
+    free(text);
+    free(reply);
+    return offset == len ? 0 : 1;
+}
+
+
+/*****************************************************************************
+   BENCHMARK
+ *****************************************************************************/
+
+static void
+bench_framing(const char* path, int replies, int chunked, size_t config_bytes, int last) {
+    const char*    framing = chunked ? "chunked" : "end-of-message";
+    NetconfSession session;
+    int64_t        started;
+    int64_t        cold_us = 0;
+    int64_t        cached_us;
+    int64_t        one_buffer_us;
+    struct timespec times[2];
+    int            idx;
+
+    if (open_session(&session, path, chunked ? hello_1_1 : hello_1_0) != 0) {
+        printf("  {\"framing\": \"%s\", \"error\": \"could not start a session\"}%s\n",
+               framing, last ? "" : ",");
+        return;
+    }
+
+    // a new mtime makes the next reply read the file again
+    for (idx=0; idx<replies; idx++) {
+        clock_gettime(CLOCK_REALTIME, &times[0]);
+        times[0].tv_nsec = (times[0].tv_nsec + idx + 1) % 1000000000;
+        times[1] = times[0];
+        utimensat(AT_FDCWD, path, times, 0);
+        started = bench_now_us();
+        if (request(&session) != 0) {
+            break;
+        }
+        cold_us += bench_now_us() - started;
+    }
+    started = bench_now_us();
+    for (idx=0; idx<replies; idx++) {
+        if (request(&session) != 0) {
+            break;
+        }
+    }
+    cached_us = bench_now_us() - started;
+    started = bench_now_us();
+    for (idx=0; idx<replies; idx++) {
+        if (request_one_buffer(path, chunked) != 0) {
+            break;
+        }
+    }
+    one_buffer_us = bench_now_us() - started;
+    netconf_end(&session);
+
+    printf("  {\"framing\": \"%s\", \"config_bytes\": %zu, \"replies\": %d,\n"
+           "   \"cold\": {\"latency_ms\": %.2f, \"mb_per_sec\": %.0f},\n"
+           "   \"cached\": {\"latency_ms\": %.2f, \"mb_per_sec\": %.0f},\n"
+           "   \"one-buffer\": {\"latency_ms\": %.2f, \"mb_per_sec\": %.0f}}%s\n",
+           framing, config_bytes, replies,
+           cold_us / 1000.0 / replies, (double)config_bytes * replies / cold_us,
+           cached_us / 1000.0 / replies, (double)config_bytes * replies / cached_us,
+           one_buffer_us / 1000.0 / replies, (double)config_bytes * replies / one_buffer_us,
+           last ? "" : ",");
+}
+
+
+/*****************************************************************************
+   MAIN
+ *****************************************************************************/
+
+int main(int argc, char* argv[]) {
+    int         num_apps = DEFAULT_APPS;
+    int         replies = DEFAULT_REPLIES;
+    char        dir[] = "/tmp/bench_get_config.XXXXXX";
+    char        path[PATH_MAX];
+    struct stat st;
+    pthread_t   thread;
+
+    if (argc > 1) {
+        num_apps = atoi(argv[1]);
+    }
+    if (argc > 2) {
+        replies = atoi(argv[2]);
+    }
+    if (num_apps <= 0 || replies <= 0) {
+        printf("usage: %s [num-apps [replies]]\n", argv[0]);
+        return 1;
+    }
+    signal(SIGPIPE, SIG_IGN);
+
+    if (mkdtemp(dir) == NULL) {
+        printf("{\"benchmark\": \"get-config\", \"error\": \"no scratch directory\"}\n");
+        return 1;
+    }
+    snprintf(path, sizeof(path), "%s/config.xml", dir);
+    if (bench_write_config(path, num_apps) != 0 || stat(path, &st) != 0 ||
+        pipe(pipe_fds) != 0 || pthread_create(&thread, NULL, drain, NULL) != 0) {
+        printf("{\"benchmark\": \"get-config\", \"error\": \"could not set up\"}\n");
+        return 1;
+    }
+
+    printf("{\"benchmark\": \"get-config\", \"apps\": %d, \"results\": [\n", num_apps);
+    bench_framing(path, replies, 0, (size_t)st.st_size, 0);
+    bench_framing(path, replies, 1, (size_t)st.st_size, 1);
+    printf("]}\n");
+
+    close(pipe_fds[1]);
+    pthread_join(thread, NULL);
+    unlink(path);
+    rmdir(dir);
+    return 0;
+}
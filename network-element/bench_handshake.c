@@ -0,0 +1,471 @@
+/*****************************************************************************
+Copyright (c) 2014-2016, Juniper Networks, Inc.
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions
+are met:
+
+1. Redistributions of source code must retain the above copyright 
+   notice, this list of conditions and the following disclaimer.
+
+2. Redistributions in binary form must reproduce the above copyright
+   notice, this list of conditions and the following disclaimer in the
+   documentation and/or other materials provided with the distribution.
+
+3. Neither the name of the copyright holder nor the names of its 
+   contributors may be used to endorse or promote products derived 
+   from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS 
+"AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT 
+LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS 
+FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE 
+COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, 
+INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, 
+BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; 
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER 
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT 
+LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN 
+ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE 
+POSSIBILITY OF SUCH DAMAGE.
+ *****************************************************************************/
+
+
+
+/*****************************************************************************
+   OVERVIEW
+
+   This file measures what an app's crypto-profile (see ssh_profile.c)
+   costs per SSH handshake: the latency from starting the NMS's ssh to
+   its having the session keys, and the CPU time both ends spent on it.
+
+   For each profile below it renders an sshd_config the way ncchd does,
+   then runs `ssh` against `sshd -i -f <config>` as its ProxyCommand, so
+   the two talk over a pipe instead of TCP and nothing but the handshake
+   is timed.  ssh has no credentials, so it gives up right after the key
+   exchange; a handshake counts as done when ssh logs that it received
+   SSH2_MSG_NEWKEYS.  This process is a subreaper, so both ends are
+   reaped here and their CPU time shows up in RUSAGE_CHILDREN.
+
+   Host keys are generated with ssh-keygen in a scratch directory under
+   /tmp.  A stock OpenSSH sshd doesn't know X509KeyAlgorithm, so if the
+   sshd under test rejects it, every profile uses an x509-key-algorithm
+   of "none".  Profiles the installed ssh or sshd doesn't support are
+   reported with an error rather than stopping the run.
+
+   Results are printed as JSON, one record per profile.  Usage:
+
+       bench_handshake [handshakes [path-to-sshd [path-to-ssh]]]
+ *****************************************************************************/
+
+
+/*****************************************************************************
+   INCLUDES AND EXTERNS
+ *****************************************************************************/
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/prctl.h>
+#include <sys/resource.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include "ncchd.h"
+#include "ssh_profile.h"
+#include "bench_util.h"
+
+
+/*****************************************************************************
+   MACROS
+ *****************************************************************************/
+
+#define DEFAULT_HANDSHAKES  50
+#define DEFAULT_SSHD        "/usr/sbin/sshd"
+#define DEFAULT_SSH         "ssh"
+#define MAX_HANDSHAKES      10000
+#define MAX_OUTPUT          65536   // of ssh's debug log, per handshake
+#define HANDSHAKE_TIMEOUT_MS 10000
+
+
+/*****************************************************************************
+   LOCAL/STATIC DEFINITIONS
+ *****************************************************************************/
+
+typedef struct Profile Profile;
+struct Profile {
+    const char*      name;
+    const char*      host_key;   // file, generated by ssh-keygen
+    SshCryptoProfile crypto;
+};
+
+// what an operator would pick between: sshd's defaults, the two modern
+// suites, a conservative one for old NMSs, and compression on top of one
+static Profile profiles[] = {
+    { "default", "hostkey_ecdsa",
+      { NULL, NULL, NULL, NULL, NULL, COMPRESSION_DEFAULT } },
+    { "curve25519-chacha20", "hostkey_ed25519",
+      { "curve25519-sha256", "chacha20-poly1305@openssh.com", NULL,
+        "ssh-ed25519", NULL, COMPRESSION_NO } },
+    { "nistp256-aes128gcm", "hostkey_ecdsa",
+      { "ecdh-sha2-nistp256", "aes128-gcm@openssh.com", NULL,
+        "ecdsa-sha2-nistp256", NULL, COMPRESSION_NO } },
+    { "dh14-aes256ctr-hmac", "hostkey_rsa",
+      { "diffie-hellman-group14-sha256", "aes256-ctr", "hmac-sha2-256",
+        "rsa-sha2-256", NULL, COMPRESSION_NO } },
+    { "sntrup761-hybrid", "hostkey_ed25519",
+      { "sntrup761x25519-sha512@openssh.com", "chacha20-poly1305@openssh.com", NULL,
+        "ssh-ed25519", NULL, COMPRESSION_NO } },
+    { "nistp256-aes128gcm-zlib", "hostkey_ecdsa",
+      { "ecdh-sha2-nistp256", "aes128-gcm@openssh.com", NULL,
+        "ecdsa-sha2-nistp256", NULL, COMPRESSION_YES } },
+};
+#define NUM_PROFILES (sizeof(profiles) / sizeof(profiles[0]))
+
+
+static int64_t
+cpu_us(const struct rusage* usage) {
+    return (int64_t)(usage->ru_utime.tv_sec + usage->ru_stime.tv_sec) * 1000000 +
+           usage->ru_utime.tv_usec + usage->ru_stime.tv_usec;
+}
+
+
+// run `command` through the shell with its output discarded
+static int // 0=OK, 1=ERROR
+run_quietly(const char* command) {
+    char line[PATH_MAX*4 + 32];
+    snprintf(line, sizeof(line), "%s >/dev/null 2>&1", command);
+    return system(line) == 0 ? 0 : 1;
+}
+
+
+static int // 0=OK, 1=ERROR
+make_host_keys(const char* ssh_keygen) {
+    char command[PATH_MAX*4];
+
+    snprintf(command, sizeof(command),
+             "%s -q -N '' -t ecdsa -b 256 -f hostkey_ecdsa && "
+             "%s -q -N '' -t ed25519 -f hostkey_ed25519 && "
+             "%s -q -N '' -t rsa -b 3072 -f hostkey_rsa",
+             ssh_keygen, ssh_keygen, ssh_keygen);
+    return run_quietly(command);
+}
+
+
+// write the sshd_config for `profile`, with just enough around the
+// profile's lines for `sshd -i` to run unprivileged
+static int // 0=OK, 1=ERROR
+write_sshd_config(const Profile* profile, const char* filename) {
+    char  cwd[PATH_MAX];
+    FILE* file = fopen(filename, "w");
+
+    if (file == NULL || getcwd(cwd, sizeof(cwd)) == NULL) {
+        if (file != NULL) {
+            fclose(file);
+        }
+        return 1;
+    }
+    fprintf(file, "UsePAM no\n");
+    fprintf(file, "HostKey %s/%s\n", cwd, profile->host_key);
+    fprintf(file, "PidFile none\n");
+    fprintf(file, "LogLevel QUIET\n");
+    ssh_profile_render(&profile->crypto, file);
+    fclose(file);
+    return 0;
+}
+
+
+// true if `sshd` accepts X509KeyAlgorithm, i.e. is PKIX-SSH
+static int
+sshd_knows_x509(const char* sshd) {
+    Profile probe = profiles[0];
+    char    command[PATH_MAX*2];
+
+    if (write_sshd_config(&probe, "probe_config") != 0) {
+        return 0;
+    }
+    snprintf(command, sizeof(command), "%s -t -f probe_config", sshd);
+    return run_quietly(command) == 0;
+}
+
+
+// read what's left of `fd` into `output`, stopping at `deadline_us`
+static size_t
+read_until_eof(int fd, char* output, size_t size, int64_t deadline_us) {
+    size_t        used = 0;
+    struct pollfd pfd = { fd, POLLIN, 0 };
+
+    while (bench_now_us() < deadline_us) {
+        int64_t left_ms = (deadline_us - bench_now_us()) / 1000;
+        ssize_t len;
+
+        if (poll(&pfd, 1, (int)(left_ms > 0 ? left_ms : 1)) <= 0) {
+            continue;
+        }
+        len = read(fd, output + used, size - 1 - used);
+        if (len <= 0) {
+            break;
+        }
+        used += (size_t)len;
+        if (used == size - 1) {
+            used = 0;   // only the end matters, keep going
+        }
+    }
+    output[used] = '\0';
+    return used;
+}
+
+
+// copy the rest of the line after `prefix` in `output`, if it's there
+static void
+find_line(const char* output, const char* prefix, char* found, size_t size) {
+    const char* start = strstr(output, prefix);
+    size_t      len;
+
+    if (start == NULL) {
+        return;
+    }
+    start += strlen(prefix);
+    len = strcspn(start, "\r\n");
+    if (len >= size) {
+        len = size - 1;
+    }
+    memcpy(found, start, len);
+    found[len] = '\0';
+}
+
+
+// one handshake: ssh against `sshd -i`, returns its latency in
+// microseconds, or -1 if the keys weren't exchanged
+static int64_t
+handshake(const char* sshd, const char* ssh, const Profile* profile,
+          char* output, char* negotiated, size_t negotiated_size) {
+    char    proxy[PATH_MAX*2];
+    int     pipe_fds[2];
+    pid_t   pid;
+    int64_t start_us;
+    int64_t elapsed_us;
+    int     status;
+
+    snprintf(proxy, sizeof(proxy), "ProxyCommand=%s -i -f sshd_config", sshd);
+    if (pipe(pipe_fds) != 0) {
+        return -1;
+    }
+    start_us = bench_now_us();
+    pid = fork();
+    if (pid == -1) {
+        close(pipe_fds[0]);
+        close(pipe_fds[1]);
+        return -1;
+    }
+    if (pid == 0) {
+        int null_fd = open("/dev/null", O_RDWR);
+        dup2(null_fd, 0);
+        dup2(null_fd, 1);
+        dup2(pipe_fds[1], 2);
+        close(pipe_fds[0]);
+        execlp(ssh, ssh, "-F", "/dev/null", "-T", "-v",
+               profile->crypto.compression == COMPRESSION_YES ? "-C" : "-oCompression=no",
+               "-o", "BatchMode=yes",
+               "-o", "StrictHostKeyChecking=no",
+               "-o", "UserKnownHostsFile=/dev/null",
+               "-o", "IdentitiesOnly=yes",
+               "-o", "IdentityFile=/dev/null",
+               "-o", "PreferredAuthentications=publickey",
+               "-o", proxy,
+               "bench@ncch-bench", "true", (char*)NULL);
+        _exit(127);
+    }
+    close(pipe_fds[1]);
+    read_until_eof(pipe_fds[0], output, MAX_OUTPUT, start_us + HANDSHAKE_TIMEOUT_MS*1000);
+    close(pipe_fds[0]);
+    kill(pid, SIGKILL);   // no-op unless it timed out
+    waitpid(pid, &status, 0);
+    elapsed_us = bench_now_us() - start_us;
+
+    // sshd outlives ssh by a moment, reap it (we're its subreaper)
+    while (waitpid(-1, &status, 0) > 0 || errno == EINTR) {
+    }
+
+    if (strstr(output, "SSH2_MSG_NEWKEYS received") == NULL) {
+        return -1;
+    }
+    if (negotiated[0] == '\0') {
+        char kex[128] = "", cipher[256] = "";
+        find_line(output, "kex: algorithm: ", kex, sizeof(kex));
+        find_line(output, "kex: server->client cipher: ", cipher, sizeof(cipher));
+        snprintf(negotiated, negotiated_size, "%s, %s", kex, cipher);
+    }
+    return elapsed_us;
+}
+
+
+// write `str` as a JSON string
+static void
+print_json_string(const char* str) {
+    putchar('"');
+    for (; *str!='\0'; str++) {
+        if (*str == '"' || *str == '\\') {
+            putchar('\\');
+        }
+        if ((unsigned char)*str >= ' ') {
+            putchar(*str);
+        }
+    }
+    putchar('"');
+}
+
+
+/*****************************************************************************
+   BENCHMARK
+ *****************************************************************************/
+
+static void
+bench_profile(const char* sshd, const char* ssh, const Profile* profile,
+              uint32_t num_handshakes, int64_t* latencies, char* output) {
+    struct rusage before, after;
+    char          negotiated[512] = "";
+    char          error[256] = "";
+    uint32_t      done = 0;
+    uint32_t      idx;
+    int64_t       total_us = 0;
+    char          command[PATH_MAX*2];
+
+    if (write_sshd_config(profile, "sshd_config") != 0) {
+        snprintf(error, sizeof(error), "could not write sshd_config");
+    } else {
+        snprintf(command, sizeof(command), "%s -t -f sshd_config", sshd);
+        if (run_quietly(command) != 0) {
+            snprintf(error, sizeof(error), "sshd rejects the profile");
+        }
+    }
+
+    getrusage(RUSAGE_CHILDREN, &before);
+    for (idx=0; error[0]=='\0' && idx<num_handshakes; idx++) {
+        int64_t latency_us = handshake(sshd, ssh, profile, output,
+                                       negotiated, sizeof(negotiated));
+        if (latency_us < 0) {
+            if (done == 0) {
+                // fails every time, most likely unsupported
+                char last[200] = "";  // fits in `error` after the prefix
+                find_line(output, "Unable to negotiate", last, sizeof(last));
+                snprintf(error, sizeof(error), "no key exchange%s%s",
+                         last[0] != '\0' ? ": unable to negotiate" : "", last);
+            }
+            continue;
+        }
+        latencies[done++] = latency_us;
+        total_us += latency_us;
+    }
+    getrusage(RUSAGE_CHILDREN, &after);
+
+    printf("  {\"profile\": \"%s\", ", profile->name);
+    if (done == 0) {
+        printf("\"error\": ");
+        print_json_string(error);
+        printf("}");
+        return;
+    }
+    qsort(latencies, done, sizeof(int64_t), bench_compare_ns);
+    printf("\"handshakes\": %u, \"failed\": %u, \"negotiated\": ", done, num_handshakes - done);
+    print_json_string(negotiated);
+    printf(", \"latency_ms\": {\"mean\": %.2f, \"p50\": %.2f, \"p99\": %.2f}, "
+           "\"cpu_ms\": %.2f}",
+           total_us / 1000.0 / done,
+           latencies[done / 2] / 1000.0,
+           latencies[(done * 99) / 100] / 1000.0,
+           (cpu_us(&after) - cpu_us(&before)) / 1000.0 / num_handshakes);
+}
+
+
+/*****************************************************************************
+   MAIN
+ *****************************************************************************/
+
+int
+main(int argc, char** argv) {
+    uint32_t    num_handshakes = DEFAULT_HANDSHAKES;
+    const char* sshd_arg = DEFAULT_SSHD;
+    const char* ssh = DEFAULT_SSH;
+    char        sshd[PATH_MAX];
+    char        ssh_keygen[PATH_MAX];
+    char        dir[] = "/tmp/bench_handshake.XXXXXX";
+    char        command[PATH_MAX];
+    int64_t*    latencies;
+    char*       output;
+    int         x509;
+    uint32_t    idx;
+
+    if (argc > 1) {
+        num_handshakes = (uint32_t)atoi(argv[1]);
+    }
+    if (argc > 2) {
+        sshd_arg = argv[2];
+    }
+    if (argc > 3) {
+        ssh = argv[3];
+    }
+    if (num_handshakes == 0 || num_handshakes > MAX_HANDSHAKES || argc > 4) {
+        printf("usage: %s [handshakes [path-to-sshd [path-to-ssh]]]\n", argv[0]);
+        return 1;
+    }
+    // sshd wants to be run by its full path
+    if (realpath(sshd_arg, sshd) == NULL || access(sshd, X_OK) != 0) {
+        printf("{\"benchmark\": \"handshake\", \"error\": \"no sshd at \\\"%s\\\"\"}\n", sshd_arg);
+        return 1;
+    }
+    // ssh-keygen is wherever ssh is
+    if (strchr(ssh, '/') != NULL) {
+        snprintf(ssh_keygen, sizeof(ssh_keygen), "%.*s/ssh-keygen",
+                 (int)(strrchr(ssh, '/') - ssh), ssh);
+    } else {
+        snprintf(ssh_keygen, sizeof(ssh_keygen), "ssh-keygen");
+    }
+
+    latencies = (int64_t*)calloc(num_handshakes, sizeof(int64_t));
+    output = (char*)malloc(MAX_OUTPUT);
+    if (latencies == NULL || output == NULL) {
+        printf("{\"benchmark\": \"handshake\", \"error\": \"out of memory\"}\n");
+        return 1;
+    }
+    if (mkdtemp(dir) == NULL || chdir(dir) != 0 || make_host_keys(ssh_keygen) != 0) {
+        printf("{\"benchmark\": \"handshake\", \"error\": \"could not set up a scratch directory\"}\n");
+        return 1;
+    }
+    prctl(PR_SET_CHILD_SUBREAPER, 1);
+
+    x509 = sshd_knows_x509(sshd);
+    for (idx=0; idx<NUM_PROFILES; idx++) {
+        if (!x509) {
+            profiles[idx].crypto.x509_key_algorithm = "none";
+        }
+    }
+
+    printf("{\"benchmark\": \"handshake\", \"sshd\": \"%s\", \"x509\": %s, \"results\": [\n",
+           sshd, x509 ? "true" : "false");
+    for (idx=0; idx<NUM_PROFILES; idx++) {
+        bench_profile(sshd, ssh, &profiles[idx], num_handshakes, latencies, output);
+        printf("%s\n", idx + 1 < NUM_PROFILES ? "," : "");
+        fflush(stdout);
+    }
+    printf("]}\n");
+
+    free(latencies);
+    free(output);
+    if (chdir("/") == 0) {
+        snprintf(command, sizeof(command), "rm -rf %s", dir);
+        if (system(command) != 0) {
+            fprintf(stderr, "could not remove \"%s\"\n", dir);
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,574 @@
+/*****************************************************************************
+Copyright (c) 2014-2016, Juniper Networks, Inc.
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions
+are met:
+
+1. Redistributions of source code must retain the above copyright 
+   notice, this list of conditions and the following disclaimer.
+
+2. Redistributions in binary form must reproduce the above copyright
+   notice, this list of conditions and the following disclaimer in the
+   documentation and/or other materials provided with the distribution.
+
+3. Neither the name of the copyright holder nor the names of its 
+   contributors may be used to endorse or promote products derived 
+   from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS 
+"AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT 
+LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS 
+FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE 
+COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, 
+INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, 
+BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; 
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER 
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT 
+LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN 
+ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE 
+POSSIBILITY OF SUCH DAMAGE.
+ *****************************************************************************/
+
+
+
+/*****************************************************************************
+   OVERVIEW
+
+   This file benchmarks ncchd's config and state handling:
+
+     - get_incoming_config()     parse config.xml
+     - verify_incoming_config()  with the host-key registry warm and cold
+     - apply_incoming_config()   start every app, and reload an unchanged
+                                 config over running apps
+     - set_sshd_config_file()    per app
+     - set/get_persisted_state() per app
+
+   on generated configs of several sizes.  ncchd.c is compiled into this
+   file (its main() renamed), so its static functions are reachable, and
+   fork/exec and the network calls are stubbed: every connect is left
+   "in progress", as it would be right after a reload.  Everything runs
+   in a scratch directory under /tmp, with freshly generated host keys.
+
+   Results are printed as JSON, one record per benchmark and size, so
+   they can be compared from run to run.  ncchd's own log goes to
+   /dev/null.  Usage:
+
+       bench_ncchd [num-apps ...]      (default 100 1000 10000)
+ *****************************************************************************/
+
+
+/*****************************************************************************
+   INCLUDES AND EXTERNS
+ *****************************************************************************/
+
+// everything ncchd.c includes comes first, so the stubs below apply only
+// to ncchd.c's own calls
+#ifdef __linux__
+#define _GNU_SOURCE
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdarg.h>
+#include <string.h>
+#include <assert.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <errno.h>
+#include <limits.h>
+#include <sys/wait.h>
+#include <sys/syscall.h>
+#include <signal.h>
+#include <unistd.h>
+#include <poll.h>
+#include <time.h>
+#include <openssl/evp.h>
+#include <openssl/ec.h>
+#include <openssl/pem.h>
+#include "bench_util.h"
+
+
+/*****************************************************************************
+   STUBS
+ *****************************************************************************/
+
+// fds handed out by the socket() stub, far above any real one
+#define FAKE_FD_BASE (1 << 24)
+
+static int fake_fds = 0;
+
+
+static int
+bench_socket(int domain, int type, int protocol) {
+    return FAKE_FD_BASE + fake_fds++;
+}
+
+
+static int
+bench_connect(int fd, const struct sockaddr* addr, socklen_t len) {
+    errno = EINPROGRESS;
+    return -1;
+}
+
+
+static int
+bench_close(int fd) {
+    return (fd >= FAKE_FD_BASE) ? 0 : close(fd);
+}
+
+
+static int
+bench_fcntl(int fd, int cmd, ...) {
+    va_list args;
+    int     arg;
+
+    if (fd >= FAKE_FD_BASE) {
+        return 0;
+    }
+    va_start(args, cmd);
+    arg = va_arg(args, int);
+    va_end(args);
+    return fcntl(fd, cmd, arg);
+}
+
+
+// every name resolves to 127.0.0.1, without asking a resolver
+typedef struct FakeAddrInfo FakeAddrInfo;
+struct FakeAddrInfo {
+    struct addrinfo    ai;
+    struct sockaddr_in sin;
+};
+
+static int
+bench_getaddrinfo(const char* node, const char* service,
+                  const struct addrinfo* hints, struct addrinfo** res) {
+    FakeAddrInfo* fake = (FakeAddrInfo*)calloc(1, sizeof(FakeAddrInfo));
+
+    if (fake == NULL) {
+        return EAI_MEMORY;
+    }
+    fake->sin.sin_family = AF_INET;
+    fake->sin.sin_port = htons((uint16_t)atoi(service));
+    fake->sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    fake->ai.ai_family = AF_INET;
+    fake->ai.ai_socktype = SOCK_STREAM;
+    fake->ai.ai_addr = (struct sockaddr*)&fake->sin;
+    fake->ai.ai_addrlen = sizeof(fake->sin);
+    *res = &fake->ai;
+    return 0;
+}
+
+
+static void
+bench_freeaddrinfo(struct addrinfo* res) {
+    free(res);  // the FakeAddrInfo starts with it
+}
+
+
+// no session ever starts, this only guards against one
+static pid_t
+bench_fork(void) {
+    errno = ENOSYS;
+    return -1;
+}
+
+
+#define socket       bench_socket
+#define connect      bench_connect
+#define close        bench_close
+#define fcntl        bench_fcntl
+#define getaddrinfo  bench_getaddrinfo
+#define freeaddrinfo bench_freeaddrinfo
+#define fork         bench_fork
+
+int ncchd_main(int argc, char* argv[]);
+#define main ncchd_main
+#include "ncchd.c"
+#undef main
+#undef close
+#undef fcntl
+
+
+/*****************************************************************************
+   MACROS
+ *****************************************************************************/
+
+#define DEFAULT_SIZES      { 100, 1000, 10000 }
+#define NUM_HOST_KEYS      4
+#define MIN_ITERATIONS     3
+#define MAX_ITERATIONS     1000
+#define MIN_BENCH_NSECS    200000000LL   // keep repeating for at least 0.2s...
+#define MAX_BENCH_NSECS    2000000000LL  // ...unless setup makes that take 2s
+
+
+/*****************************************************************************
+   LOCAL/STATIC DEFINITIONS
+ *****************************************************************************/
+
+static FILE* json = NULL;
+static int   first_result = 1;
+
+
+// repetitions of one benchmark at one size
+typedef struct Timing Timing;
+struct Timing {
+    int      iterations;
+    int64_t  total_ns;
+    int64_t  min_ns;
+    int64_t  started_ns;
+    int64_t  first_ns;       // when the first iteration started, setup included
+};
+
+
+static void
+timing_init(Timing* timing) {
+    timing->iterations = 0;
+    timing->total_ns = 0;
+    timing->min_ns = INT64_MAX;
+    timing->first_ns = bench_now_ns();
+}
+
+
+static int // 1 while more iterations are wanted
+timing_more(Timing* timing) {
+    return timing->iterations < MIN_ITERATIONS ||
+           (timing->total_ns < MIN_BENCH_NSECS && timing->iterations < MAX_ITERATIONS &&
+            bench_now_ns() - timing->first_ns < MAX_BENCH_NSECS);
+}
+
+
+static void
+timing_start(Timing* timing) {
+    timing->started_ns = bench_now_ns();
+}
+
+
+static void
+timing_stop(Timing* timing) {
+    int64_t elapsed = bench_now_ns() - timing->started_ns;
+
+    timing->total_ns += elapsed;
+    if (elapsed < timing->min_ns) {
+        timing->min_ns = elapsed;
+    }
+    timing->iterations++;
+}
+
+
+// `ops` is how many operations one iteration does (e.g. one per app)
+static void
+report(const char* name, uint32_t num_apps, Timing* timing, uint32_t ops) {
+    double mean = (double)timing->total_ns / timing->iterations;
+
+    fprintf(json, "%s\n    {\"name\": \"%s\", \"apps\": %u, \"iterations\": %d, "
+                  "\"mean_ns\": %.0f, \"min_ns\": %lld, \"ns_per_op\": %.1f}",
+            first_result ? "" : ",", name, num_apps, timing->iterations,
+            mean, (long long)timing->min_ns, mean / ops);
+    fflush(json);
+    first_result = 0;
+}
+
+
+static int // 0=OK, 1=ERROR
+write_host_keys(void) {
+    int idx;
+
+    for (idx=0; idx<NUM_HOST_KEYS; idx++) {
+        EVP_PKEY_CTX* ctx = EVP_PKEY_CTX_new_id(EVP_PKEY_EC, NULL);
+        EVP_PKEY*     pkey = NULL;
+        char          filename[32];
+        FILE*         file;
+        int           ok;
+
+        ok = ctx != NULL &&
+             EVP_PKEY_keygen_init(ctx) > 0 &&
+             EVP_PKEY_CTX_set_ec_paramgen_curve_nid(ctx, NID_X9_62_prime256v1) > 0 &&
+             EVP_PKEY_keygen(ctx, &pkey) > 0;
+        EVP_PKEY_CTX_free(ctx);
+        if (!ok) {
+            return 1;
+        }
+        snprintf(filename, sizeof(filename), "key%d.pem", idx);
+        file = fopen(filename, "w");
+        ok = file != NULL && PEM_write_PrivateKey(file, pkey, NULL, NULL, 0, NULL, NULL);
+        if (file != NULL) {
+            fclose(file);
+        }
+        EVP_PKEY_free(pkey);
+        if (!ok) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+
+// a config.xml of `num_apps` apps, two servers each, sharing the host keys
+static int // 0=OK, 1=ERROR
+write_config(uint32_t num_apps) {
+    FILE*    file = fopen("config.xml", "w");
+    uint32_t idx;
+
+    if (file == NULL) {
+        return 1;
+    }
+    fprintf(file, "<netconf xmlns=\"urn:ietf:params:xml:ns:yang:ietf-netconf-server\">\n"
+                  "  <call-home>\n"
+                  "    <applications>\n");
+    for (idx=0; idx<num_apps; idx++) {
+        fprintf(file,
+                "      <application>\n"
+                "        <name>app-%u</name>\n"
+                "        <servers>\n"
+                "           <server><address>nms-%u.example.com</address><port>4334</port></server>\n"
+                "           <server><address>10.%u.%u.%u</address><port>4334</port></server>\n"
+                "        </servers>\n"
+                "        <transport><ssh><host-keys><host-key><name>key%u.pem</name></host-key></host-keys></ssh></transport>\n"
+                "        <connection-type><persistent><keep-alives>"
+                "<interval-secs>15</interval-secs><count-max>3</count-max>"
+                "</keep-alives></persistent></connection-type>\n"
+                "        <reconnect-strategy>\n"
+                "           <start-with>first-listed</start-with>\n"
+                "           <interval-secs>5</interval-secs>\n"
+                "           <count-max>3</count-max>\n"
+                "        </reconnect-strategy>\n"
+                "      </application>\n",
+                idx, idx % 64, (idx >> 16) & 0xff, (idx >> 8) & 0xff, idx & 0xff,
+                idx % NUM_HOST_KEYS);
+    }
+    fprintf(file, "    </applications>\n"
+                  "  </call-home>\n"
+                  "</netconf>\n");
+    return fclose(file) == 0 ? 0 : 1;
+}
+
+
+static Configuration* // NULL on error
+load_config(void) {
+    Configuration* config = (Configuration*)calloc(1, sizeof(Configuration));
+
+    if (config == NULL || get_incoming_config(config) != 0) {
+        free(config);
+        return NULL;
+    }
+    return config;
+}
+
+
+// stop every app in `active`, leaving it empty
+static void
+stop_all(Configuration* active) {
+    Configuration empty;
+
+    memset(&empty, 0, sizeof(empty));
+    apply_incoming_config(active, &empty);
+    free(active->runtime);
+    active->runtime = NULL;
+}
+
+
+/*****************************************************************************
+   BENCHMARKS
+ *****************************************************************************/
+
+static int // 0=OK, 1=ERROR
+bench_size(uint32_t num_apps) {
+    Configuration  active;
+    Configuration* config;
+    Timing         timing;
+    uint32_t       idx;
+
+    if (write_config(num_apps) != 0) {
+        return 1;
+    }
+
+    // parsing
+    timing_init(&timing);
+    while (timing_more(&timing)) {
+        config = (Configuration*)calloc(1, sizeof(Configuration));
+        timing_start(&timing);
+        if (get_incoming_config(config) != 0) {
+            return 1;
+        }
+        timing_stop(&timing);
+        free_configuration(config);
+    }
+    report("get_incoming_config", num_apps, &timing, num_apps);
+
+    // verification, with the registry as a reload finds it and empty
+    config = load_config();
+    if (config == NULL) {
+        return 1;
+    }
+    timing_init(&timing);
+    while (timing_more(&timing)) {
+        timing_start(&timing);
+        if (verify_incoming_config(config, true) != 0) {
+            return 1;
+        }
+        timing_stop(&timing);
+    }
+    report("verify_incoming_config_warm", num_apps, &timing, num_apps);
+    timing_init(&timing);
+    while (timing_more(&timing)) {
+        host_keys_clear();
+        timing_start(&timing);
+        if (verify_incoming_config(config, true) != 0) {
+            return 1;
+        }
+        timing_stop(&timing);
+    }
+    report("verify_incoming_config_cold", num_apps, &timing, num_apps);
+
+    // sshd config files, one per app
+    timing_init(&timing);
+    while (timing_more(&timing)) {
+        timing_start(&timing);
+        for (idx=0; idx<config->num_apps; idx++) {
+            if (set_sshd_config_file(&config->apps[idx]) != 0) {
+                return 1;
+            }
+        }
+        timing_stop(&timing);
+    }
+    report("set_sshd_config_file", num_apps, &timing, num_apps);
+
+    // persisted state, one file per app
+    timing_init(&timing);
+    while (timing_more(&timing)) {
+        PersistedState state;
+        memset(&state, 0, sizeof(state));
+        snprintf(state.last_connected_addr, sizeof(state.last_connected_addr), "10.0.0.1");
+        state.last_connected_port = 4334;
+        timing_start(&timing);
+        for (idx=0; idx<config->num_apps; idx++) {
+            if (set_persisted_state(config->apps[idx].name, &state) != 0) {
+                return 1;
+            }
+        }
+        timing_stop(&timing);
+    }
+    report("set_persisted_state", num_apps, &timing, num_apps);
+    timing_init(&timing);
+    while (timing_more(&timing)) {
+        PersistedState state;
+        timing_start(&timing);
+        for (idx=0; idx<config->num_apps; idx++) {
+            if (get_persisted_state(config->apps[idx].name, &state) != 0) {
+                return 1;
+            }
+        }
+        timing_stop(&timing);
+    }
+    report("get_persisted_state", num_apps, &timing, num_apps);
+    free_configuration(config);
+
+    // applying: starting every app, then reloading the same config over
+    // the running apps, which keeps every session
+    memset(&active, 0, sizeof(active));
+    timing_init(&timing);
+    while (timing_more(&timing)) {
+        config = load_config();
+        if (config == NULL) {
+            return 1;
+        }
+        timing_start(&timing);
+        if (apply_incoming_config(&active, config) != 0) {
+            return 1;
+        }
+        timing_stop(&timing);
+        free(config);
+        stop_all(&active);
+    }
+    report("apply_incoming_config_start", num_apps, &timing, num_apps);
+
+    config = load_config();
+    if (config == NULL || apply_incoming_config(&active, config) != 0) {
+        return 1;
+    }
+    free(config);
+    timing_init(&timing);
+    while (timing_more(&timing)) {
+        config = load_config();
+        if (config == NULL) {
+            return 1;
+        }
+        timing_start(&timing);
+        if (apply_incoming_config(&active, config) != 0) {
+            return 1;
+        }
+        timing_stop(&timing);
+        free(config);
+    }
+    report("apply_incoming_config_reload", num_apps, &timing, num_apps);
+    stop_all(&active);
+    return 0;
+}
+
+
+/*****************************************************************************
+   MAIN
+ *****************************************************************************/
+
+int main(int argc, char* argv[]) {
+    uint32_t default_sizes[] = DEFAULT_SIZES;
+    char     dir[] = "/tmp/bench_ncchd.XXXXXX";
+    char     command[64];
+    int      devnull;
+    int      idx;
+    int      result = 0;
+
+    // JSON goes to the real stdout, ncchd's log to /dev/null
+    json = fdopen(dup(STDOUT_FILENO), "w");
+    devnull = open("/dev/null", O_WRONLY);
+    if (json == NULL || devnull == -1 || dup2(devnull, STDOUT_FILENO) == -1) {
+        fprintf(stderr, "could not redirect stdout\n");
+        return 1;
+    }
+    log_set_level("error");
+
+    if (mkdtemp(dir) == NULL || chdir(dir) != 0) {
+        fprintf(stderr, "could not create scratch directory\n");
+        return 1;
+    }
+    if (write_host_keys() != 0 || status_table_create(STATUS_TABLE_PATH) != 0) {
+        fprintf(stderr, "could not set up scratch directory \"%s\"\n", dir);
+        return 1;
+    }
+
+    fprintf(json, "{\"benchmark\": \"ncchd\", \"results\": [");
+    if (argc > 1) {
+        for (idx=1; idx<argc && result == 0; idx++) {
+            result = bench_size((uint32_t)strtoul(argv[idx], NULL, 10));
+        }
+    } else {
+        for (idx=0; idx<(int)(sizeof(default_sizes)/sizeof(default_sizes[0])) && result == 0; idx++) {
+            result = bench_size(default_sizes[idx]);
+        }
+    }
+    fprintf(json, "\n]}\n");
+    if (result != 0) {
+        fprintf(stderr, "benchmark failed, scratch directory kept in \"%s\"\n", dir);
+        return 1;
+    }
+
+    status_table_destroy(STATUS_TABLE_PATH);
+    host_keys_clear();
+    if (chdir("/") == 0) {
+        snprintf(command, sizeof(command), "rm -rf %s", dir);
+        result = system(command);
+    }
+    return 0;
+}
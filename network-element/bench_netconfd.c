@@ -0,0 +1,1067 @@
+/*****************************************************************************
+Copyright (c) 2014-2016, Juniper Networks, Inc.
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions
+are met:
+
+1. Redistributions of source code must retain the above copyright 
+   notice, this list of conditions and the following disclaimer.
+
+2. Redistributions in binary form must reproduce the above copyright
+   notice, this list of conditions and the following disclaimer in the
+   documentation and/or other materials provided with the distribution.
+
+3. Neither the name of the copyright holder nor the names of its 
+   contributors may be used to endorse or promote products derived 
+   from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS 
+"AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT 
+LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS 
+FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE 
+COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, 
+INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, 
+BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; 
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER 
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT 
+LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN 
+ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE 
+POSSIBILITY OF SUCH DAMAGE.
+ *****************************************************************************/
+
+
+
+/*****************************************************************************
+   OVERVIEW
+
+   This file benchmarks netconfd as SSHD runs it, a session on its stdin
+   and stdout, by replaying client traffic into it through pipes and
+   reading its replies back.  The corpus is what clients send: a <hello>
+   (base:1.0 or base:1.1), then RPCs, pipelined, and a <close-session>:
+
+     - "base-1.0": end-of-message (]]>]]>) framing, small RPCs written
+       the ways clients write them (one line, pretty-printed with an XML
+       declaration and a urn:uuid message-id, <get/>, a <candidate/>
+       source that is refused)
+     - "base-1.1": the same in RFC 6242 chunks, a message sometimes cut
+       into several chunks of random sizes
+     - "eom-in-1.1": base:1.1 <hello>s, but messages ending in ]]>]]>,
+       as SimpleNMS sends them
+     - "huge-1.0" and "huge-1.1": <get-config>s carrying a 256 KB filter
+       (with lines much longer than netconf.c's NETCONF_MAX_LINE),
+       answered from a config.xml of 20k apps (about 12 MB)
+
+   plus any recordings named on the command line: client traffic as it
+   came, e.g. saved with tee(1) between SSHD and netconfd.
+
+   Each corpus is replayed three ways:
+
+     - "pipelined": written as fast as netconfd takes it, 64 KB a write
+     - "split": written in pieces of random sizes, each left for
+       netconfd to read before the next, so its reads see them apart
+     - "misaligned": the same, cut in the middle of every ]]>]]>, chunk
+       header and end-of-chunks marker, and once within each message
+
+   Every reply is checked: its framing, that its message-id is the
+   request's, and its contents (the datastore, verbatim, or <ok/>, or the
+   expected <rpc-error>).  All three replays of a corpus must get the same
+   replies, byte for byte, which is all that's checked for a recording.
+   For each replay it reports messages (replies) and bytes (in and out)
+   per second, which only mean something for "pipelined", the read() and
+   write() system calls netconfd made per message (from /proc/<pid>/io;
+   it also makes a poll() per read()), and its peak RSS (VmHWM, sampled
+   every 10 ms).  Results are
+   printed as JSON; the exit status is 1 if any reply was wrong, so it
+   doubles as a regression test of netconfd's framing.  Usage:
+
+       bench_netconfd [rpcs [path-to-netconfd [recording ...]]]
+ *****************************************************************************/
+
+
+/*****************************************************************************
+   INCLUDES AND EXTERNS
+ *****************************************************************************/
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdarg.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include "bench_util.h"
+
+
+/*****************************************************************************
+   MACROS
+ *****************************************************************************/
+
+#define DEFAULT_RPCS       2000
+#define DEFAULT_NETCONFD   "./netconfd"
+#define SMALL_APPS         20       // the datastore, for the small RPCs
+#define HUGE_APPS          20000    // and for the huge ones
+#define HUGE_FILTER_BYTES  (256 * 1024)
+#define LONG_LINE_BYTES    10000
+#define PIPELINED_WRITE    65536
+#define MAX_ID             64       // as netconf.h's NETCONF_MAX_ID
+#define MAX_ERROR          256
+
+#define NETCONF_NS  "urn:ietf:params:xml:ns:netconf:base:1.0"
+#define BASE_1_1    "urn:ietf:params:netconf:base:1.1"
+#define EOM         "]]>]]>\n"
+
+enum FRAMING { FRAMING_EOM, FRAMING_CHUNKED, FRAMING_EOM_IN_1_1 };
+enum REPLAY  { REPLAY_PIPELINED, REPLAY_SPLIT, REPLAY_MISALIGNED, NUM_REPLAYS };
+enum REPLY   { REPLY_DATA, REPLY_OK, REPLY_INVALID_VALUE };
+
+
+/*****************************************************************************
+   STRUCTS
+ *****************************************************************************/
+
+typedef struct Buffer Buffer;
+struct Buffer {
+  char   *data;
+  size_t  len;
+  size_t  cap;
+};
+
+// a reply the corpus should get
+typedef struct Expected Expected;
+struct Expected {
+  uint8_t  kind;
+  char     id[MAX_ID];
+};
+
+typedef struct Corpus Corpus;
+struct Corpus {
+  const char *name;
+  Buffer      stream;               // what the client sends
+  size_t     *cuts;                 // offsets into it, for "misaligned"
+  size_t      num_cuts;
+  size_t      max_cuts;
+  Expected   *expected;             // NULL for a recording
+  size_t      num_expected;
+  uint8_t     chunked;              // replies after the <hello> are chunked
+  size_t      split_max;            // "split"'s pieces, at most
+  const char *datastore;
+  const char *body;                 // the datastore as <data> holds it
+  size_t      body_len;
+};
+
+// what a replay got
+typedef struct Replay Replay;
+struct Replay {
+  const Corpus *corpus;
+  uint8_t       how;
+  uint8_t       seen_hello;
+  uint8_t       chunked;            // past the <hello>
+  uint8_t       deframe;            // where it is in a chunk's framing
+  uint64_t      chunk_left;
+  Buffer        message;            // the reply so far
+  size_t        replies;            // not counting the <hello>
+  uint64_t      bytes_out;
+  uint64_t      hash;               // of the replies
+  char          error[MAX_ERROR];   // the first thing wrong, if any
+};
+
+// the writer thread's
+typedef struct Writer Writer;
+struct Writer {
+  const Corpus *corpus;
+  uint8_t       how;
+  int           fd;
+};
+
+
+/*****************************************************************************
+   LOCAL/STATIC DEFINITIONS
+ *****************************************************************************/
+
+static const char hello_1_0[] =
+    "<hello xmlns=\"" NETCONF_NS "\">\n"
+    "<capabilities><capability>urn:ietf:params:netconf:base:1.0</capability></capabilities>\n"
+    "</hello>\n";
+
+static const char hello_1_1[] =
+    "<hello xmlns=\"" NETCONF_NS "\">\n"
+    "<capabilities><capability>urn:ietf:params:netconf:base:1.0</capability>"
+    "<capability>" BASE_1_1 "</capability></capabilities>\n"
+    "</hello>\n";
+
+static const char* replay_names[NUM_REPLAYS] = { "pipelined", "split", "misaligned" };
+
+// where a reply is in its chunks' framing
+enum DEFRAME { AT_CHUNK, AT_HASH, AT_SIZE, IN_SIZE, IN_CHUNK, AT_END };
+
+static uint64_t random_state = 88172645463325252ULL;
+
+
+// xorshift64, seeded the same every run so the corpus is too
+static uint64_t
+next_random(void) {
+    random_state ^= random_state << 13;
+    random_state ^= random_state >> 7;
+    random_state ^= random_state << 17;
+    return random_state;
+}
+
+
+static int // 0=OK, 1=ERROR (out of memory)
+buffer_add(Buffer* buffer, const void* data, size_t len) {
+    if (buffer->len + len + 1 > buffer->cap) {
+        size_t cap = buffer->cap ? buffer->cap : 4096;
+        char*  grown;
+
+        while (buffer->len + len + 1 > cap) {
+            cap *= 2;
+        }
+        if ((grown = (char*)realloc(buffer->data, cap)) == NULL) {
+            return 1;
+        }
+        buffer->data = grown;
+        buffer->cap = cap;
+    }
+    memcpy(buffer->data + buffer->len, data, len);
+    buffer->len += len;
+    buffer->data[buffer->len] = '\0';
+    return 0;
+}
+
+
+static int // 0=OK, 1=ERROR (out of memory)
+buffer_printf(Buffer* buffer, const char* format, ...) {
+    char    text[1024];
+    va_list args;
+    int     len;
+
+    va_start(args, format);
+    len = vsnprintf(text, sizeof(text), format, args);
+    va_end(args);
+    if (len < 0 || (size_t)len >= sizeof(text)) {
+        return 1;
+    }
+    return buffer_add(buffer, text, (size_t)len);
+}
+
+
+// where "misaligned" cuts the stream: `offset` bytes from its end so far
+static int // 0=OK, 1=ERROR (out of memory)
+add_cut(Corpus* corpus, size_t offset) {
+    if (corpus->num_cuts == corpus->max_cuts) {
+        size_t  max_cuts = corpus->max_cuts ? corpus->max_cuts * 2 : 1024;
+        size_t* cuts = (size_t*)realloc(corpus->cuts, sizeof(size_t) * max_cuts);
+
+        if (cuts == NULL) {
+            return 1;
+        }
+        corpus->cuts = cuts;
+        corpus->max_cuts = max_cuts;
+    }
+    corpus->cuts[corpus->num_cuts++] = corpus->stream.len - offset;
+    return 0;
+}
+
+
+// the file at `path`, all of it
+static int // 0=OK, 1=ERROR
+read_file(const char* path, Buffer* file) {
+    char    buf[65536];
+    ssize_t got;
+    int     fd = open(path, O_RDONLY);
+
+    if (fd == -1) {
+        return 1;
+    }
+    while ((got = read(fd, buf, sizeof(buf))) > 0) {
+        if (buffer_add(file, buf, (size_t)got) != 0) {
+            break;
+        }
+    }
+    close(fd);
+    return (got == 0 && file->data != NULL) ? 0 : 1;
+}
+
+
+// the config.xml at `path`, less its XML declaration, as <data> holds it
+static char* // NULL on error; the caller frees it
+read_body(const char* path, size_t* len) {
+    Buffer file = { NULL, 0, 0 };
+    char*  body;
+
+    if (read_file(path, &file) != 0) {
+        free(file.data);
+        return NULL;
+    }
+    body = file.data + strspn(file.data, " \t\r\n");
+    if (strncmp(body, "<?xml", 5) == 0 && strstr(body, "?>") != NULL) {
+        body = strstr(body, "?>") + 2;
+        body += strspn(body, " \t\r\n");
+    }
+    *len = file.len - (size_t)(body - file.data);
+    memmove(file.data, body, *len + 1);
+    return file.data;
+}
+
+
+/*****************************************************************************
+   THE CORPUS
+ *****************************************************************************/
+
+// append `text` as the client frames a message
+static int // 0=OK, 1=ERROR (out of memory)
+add_message(Corpus* corpus, const char* text, size_t len, int chunked) {
+    size_t offset;
+    int    result = 0;
+
+    if (!chunked) {
+        result |= buffer_add(&corpus->stream, text, len);
+        result |= add_cut(corpus, next_random() % (len + 1));
+        result |= buffer_add(&corpus->stream, EOM, strlen(EOM));
+        result |= add_cut(corpus, 6);   // "]" / "]>]]>\n"
+        result |= add_cut(corpus, 4);   // "]]>" / "]]>\n"
+        result |= add_cut(corpus, 2);   // "]]>]]" / ">\n"
+        return result;
+    }
+
+    // one chunk, or (one time in four) several of random sizes
+    for (offset=0; offset<len && result==0; ) {
+        size_t piece = len - offset;
+        char   header[32];
+
+        if (next_random() % 4 == 0) {
+            piece = 1 + next_random() % piece;
+        }
+        snprintf(header, sizeof(header), "\n#%zu\n", piece);
+        result |= buffer_add(&corpus->stream, header, strlen(header));
+        result |= add_cut(corpus, strlen(header) - 1);      // "\n" / "#..."
+        result |= add_cut(corpus, strlen(header) - 2);      // "\n#" / "..."
+        if (strlen(header) > 4) {
+            result |= add_cut(corpus, strlen(header) - 3);  // mid-size
+        }
+        result |= add_cut(corpus, 1);                       // before "\n"
+        result |= buffer_add(&corpus->stream, text + offset, piece);
+        result |= add_cut(corpus, next_random() % (piece + 1));
+        offset += piece;
+    }
+    result |= buffer_add(&corpus->stream, "\n##\n", 4);
+    result |= add_cut(corpus, 3);
+    result |= add_cut(corpus, 2);
+    result |= add_cut(corpus, 1);
+    return result;
+}
+
+
+// the `idx`th RPC: its text, and the reply it should get
+static int // 0=OK, 1=ERROR (out of memory)
+make_rpc(Buffer* rpc, Expected* expected, uint32_t idx, int huge) {
+    uint32_t line;
+    uint32_t item;
+    int      result = 0;
+
+    rpc->len = 0;
+    snprintf(expected->id, sizeof(expected->id), "%u", idx + 1);
+    expected->kind = REPLY_DATA;
+
+    if (huge) {
+        // a subtree filter (ignored), every 16th line a long one
+        result |= buffer_printf(rpc, "<rpc message-id=\"%u\" xmlns=\"" NETCONF_NS "\">\n"
+                                "<get-config><source><running/></source>\n"
+                                "<filter type=\"subtree\"><netconf>\n", idx + 1);
+        for (line=0; rpc->len < HUGE_FILTER_BYTES && result == 0; line++) {
+            size_t end = rpc->len + (line % 16 == 15 ? LONG_LINE_BYTES : 1);
+
+            for (item=0; rpc->len < end && result == 0; item++) {
+                result |= buffer_printf(rpc, "<application><name>app-%u</name></application>",
+                                        line * 1000 + item);
+            }
+            result |= buffer_add(rpc, "\n", 1);
+        }
+        result |= buffer_printf(rpc, "</netconf></filter>\n</get-config>\n</rpc>\n");
+        return result;
+    }
+
+    switch (idx % 8) {
+    case 4:
+        return buffer_printf(rpc, "<rpc message-id=\"%u\" xmlns=\"" NETCONF_NS "\">\n"
+                             "<get/>\n</rpc>\n", idx + 1);
+    case 5:
+        expected->kind = REPLY_INVALID_VALUE;
+        return buffer_printf(rpc, "<rpc message-id=\"%u\" xmlns=\"" NETCONF_NS "\">\n"
+                             "<get-config><source><candidate/></source></get-config>\n"
+                             "</rpc>\n", idx + 1);
+    case 6:
+        snprintf(expected->id, sizeof(expected->id),
+                 "urn:uuid:7e0b1a36-0000-4000-8000-%012u", idx + 1);
+        return buffer_printf(rpc, "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n"
+                             "<rpc message-id=\"%s\"\n"
+                             "     xmlns=\"" NETCONF_NS "\">\n"
+                             "  <get-config>\n"
+                             "    <source>\n"
+                             "      <running/>\n"
+                             "    </source>\n"
+                             "    <filter type=\"subtree\">\n"
+                             "      <netconf><call-home><applications><application>\n"
+                             "        <name>app-%u</name>\n"
+                             "      </application></applications></call-home></netconf>\n"
+                             "    </filter>\n"
+                             "  </get-config>\n"
+                             "</rpc>\n", expected->id, idx % SMALL_APPS);
+    case 7:
+        return buffer_printf(rpc, "<rpc message-id=\"%u\" xmlns=\"" NETCONF_NS "\">"
+                             "<get-config><source><running/></source></get-config></rpc>\n",
+                             idx + 1);
+    default:
+        return buffer_printf(rpc, "<rpc message-id=\"%u\" xmlns=\"" NETCONF_NS "\">\n"
+                             "<get-config><source><running/></source></get-config>\n"
+                             "</rpc>\n", idx + 1);
+    }
+}
+
+
+// a session: <hello>, `rpcs` RPCs and <close-session>
+static int // 0=OK, 1=ERROR
+make_corpus(Corpus* corpus, uint8_t framing, uint32_t rpcs, int huge) {
+    const char* hello = (framing == FRAMING_EOM) ? hello_1_0 : hello_1_1;
+    Buffer      rpc = { NULL, 0, 0 };
+    uint32_t    idx;
+    int         result = 0;
+
+    corpus->expected = (Expected*)calloc(rpcs + 1, sizeof(Expected));
+    if (corpus->expected == NULL) {
+        return 1;
+    }
+    corpus->chunked = (framing != FRAMING_EOM);
+    corpus->split_max = huge ? 8192 : 64;
+
+    // the <hello> is always ]]>]]> framed
+    result |= add_message(corpus, hello, strlen(hello), 0);
+    for (idx=0; idx<rpcs && result==0; idx++) {
+        result |= make_rpc(&rpc, &corpus->expected[idx], idx, huge);
+        result |= add_message(corpus, rpc.data, rpc.len, framing == FRAMING_CHUNKED);
+    }
+    rpc.len = 0;
+    result |= buffer_printf(&rpc, "<rpc message-id=\"%u\" xmlns=\"" NETCONF_NS "\">\n"
+                            "<close-session/>\n</rpc>\n", rpcs + 1);
+    result |= add_message(corpus, rpc.data, rpc.len, framing == FRAMING_CHUNKED);
+    snprintf(corpus->expected[rpcs].id, MAX_ID, "%u", rpcs + 1);
+    corpus->expected[rpcs].kind = REPLY_OK;
+    corpus->num_expected = rpcs + 1;
+    free(rpc.data);
+    return result;
+}
+
+
+// a recording: the client's bytes as they came
+static int // 0=OK, 1=ERROR
+load_recording(Corpus* corpus, const char* path) {
+    char*  hello_end;
+    size_t offset;
+
+    if (read_file(path, &corpus->stream) != 0) {
+        return 1;
+    }
+    hello_end = strstr(corpus->stream.data, "]]>]]>");
+    if (hello_end != NULL) {
+        *hello_end = '\0';
+        corpus->chunked = strstr(corpus->stream.data, BASE_1_1) != NULL;
+        *hello_end = ']';
+    }
+    corpus->split_max = 64;
+
+    // cut wherever framing might be
+    for (offset=1; offset<corpus->stream.len; offset++) {
+        if ((corpus->stream.data[offset-1] == ']' && corpus->stream.data[offset] == ']') ||
+            (corpus->stream.data[offset-1] == '\n' && corpus->stream.data[offset] == '#') ||
+            (corpus->stream.data[offset-1] == '#' && corpus->stream.data[offset] == '#')) {
+            if (add_cut(corpus, corpus->stream.len - offset) != 0) {
+                return 1;
+            }
+        }
+    }
+    return 0;
+}
+
+
+/*****************************************************************************
+   THE REPLIES
+ *****************************************************************************/
+
+static void
+replay_failed(Replay* replay, const char* format, ...) {
+    va_list args;
+
+    if (replay->error[0] != '\0') {
+        return;   // the first one's what matters
+    }
+    va_start(args, format);
+    vsnprintf(replay->error, sizeof(replay->error), format, args);
+    va_end(args);
+}
+
+
+// FNV-1a, to compare replays' replies
+static void
+hash_add(Replay* replay, const char* data, size_t len) {
+    size_t idx;
+
+    for (idx=0; idx<len; idx++) {
+        replay->hash = (replay->hash ^ (uint8_t)data[idx]) * 1099511628211ULL;
+    }
+}
+
+
+// check a whole reply against what the corpus expects
+static void
+check_reply(Replay* replay, const char* text, size_t len) {
+    const Corpus*   corpus = replay->corpus;
+    const Expected* expected;
+    char            head[256];
+    static const char tail[] = "</data>\n</rpc-reply>\n";
+
+    if (!replay->seen_hello) {
+        // its session-id is netconfd's pid, so it isn't hashed
+        if (strstr(text, "<hello") == NULL || strstr(text, "<session-id>") == NULL ||
+            strstr(text, BASE_1_1) == NULL) {
+            replay_failed(replay, "bad <hello>");
+        }
+        replay->seen_hello = 1;
+        replay->chunked = corpus->chunked;
+        return;
+    }
+    hash_add(replay, text, len);
+    hash_add(replay, "", 1);   // where it ended
+    if (corpus->expected == NULL) {
+        replay->replies++;
+        return;
+    }
+    if (replay->replies >= corpus->num_expected) {
+        replay_failed(replay, "reply %zu, but only %zu RPCs", replay->replies + 1,
+                      corpus->num_expected);
+        replay->replies++;
+        return;
+    }
+    expected = &corpus->expected[replay->replies++];
+    snprintf(head, sizeof(head), "<rpc-reply message-id=\"%s\"\n"
+             "           xmlns=\"" NETCONF_NS "\">\n", expected->id);
+    if (len < strlen(head) || memcmp(text, head, strlen(head)) != 0) {
+        replay_failed(replay, "reply %zu: not for message-id %s", replay->replies, expected->id);
+        return;
+    }
+    text += strlen(head);
+    len -= strlen(head);
+    switch (expected->kind) {
+    case REPLY_DATA:
+        if (len != strlen("<data>\n") + corpus->body_len + strlen(tail) ||
+            memcmp(text, "<data>\n", strlen("<data>\n")) != 0 ||
+            memcmp(text + strlen("<data>\n"), corpus->body, corpus->body_len) != 0 ||
+            memcmp(text + len - strlen(tail), tail, strlen(tail)) != 0) {
+            replay_failed(replay, "reply %zu (message-id %s): not the datastore",
+                          replay->replies, expected->id);
+        }
+        break;
+    case REPLY_OK:
+        if (strcmp(text, "  <ok/>\n</rpc-reply>\n") != 0) {
+            replay_failed(replay, "reply %zu (message-id %s): not <ok/>",
+                          replay->replies, expected->id);
+        }
+        break;
+    case REPLY_INVALID_VALUE:
+        if (strstr(text, "<error-tag>invalid-value</error-tag>") == NULL) {
+            replay_failed(replay, "reply %zu (message-id %s): not invalid-value",
+                          replay->replies, expected->id);
+        }
+        break;
+    }
+}
+
+
+// the reply so far is whole
+static void
+end_reply(Replay* replay) {
+    check_reply(replay, replay->message.data != NULL ? replay->message.data : "",
+                replay->message.len);
+    replay->message.len = 0;
+}
+
+
+// take what netconfd wrote, checking its framing reply by reply
+static int // 0=OK, 1=ERROR (bad framing, or out of memory)
+deframe(Replay* replay, const char* data, size_t len) {
+    const char* end = data + len;
+
+    while (data < end && replay->error[0] == '\0') {
+        if (!replay->chunked) {
+            // ]]>]]>\n ends it, maybe straddling what's held and what came
+            const char* marker = NULL;
+            size_t      used = 0;
+            size_t      held = replay->message.len < 6 ? replay->message.len : 6;
+
+            if (held > 0) {
+                char   window[12];
+                size_t more = (size_t)(end - data) < 6 ? (size_t)(end - data) : 6;
+
+                memcpy(window, replay->message.data + replay->message.len - held, held);
+                memcpy(window + held, data, more);
+                marker = (const char*)memmem(window, held + more, EOM, strlen(EOM));
+                if (marker != NULL) {
+                    used = (size_t)(marker - window) + strlen(EOM) - held;
+                }
+            }
+            if (marker == NULL &&
+                (marker = (const char*)memmem(data, (size_t)(end - data), EOM, strlen(EOM))) != NULL) {
+                used = (size_t)(marker - data) + strlen(EOM);
+            }
+            if (marker == NULL) {
+                used = (size_t)(end - data);
+            }
+            if (buffer_add(&replay->message, data, used) != 0) {
+                return 1;
+            }
+            data += used;
+            if (marker != NULL) {
+                replay->message.len -= strlen(EOM);
+                replay->message.data[replay->message.len] = '\0';
+                end_reply(replay);
+            }
+            continue;
+        }
+
+        switch (replay->deframe) {
+        case AT_CHUNK:
+            if (*data++ != '\n') {
+                replay_failed(replay, "reply %zu: no chunk header", replay->replies + 1);
+                return 1;
+            }
+            replay->deframe = AT_HASH;
+            break;
+        case AT_HASH:
+            if (*data++ != '#') {
+                replay_failed(replay, "reply %zu: no chunk header", replay->replies + 1);
+                return 1;
+            }
+            replay->deframe = AT_SIZE;
+            break;
+        case AT_SIZE:
+            if (*data == '#' && replay->message.len > 0) {
+                data++;
+                replay->deframe = AT_END;
+                break;
+            }
+            if (*data < '1' || *data > '9') {
+                replay_failed(replay, "reply %zu: bad chunk size", replay->replies + 1);
+                return 1;
+            }
+            replay->chunk_left = (uint64_t)(*data++ - '0');
+            replay->deframe = IN_SIZE;
+            break;
+        case IN_SIZE:
+            if (*data == '\n') {
+                data++;
+                replay->deframe = IN_CHUNK;
+                break;
+            }
+            if (*data < '0' || *data > '9' || replay->chunk_left > UINT32_MAX / 10) {
+                replay_failed(replay, "reply %zu: bad chunk size", replay->replies + 1);
+                return 1;
+            }
+            replay->chunk_left = replay->chunk_left * 10 + (uint64_t)(*data++ - '0');
+            break;
+        case IN_CHUNK: {
+            size_t take = (size_t)(end - data) < replay->chunk_left ? (size_t)(end - data)
+                                                                    : (size_t)replay->chunk_left;
+
+            if (buffer_add(&replay->message, data, take) != 0) {
+                return 1;
+            }
+            data += take;
+            replay->chunk_left -= take;
+            if (replay->chunk_left == 0) {
+                replay->deframe = AT_CHUNK;
+            }
+            break;
+        }
+        case AT_END:
+            if (*data++ != '\n') {
+                replay_failed(replay, "reply %zu: bad end of chunks", replay->replies + 1);
+                return 1;
+            }
+            replay->deframe = AT_CHUNK;
+            end_reply(replay);
+            break;
+        }
+    }
+    return 0;
+}
+
+
+/*****************************************************************************
+   THE REPLAYS
+ *****************************************************************************/
+
+// write all of `len`, then (unless pipelining) wait for netconfd to read it
+static int // 0=OK, 1=ERROR (netconfd has gone)
+write_piece(int fd, const char* data, size_t len, int wait) {
+    struct pollfd pfd;
+    ssize_t       written;
+    int           unread;
+
+    while (len > 0) {
+        written = write(fd, data, len);
+        if (written == -1 && errno == EINTR) {
+            continue;
+        }
+        if (written <= 0) {
+            return 1;
+        }
+        data += written;
+        len -= (size_t)written;
+    }
+    while (wait && ioctl(fd, FIONREAD, &unread) == 0 && unread > 0) {
+        pfd.fd = fd;
+        pfd.events = POLLOUT;
+        if (poll(&pfd, 1, 0) == 1 && (pfd.revents & POLLERR)) {
+            return 1;
+        }
+        sched_yield();
+    }
+    return 0;
+}
+
+
+// the client: write the corpus as `how` says, then close
+static void*
+write_corpus(void* arg) {
+    Writer*       writer = (Writer*)arg;
+    const Corpus* corpus = writer->corpus;
+    const char*   data = corpus->stream.data;
+    size_t        len = corpus->stream.len;
+    size_t        offset = 0;
+    size_t        cut = 0;
+    size_t        piece;
+
+    while (offset < len) {
+        switch (writer->how) {
+        case REPLAY_PIPELINED:
+            piece = (len - offset < PIPELINED_WRITE) ? len - offset : PIPELINED_WRITE;
+            break;
+        case REPLAY_SPLIT:
+            piece = 1 + next_random() % corpus->split_max;
+            piece = (len - offset < piece) ? len - offset : piece;
+            break;
+        default:
+            while (cut < corpus->num_cuts && corpus->cuts[cut] <= offset) {
+                cut++;
+            }
+            piece = (cut < corpus->num_cuts ? corpus->cuts[cut] : len) - offset;
+            break;
+        }
+        if (write_piece(writer->fd, data + offset, piece, writer->how != REPLAY_PIPELINED) != 0) {
+            break;
+        }
+        offset += piece;
+    }
+    close(writer->fd);
+    return NULL;
+}
+
+
+// netconfd's read() and write() calls so far
+static void
+read_syscalls(pid_t pid, uint64_t* reads, uint64_t* writes) {
+    char               path[64];
+    char               line[128];
+    unsigned long long value;
+    FILE*              file;
+
+    *reads = 0;
+    *writes = 0;
+    snprintf(path, sizeof(path), "/proc/%d/io", (int)pid);
+    if ((file = fopen(path, "r")) == NULL) {
+        return;
+    }
+    while (fgets(line, sizeof(line), file) != NULL) {
+        if (sscanf(line, "syscr: %llu", &value) == 1) {
+            *reads = value;
+        } else if (sscanf(line, "syscw: %llu", &value) == 1) {
+            *writes = value;
+        }
+    }
+    fclose(file);
+}
+
+
+// netconfd's peak RSS so far, in KB.  Not getrusage()'s, which counts the
+// copy of this process it was forked from.
+static long
+read_peak_rss(pid_t pid) {
+    char  path[64];
+    char  line[128];
+    long  value = 0;
+    FILE* file;
+
+    snprintf(path, sizeof(path), "/proc/%d/status", (int)pid);
+    if ((file = fopen(path, "r")) == NULL) {
+        return 0;
+    }
+    while (fgets(line, sizeof(line), file) != NULL) {
+        if (sscanf(line, "VmHWM: %ld", &value) == 1) {
+            break;
+        }
+    }
+    fclose(file);
+    return value;
+}
+
+
+// replay `corpus` into a netconfd of its own, `how` says how, and print
+// what it did
+static int // 0=OK, 1=ERROR (a reply was wrong)
+replay_corpus(const char* netconfd, const char* dir, Corpus* corpus, uint8_t how,
+              uint64_t* hash, int last) {
+    static char    buf[1 << 20];
+    Replay         replay;
+    Writer         writer;
+    pthread_t      thread;
+    siginfo_t      info;
+    char           events[PATH_MAX];
+    int            in_fds[2];
+    int            out_fds[2];
+    int            status;
+    pid_t          pid;
+    ssize_t        len;
+    int64_t        started;
+    int64_t        elapsed_us;
+    int64_t        sampled_us = 0;
+    long           peak_rss = 0;
+    uint64_t       reads;
+    uint64_t       writes;
+
+    memset(&replay, 0, sizeof(replay));
+    replay.corpus = corpus;
+    replay.how = how;
+    replay.hash = 14695981039346656037ULL;
+    snprintf(events, sizeof(events), "%s/events", dir);
+    if (pipe(in_fds) != 0 || pipe(out_fds) != 0) {
+        printf("  {\"corpus\": \"%s\", \"error\": \"no pipes\"}%s\n", corpus->name, last ? "" : ",");
+        return 1;
+    }
+
+    started = bench_now_us();
+    pid = fork();
+    if (pid == 0) {
+        dup2(in_fds[0], 0);
+        dup2(out_fds[1], 1);
+        close(in_fds[0]);
+        close(in_fds[1]);
+        close(out_fds[0]);
+        close(out_fds[1]);
+        setenv("HOME", dir, 1);
+        execl(netconfd, netconfd, "-c", corpus->datastore, "-n", events, (char*)NULL);
+        _exit(127);
+    }
+    close(in_fds[0]);
+    close(out_fds[1]);
+    writer.corpus = corpus;
+    writer.how = how;
+    writer.fd = in_fds[1];
+    if (pid == -1 || pthread_create(&thread, NULL, write_corpus, &writer) != 0) {
+        printf("  {\"corpus\": \"%s\", \"error\": \"could not start netconfd\"}%s\n",
+               corpus->name, last ? "" : ",");
+        return 1;
+    }
+
+    while ((len = read(out_fds[0], buf, sizeof(buf))) != 0) {
+        if (len == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            break;
+        }
+        replay.bytes_out += (uint64_t)len;
+        // it only goes up, now and then is often enough
+        if (bench_now_us() - sampled_us >= 10000) {
+            long rss = read_peak_rss(pid);
+
+            peak_rss = (rss > peak_rss) ? rss : peak_rss;
+            sampled_us = bench_now_us();
+        }
+        if (replay.error[0] == '\0' && deframe(&replay, buf, (size_t)len) != 0) {
+            replay_failed(&replay, "out of memory");
+        }
+    }
+    elapsed_us = bench_now_us() - started;
+    close(out_fds[0]);
+    pthread_join(thread, NULL);
+
+    // its counts are still there until it's reaped
+    waitid(P_PID, (id_t)pid, &info, WEXITED | WNOWAIT);
+    read_syscalls(pid, &reads, &writes);
+    waitpid(pid, &status, 0);
+
+    if (!replay.seen_hello) {
+        replay_failed(&replay, "no <hello>");
+    } else if (replay.message.len > 0) {
+        replay_failed(&replay, "%zu bytes after the last reply", replay.message.len);
+    } else if (corpus->expected != NULL && replay.replies < corpus->num_expected) {
+        replay_failed(&replay, "%zu replies to %zu RPCs", replay.replies, corpus->num_expected);
+    } else if (how == REPLAY_PIPELINED) {
+        *hash = replay.hash;
+    } else if (replay.hash != *hash) {
+        replay_failed(&replay, "replies differ from the pipelined replay's");
+    }
+    if (elapsed_us <= 0) {
+        elapsed_us = 1;
+    }
+
+    printf("  {\"corpus\": \"%s\", \"replay\": \"%s\", \"messages\": %zu, "
+           "\"bytes_in\": %zu, \"bytes_out\": %llu,\n",
+           corpus->name, replay_names[how], replay.replies, corpus->stream.len,
+           (unsigned long long)replay.bytes_out);
+    if (how == REPLAY_PIPELINED) {
+        printf("   \"seconds\": %.3f, \"messages_per_sec\": %.0f, \"mb_per_sec\": %.1f,\n",
+               elapsed_us / 1e6, replay.replies * 1e6 / elapsed_us,
+               (double)(corpus->stream.len + replay.bytes_out) / elapsed_us);
+    }
+    printf("   \"reads\": %llu, \"writes\": %llu, \"syscalls_per_message\": %.2f, "
+           "\"peak_rss_kb\": %ld, \"ok\": %s",
+           (unsigned long long)reads, (unsigned long long)writes,
+           replay.replies ? (double)(reads + writes) / replay.replies : 0.0,
+           peak_rss, replay.error[0] ? "false" : "true");
+    if (replay.error[0] != '\0') {
+        printf(", \"error\": \"%s\"", replay.error);
+    }
+    printf("}%s\n", last ? "" : ",");
+    fflush(stdout);
+    free(replay.message.data);
+    return replay.error[0] ? 1 : 0;
+}
+
+
+/*****************************************************************************
+   MAIN
+ *****************************************************************************/
+
+int main(int argc, char* argv[]) {
+    static const struct {
+        const char* name;
+        uint8_t     framing;
+        uint8_t     huge;
+    } corpora[] = {
+        { "base-1.0",   FRAMING_EOM,        0 },
+        { "base-1.1",   FRAMING_CHUNKED,    0 },
+        { "eom-in-1.1", FRAMING_EOM_IN_1_1, 0 },
+        { "huge-1.0",   FRAMING_EOM,        1 },
+        { "huge-1.1",   FRAMING_CHUNKED,    1 },
+    };
+    size_t      num_corpora = sizeof(corpora) / sizeof(corpora[0]);
+    size_t      num_recordings = 0;
+    uint32_t    rpcs = DEFAULT_RPCS;
+    const char* netconfd = DEFAULT_NETCONFD;
+    char        dir[] = "/tmp/bench_netconfd.XXXXXX";
+    char        small_path[PATH_MAX];
+    char        huge_path[PATH_MAX];
+    char*       small_body;
+    char*       huge_body;
+    size_t      small_len;
+    size_t      huge_len;
+    size_t      idx;
+    uint8_t     how;
+    int         failed = 0;
+
+    if (argc > 1) {
+        rpcs = (uint32_t)atoi(argv[1]);
+    }
+    if (argc > 2) {
+        netconfd = argv[2];
+    }
+    if (argc > 3) {
+        num_recordings = (size_t)(argc - 3);
+    }
+    if (rpcs == 0 || access(netconfd, X_OK) != 0) {
+        printf("usage: %s [rpcs [path-to-netconfd [recording ...]]]\n", argv[0]);
+        return 1;
+    }
+    signal(SIGPIPE, SIG_IGN);
+
+    if (mkdtemp(dir) == NULL) {
+        printf("{\"benchmark\": \"netconfd\", \"error\": \"no scratch directory\"}\n");
+        return 1;
+    }
+    snprintf(small_path, sizeof(small_path), "%s/config.xml", dir);
+    snprintf(huge_path, sizeof(huge_path), "%s/huge.xml", dir);
+    if (bench_write_config(small_path, SMALL_APPS) != 0 || bench_write_config(huge_path, HUGE_APPS) != 0 ||
+        (small_body = read_body(small_path, &small_len)) == NULL ||
+        (huge_body = read_body(huge_path, &huge_len)) == NULL) {
+        printf("{\"benchmark\": \"netconfd\", \"error\": \"could not set up\"}\n");
+        return 1;
+    }
+
+    printf("{\"benchmark\": \"netconfd\", \"rpcs\": %u, \"results\": [\n", rpcs);
+    for (idx=0; idx<num_corpora + num_recordings; idx++) {
+        Corpus   corpus;
+        uint64_t hash = 0;
+        int      last = (idx == num_corpora + num_recordings - 1);
+
+        memset(&corpus, 0, sizeof(corpus));
+        corpus.datastore = small_path;
+        corpus.body = small_body;
+        corpus.body_len = small_len;
+        if (idx < num_corpora) {
+            corpus.name = corpora[idx].name;
+            if (corpora[idx].huge) {
+                corpus.datastore = huge_path;
+                corpus.body = huge_body;
+                corpus.body_len = huge_len;
+            }
+            // the huge replies are 12 MB each, a few make the point
+            if (make_corpus(&corpus, corpora[idx].framing,
+                            corpora[idx].huge ? (rpcs + 99) / 100 : rpcs,
+                            corpora[idx].huge) != 0) {
+                printf("  {\"corpus\": \"%s\", \"error\": \"out of memory\"}%s\n",
+                       corpus.name, last ? "" : ",");
+                failed = 1;
+                continue;
+            }
+        } else {
+            corpus.name = argv[3 + idx - num_corpora];
+            if (load_recording(&corpus, corpus.name) != 0) {
+                printf("  {\"corpus\": \"%s\", \"error\": \"could not read it\"}%s\n",
+                       corpus.name, last ? "" : ",");
+                failed = 1;
+                continue;
+            }
+        }
+        for (how=0; how<NUM_REPLAYS; how++) {
+            failed |= replay_corpus(netconfd, dir, &corpus, how, &hash,
+                                    last && how == NUM_REPLAYS - 1);
+        }
+        free(corpus.stream.data);
+        free(corpus.cuts);
+        free(corpus.expected);
+    }
+    printf("]}\n");
+
+    unlink(small_path);
+    unlink(huge_path);
+    snprintf(small_path, sizeof(small_path), "%s/events", dir);
+    unlink(small_path);
+    rmdir(dir);
+    free(small_body);
+    free(huge_body);
+    return failed;
+}
@@ -0,0 +1,444 @@
+/*****************************************************************************
+Copyright (c) 2014-2016, Juniper Networks, Inc.
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions
+are met:
+
+1. Redistributions of source code must retain the above copyright 
+   notice, this list of conditions and the following disclaimer.
+
+2. Redistributions in binary form must reproduce the above copyright
+   notice, this list of conditions and the following disclaimer in the
+   documentation and/or other materials provided with the distribution.
+
+3. Neither the name of the copyright holder nor the names of its 
+   contributors may be used to endorse or promote products derived 
+   from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS 
+"AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT 
+LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS 
+FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE 
+COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, 
+INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, 
+BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; 
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER 
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT 
+LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN 
+ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE 
+POSSIBILITY OF SUCH DAMAGE.
+ *****************************************************************************/
+
+
+
+/*****************************************************************************
+   OVERVIEW
+
+   This file is a load test of an NMS's accept side (SimpleNMS's admission
+   control, see management-server/DESIGN.txt): a simulator of a fleet of
+   devices all calling home at once, as after an NMS restart or a
+   network outage.
+
+   Each simulated device connects to the NMS on 127.0.0.1 from a source
+   address of its own in 127.1.0.0/16 (`sources` of them, shared round
+   robin), sends its SSH identification string, and waits for the NMS's.
+   Once that arrives the NMS has taken the device on: the device holds
+   the connection for `hold-msecs`, as long as its handshake and login
+   would take, then hangs up.  A connection the NMS closes or resets
+   before saying anything was shed; the device calls home again after
+   RETRY_MSECS (+/-25%), as ncchd would after interval-secs, until it's
+   been taken on or the test runs out of time.  No SSH key exchange is
+   done, so what's measured is the NMS's admission, not its crypto.
+
+   Results are printed as JSON: how long until every device had been
+   taken on, how many attempts that took and why the others failed, the
+   time from a connect to being taken on or shed (p50 and p99), and the
+   most devices the NMS had taken on at once.  Run it against a SimpleNMS
+   with and without admission control to compare.
+
+   `ports` may list several NMS instances ("7777,7778"), each device
+   calling home to one of them round robin; the report then has the
+   devices each took on, and the rate at which they took them on between
+   them (see management-server's `make bench_admission_scale`).  Usage:
+
+       bench_nms [devices [ports [sources [hold-msecs [seconds]]]]]
+ *****************************************************************************/
+
+
+/*****************************************************************************
+   INCLUDES AND EXTERNS
+ *****************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include "bench_util.h"
+
+
+/*****************************************************************************
+   MACROS
+ *****************************************************************************/
+
+#define DEFAULT_DEVICES      2000
+#define DEFAULT_PORT         7777    // SimpleNMS's config.prop
+#define DEFAULT_SOURCES      2000
+#define DEFAULT_HOLD_MSECS   200
+#define DEFAULT_SECONDS      120
+#define MAX_PORTS            64
+#define RETRY_MSECS          1000
+#define ATTEMPT_TIMEOUT_SECS 30      // as ncchd's CONNECT_TIMEOUT_SECS
+
+#define IDENT "SSH-2.0-bench_nms\r\n"
+
+
+/*****************************************************************************
+   LOCAL/STATIC DEFINITIONS
+ *****************************************************************************/
+
+enum DEVICE_STATE { DEVICE_WAITING, DEVICE_CONNECTING, DEVICE_CONNECTED,
+                    DEVICE_TAKEN_ON, DEVICE_DONE };
+
+typedef struct Device Device;
+struct Device {
+    uint8_t  state;          // enum DEVICE_STATE
+    uint32_t source;         // host part of its 127.1.0.0/16 address
+    uint32_t nms;            // which of the ports it calls home to
+    int64_t  next_ns;        // when to dial, hang up or give up
+    int64_t  dialed_ns;      // this attempt's connect
+};
+
+// what happened to the attempts, for the report
+typedef struct Results Results;
+struct Results {
+    uint32_t attempts;
+    uint32_t taken_on;
+    uint32_t shed;           // closed or reset before the NMS said anything
+    uint32_t refused;        // connect failed
+    uint32_t timed_out;      // nothing from the NMS in ATTEMPT_TIMEOUT_SECS
+    uint32_t handshaking;    // taken on and not yet hung up
+    uint32_t peak_handshaking;
+    int64_t  last_taken_on_ns;
+    uint32_t taken_on_by_nms[MAX_PORTS];
+    int64_t* taken_on_ns;    // connect to the NMS's identification, per device
+    int64_t* shed_ns;        // connect to being shed, per attempt (capped)
+    uint32_t num_shed_ns;
+    uint32_t shed_capacity;
+};
+
+static Device*        devices = NULL;
+static struct pollfd* fds = NULL;
+static Results        results;
+static uint16_t       ports[MAX_PORTS];
+static uint32_t       num_ports = 0;
+static unsigned int   seed = 1;
+
+
+// print "name": {"p50": ..., "p99": ...} in milliseconds, sorting `ns`
+static void
+print_percentiles(const char* name, int64_t* ns, uint32_t count) {
+    if (count == 0) {
+        printf("\"%s\": null", name);
+        return;
+    }
+    qsort(ns, count, sizeof(int64_t), bench_compare_ns);
+    printf("\"%s\": {\"p50\": %.1f, \"p99\": %.1f}", name,
+           ns[count / 2] / 1e6, ns[(uint64_t)count * 99 / 100] / 1e6);
+}
+
+
+// the device calls home again after RETRY_MSECS, +/-25%
+static void
+device_retry(uint32_t idx, int64_t now) {
+    int64_t retry_ns = (int64_t)RETRY_MSECS * 1000000;
+    int64_t jitter = retry_ns / 4;
+
+    if (fds[idx].fd != -1) {
+        close(fds[idx].fd);
+        fds[idx].fd = -1;
+    }
+    devices[idx].state = DEVICE_WAITING;
+    devices[idx].next_ns = now + retry_ns - jitter +
+                           (int64_t)(rand_r(&seed) % 1000) * (2 * jitter) / 1000;
+}
+
+
+static void
+device_dial(uint32_t idx, int64_t now) {
+    Device*            device = &devices[idx];
+    struct sockaddr_in addr;
+    int                fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+
+    results.attempts++;
+    device->dialed_ns = now;
+    if (fd == -1) {
+        results.refused++;
+        device_retry(idx, now);
+        return;
+    }
+    fds[idx].fd = fd;
+
+    // a source address of its own, as a device on the network would have
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(0x7f010000 + device->source);
+    if (bind(fd, (struct sockaddr*)&addr, sizeof(addr)) != 0) {
+        results.refused++;
+        device_retry(idx, now);
+        return;
+    }
+
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = htons(ports[device->nms]);
+    if (connect(fd, (struct sockaddr*)&addr, sizeof(addr)) != 0 && errno != EINPROGRESS) {
+        results.refused++;
+        device_retry(idx, now);
+        return;
+    }
+    device->state = DEVICE_CONNECTING;
+    device->next_ns = now + (int64_t)ATTEMPT_TIMEOUT_SECS * 1000000000;
+    fds[idx].events = POLLOUT;
+}
+
+
+// the NMS closed or reset the connection before saying anything
+static void
+device_shed(uint32_t idx, int64_t now) {
+    results.shed++;
+    if (results.num_shed_ns < results.shed_capacity) {
+        results.shed_ns[results.num_shed_ns++] = now - devices[idx].dialed_ns;
+    }
+    device_retry(idx, now);
+}
+
+
+static void
+device_event(uint32_t idx, int64_t now, int64_t hold_ns) {
+    Device*   device = &devices[idx];
+    char      buf[4096];
+    int       err = 0;
+    socklen_t len = sizeof(err);
+    ssize_t   n;
+
+    if (device->state == DEVICE_CONNECTING) {
+        if (getsockopt(fds[idx].fd, SOL_SOCKET, SO_ERROR, &err, &len) != 0 || err != 0) {
+            if (err == ECONNRESET) {
+                device_shed(idx, now);
+            } else {
+                results.refused++;
+                device_retry(idx, now);
+            }
+            return;
+        }
+        // an SSH server sends its identification right away
+        if (write(fds[idx].fd, IDENT, sizeof(IDENT) - 1) != sizeof(IDENT) - 1) {
+            device_shed(idx, now);
+            return;
+        }
+        device->state = DEVICE_CONNECTED;
+        fds[idx].events = POLLIN;
+        return;
+    }
+
+    n = read(fds[idx].fd, buf, sizeof(buf));
+    if (n < 0 && (errno == EAGAIN || errno == EINTR)) {
+        return;
+    }
+    if (device->state == DEVICE_CONNECTED) {
+        if (n <= 0) {
+            device_shed(idx, now);
+            return;
+        }
+        // taken on: hold the connection as a handshake would
+        device->state = DEVICE_TAKEN_ON;
+        device->next_ns = now + hold_ns;
+        results.taken_on_ns[results.taken_on++] = now - device->dialed_ns;
+        results.last_taken_on_ns = now;
+        results.taken_on_by_nms[device->nms]++;
+        if (++results.handshaking > results.peak_handshaking) {
+            results.peak_handshaking = results.handshaking;
+        }
+        return;
+    }
+    if (n <= 0) {
+        // the NMS gave up on the handshake first, which is as good
+        results.handshaking--;
+        close(fds[idx].fd);
+        fds[idx].fd = -1;
+        device->state = DEVICE_DONE;
+    }
+}
+
+
+static void
+device_timer(uint32_t idx, int64_t now) {
+    Device* device = &devices[idx];
+
+    switch (device->state) {
+        case DEVICE_WAITING:
+            device_dial(idx, now);
+            break;
+        case DEVICE_CONNECTING:
+        case DEVICE_CONNECTED:
+            results.timed_out++;
+            device_retry(idx, now);
+            break;
+        case DEVICE_TAKEN_ON:
+            results.handshaking--;
+            close(fds[idx].fd);
+            fds[idx].fd = -1;
+            device->state = DEVICE_DONE;
+            break;
+        default:
+            break;
+    }
+}
+
+
+/*****************************************************************************
+   MAIN
+ *****************************************************************************/
+
+int main(int argc, char* argv[]) {
+    uint32_t      num_devices = DEFAULT_DEVICES;
+    const char*   port_list = NULL;
+    char*         end_ptr;
+    uint32_t      sources = DEFAULT_SOURCES;
+    uint32_t      hold_msecs = DEFAULT_HOLD_MSECS;
+    uint32_t      seconds = DEFAULT_SECONDS;
+    struct rlimit limit;
+    int64_t       start, end, now;
+    uint32_t      idx, done;
+
+    if (argc > 1) {
+        num_devices = strtoul(argv[1], NULL, 10);
+    }
+    if (argc > 2) {
+        port_list = argv[2];
+    }
+    if (argc > 3) {
+        sources = strtoul(argv[3], NULL, 10);
+    }
+    if (argc > 4) {
+        hold_msecs = strtoul(argv[4], NULL, 10);
+    }
+    if (argc > 5) {
+        seconds = strtoul(argv[5], NULL, 10);
+    }
+    if (port_list == NULL) {
+        ports[num_ports++] = DEFAULT_PORT;
+    }
+    while (port_list != NULL && num_ports < MAX_PORTS) {
+        unsigned long port = strtoul(port_list, &end_ptr, 10);
+        if (port == 0 || port > 65535 || (*end_ptr != ',' && *end_ptr != '\0')) {
+            num_ports = 0;
+            break;
+        }
+        ports[num_ports++] = (uint16_t)port;
+        port_list = (*end_ptr == ',') ? end_ptr + 1 : NULL;
+    }
+    if (num_devices == 0 || num_ports == 0 || port_list != NULL || sources == 0 ||
+        sources > 65534 || seconds == 0) {
+        printf("usage: %s [devices [ports [sources [hold-msecs [seconds]]]]]\n", argv[0]);
+        return 1;
+    }
+
+    // a socket per device
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < num_devices + 64) {
+        limit.rlim_cur = (limit.rlim_max < num_devices + 64) ? limit.rlim_max
+                                                             : num_devices + 64;
+        setrlimit(RLIMIT_NOFILE, &limit);
+    }
+
+    devices = (Device*)calloc(num_devices, sizeof(Device));
+    fds = (struct pollfd*)calloc(num_devices, sizeof(struct pollfd));
+    results.taken_on_ns = (int64_t*)calloc(num_devices, sizeof(int64_t));
+    results.shed_capacity = num_devices * 16;
+    results.shed_ns = (int64_t*)calloc(results.shed_capacity, sizeof(int64_t));
+    if (devices == NULL || fds == NULL || results.taken_on_ns == NULL ||
+        results.shed_ns == NULL) {
+        printf("{\"benchmark\": \"nms\", \"error\": \"out of memory\"}\n");
+        return 1;
+    }
+
+    // the whole fleet calls home at once
+    start = bench_now_ns();
+    end = start + (int64_t)seconds * 1000000000;
+    for (idx=0; idx<num_devices; idx++) {
+        devices[idx].state = DEVICE_WAITING;
+        devices[idx].source = 1 + idx % sources;
+        devices[idx].nms = idx % num_ports;
+        devices[idx].next_ns = start;
+        fds[idx].fd = -1;
+    }
+
+    done = 0;
+    while (done < num_devices && (now = bench_now_ns()) < end) {
+        int64_t next = end;
+
+        done = 0;
+        for (idx=0; idx<num_devices; idx++) {
+            if (devices[idx].state != DEVICE_DONE && now >= devices[idx].next_ns) {
+                device_timer(idx, now);
+            }
+            if (devices[idx].state == DEVICE_DONE) {
+                done++;
+            } else if (devices[idx].next_ns < next) {
+                next = devices[idx].next_ns;
+            }
+            fds[idx].revents = 0;
+        }
+        if (done == num_devices) {
+            break;
+        }
+        if (poll(fds, num_devices, (int)((next - now + 999999) / 1000000)) <= 0) {
+            continue;
+        }
+        now = bench_now_ns();
+        for (idx=0; idx<num_devices; idx++) {
+            if (fds[idx].fd != -1 && fds[idx].revents != 0) {
+                device_event(idx, now, (int64_t)hold_msecs * 1000000);
+            }
+        }
+    }
+
+    printf("{\"benchmark\": \"nms\", \"devices\": %u, \"instances\": %u, \"sources\": %u, "
+           "\"hold_ms\": %u, \"taken_on\": %u, \"taken_on_by_instance\": [", num_devices,
+           num_ports, sources < num_devices ? sources : num_devices, hold_msecs,
+           results.taken_on);
+    for (idx=0; idx<num_ports; idx++) {
+        printf("%s%u", idx ? ", " : "", results.taken_on_by_nms[idx]);
+    }
+    printf("], ");
+    if (results.taken_on == num_devices) {
+        printf("\"all_taken_on_ms\": %.1f, ", (results.last_taken_on_ns - start) / 1e6);
+    } else {
+        printf("\"all_taken_on_ms\": null, ");
+    }
+    if (results.taken_on > 0 && results.last_taken_on_ns > start) {
+        printf("\"taken_on_per_sec\": %.1f, ",
+               results.taken_on * 1e9 / (results.last_taken_on_ns - start));
+    } else {
+        printf("\"taken_on_per_sec\": null, ");
+    }
+    printf("\"attempts\": %u, \"shed\": %u, \"refused\": %u, \"timed_out\": %u, "
+           "\"peak_handshaking\": %u, ", results.attempts, results.shed,
+           results.refused, results.timed_out, results.peak_handshaking);
+    print_percentiles("taken_on_ms", results.taken_on_ns, results.taken_on);
+    printf(", ");
+    print_percentiles("shed_ms", results.shed_ns, results.num_shed_ns);
+    printf("}\n");
+    return 0;
+}
@@ -0,0 +1,434 @@
+/*****************************************************************************
+Copyright (c) 2014-2016, Juniper Networks, Inc.
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions
+are met:
+
+1. Redistributions of source code must retain the above copyright 
+   notice, this list of conditions and the following disclaimer.
+
+2. Redistributions in binary form must reproduce the above copyright
+   notice, this list of conditions and the following disclaimer in the
+   documentation and/or other materials provided with the distribution.
+
+3. Neither the name of the copyright holder nor the names of its 
+   contributors may be used to endorse or promote products derived 
+   from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS 
+"AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT 
+LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS 
+FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE 
+COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, 
+INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, 
+BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; 
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER 
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT 
+LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN 
+ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE 
+POSSIBILITY OF SUCH DAMAGE.
+ *****************************************************************************/
+
+
+
+
+/*****************************************************************************
+   OVERVIEW
+
+   This file benchmarks event notifications (notify.c, and netconf.c's
+   subscriptions): a producer thread publishes events into a scratch
+   ring at a given rate (0 = as fast as it can), while the main thread
+   serves a number of subscribed sessions from one poll loop, as the
+   netconfd daemon does, each writing to a loopback TCP connection read
+   by a thread that counts the notifications it gets.  It runs twice:
+
+     - "batched": netconf_notify(), which sends everything published
+       since the last call in one write
+     - "one-per-write": each notification written on its own, which is
+       what a session without batching would do
+
+   For each it reports events published and notifications delivered per
+   second, notifications lost (overwritten before a session got to them)
+   and the average number of notifications per write.  Results are
+   printed as JSON.  Usage:
+
+       bench_notify [sessions [seconds [events-per-sec]]]
+ *****************************************************************************/
+
+
+/*****************************************************************************
+   INCLUDES AND EXTERNS
+ *****************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include "netconf.h"
+#include "notify.h"
+#include "bench_util.h"
+
+
+/*****************************************************************************
+   MACROS
+ *****************************************************************************/
+
+#define DEFAULT_SESSIONS  4
+#define DEFAULT_SECONDS   3
+#define DEFAULT_RATE      0        // as fast as it can
+#define MAX_SESSIONS      256
+#define ONE_PER_WRITE_MAX 128      // about what fits in a batch
+
+
+/*****************************************************************************
+   STRUCTS
+ *****************************************************************************/
+
+typedef struct Client Client;
+struct Client {
+  int             fd;              // the session's end
+  int             peer_fd;         // the NMS's end
+  uint64_t        writes;
+  uint64_t        received;        // counted by the client thread
+  pthread_t       thread;
+  NetconfSession  netconf;
+};
+
+
+/*****************************************************************************
+   LOCAL/STATIC DEFINITIONS
+ *****************************************************************************/
+
+static const char hello_1_0[] =
+    "<hello xmlns=\"urn:ietf:params:xml:ns:netconf:base:1.0\">\n"
+    "<capabilities><capability>urn:ietf:params:netconf:base:1.0</capability></capabilities>\n"
+    "</hello>\n"
+    "]]>]]>\n";
+
+static const char subscribe[] =
+    "<rpc message-id=\"1\" xmlns=\"urn:ietf:params:xml:ns:netconf:base:1.0\">\n"
+    "<create-subscription xmlns=\"urn:ietf:params:xml:ns:netconf:notification:1.0\"/>\n"
+    "</rpc>\n"
+    "]]>]]>\n";
+
+static const char event[] =
+    "<netconf-config-change xmlns=\"urn:ietf:params:xml:ns:yang:ietf-netconf-notifications\">"
+    "<changed-by><username>admin</username><session-id>1</session-id></changed-by>"
+    "<datastore>running</datastore>"
+    "<edit><target>/call-home/applications/application[name='app-1']</target>"
+    "<operation>replace</operation></edit>"
+    "</netconf-config-change>";
+
+static NotifyRing*  ring;
+static Client       clients[MAX_SESSIONS];
+static volatile int producing;
+static int          rate;
+static uint64_t     published;
+
+
+// publish events, paced to `rate` a second if it's set
+static void*
+produce(void* arg) {
+    int64_t started = bench_now_us();
+
+    (void)arg;
+    published = 0;
+    while (producing) {
+        if (rate > 0 && (int64_t)published * 1000000 / rate > bench_now_us() - started) {
+            usleep(100);
+            continue;
+        }
+        notify_publish(ring, event, sizeof(event) - 1);
+        published++;
+    }
+    return NULL;
+}
+
+
+// the NMS: count the messages that come, i.e. their ]]>]]>s
+static void*
+receive(void* arg) {
+    static const char eom[] = "]]>]]>";
+    Client*           client = (Client*)arg;
+    char              buf[1 << 16];
+    size_t            matched = 0;
+    ssize_t           len;
+    ssize_t           idx;
+
+    while ((len = read(client->peer_fd, buf, sizeof(buf))) > 0) {
+        for (idx=0; idx<len; idx++) {
+            if (buf[idx] == eom[matched]) {
+                if (++matched == sizeof(eom) - 1) {
+                    __atomic_add_fetch(&client->received, 1, __ATOMIC_RELAXED);
+                    matched = 0;
+                }
+            } else {
+                matched = (buf[idx] == eom[0]) ? 1 : 0;
+            }
+        }
+    }
+    return NULL;
+}
+
+
+// NetconfWrite to the session's socket, which doesn't block
+static ssize_t // -1 on error, 0 if it would block
+write_client(void* ctx, const struct iovec* iov, int iovcnt) {
+    Client* client = (Client*)ctx;
+    ssize_t written = writev(client->fd, iov, iovcnt);
+
+    if (written == -1) {
+        return (errno == EAGAIN || errno == EINTR) ? 0 : -1;
+    }
+    client->writes++;
+    return written;
+}
+
+
+// a loopback TCP connection for the client, and a subscribed session on it
+static int // 0=OK, 1=ERROR
+open_client(Client* client, int listen_fd, const struct sockaddr_in* addr) {
+    size_t used;
+    int    one = 1;
+
+    memset(client, 0, sizeof(Client));
+    client->peer_fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (client->peer_fd == -1 ||
+        connect(client->peer_fd, (const struct sockaddr*)addr, sizeof(*addr)) != 0 ||
+        (client->fd = accept(listen_fd, NULL, NULL)) == -1) {
+        return 1;
+    }
+    setsockopt(client->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    if (pthread_create(&client->thread, NULL, receive, client) != 0) {
+        return 1;
+    }
+    netconf_init(&client->netconf, 1, write_client, client);
+    client->netconf.events = ring;
+    if (netconf_start(&client->netconf) != 0 ||
+        netconf_input(&client->netconf, hello_1_0, strlen(hello_1_0), &used) != 0 ||
+        netconf_input(&client->netconf, subscribe, strlen(subscribe), &used) != 0) {
+        return 1;
+    }
+    while (netconf_pending(&client->netconf)) {
+        netconf_output(&client->netconf);
+    }
+    fcntl(client->fd, F_SETFL, fcntl(client->fd, F_GETFL) | O_NONBLOCK);
+    client->writes = 0;
+    return 0;
+}
+
+
+// Send one client what's new the way a session without batching would:
+// a write per notification, waiting for the socket when it's full, and
+// no more than a batch's worth per call.
+static int // 0=OK, 1=ERROR
+send_one_per_write(Client* client) {
+    NetconfSession* session = &client->netconf;
+    NotifyEvent     copy;
+    char            text[NOTIFY_EVENT_MAX + 256];
+    int             len;
+    int             result;
+    int             count = 0;
+
+    while (count < ONE_PER_WRITE_MAX &&
+           (result = notify_read(ring, session->notify_next, &copy)) != 1) {
+        if (result == 2) {
+            uint64_t oldest = notify_oldest(ring);
+            session->notify_lost += oldest - session->notify_next;
+            session->notify_next = oldest;
+            continue;
+        }
+        len = snprintf(text, sizeof(text),
+                       "<notification xmlns=\"urn:ietf:params:xml:ns:netconf:notification:1.0\">\n"
+                       "<eventTime>%lld.%09d</eventTime>\n%.*s\n</notification>\n]]>]]>\n",
+                       (long long)copy.time_sec, copy.time_nsec, (int)copy.len, copy.text);
+        session->notify_next++;
+        session->notify_sent++;
+        if (write(client->fd, text, (size_t)len) != len) {
+            struct pollfd fds;
+
+            if (errno != EAGAIN) {
+                return 1;
+            }
+            fds.fd = client->fd;
+            fds.events = POLLOUT;
+            poll(&fds, 1, -1);
+            session->notify_next--;   // again, once there's room
+            session->notify_sent--;
+            continue;
+        }
+        client->writes++;
+        count++;
+    }
+    return 0;
+}
+
+
+/*****************************************************************************
+   BENCHMARK
+ *****************************************************************************/
+
+static void
+bench_mode(int num_sessions, int seconds, int batched, int last) {
+    struct sockaddr_in addr;
+    socklen_t          addr_len = sizeof(addr);
+    struct pollfd      fds[MAX_SESSIONS];
+    pthread_t          producer;
+    uint64_t           delivered = 0;
+    uint64_t           lost = 0;
+    uint64_t           writes = 0;
+    int64_t            started;
+    int64_t            elapsed;
+    int                listen_fd;
+    int                idx;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (listen_fd == -1 || bind(listen_fd, (struct sockaddr*)&addr, sizeof(addr)) != 0 ||
+        listen(listen_fd, MAX_SESSIONS) != 0 ||
+        getsockname(listen_fd, (struct sockaddr*)&addr, &addr_len) != 0) {
+        printf("  {\"mode\": \"%s\", \"error\": \"no loopback socket\"}%s\n",
+               batched ? "batched" : "one-per-write", last ? "" : ",");
+        return;
+    }
+    for (idx=0; idx<num_sessions; idx++) {
+        if (open_client(&clients[idx], listen_fd, &addr) != 0) {
+            printf("  {\"mode\": \"%s\", \"error\": \"could not start a session\"}%s\n",
+                   batched ? "batched" : "one-per-write", last ? "" : ",");
+            exit(1);
+        }
+        // the <hello> and <ok/> aren't notifications
+        while (__atomic_load_n(&clients[idx].received, __ATOMIC_RELAXED) < 2) {
+            usleep(100);
+        }
+        __atomic_store_n(&clients[idx].received, 0, __ATOMIC_RELAXED);
+    }
+    close(listen_fd);
+
+    producing = 1;
+    started = bench_now_us();
+    pthread_create(&producer, NULL, produce, NULL);
+    while (bench_now_us() - started < (int64_t)seconds * 1000000) {
+        int num_fds = 0;
+
+        for (idx=0; idx<num_sessions; idx++) {
+            Client* client = &clients[idx];
+
+            if (!batched) {
+                send_one_per_write(client);
+            } else if (netconf_pending(&client->netconf)) {
+                fds[num_fds].fd = client->fd;
+                fds[num_fds++].events = POLLOUT;
+            } else {
+                netconf_notify(&client->netconf);
+            }
+        }
+        poll(fds, num_fds, batched ? NETCONF_NOTIFY_TICK_MSECS : 0);
+        for (idx=0; idx<num_fds; idx++) {
+            if (fds[idx].revents != 0) {
+                int client_idx;
+
+                for (client_idx=0; clients[client_idx].fd != fds[idx].fd; client_idx++) {
+                    ;
+                }
+                netconf_output(&clients[client_idx].netconf);
+            }
+        }
+    }
+    producing = 0;
+    pthread_join(producer, NULL);
+    elapsed = bench_now_us() - started;
+
+    for (idx=0; idx<num_sessions; idx++) {
+        Client* client = &clients[idx];
+
+        // what's been written by now still counts
+        while (netconf_pending(&client->netconf) && netconf_output(&client->netconf) == 0) {
+            ;
+        }
+        shutdown(client->fd, SHUT_WR);
+        pthread_join(client->thread, NULL);
+        delivered += client->received;
+        lost += client->netconf.notify_lost;
+        writes += client->writes;
+        netconf_end(&client->netconf);
+        close(client->fd);
+        close(client->peer_fd);
+    }
+
+    printf("  {\"mode\": \"%s\", \"sessions\": %d, \"seconds\": %.2f,\n"
+           "   \"published_per_sec\": %.0f, \"delivered_per_sec\": %.0f,\n"
+           "   \"lost\": %llu, \"notifications_per_write\": %.1f}%s\n",
+           batched ? "batched" : "one-per-write", num_sessions, elapsed / 1e6,
+           published * 1e6 / elapsed, delivered * 1e6 / elapsed,
+           (unsigned long long)lost, writes > 0 ? (double)delivered / writes : 0.0,
+           last ? "" : ",");
+}
+
+
+/*****************************************************************************
+   MAIN
+ *****************************************************************************/
+
+int main(int argc, char* argv[]) {
+    int  num_sessions = DEFAULT_SESSIONS;
+    int  seconds = DEFAULT_SECONDS;
+    char path[] = "/tmp/bench_notify.XXXXXX";
+    int  fd;
+
+    rate = DEFAULT_RATE;
+    if (argc > 1) {
+        num_sessions = atoi(argv[1]);
+    }
+    if (argc > 2) {
+        seconds = atoi(argv[2]);
+    }
+    if (argc > 3) {
+        rate = atoi(argv[3]);
+    }
+    if (num_sessions <= 0 || num_sessions > MAX_SESSIONS || seconds <= 0 || rate < 0) {
+        printf("usage: %s [sessions (1-%d) [seconds [events-per-sec]]]\n", argv[0],
+               MAX_SESSIONS);
+        return 1;
+    }
+    signal(SIGPIPE, SIG_IGN);
+
+    // a fresh ring: notify_ring_open() creates it where there's none
+    if ((fd = mkstemp(path)) == -1) {
+        printf("{\"benchmark\": \"notify\", \"error\": \"no scratch file\"}\n");
+        return 1;
+    }
+    close(fd);
+    unlink(path);
+    if ((ring = notify_ring_open(path, 1)) == NULL) {
+        printf("{\"benchmark\": \"notify\", \"error\": \"could not open the ring\"}\n");
+        return 1;
+    }
+
+    printf("{\"benchmark\": \"notify\", \"event_bytes\": %zu, \"rate\": %d, \"results\": [\n",
+           sizeof(event) - 1, rate);
+    bench_mode(num_sessions, seconds, 1, 0);
+    bench_mode(num_sessions, seconds, 0, 1);
+    printf("]}\n");
+
+    notify_ring_close(ring);
+    unlink(path);
+    return 0;
+}
@@ -0,0 +1,430 @@
+/*****************************************************************************
+Copyright (c) 2014-2016, Juniper Networks, Inc.
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions
+are met:
+
+1. Redistributions of source code must retain the above copyright 
+   notice, this list of conditions and the following disclaimer.
+
+2. Redistributions in binary form must reproduce the above copyright
+   notice, this list of conditions and the following disclaimer in the
+   documentation and/or other materials provided with the distribution.
+
+3. Neither the name of the copyright holder nor the names of its 
+   contributors may be used to endorse or promote products derived 
+   from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS 
+"AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT 
+LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS 
+FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE 
+COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, 
+INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, 
+BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; 
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER 
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT 
+LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN 
+ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE 
+POSSIBILITY OF SUCH DAMAGE.
+ *****************************************************************************/
+
+
+
+/*****************************************************************************
+   OVERVIEW
+
+   This file benchmarks the two ways ncchd can serve a call-home session,
+   on loopback:
+
+     - "relay": relay the NMS connection to a NETCONF server already
+       running on the box (here an echo server), see relay.c
+     - "exec": fork/exec a process per session on the NMS connection,
+       as ncchd does with `sshd -i`
+
+   The exec'd command defaults to /bin/cat, which echoes like the relay's
+   local server does.  A real sshd can't be driven without an SSH client,
+   and would add its handshake and crypto on top, so these numbers bound
+   the exec path's cost from below.
+
+   For each path it reports the average time to set a session up (until
+   the first byte echoes back), the average round-trip time of a 1-byte
+   message, and bulk throughput.  Results are printed as JSON.  Usage:
+
+       bench_relay [sessions [megabytes [exec-command]]]
+ *****************************************************************************/
+
+
+/*****************************************************************************
+   INCLUDES AND EXTERNS
+ *****************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include "relay.h"
+#include "bench_util.h"
+
+
+/*****************************************************************************
+   MACROS
+ *****************************************************************************/
+
+#define DEFAULT_SESSIONS  200
+#define DEFAULT_MEGABYTES 256
+#define DEFAULT_COMMAND   "/bin/cat"
+#define PING_COUNT        2000
+
+
+/*****************************************************************************
+   LOCAL/STATIC DEFINITIONS
+ *****************************************************************************/
+
+static int      local_listen_fd = -1;
+static uint16_t local_port = 0;
+
+
+static int // -1 on error, listening socket otherwise
+listen_loopback(uint16_t* port) {
+    struct sockaddr_in addr;
+    socklen_t          len = sizeof(addr);
+    int                fd = socket(AF_INET, SOCK_STREAM, 0);
+
+    if (fd == -1) {
+        return -1;
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (bind(fd, (struct sockaddr*)&addr, sizeof(addr)) != 0 ||
+        listen(fd, 128) != 0 ||
+        getsockname(fd, (struct sockaddr*)&addr, &len) != 0) {
+        close(fd);
+        return -1;
+    }
+    *port = ntohs(addr.sin_port);
+    return fd;
+}
+
+
+// a connected loopback pair: `nms` plays the NMS, `device` is the socket
+// ncchd's connect would have produced
+static int // 0=OK, 1=ERROR
+connected_pair(int* nms, int* device) {
+    struct sockaddr_in addr;
+    uint16_t           port;
+    int                listen_fd = listen_loopback(&port);
+    int                one = 1;
+
+    if (listen_fd == -1) {
+        return 1;
+    }
+    *device = socket(AF_INET, SOCK_STREAM, 0);
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = htons(port);
+    if (connect(*device, (struct sockaddr*)&addr, sizeof(addr)) != 0) {
+        close(listen_fd);
+        return 1;
+    }
+    *nms = accept(listen_fd, NULL, NULL);
+    close(listen_fd);
+    setsockopt(*nms, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    setsockopt(*device, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    return *nms == -1 ? 1 : 0;
+}
+
+
+static void*
+echo_connection(void* arg) {
+    int     fd = (int)(intptr_t)arg;
+    char    buf[65536];
+    ssize_t n;
+    int     one = 1;
+
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    while ((n = read(fd, buf, sizeof(buf))) > 0) {
+        ssize_t off = 0;
+        while (off < n) {
+            ssize_t w = write(fd, buf + off, n - off);
+            if (w <= 0) {
+                close(fd);
+                return NULL;
+            }
+            off += w;
+        }
+    }
+    close(fd);
+    return NULL;
+}
+
+
+// the NETCONF server already running on the box, here an echo server
+static void*
+local_server(void* arg) {
+    for (;;) {
+        pthread_t thread;
+        int       fd = accept(local_listen_fd, NULL, NULL);
+
+        if (fd == -1) {
+            continue;
+        }
+        if (pthread_create(&thread, NULL, echo_connection, (void*)(intptr_t)fd) == 0) {
+            pthread_detach(thread);
+        } else {
+            close(fd);
+        }
+    }
+    return NULL;
+}
+
+
+// what ncchd's event loop does for a relay, for a single relay
+static void*
+relay_loop(void* arg) {
+    Relay* relay = (Relay*)arg;
+
+    for (;;) {
+        struct pollfd fds[2];
+        int           side;
+
+        for (side=0; side<2; side++) {
+            fds[side].fd = relay->fd[side];
+            fds[side].events = relay_events(relay, side);
+            fds[side].revents = 0;
+            if (fds[side].events == 0) {
+                fds[side].fd = -1;
+            }
+        }
+        poll(fds, 2, 1000);
+        if (relay_pump(relay) != 0) {
+            break;
+        }
+    }
+    relay_close(relay);
+    return NULL;
+}
+
+
+// per-path session handle
+typedef struct Session Session;
+struct Session {
+    int       nms;       // the NMS's end
+    pthread_t relay_thread;
+    pid_t     pid;       // exec path's child
+    size_t    bulk;      // bytes for bulk_sender() to send
+};
+
+
+static int // 0=OK, 1=ERROR
+session_open(Session* session, const char* command) {
+    int device;
+    int one = 1;
+
+    session->pid = -1;
+    if (connected_pair(&session->nms, &device) != 0) {
+        return 1;
+    }
+
+    if (command == NULL) {
+        Relay* relay;
+        char   error[128];
+
+        if (relay_open(&relay, device, "127.0.0.1", local_port, error, sizeof(error)) != 0) {
+            close(device);
+            close(session->nms);
+            return 1;
+        }
+        setsockopt(relay->fd[RELAY_LOCAL], IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        return pthread_create(&session->relay_thread, NULL, relay_loop, relay) == 0 ? 0 : 1;
+    }
+
+    session->pid = fork();
+    if (session->pid == 0) {
+        dup2(device, 0);
+        dup2(device, 1);
+        execl(command, command, (char*)NULL);
+        _exit(1);
+    }
+    close(device);
+    return session->pid == -1 ? 1 : 0;
+}
+
+
+static void
+session_close(Session* session) {
+    int status;
+
+    shutdown(session->nms, SHUT_WR);
+    while (read(session->nms, &status, sizeof(status)) > 0) {
+        // drain until the far end closes too
+    }
+    close(session->nms);
+    if (session->pid == -1) {
+        pthread_join(session->relay_thread, NULL);
+    } else {
+        waitpid(session->pid, &status, 0);
+    }
+}
+
+
+static int // 0=OK, 1=ERROR
+ping(int fd) {
+    char byte = 'p';
+
+    if (write(fd, &byte, 1) != 1 || read(fd, &byte, 1) != 1) {
+        return 1;
+    }
+    return 0;
+}
+
+
+static void*
+bulk_sender(void* arg) {
+    Session* session = (Session*)arg;
+    size_t   remaining = session->bulk;
+    char     buf[65536];
+
+    memset(buf, 'x', sizeof(buf));
+    while (remaining > 0) {
+        ssize_t n = write(session->nms, buf, remaining < sizeof(buf) ? remaining : sizeof(buf));
+        if (n <= 0) {
+            break;
+        }
+        remaining -= n;
+    }
+    return NULL;
+}
+
+
+/*****************************************************************************
+   BENCHMARK
+ *****************************************************************************/
+
+static void
+bench_path(const char* name, const char* command, int sessions, int megabytes) {
+    Session   session;
+    Session   sender;
+    pthread_t thread;
+    int64_t   setup_ns = 0;
+    int64_t   start;
+    int64_t   rtt_ns;
+    int64_t   bulk_ns;
+    size_t    total = (size_t)megabytes << 20;
+    size_t    received = 0;
+    char      buf[65536];
+    int       idx;
+
+    // session setup, until the first byte has made it there and back
+    for (idx=0; idx<sessions; idx++) {
+        start = bench_now_ns();
+        if (session_open(&session, command) != 0 || ping(session.nms) != 0) {
+            printf("{\"path\": \"%s\", \"error\": \"session setup failed\"}", name);
+            return;
+        }
+        setup_ns += bench_now_ns() - start;
+        session_close(&session);
+    }
+
+    // latency and throughput, on one session
+    if (session_open(&session, command) != 0) {
+        printf("{\"path\": \"%s\", \"error\": \"session setup failed\"}", name);
+        return;
+    }
+    start = bench_now_ns();
+    for (idx=0; idx<PING_COUNT; idx++) {
+        if (ping(session.nms) != 0) {
+            printf("{\"path\": \"%s\", \"error\": \"ping failed\"}", name);
+            return;
+        }
+    }
+    rtt_ns = (bench_now_ns() - start) / PING_COUNT;
+
+    sender = session;
+    sender.bulk = total;
+    start = bench_now_ns();
+    pthread_create(&thread, NULL, bulk_sender, &sender);
+    while (received < total) {
+        ssize_t n = read(session.nms, buf, sizeof(buf));
+        if (n <= 0) {
+            break;
+        }
+        received += n;
+    }
+    bulk_ns = bench_now_ns() - start;
+    pthread_join(thread, NULL);
+    session_close(&session);
+
+    printf("{\"path\": \"%s\"", name);
+    if (command != NULL) {
+        printf(", \"command\": \"%s\"", command);
+    }
+    printf(", \"setup_us_avg\": %.1f, \"rtt_us_avg\": %.1f, \"megabytes\": %d, "
+           "\"throughput_mb_per_s\": %.1f}",
+           setup_ns / 1000.0 / sessions, rtt_ns / 1000.0, megabytes,
+           (received / 1048576.0) / (bulk_ns / 1e9));
+}
+
+
+/*****************************************************************************
+   MAIN
+ *****************************************************************************/
+
+int main(int argc, char* argv[]) {
+    int         sessions = DEFAULT_SESSIONS;
+    int         megabytes = DEFAULT_MEGABYTES;
+    const char* command = DEFAULT_COMMAND;
+    pthread_t   thread;
+
+    if (argc > 1) {
+        sessions = atoi(argv[1]);
+    }
+    if (argc > 2) {
+        megabytes = atoi(argv[2]);
+    }
+    if (argc > 3) {
+        command = argv[3];
+    }
+    if (sessions <= 0 || megabytes <= 0) {
+        printf("usage: %s [sessions [megabytes [exec-command]]]\n", argv[0]);
+        return 1;
+    }
+    if (!relay_supported()) {
+        printf("{\"benchmark\": \"relay\", \"error\": \"splice() not supported\"}\n");
+        return 1;
+    }
+    signal(SIGPIPE, SIG_IGN);
+
+    local_listen_fd = listen_loopback(&local_port);
+    if (local_listen_fd == -1 ||
+        pthread_create(&thread, NULL, local_server, NULL) != 0) {
+        printf("{\"benchmark\": \"relay\", \"error\": \"no local server\"}\n");
+        return 1;
+    }
+
+    printf("{\"benchmark\": \"relay\", \"sessions\": %d, \"results\": [", sessions);
+    fflush(stdout);
+    bench_path("relay", NULL, sessions, megabytes);
+    printf(", ");
+    fflush(stdout);
+    bench_path("exec", command, sessions, megabytes);
+    printf("]}\n");
+    return 0;
+}
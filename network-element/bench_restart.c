@@ -0,0 +1,340 @@
+/*****************************************************************************
+Copyright (c) 2014-2016, Juniper Networks, Inc.
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions
+are met:
+
+1. Redistributions of source code must retain the above copyright 
+   notice, this list of conditions and the following disclaimer.
+
+2. Redistributions in binary form must reproduce the above copyright
+   notice, this list of conditions and the following disclaimer in the
+   documentation and/or other materials provided with the distribution.
+
+3. Neither the name of the copyright holder nor the names of its 
+   contributors may be used to endorse or promote products derived 
+   from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS 
+"AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT 
+LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS 
+FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE 
+COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, 
+INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, 
+BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; 
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER 
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT 
+LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN 
+ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE 
+POSSIBILITY OF SUCH DAMAGE.
+ *****************************************************************************/
+
+
+
+
+
+/*****************************************************************************
+   OVERVIEW
+
+   This file checks that restarting ncchd (SIGUSR2, or `ncchctl restart`,
+   see DESIGN.txt) doesn't drop established sessions, and measures how
+   long traffic on them stalls while it does.
+
+   It runs ncchd (see bench_util.c) with relay-mode apps that call home
+   to a fake NMS in this process and relay to an echo server, also in
+   this process.  Once every
+   app is connected, the NMS pings all of its sessions in rounds: a byte
+   to each, then waiting for every echo.  Meanwhile ncchd is restarted a
+   few times.  A session that closes, or a connection accepted after the
+   first `num-apps`, is a drop.
+
+   It reports, as JSON, the drops (which should be 0), the number of ping
+   rounds, and the slowest round with and without restarts going on.
+   Usage:
+
+       bench_restart [num-apps [restarts [path-to-ncchd]]]
+ *****************************************************************************/
+
+
+/*****************************************************************************
+   INCLUDES AND EXTERNS
+ *****************************************************************************/
+
+#define _GNU_SOURCE  // accept4()
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <limits.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include "bench_util.h"
+
+
+/*****************************************************************************
+   MACROS
+ *****************************************************************************/
+
+#define DEFAULT_APPS      500
+#define DEFAULT_RESTARTS  5
+#define DEFAULT_NCCHD     "./ncchd"
+#define CONNECT_SECONDS   30     // for every app to call home
+#define RESTART_GAP_MS    1000   // between restarts
+#define ROUND_TIMEOUT_MS  10000  // a round slower than this is a failure
+
+
+/*****************************************************************************
+   LOCAL/STATIC DEFINITIONS
+ *****************************************************************************/
+
+static int echo_listen_fd = -1;
+
+
+// the local "NETCONF server": echo whatever arrives on each connection
+static void*
+echo_server(void* arg) {
+    int            max_fds = *(int*)arg + 1;
+    struct pollfd* fds = (struct pollfd*)calloc(max_fds, sizeof(struct pollfd));
+    int            num_fds = 1;
+    int            idx;
+    char           buf[256];
+
+    if (fds == NULL) {
+        return NULL;
+    }
+    fds[0].fd = echo_listen_fd;
+    fds[0].events = POLLIN;
+    for (;;) {
+        if (poll(fds, num_fds, -1) <= 0) {
+            continue;
+        }
+        for (idx=1; idx<num_fds; idx++) {
+            ssize_t len;
+
+            if (fds[idx].revents == 0) {
+                continue;
+            }
+            len = read(fds[idx].fd, buf, sizeof(buf));
+            if (len <= 0 || write(fds[idx].fd, buf, len) != len) {
+                close(fds[idx].fd);
+                fds[idx--] = fds[--num_fds];
+            }
+        }
+        if (fds[0].revents != 0) {
+            int fd = accept4(echo_listen_fd, NULL, NULL, SOCK_CLOEXEC);
+
+            if (fd != -1 && num_fds < max_fds) {
+                fds[num_fds].fd = fd;
+                fds[num_fds].events = POLLIN;
+                num_fds++;
+            } else if (fd != -1) {
+                close(fd);
+            }
+        }
+    }
+    return NULL;
+}
+
+
+// a config.xml of `num_apps` relay-mode apps calling home to the fake NMS
+static int // 0=OK, 1=ERROR
+write_config(int num_apps, uint16_t nms_port, uint16_t echo_port) {
+    FILE* file = bench_config_open();
+    int   idx;
+
+    if (file == NULL) {
+        return 1;
+    }
+    for (idx=0; idx<num_apps; idx++) {
+        fprintf(file,
+                "      <application>\n"
+                "        <name>app-%d</name>\n"
+                "        <servers><server><address>127.0.0.1</address><port>%u</port></server></servers>\n"
+                "        <transport><ssh><host-keys/>"
+                "<relay-to><address>127.0.0.1</address><port>%u</port></relay-to>"
+                "</ssh></transport>\n"
+                "        <reconnect-strategy><interval-secs>1</interval-secs></reconnect-strategy>\n"
+                "      </application>\n",
+                idx, nms_port, echo_port);
+    }
+    return bench_config_close(file);
+}
+
+
+/*****************************************************************************
+   BENCHMARK
+ *****************************************************************************/
+
+// Ping every session once and wait for all the echoes.  Returns the
+// round's duration in ms, or -1 if a session closed, or timed out.
+static int64_t
+ping_round(struct pollfd* fds, int num_fds) {
+    int64_t start = bench_now_ms();
+    int     pending = num_fds;
+    int     idx;
+    char    byte = 'p';
+
+    for (idx=0; idx<num_fds; idx++) {
+        if (write(fds[idx].fd, &byte, 1) != 1) {
+            return -1;
+        }
+        fds[idx].events = POLLIN;
+    }
+    while (pending > 0) {
+        if (bench_now_ms() - start > ROUND_TIMEOUT_MS ||
+            poll(fds, num_fds, 100) < 0) {
+            return -1;
+        }
+        for (idx=0; idx<num_fds; idx++) {
+            if (fds[idx].events != 0 && fds[idx].revents != 0) {
+                if (read(fds[idx].fd, &byte, 1) != 1) {
+                    return -1;
+                }
+                fds[idx].events = 0;  // poll() ignores it until next round
+                pending--;
+            }
+        }
+    }
+    return bench_now_ms() - start;
+}
+
+
+static int // 0=OK, 1=ERROR
+bench_restarts(const char* ncchd, int nms_fd, int num_apps, int restarts) {
+    struct pollfd* fds = (struct pollfd*)calloc(num_apps, sizeof(struct pollfd));
+    struct pollfd  accept_fd = { nms_fd, POLLIN, 0 };
+    int            num_fds = 0;
+    int            done = 0;
+    int            drops = 0;
+    int            rounds = 0;
+    int64_t        quiet_max = 0;
+    int64_t        restart_max = 0;
+    int64_t        next_restart;
+    int64_t        deadline;
+    int64_t        elapsed;
+    pid_t          pid;
+    int            fd;
+
+    if (fds == NULL || bench_clear_state() != 0) {
+        return 1;
+    }
+    pid = bench_start_ncchd(ncchd, "NCCHD_LOG_LEVEL", "info", (char*)NULL);
+    if (pid == -1) {
+        return 1;
+    }
+
+    // wait for every app to call home
+    deadline = bench_now_ms() + CONNECT_SECONDS * 1000;
+    while (num_fds < num_apps && bench_now_ms() < deadline) {
+        if (poll(&accept_fd, 1, 100) == 1 &&
+            (fd = accept4(nms_fd, NULL, NULL, SOCK_CLOEXEC)) != -1) {
+            fds[num_fds++].fd = fd;
+        }
+    }
+
+    // a couple of seconds of pings without restarts, then with
+    next_restart = bench_now_ms() + 2 * RESTART_GAP_MS;
+    while (num_fds == num_apps && done < restarts) {
+        if (bench_now_ms() >= next_restart) {
+            kill(pid, SIGUSR2);
+            next_restart = bench_now_ms() + RESTART_GAP_MS;
+            done++;
+        }
+        elapsed = ping_round(fds, num_fds);
+        if (elapsed < 0) {
+            drops++;
+            break;
+        }
+        rounds++;
+        if (done == 0 && elapsed > quiet_max) {
+            quiet_max = elapsed;
+        } else if (done > 0 && elapsed > restart_max) {
+            restart_max = elapsed;
+        }
+        // an app that called home again lost its session
+        while (poll(&accept_fd, 1, 0) == 1 &&
+               (fd = accept4(nms_fd, NULL, NULL, SOCK_CLOEXEC)) != -1) {
+            drops++;
+            close(fd);
+        }
+        usleep(10000);
+    }
+
+    printf("{\"benchmark\": \"restart\", \"apps\": %d, \"connected\": %d, "
+           "\"restarts\": %d, \"drops\": %d, \"rounds\": %d, "
+           "\"max_round_ms\": %lld, \"max_round_ms_restarting\": %lld}\n",
+           num_apps, num_fds, done, drops, rounds,
+           (long long)quiet_max, (long long)restart_max);
+
+    for (fd=0; fd<num_fds; fd++) {
+        close(fds[fd].fd);
+    }
+    free(fds);
+    if (bench_stop_ncchd(pid) != 0) {
+        return 1;
+    }
+    return (num_fds == num_apps && drops == 0) ? 0 : 1;
+}
+
+
+/*****************************************************************************
+   MAIN
+ *****************************************************************************/
+
+int main(int argc, char* argv[]) {
+    int         num_apps = DEFAULT_APPS;
+    int         restarts = DEFAULT_RESTARTS;
+    const char* ncchd_arg = DEFAULT_NCCHD;
+    char        ncchd[PATH_MAX];
+    char        dir[] = "/tmp/bench_restart.XXXXXX";
+    uint16_t    nms_port;
+    uint16_t    echo_port;
+    pthread_t   thread;
+    int         nms_fd;
+    int         result;
+
+    if (argc > 1) {
+        num_apps = atoi(argv[1]);
+    }
+    if (argc > 2) {
+        restarts = atoi(argv[2]);
+    }
+    if (argc > 3) {
+        ncchd_arg = argv[3];
+    }
+    if (num_apps <= 0 || restarts <= 0) {
+        printf("usage: %s [num-apps [restarts [path-to-ncchd]]]\n", argv[0]);
+        return 1;
+    }
+    if (bench_find_ncchd("restart", ncchd_arg, ncchd) != 0) {
+        return 1;
+    }
+    signal(SIGPIPE, SIG_IGN);
+
+    nms_fd = bench_listen_loopback(&nms_port);
+    echo_listen_fd = bench_listen_loopback(&echo_port);
+    if (nms_fd == -1 || echo_listen_fd == -1) {
+        printf("{\"benchmark\": \"restart\", \"error\": \"could not listen on loopback\"}\n");
+        return 1;
+    }
+    if (pthread_create(&thread, NULL, echo_server, &num_apps) != 0) {
+        printf("{\"benchmark\": \"restart\", \"error\": \"could not start the echo server\"}\n");
+        return 1;
+    }
+
+    if (bench_scratch_open(dir) != 0 ||
+        write_config(num_apps, nms_port, echo_port) != 0) {
+        printf("{\"benchmark\": \"restart\", \"error\": \"could not set up a scratch directory\"}\n");
+        return 1;
+    }
+
+    result = bench_restarts(ncchd, nms_fd, num_apps, restarts);
+    bench_scratch_close(dir, result == 0);
+    return result == 0 ? 0 : 1;
+}
@@ -0,0 +1,434 @@
+/*****************************************************************************
+Copyright (c) 2014-2016, Juniper Networks, Inc.
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions
+are met:
+
+1. Redistributions of source code must retain the above copyright 
+   notice, this list of conditions and the following disclaimer.
+
+2. Redistributions in binary form must reproduce the above copyright
+   notice, this list of conditions and the following disclaimer in the
+   documentation and/or other materials provided with the distribution.
+
+3. Neither the name of the copyright holder nor the names of its 
+   contributors may be used to endorse or promote products derived 
+   from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS 
+"AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT 
+LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS 
+FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE 
+COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, 
+INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, 
+BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; 
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER 
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT 
+LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN 
+ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE 
+POSSIBILITY OF SUCH DAMAGE.
+ *****************************************************************************/
+
+
+
+
+
+/*****************************************************************************
+   OVERVIEW
+
+   This file checks that the "lowest-latency" start-with strategy (see
+   server_stats.c) converges on the fastest healthy server, and that what
+   it learned survives a restart.
+
+   It runs ncchd (see bench_util.c) with relay-mode apps, each listing
+   the same stand-in NMSs served by this process:
+
+       slow      answers after 40ms
+       flaky     answers after 3ms, but hangs up on 70% of connections
+       medium    answers after 20ms
+       fast      answers after 5ms (listed last, so it's found, not given)
+
+   A stand-in "answers" by sending an SSH banner, which is what ncchd
+   times, then hangs up after HOLD_MS so the apps keep reconnecting (and
+   choosing) with interval-secs 0.  The relayed sessions go to a discard
+   server, also in this process.
+
+   It reports, as JSON, the share of sessions each stand-in got in each
+   WINDOW_MS window, how long it took until "fast" got 90% of a window,
+   and the share "fast" got in the first window after ncchd restarted
+   on the state files it left.  Usage:
+
+       bench_select [num-apps [seconds [path-to-ncchd]]]
+ *****************************************************************************/
+
+
+/*****************************************************************************
+   INCLUDES AND EXTERNS
+ *****************************************************************************/
+
+#define _GNU_SOURCE  // accept4()
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <string.h>
+#include <limits.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include "bench_util.h"
+
+
+/*****************************************************************************
+   MACROS
+ *****************************************************************************/
+
+#define DEFAULT_APPS     50
+#define DEFAULT_SECONDS  5
+#define DEFAULT_NCCHD    "./ncchd"
+#define WINDOW_MS        500
+#define HOLD_MS          100
+#define MAX_WINDOWS      256
+#define MAX_CONNS        4096
+#define NUM_STANDINS     4
+#define FASTEST          3      // index of "fast" in standins[]
+#define CONVERGED_SHARE  0.9
+
+
+/*****************************************************************************
+   LOCAL/STATIC DEFINITIONS
+ *****************************************************************************/
+
+typedef struct StandIn StandIn;
+struct StandIn {
+    const char*      name;
+    int              delay_ms;    // before the banner
+    int              fail_pct;    // connections hung up on right away
+    int              listen_fd;
+    uint16_t         port;
+    _Atomic uint32_t sessions[MAX_WINDOWS];  // banners sent, per window
+};
+
+static StandIn standins[NUM_STANDINS] = {
+    { "slow",   40,  0, -1, 0, {0} },
+    { "flaky",   3, 70, -1, 0, {0} },
+    { "medium", 20,  0, -1, 0, {0} },
+    { "fast",    5,  0, -1, 0, {0} },
+};
+
+static int              discard_listen_fd = -1;
+static int64_t          epoch_ms = 0;      // window 0 starts here
+static _Atomic int      recording = 0;
+
+
+// a connection to a stand-in (or the discard server, standin -1)
+typedef struct Conn Conn;
+struct Conn {
+    int     fd;
+    int     standin;
+    int64_t greet_ms;    // send the banner then, 0 once sent
+    int64_t close_ms;
+};
+
+
+// Serve every stand-in and the discard server from one poll() loop,
+// which is plenty for the delays involved
+static void*
+serve(void* arg) {
+    static Conn   conns[MAX_CONNS];
+    struct pollfd fds[NUM_STANDINS + 1 + MAX_CONNS];
+    struct linger linger = { 1, 0 };
+    int           num_conns = 0;
+    unsigned int  seed = 1;
+    int           idx;
+
+    (void)arg;
+    for (;;) {
+        int64_t now = bench_now_ms();
+        int64_t next = now + 100;
+        int     num_fds = 0;
+
+        // banners and hang-ups due
+        for (idx=0; idx<num_conns; idx++) {
+            Conn* conn = &(conns[idx]);
+
+            if (conn->greet_ms != 0 && now >= conn->greet_ms) {
+                const char banner[] = "SSH-2.0-standin\r\n";
+                if (write(conn->fd, banner, sizeof(banner) - 1) > 0 &&
+                    atomic_load(&recording)) {
+                    int64_t window = (now - epoch_ms) / WINDOW_MS;
+                    if (window >= 0 && window < MAX_WINDOWS) {
+                        atomic_fetch_add(&(standins[conn->standin].sessions[window]), 1);
+                    }
+                }
+                conn->greet_ms = 0;
+            }
+            if (conn->close_ms != 0 && now >= conn->close_ms) {
+                setsockopt(conn->fd, SOL_SOCKET, SO_LINGER, &linger, sizeof(linger));
+                close(conn->fd);
+                conns[idx--] = conns[--num_conns];
+                continue;
+            }
+            if (conn->greet_ms != 0 && conn->greet_ms < next) {
+                next = conn->greet_ms;
+            }
+            if (conn->close_ms != 0 && conn->close_ms < next) {
+                next = conn->close_ms;
+            }
+        }
+
+        for (idx=0; idx<NUM_STANDINS; idx++) {
+            fds[num_fds].fd = standins[idx].listen_fd;
+            fds[num_fds++].events = POLLIN;
+        }
+        fds[num_fds].fd = discard_listen_fd;
+        fds[num_fds++].events = POLLIN;
+        for (idx=0; idx<num_conns; idx++) {
+            fds[num_fds].fd = conns[idx].fd;
+            fds[num_fds++].events = POLLIN;
+        }
+        if (poll(fds, num_fds, next > now ? (int)(next - now) : 0) <= 0) {
+            continue;
+        }
+
+        // data on the connections: the discard server drops it, the
+        // stand-ins only notice the NMS-side close
+        for (idx=num_conns-1; idx>=0; idx--) {
+            char buf[4096];
+
+            if (fds[NUM_STANDINS + 1 + idx].revents != 0 &&
+                read(conns[idx].fd, buf, sizeof(buf)) <= 0) {
+                close(conns[idx].fd);
+                conns[idx] = conns[--num_conns];
+            }
+        }
+        for (idx=0; idx<=NUM_STANDINS; idx++) {
+            int fd;
+
+            if (fds[idx].revents == 0 ||
+                (fd = accept4(fds[idx].fd, NULL, NULL, SOCK_CLOEXEC)) == -1) {
+                continue;
+            }
+            if (num_conns == MAX_CONNS) {
+                close(fd);
+                continue;
+            }
+            conns[num_conns].fd = fd;
+            conns[num_conns].standin = idx < NUM_STANDINS ? idx : -1;
+            conns[num_conns].greet_ms = 0;
+            conns[num_conns].close_ms = 0;
+            if (idx < NUM_STANDINS) {
+                if ((int)(rand_r(&seed) % 100) < standins[idx].fail_pct) {
+                    conns[num_conns].close_ms = bench_now_ms();  // hang up unanswered
+                } else {
+                    conns[num_conns].greet_ms = bench_now_ms() + standins[idx].delay_ms;
+                    conns[num_conns].close_ms = conns[num_conns].greet_ms + HOLD_MS;
+                }
+            }
+            num_conns++;
+        }
+    }
+    return NULL;
+}
+
+
+// a config.xml of `num_apps` relay-mode apps listing every stand-in
+static int // 0=OK, 1=ERROR
+write_config(int num_apps, uint16_t discard_port) {
+    FILE* file = bench_config_open();
+    int   idx;
+    int   svr;
+
+    if (file == NULL) {
+        return 1;
+    }
+    for (idx=0; idx<num_apps; idx++) {
+        fprintf(file,
+                "      <application>\n"
+                "        <name>app-%d</name>\n"
+                "        <servers>\n", idx);
+        for (svr=0; svr<NUM_STANDINS; svr++) {
+            fprintf(file, "          <server><address>127.0.0.1</address><port>%u</port></server>\n",
+                    standins[svr].port);
+        }
+        fprintf(file,
+                "        </servers>\n"
+                "        <transport><ssh><host-keys/>"
+                "<relay-to><address>127.0.0.1</address><port>%u</port></relay-to>"
+                "</ssh></transport>\n"
+                "        <reconnect-strategy>\n"
+                "           <start-with>lowest-latency</start-with>\n"
+                "           <interval-secs>0</interval-secs>\n"
+                "           <count-max>1</count-max>\n"
+                "        </reconnect-strategy>\n"
+                "      </application>\n",
+                discard_port);
+    }
+    return bench_config_close(file);
+}
+
+
+/*****************************************************************************
+   BENCHMARK
+ *****************************************************************************/
+
+static pid_t // -1 on error
+start_ncchd(const char* ncchd) {
+    return bench_start_ncchd(ncchd, "NCCHD_LOG_LEVEL", "error",  // not every hang-up
+                             "NCCHD_CONNECT_RATE", "0",          // reconnect as fast as they can
+                             "NCCHD_MAX_HANDSHAKES", "0",
+                             (char*)NULL);
+}
+
+
+// fast's share of the sessions in `window`, -1 if there were none
+static double
+fast_share(int window) {
+    uint32_t total = 0;
+    int      idx;
+
+    for (idx=0; idx<NUM_STANDINS; idx++) {
+        total += atomic_load(&(standins[idx].sessions[window]));
+    }
+    return total == 0 ? -1.0
+                      : (double)atomic_load(&(standins[FASTEST].sessions[window])) / total;
+}
+
+
+static int // 0=OK, 1=ERROR
+bench_select(const char* ncchd, int num_apps, int seconds) {
+    int     windows = seconds * 1000 / WINDOW_MS;
+    int     converged = -1;
+    int     window;
+    int     idx;
+    double  after_restart;
+    pid_t   pid;
+
+    if (windows + 2 > MAX_WINDOWS) {
+        windows = MAX_WINDOWS - 2;
+    }
+    if (bench_clear_state() != 0) {
+        return 1;
+    }
+
+    // learn from scratch
+    epoch_ms = bench_now_ms();
+    atomic_store(&recording, 1);
+    if ((pid = start_ncchd(ncchd)) == -1) {
+        return 1;
+    }
+    usleep(windows * WINDOW_MS * 1000);
+    atomic_store(&recording, 0);
+    if (bench_stop_ncchd(pid) != 0) {
+        return 1;
+    }
+
+    printf("{\"benchmark\": \"select\", \"apps\": %d, \"window_ms\": %d,\n"
+           " \"standins\": [", num_apps, WINDOW_MS);
+    for (idx=0; idx<NUM_STANDINS; idx++) {
+        printf("%s{\"name\": \"%s\", \"delay_ms\": %d, \"fail_pct\": %d}",
+               idx == 0 ? "" : ", ", standins[idx].name, standins[idx].delay_ms,
+               standins[idx].fail_pct);
+    }
+    printf("],\n \"sessions_per_window\": [");
+    for (window=0; window<windows; window++) {
+        printf("%s\n    [", window == 0 ? "" : ",");
+        for (idx=0; idx<NUM_STANDINS; idx++) {
+            printf("%s%u", idx == 0 ? "" : ", ",
+                   atomic_load(&(standins[idx].sessions[window])));
+        }
+        printf("]");
+        if (converged == -1 && fast_share(window) >= CONVERGED_SHARE) {
+            converged = window;
+        }
+    }
+    printf("\n ],\n");
+
+    // then start over on what it learned, in the next free window
+    for (idx=0; idx<NUM_STANDINS; idx++) {
+        atomic_store(&(standins[idx].sessions[windows]), 0);
+    }
+    epoch_ms = bench_now_ms() - (int64_t)windows * WINDOW_MS;
+    atomic_store(&recording, 1);
+    if ((pid = start_ncchd(ncchd)) == -1) {
+        return 1;
+    }
+    usleep(WINDOW_MS * 1000);
+    atomic_store(&recording, 0);
+    after_restart = fast_share(windows);
+    if (bench_stop_ncchd(pid) != 0) {
+        return 1;
+    }
+
+    printf(" \"converged_ms\": %d, \"fast_share_last_window\": %.2f,"
+           " \"fast_share_after_restart\": %.2f}\n",
+           converged == -1 ? -1 : (converged + 1) * WINDOW_MS,
+           fast_share(windows - 1), after_restart);
+    return (converged != -1 && after_restart >= CONVERGED_SHARE) ? 0 : 1;
+}
+
+
+/*****************************************************************************
+   MAIN
+ *****************************************************************************/
+
+int main(int argc, char* argv[]) {
+    int         num_apps = DEFAULT_APPS;
+    int         seconds = DEFAULT_SECONDS;
+    const char* ncchd_arg = DEFAULT_NCCHD;
+    char        ncchd[PATH_MAX];
+    char        dir[] = "/tmp/bench_select.XXXXXX";
+    uint16_t    discard_port;
+    pthread_t   thread;
+    int         idx;
+    int         result;
+
+    if (argc > 1) {
+        num_apps = atoi(argv[1]);
+    }
+    if (argc > 2) {
+        seconds = atoi(argv[2]);
+    }
+    if (argc > 3) {
+        ncchd_arg = argv[3];
+    }
+    if (num_apps <= 0 || seconds <= 0) {
+        printf("usage: %s [num-apps [seconds [path-to-ncchd]]]\n", argv[0]);
+        return 1;
+    }
+    if (bench_find_ncchd("select", ncchd_arg, ncchd) != 0) {
+        return 1;
+    }
+    signal(SIGPIPE, SIG_IGN);
+
+    for (idx=0; idx<NUM_STANDINS; idx++) {
+        standins[idx].listen_fd = bench_listen_loopback(&(standins[idx].port));
+        if (standins[idx].listen_fd == -1) {
+            break;
+        }
+    }
+    discard_listen_fd = bench_listen_loopback(&discard_port);
+    if (idx < NUM_STANDINS || discard_listen_fd == -1) {
+        printf("{\"benchmark\": \"select\", \"error\": \"could not listen on loopback\"}\n");
+        return 1;
+    }
+    if (pthread_create(&thread, NULL, serve, NULL) != 0) {
+        printf("{\"benchmark\": \"select\", \"error\": \"could not start the stand-ins\"}\n");
+        return 1;
+    }
+
+    if (bench_scratch_open(dir) != 0 ||
+        write_config(num_apps, discard_port) != 0) {
+        printf("{\"benchmark\": \"select\", \"error\": \"could not set up a scratch directory\"}\n");
+        return 1;
+    }
+
+    result = bench_select(ncchd, num_apps, seconds);
+    bench_scratch_close(dir, result == 0);
+    return result == 0 ? 0 : 1;
+}
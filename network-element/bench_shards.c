@@ -0,0 +1,243 @@
+/*****************************************************************************
+Copyright (c) 2014-2016, Juniper Networks, Inc.
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions
+are met:
+
+1. Redistributions of source code must retain the above copyright 
+   notice, this list of conditions and the following disclaimer.
+
+2. Redistributions in binary form must reproduce the above copyright
+   notice, this list of conditions and the following disclaimer in the
+   documentation and/or other materials provided with the distribution.
+
+3. Neither the name of the copyright holder nor the names of its 
+   contributors may be used to endorse or promote products derived 
+   from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS 
+"AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT 
+LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS 
+FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE 
+COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, 
+INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, 
+BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; 
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER 
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT 
+LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN 
+ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE 
+POSSIBILITY OF SUCH DAMAGE.
+ *****************************************************************************/
+
+
+
+
+/*****************************************************************************
+   OVERVIEW
+
+   This file measures how ncchd's session rate scales with the number of
+   worker threads ("shards", see NCCHD_WORKERS in DESIGN.txt).
+
+   It runs ncchd (see bench_util.c) with relay-mode apps whose NMS, a
+   fake one in this process, resets each call-home connection right away,
+   and the apps reconnect with interval-secs 0, so every app turns over
+   sessions as fast as its shard can connect, relay, and clean up.
+
+   For each worker count it reports the NMS's accepts per second, after a
+   warmup, as JSON along with the number of online CPUs.  Usage:
+
+       bench_shards [num-apps [seconds [path-to-ncchd]]]
+ *****************************************************************************/
+
+
+/*****************************************************************************
+   INCLUDES AND EXTERNS
+ *****************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <string.h>
+#include <limits.h>
+#include <pthread.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include "bench_util.h"
+
+
+/*****************************************************************************
+   MACROS
+ *****************************************************************************/
+
+#define DEFAULT_APPS    256
+#define DEFAULT_SECONDS 3
+#define DEFAULT_NCCHD   "./ncchd"
+#define WARMUP_SECONDS  1
+#define ACCEPT_THREADS  4
+#define WORKER_COUNTS   { 1, 2, 4, 8 }
+
+
+/*****************************************************************************
+   LOCAL/STATIC DEFINITIONS
+ *****************************************************************************/
+
+static int                nms_listen_fd = -1;
+static int                local_listen_fd = -1;
+static _Atomic uint64_t   nms_accepts = 0;
+
+
+// accept and reset connections on `arg`'s listening socket
+static void*
+accept_and_reset(void* arg) {
+    int* listen_fd = (int*)arg;
+
+    for (;;) {
+        if (bench_accept_and_reset(*listen_fd) != 0) {
+            continue;
+        }
+        if (listen_fd == &nms_listen_fd) {
+            atomic_fetch_add(&nms_accepts, 1);
+        }
+    }
+    return NULL;
+}
+
+
+// a config.xml of `num_apps` relay-mode apps calling home to the fake NMS
+static int // 0=OK, 1=ERROR
+write_config(int num_apps, uint16_t nms_port, uint16_t local_port) {
+    FILE* file = bench_config_open();
+    int   idx;
+
+    if (file == NULL) {
+        return 1;
+    }
+    for (idx=0; idx<num_apps; idx++) {
+        fprintf(file,
+                "      <application>\n"
+                "        <name>app-%d</name>\n"
+                "        <servers><server><address>127.0.0.1</address><port>%u</port></server></servers>\n"
+                "        <transport><ssh><host-keys/>"
+                "<relay-to><address>127.0.0.1</address><port>%u</port></relay-to>"
+                "</ssh></transport>\n"
+                "        <reconnect-strategy>\n"
+                "           <start-with>first-listed</start-with>\n"
+                "           <interval-secs>0</interval-secs>\n"
+                "           <count-max>3</count-max>\n"
+                "        </reconnect-strategy>\n"
+                "      </application>\n",
+                idx, nms_port, local_port);
+    }
+    return bench_config_close(file);
+}
+
+
+/*****************************************************************************
+   BENCHMARK
+ *****************************************************************************/
+
+// run ncchd with `workers` shards and report the NMS's accept rate
+static int // 0=OK, 1=ERROR
+bench_workers(const char* ncchd, int workers, int seconds) {
+    char     value[16];
+    pid_t    pid;
+    uint64_t accepts;
+    int64_t  start;
+
+    if (bench_clear_state() != 0) {
+        return 1;
+    }
+    snprintf(value, sizeof(value), "%d", workers);
+    pid = bench_start_ncchd(ncchd, "NCCHD_WORKERS", value,
+                            "NCCHD_LOG_LEVEL", "warn",  // not per-session lines
+                            (char*)NULL);
+    if (pid == -1) {
+        return 1;
+    }
+
+    sleep(WARMUP_SECONDS);
+    accepts = atomic_load(&nms_accepts);
+    start = bench_now_ns();
+    sleep(seconds);
+    accepts = atomic_load(&nms_accepts) - accepts;
+    printf("%s\n    {\"workers\": %d, \"sessions\": %llu, \"sessions_per_sec\": %.0f}",
+           workers == 1 ? "" : ",", workers, (unsigned long long)accepts,
+           accepts / ((bench_now_ns() - start) / 1e9));
+    fflush(stdout);
+
+    if (bench_stop_ncchd(pid) != 0) {
+        return 1;
+    }
+    return accepts > 0 ? 0 : 1;
+}
+
+
+/*****************************************************************************
+   MAIN
+ *****************************************************************************/
+
+int main(int argc, char* argv[]) {
+    int         worker_counts[] = WORKER_COUNTS;
+    int         num_apps = DEFAULT_APPS;
+    int         seconds = DEFAULT_SECONDS;
+    const char* ncchd_arg = DEFAULT_NCCHD;
+    char        ncchd[PATH_MAX];
+    char        dir[] = "/tmp/bench_shards.XXXXXX";
+    uint16_t    nms_port;
+    uint16_t    local_port;
+    pthread_t   thread;
+    int         idx;
+    int         result = 0;
+
+    if (argc > 1) {
+        num_apps = atoi(argv[1]);
+    }
+    if (argc > 2) {
+        seconds = atoi(argv[2]);
+    }
+    if (argc > 3) {
+        ncchd_arg = argv[3];
+    }
+    if (num_apps <= 0 || seconds <= 0) {
+        printf("usage: %s [num-apps [seconds [path-to-ncchd]]]\n", argv[0]);
+        return 1;
+    }
+    if (bench_find_ncchd("shards", ncchd_arg, ncchd) != 0) {
+        return 1;
+    }
+    signal(SIGPIPE, SIG_IGN);
+
+    nms_listen_fd = bench_listen_loopback(&nms_port);
+    local_listen_fd = bench_listen_loopback(&local_port);
+    if (nms_listen_fd == -1 || local_listen_fd == -1) {
+        printf("{\"benchmark\": \"shards\", \"error\": \"could not listen on loopback\"}\n");
+        return 1;
+    }
+    for (idx=0; idx<ACCEPT_THREADS; idx++) {
+        if (pthread_create(&thread, NULL, accept_and_reset, &nms_listen_fd) != 0 ||
+            pthread_create(&thread, NULL, accept_and_reset, &local_listen_fd) != 0) {
+            printf("{\"benchmark\": \"shards\", \"error\": \"could not start the fake NMS\"}\n");
+            return 1;
+        }
+    }
+
+    if (bench_scratch_open(dir) != 0 ||
+        write_config(num_apps, nms_port, local_port) != 0) {
+        printf("{\"benchmark\": \"shards\", \"error\": \"could not set up a scratch directory\"}\n");
+        return 1;
+    }
+
+    printf("{\"benchmark\": \"shards\", \"apps\": %d, \"cpus\": %ld, \"results\": [",
+           num_apps, sysconf(_SC_NPROCESSORS_ONLN));
+    fflush(stdout);
+    for (idx=0; idx<(int)(sizeof(worker_counts)/sizeof(worker_counts[0])) && result == 0; idx++) {
+        result = bench_workers(ncchd, worker_counts[idx], seconds);
+    }
+    printf("\n]}\n");
+    bench_scratch_close(dir, result == 0);
+    return result == 0 ? 0 : 1;
+}
@@ -0,0 +1,295 @@
+/*****************************************************************************
+Copyright (c) 2014-2016, Juniper Networks, Inc.
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions
+are met:
+
+1. Redistributions of source code must retain the above copyright 
+   notice, this list of conditions and the following disclaimer.
+
+2. Redistributions in binary form must reproduce the above copyright
+   notice, this list of conditions and the following disclaimer in the
+   documentation and/or other materials provided with the distribution.
+
+3. Neither the name of the copyright holder nor the names of its 
+   contributors may be used to endorse or promote products derived 
+   from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS 
+"AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT 
+LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS 
+FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE 
+COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, 
+INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, 
+BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; 
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER 
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT 
+LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN 
+ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE 
+POSSIBILITY OF SUCH DAMAGE.
+ *****************************************************************************/
+
+
+
+/*****************************************************************************
+   OVERVIEW
+
+   This file measures what TCP Fast Open (see tcp_profile.c) saves a
+   call-home connect: the time from the device's connect() to the NMS
+   having the device's SSH identification string, its "time to banner".
+
+   Each connect is made the way ncchd makes them, with a socket-profile
+   (TCP_NODELAY and TCP_QUICKACK, plus Fast Open or not) applied through
+   tcp_profile.c, and the banner written as soon as the socket is
+   writable, as sshd would.  The NMS is a listener in this process with
+   Fast Open enabled.  Each mode's first connect isn't timed: with Fast
+   Open it's the one that gets the cookie.  A connect counts as Fast Open
+   if the kernel reports its SYN's data was taken (TCPI_OPT_SYN_DATA).
+
+   Run as root, it moves into a network namespace of its own, allows Fast
+   Open there (net.ipv4.tcp_fastopen = 3) and adds `delay-msecs` of
+   latency to each packet on its loopback with netem, so a round trip
+   takes twice that; the host's own network settings aren't touched.  Run
+   otherwise, or without netem, it runs with no added latency and says so
+   ("delay_ms": 0).
+
+   Results are printed as JSON, one record per mode.  Usage:
+
+       bench_tfo [connects [delay-msecs]]
+ *****************************************************************************/
+
+
+/*****************************************************************************
+   INCLUDES AND EXTERNS
+ *****************************************************************************/
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sched.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include "ncchd.h"
+#include "tcp_profile.h"
+#include "bench_util.h"
+
+
+/*****************************************************************************
+   MACROS
+ *****************************************************************************/
+
+#define DEFAULT_CONNECTS     200
+#define DEFAULT_DELAY_MSECS  10
+#define TIMEOUT_MSECS        5000
+
+#define BANNER "SSH-2.0-bench_tfo\r\n"
+
+
+/*****************************************************************************
+   LOCAL/STATIC DEFINITIONS
+ *****************************************************************************/
+
+// wait for `events` on `fd`, up to TIMEOUT_MSECS
+static int // 0=OK, 1=ERROR
+wait_for(int fd, short events) {
+    struct pollfd pfd;
+
+    pfd.fd = fd;
+    pfd.events = events;
+    return poll(&pfd, 1, TIMEOUT_MSECS) == 1 ? 0 : 1;
+}
+
+
+// a private network namespace with `*delay_ms` of latency on its loopback,
+// or none (and `*delay_ms` zeroed) if netem isn't available
+static int // 0=OK, 1=ERROR
+isolate(uint32_t* delay_ms) {
+    char  command[128];
+    FILE* file;
+
+    if (geteuid() != 0 || unshare(CLONE_NEWNET) != 0) {
+        return 1;
+    }
+    if (system("ip link set lo up") != 0) {
+        return 1;
+    }
+    file = fopen("/proc/sys/net/ipv4/tcp_fastopen", "w");
+    if (file == NULL) {
+        return 1;
+    }
+    fprintf(file, "3\n");
+    fclose(file);
+    if (*delay_ms > 0) {
+        snprintf(command, sizeof(command),
+                 "tc qdisc add dev lo root netem delay %ums 2>/dev/null", *delay_ms);
+        if (system(command) != 0) {
+            *delay_ms = 0;
+        }
+    }
+    return 0;
+}
+
+
+// One connect to `addr`, the banner written as soon as it's writable.
+// Returns the time from connect() until the listener had the banner.
+static int64_t // -1 on error
+time_to_banner(int listener, const struct sockaddr_in* addr,
+               const SocketProfile* profile, bool* syn_data) {
+    struct tcp_info info;
+    socklen_t       len = sizeof(info);
+    char            buf[64];
+    int64_t         start, result = -1;
+    int             fd, peer = -1, rc;
+
+    fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd == -1) {
+        return -1;
+    }
+    tcp_profile_apply(profile, fd);
+    if (profile->fast_open && tcp_fast_open(fd) != 0) {
+        close(fd);
+        return -1;
+    }
+
+    start = bench_now_ns();
+    rc = connect(fd, (const struct sockaddr*)addr, sizeof(*addr));
+    if ((rc == 0 || errno == EINPROGRESS) && wait_for(fd, POLLOUT) == 0) {
+        tcp_profile_connected(profile, fd);
+        if (write(fd, BANNER, sizeof(BANNER) - 1) == sizeof(BANNER) - 1 &&
+            wait_for(listener, POLLIN) == 0 &&
+            (peer = accept(listener, NULL, NULL)) != -1 &&
+            wait_for(peer, POLLIN) == 0 && read(peer, buf, sizeof(buf)) > 0) {
+            result = bench_now_ns() - start;
+        }
+    }
+    *syn_data = false;
+#ifdef TCPI_OPT_SYN_DATA
+    if (getsockopt(fd, IPPROTO_TCP, TCP_INFO, &info, &len) == 0) {
+        *syn_data = (info.tcpi_options & TCPI_OPT_SYN_DATA) != 0;
+    }
+#endif
+    if (peer != -1) {
+        close(peer);
+    }
+    close(fd);
+    return result;
+}
+
+
+/*****************************************************************************
+   BENCHMARKS
+ *****************************************************************************/
+
+// time `connects` connects with (or without) Fast Open, and print a record
+static int // 0=OK, 1=ERROR
+bench_mode(int listener, const struct sockaddr_in* addr, uint32_t connects,
+           bool fast_open, uint32_t delay_ms, bool isolated) {
+    SocketProfile profile;
+    int64_t*      times = (int64_t*)calloc(connects, sizeof(int64_t));
+    uint32_t      done = 0, with_syn_data = 0, idx;
+    int64_t       total = 0;
+    bool          syn_data;
+
+    if (times == NULL) {
+        return 1;
+    }
+    memset(&profile, 0, sizeof(profile));
+    profile.nodelay = 1;
+    profile.quickack = 1;
+    profile.fast_open = fast_open;
+
+    // the first connect gets the cookie (or warms up), untimed
+    time_to_banner(listener, addr, &profile, &syn_data);
+    for (idx=0; idx<connects; idx++) {
+        int64_t ns = time_to_banner(listener, addr, &profile, &syn_data);
+        if (ns < 0) {
+            continue;
+        }
+        times[done++] = ns;
+        total += ns;
+        with_syn_data += syn_data;
+    }
+
+    printf("{\"benchmark\": \"tfo\", \"mode\": \"%s\", \"delay_ms\": %u, "
+           "\"isolated\": %s, \"connects\": %u, \"failed\": %u, \"syn_data\": %u",
+           fast_open ? "fast-open" : "plain", delay_ms,
+           isolated ? "true" : "false", connects, connects - done, with_syn_data);
+    if (done > 0) {
+        qsort(times, done, sizeof(int64_t), bench_compare_ns);
+        printf(", \"time_to_banner_ms\": {\"mean\": %.3f, \"p50\": %.3f, \"p99\": %.3f}",
+               total / 1e6 / done, times[done / 2] / 1e6,
+               times[(uint64_t)done * 99 / 100] / 1e6);
+    }
+    printf("}\n");
+    fflush(stdout);
+    free(times);
+    return done > 0 ? 0 : 1;
+}
+
+
+/*****************************************************************************
+   MAIN
+ *****************************************************************************/
+
+int main(int argc, char* argv[]) {
+    uint32_t           connects = DEFAULT_CONNECTS;
+    uint32_t           delay_ms = DEFAULT_DELAY_MSECS;
+    struct sockaddr_in addr;
+    socklen_t          len = sizeof(addr);
+    int                listener, on = 1, qlen = 64;
+    bool               isolated;
+
+    if (argc > 1) {
+        connects = strtoul(argv[1], NULL, 10);
+    }
+    if (argc > 2) {
+        delay_ms = strtoul(argv[2], NULL, 10);
+    }
+    if (connects == 0 || delay_ms > 1000) {
+        printf("usage: %s [connects [delay-msecs]]\n", argv[0]);
+        return 1;
+    }
+    if (!tcp_fast_open_supported()) {
+        printf("{\"benchmark\": \"tfo\", \"error\": \"no TCP Fast Open on this platform\"}\n");
+        return 1;
+    }
+    isolated = (isolate(&delay_ms) == 0);
+    if (!isolated) {
+        delay_ms = 0;
+    }
+
+    // the NMS: a listener that hands out Fast Open cookies
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    listener = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (listener == -1 ||
+        setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on)) != 0 ||
+        setsockopt(listener, IPPROTO_TCP, TCP_FASTOPEN, &qlen, sizeof(qlen)) != 0 ||
+        bind(listener, (struct sockaddr*)&addr, sizeof(addr)) != 0 ||
+        listen(listener, 64) != 0 ||
+        getsockname(listener, (struct sockaddr*)&addr, &len) != 0) {
+        printf("{\"benchmark\": \"tfo\", \"error\": \"listener: %s\"}\n", strerror(errno));
+        return 1;
+    }
+
+    if (bench_mode(listener, &addr, connects, false, delay_ms, isolated) != 0 ||
+        bench_mode(listener, &addr, connects, true, delay_ms, isolated) != 0) {
+        return 1;
+    }
+    close(listener);
+    return 0;
+}
@@ -0,0 +1,689 @@
+/*****************************************************************************
+Copyright (c) 2014-2016, Juniper Networks, Inc.
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions
+are met:
+
+1. Redistributions of source code must retain the above copyright 
+   notice, this list of conditions and the following disclaimer.
+
+2. Redistributions in binary form must reproduce the above copyright
+   notice, this list of conditions and the following disclaimer in the
+   documentation and/or other materials provided with the distribution.
+
+3. Neither the name of the copyright holder nor the names of its 
+   contributors may be used to endorse or promote products derived 
+   from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS 
+"AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT 
+LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS 
+FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE 
+COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, 
+INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, 
+BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; 
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER 
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT 
+LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN 
+ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE 
+POSSIBILITY OF SUCH DAMAGE.
+ *****************************************************************************/
+
+
+
+/*****************************************************************************
+   OVERVIEW
+
+   This file compares the ways ncchd can serve an SSH session: exec'ing
+   `sshd -i` (which execs netconfd for the subsystem), its in-process
+   SSH server (see ssh_server.c), and the in-process server with the apps
+   calling the same NMS endpoint sharing one connection
+   (<shared-connection/>).  The apps are spread over NMS endpoints
+   (loopback ports), apps-per-endpoint to each.  For each path it measures
+
+     - memory per session: the PSS (RSS where there's no smaps_rollup) of
+       ncchd and all its descendants with every app's session held open,
+       less the same for an ncchd whose NMS refuses connections, per app
+     - SSH sessions: the connections the NMS accepted (a key exchange
+       each) to get every app's session up
+     - sessions per second: every app calling home again as soon as its
+       session ends (interval-secs 0), with the NMS doing a whole NETCONF
+       session each time: key exchange, publickey authentication, the
+       "netconf" subsystem, the <hello>, and a <close-session>; shared,
+       the NMS opens as many channels as the <hello> offers, and does the
+       NETCONF session on each
+     - handshakes per session: connections accepted per NETCONF session
+       done, meanwhile
+
+   Then what sharing saved over the unshared in-process path: SSH
+   sessions, handshakes per NETCONF session, and memory.
+
+   It runs ncchd (see bench_util.c, built with `make LIBSSH=1`) in a
+   scratch directory made under the current one, since sshd's
+   StrictModes won't use an AuthorizedKeysFile under /tmp.  The NMS is
+   this process, using libssh's client on the connections it accepts,
+   and authenticates as the current user with a key generated for the
+   run, which ncchd is told about with NCCHD_AUTHORIZED_KEYS.  The sshd-exec path needs ncchd's
+   sshd (and PAM, so usually root) and netconfd next to ncchd.
+
+   Results are printed as JSON, one record per path.  Usage:
+
+       bench_transport [num-apps [seconds [path-to-ncchd [apps-per-endpoint]]]]
+ *****************************************************************************/
+
+
+/*****************************************************************************
+   INCLUDES AND EXTERNS
+ *****************************************************************************/
+
+#define _GNU_SOURCE  // accept4()
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <string.h>
+#include <dirent.h>
+#include <libgen.h>
+#include <limits.h>
+#include <poll.h>
+#include <pthread.h>
+#include <pwd.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <libssh/libssh.h>
+#include "bench_util.h"
+
+
+/*****************************************************************************
+   MACROS
+ *****************************************************************************/
+
+#define DEFAULT_APPS       50
+#define DEFAULT_SECONDS    5
+#define DEFAULT_NCCHD      "./ncchd"
+#define DEFAULT_PER_ENDPOINT 10    // apps
+#define MAX_ENDPOINTS      256
+#define SSH_CHANNELS_MAX   64      // SSH_SERVER_MAX_CHANNELS
+#define NMS_WORKERS        8
+#define CONNECT_SECONDS    30      // for every app to call home
+#define IDLE_SECONDS       1       // for ncchd to settle with nothing to serve
+#define READ_TIMEOUT_MSECS 10000
+#define MAX_QUEUE          4096
+
+
+/*****************************************************************************
+   LOCAL/STATIC DEFINITIONS
+ *****************************************************************************/
+
+// the <hello> of a shared connection says how many channels it takes
+static const char shared_capability[] =
+    "urn:juniper:params:netconf:capability:shared-connection:1.0?channels=";
+
+enum PATH { PATH_SSHD_EXEC, PATH_IN_PROCESS, PATH_SHARED };
+
+typedef struct PathResult PathResult;
+struct PathResult {
+    bool     ok;
+    long     kb;               // for every app's session, over the idle ncchd's
+    uint32_t ssh_sessions;     // connections to get them up
+    double   handshakes;       // connections per NETCONF session, cycling
+};
+
+static const char close_session[] =
+    "<rpc message-id=\"101\" xmlns=\"urn:ietf:params:xml:ns:netconf:base:1.0\">\n"
+    "  <close-session/>\n"
+    "</rpc>\n"
+    "]]>]]>\n";
+
+// accepted connections waiting for a worker
+static pthread_mutex_t queue_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t  queue_cond = PTHREAD_COND_INITIALIZER;
+static int             queue[MAX_QUEUE];
+static int             queue_len = 0;
+
+// sessions held open, in the memory phase, and the apps they serve
+static pthread_mutex_t held_lock = PTHREAD_MUTEX_INITIALIZER;
+static ssh_session*    held = NULL;
+static int             num_held = 0;
+static int             held_apps = 0;
+
+static int             listen_fds[MAX_ENDPOINTS];
+static int             num_endpoints = 0;
+static ssh_key         nms_key = NULL;
+static char            user[64];
+static _Atomic int     holding = 0;      // hold sessions rather than close them
+static _Atomic int     counting = 0;     // count completed sessions
+static _Atomic uint32_t completed = 0;
+static _Atomic uint32_t failed = 0;
+static _Atomic uint32_t accepted = 0;
+
+
+// read from the channel until the end of a NETCONF 1.0 message, setting
+// `channels` (if not NULL) to those a shared connection's <hello> offers,
+// 1 if it doesn't
+static int // 0=OK, 1=ERROR
+read_message(ssh_channel channel, int* channels) {
+    char   buf[4096];
+    size_t used = 0;
+    int    len;
+    char*  cap;
+
+    if (channels != NULL) {
+        *channels = 1;
+    }
+    for (;;) {
+        len = ssh_channel_read_timeout(channel, buf + used, sizeof(buf) - 1 - used,
+                                       0, READ_TIMEOUT_MSECS);
+        if (len <= 0) {
+            return 1;
+        }
+        used += (size_t)len;
+        buf[used] = '\0';
+        if (strstr(buf, "]]>]]>") != NULL) {
+            // a <hello> fits in the buffer
+            if (channels != NULL && (cap = strstr(buf, shared_capability)) != NULL) {
+                *channels = atoi(cap + sizeof(shared_capability) - 1);
+            }
+            return 0;
+        }
+        if (used > sizeof(buf) / 2) {
+            // keep the tail, the marker may straddle reads
+            memmove(buf, buf + used - 8, 8);
+            used = 8;
+        }
+    }
+}
+
+
+// be the NMS on an accepted connection: a NETCONF session up to the
+// <hello> on each channel it may open, then held or closed
+static void
+nms_session(int fd) {
+    ssh_session session = ssh_new();
+    ssh_channel channel = NULL;
+    ssh_channel channels[SSH_CHANNELS_MAX];
+    bool        process_config = false;
+    socket_t    sock = fd;
+    int         num_channels = 0;
+    int         offered = 1;
+    int         idx;
+
+    if (session == NULL) {
+        close(fd);
+        atomic_fetch_add(&failed, 1);
+        return;
+    }
+    ssh_options_set(session, SSH_OPTIONS_FD, &sock);
+    ssh_options_set(session, SSH_OPTIONS_HOST, "ncchd");
+    ssh_options_set(session, SSH_OPTIONS_USER, user);
+    ssh_options_set(session, SSH_OPTIONS_PROCESS_CONFIG, &process_config);
+
+    // ncchd's host key isn't checked, this measures its cost, not trust
+    if (ssh_connect(session) != SSH_OK ||
+        ssh_userauth_publickey(session, NULL, nms_key) != SSH_AUTH_SUCCESS) {
+        goto failed;
+    }
+    // a shared connection's first <hello> says how many more to open
+    while (num_channels < offered && num_channels < SSH_CHANNELS_MAX) {
+        if ((channel = ssh_channel_new(session)) == NULL) {
+            goto failed;
+        }
+        channels[num_channels++] = channel;
+        if (ssh_channel_open_session(channel) != SSH_OK ||
+            ssh_channel_request_subsystem(channel, "netconf") != SSH_OK ||
+            read_message(channel, num_channels == 1 ? &offered : NULL) != 0) {
+            goto failed;
+        }
+    }
+
+    if (atomic_load(&holding)) {
+        pthread_mutex_lock(&held_lock);
+        held[num_held++] = session;   // and its channels
+        held_apps += num_channels;
+        pthread_mutex_unlock(&held_lock);
+        return;
+    }
+    for (idx=0; idx<num_channels; idx++) {
+        if (ssh_channel_write(channels[idx], close_session, sizeof(close_session) - 1) < 0 ||
+            read_message(channels[idx], NULL) != 0) {
+            goto failed;
+        }
+        if (atomic_load(&counting)) {
+            atomic_fetch_add(&completed, 1);
+        }
+    }
+    for (idx=0; idx<num_channels; idx++) {
+        ssh_channel_send_eof(channels[idx]);
+        ssh_channel_close(channels[idx]);
+        ssh_channel_free(channels[idx]);
+    }
+    ssh_disconnect(session);
+    ssh_free(session);
+    return;
+
+failed:
+    if (atomic_load(&counting)) {
+        atomic_fetch_add(&failed, 1);
+    }
+    for (idx=0; idx<num_channels; idx++) {
+        ssh_channel_free(channels[idx]);
+    }
+    ssh_disconnect(session);
+    ssh_free(session);
+}
+
+
+static void*
+nms_worker(void* arg) {
+    (void)arg;
+    for (;;) {
+        int fd;
+
+        pthread_mutex_lock(&queue_lock);
+        while (queue_len == 0) {
+            pthread_cond_wait(&queue_cond, &queue_lock);
+        }
+        fd = queue[--queue_len];
+        pthread_mutex_unlock(&queue_lock);
+        nms_session(fd);
+    }
+    return NULL;
+}
+
+
+static void*
+nms_accept(void* arg) {
+    struct pollfd fds[MAX_ENDPOINTS];
+    int           idx;
+
+    (void)arg;
+    for (idx=0; idx<num_endpoints; idx++) {
+        fds[idx].fd = listen_fds[idx];
+        fds[idx].events = POLLIN;
+    }
+    for (;;) {
+        if (poll(fds, num_endpoints, -1) <= 0) {
+            continue;
+        }
+        for (idx=0; idx<num_endpoints; idx++) {
+            int fd;
+
+            if (!(fds[idx].revents & POLLIN) ||
+                (fd = accept4(fds[idx].fd, NULL, NULL, SOCK_CLOEXEC)) == -1) {
+                continue;
+            }
+            atomic_fetch_add(&accepted, 1);
+            pthread_mutex_lock(&queue_lock);
+            if (queue_len == MAX_QUEUE) {
+                close(fd);
+            } else {
+                queue[queue_len++] = fd;
+                pthread_cond_signal(&queue_cond);
+            }
+            pthread_mutex_unlock(&queue_lock);
+        }
+    }
+    return NULL;
+}
+
+
+// close every held session
+static void
+release_held(void) {
+    int idx;
+
+    pthread_mutex_lock(&held_lock);
+    for (idx=0; idx<num_held; idx++) {
+        ssh_disconnect(held[idx]);
+        ssh_free(held[idx]);
+    }
+    num_held = 0;
+    held_apps = 0;
+    pthread_mutex_unlock(&held_lock);
+}
+
+
+// the apps whose session is up and held
+static int
+held_count(void) {
+    int count;
+
+    pthread_mutex_lock(&held_lock);
+    count = held_apps;
+    pthread_mutex_unlock(&held_lock);
+    return count;
+}
+
+
+// the process's proportional set size in kB, its RSS if the kernel
+// has no smaps_rollup
+static long
+process_kb(pid_t pid) {
+    char  path[64];
+    char  line[256];
+    FILE* file;
+    long  kb = 0;
+
+    snprintf(path, sizeof(path), "/proc/%d/smaps_rollup", (int)pid);
+    if ((file = fopen(path, "r")) != NULL) {
+        while (fgets(line, sizeof(line), file) != NULL) {
+            if (sscanf(line, "Pss: %ld kB", &kb) == 1) {
+                break;
+            }
+        }
+        fclose(file);
+        return kb;
+    }
+    snprintf(path, sizeof(path), "/proc/%d/status", (int)pid);
+    if ((file = fopen(path, "r")) != NULL) {
+        while (fgets(line, sizeof(line), file) != NULL) {
+            if (sscanf(line, "VmRSS: %ld kB", &kb) == 1) {
+                break;
+            }
+        }
+        fclose(file);
+    }
+    return kb;
+}
+
+
+static pid_t
+parent_of(pid_t pid) {
+    char  path[64];
+    char  stat[512];
+    char* close_paren;
+    FILE* file;
+    int   ppid = -1;
+
+    snprintf(path, sizeof(path), "/proc/%d/stat", (int)pid);
+    if ((file = fopen(path, "r")) == NULL) {
+        return -1;
+    }
+    if (fgets(stat, sizeof(stat), file) != NULL &&
+        (close_paren = strrchr(stat, ')')) != NULL) {
+        sscanf(close_paren + 1, " %*c %d", &ppid);
+    }
+    fclose(file);
+    return (pid_t)ppid;
+}
+
+
+// memory of `root` and all its descendants, in kB
+static long
+tree_kb(pid_t root) {
+    DIR*           dir = opendir("/proc");
+    struct dirent* entry;
+    long           kb = 0;
+
+    if (dir == NULL) {
+        return 0;
+    }
+    while ((entry = readdir(dir)) != NULL) {
+        pid_t pid = (pid_t)atoi(entry->d_name);
+        pid_t up = pid;
+        int   depth;
+
+        // walk up a few generations: ncchd, sshd, its session child, netconfd
+        for (depth=0; up>1 && up!=root && depth<8; depth++) {
+            up = parent_of(up);
+        }
+        if (pid > 0 && up == root) {
+            kb += process_kb(pid);
+        }
+    }
+    closedir(dir);
+    return kb;
+}
+
+
+// a config.xml of `num_apps` apps calling home to `ports`, the first
+// per_endpoint to the first, and so on
+static int // 0=OK, 1=ERROR
+write_config(int num_apps, int per_endpoint, const uint16_t* ports, enum PATH path) {
+    FILE*       file = bench_config_open();
+    const char* transport = "";
+    int         idx;
+
+    if (path == PATH_IN_PROCESS) {
+        transport = "<in-process/>";
+    } else if (path == PATH_SHARED) {
+        transport = "<in-process/><shared-connection/>";
+    }
+    if (file == NULL) {
+        return 1;
+    }
+    for (idx=0; idx<num_apps; idx++) {
+        fprintf(file,
+                "      <application>\n"
+                "        <name>app-%d</name>\n"
+                "        <servers>\n"
+                "          <server><address>127.0.0.1</address><port>%u</port></server>\n"
+                "        </servers>\n"
+                "        <transport><ssh>"
+                "<host-keys><host-key><name>hostkey</name></host-key></host-keys>"
+                "<crypto-profile><x509-key-algorithm>none</x509-key-algorithm></crypto-profile>"
+                "%s</ssh></transport>\n"
+                "        <reconnect-strategy>\n"
+                "           <interval-secs>0</interval-secs>\n"
+                "           <count-max>1</count-max>\n"
+                "        </reconnect-strategy>\n"
+                "      </application>\n",
+                idx, ports[idx / per_endpoint], transport);
+    }
+    return bench_config_close(file);
+}
+
+
+/*****************************************************************************
+   BENCHMARK
+ *****************************************************************************/
+
+static pid_t // -1 on error
+start_ncchd(const char* ncchd, const char* authorized_keys) {
+    return bench_start_ncchd(ncchd, "NCCHD_LOG_LEVEL", "error",  // not every session
+                             "NCCHD_CONNECT_RATE", "0",          // reconnect as fast as they can
+                             "NCCHD_MAX_HANDSHAKES", "0",
+                             "NCCHD_AUTHORIZED_KEYS", authorized_keys,
+                             (char*)NULL);
+}
+
+
+static void
+bench_path(const char* ncchd, const char* authorized_keys, int num_apps, int per_endpoint,
+           int seconds, const uint16_t* ports, const uint16_t* closed_ports, enum PATH path,
+           PathResult* result) {
+    const char* names[] = { "sshd-exec", "in-process", "in-process-shared" };
+    const char* name = names[path];
+    long        idle_kb;
+    long        held_kb;
+    int64_t     deadline;
+    int64_t     started;
+    uint32_t    done;
+    uint32_t    handshakes;
+    pid_t       pid;
+
+    memset(result, 0, sizeof(PathResult));
+
+    // ncchd on its own: nothing answers, so no sessions
+    if (write_config(num_apps, per_endpoint, closed_ports, path) != 0 ||
+        (pid = start_ncchd(ncchd, authorized_keys)) == -1) {
+        printf("  {\"path\": \"%s\", \"error\": \"could not start ncchd\"}", name);
+        return;
+    }
+    sleep(IDLE_SECONDS);
+    idle_kb = tree_kb(pid);
+    bench_stop_ncchd(pid);
+
+    // every app's session held open
+    atomic_store(&holding, 1);
+    atomic_store(&accepted, 0);
+    if (write_config(num_apps, per_endpoint, ports, path) != 0 ||
+        (pid = start_ncchd(ncchd, authorized_keys)) == -1) {
+        printf("  {\"path\": \"%s\", \"error\": \"could not start ncchd\"}", name);
+        return;
+    }
+    deadline = bench_now_ms() + CONNECT_SECONDS * 1000;
+    while (held_count() < num_apps && bench_now_ms() < deadline) {
+        usleep(100000);
+    }
+    if (held_count() < num_apps) {
+        printf("  {\"path\": \"%s\", \"error\": \"only %d of %d sessions came up, see ncchd.log\"}",
+               name, held_count(), num_apps);
+        atomic_store(&holding, 0);
+        release_held();
+        bench_stop_ncchd(pid);
+        return;
+    }
+    usleep(200000);  // netconfd may still be exiting... or starting
+    held_kb = tree_kb(pid);
+    result->ssh_sessions = atomic_load(&accepted);
+
+    // then every session closed as soon as it's up, over and over
+    atomic_store(&holding, 0);
+    atomic_store(&completed, 0);
+    atomic_store(&failed, 0);
+    atomic_store(&accepted, 0);
+    atomic_store(&counting, 1);
+    release_held();
+    started = bench_now_ms();
+    sleep((unsigned int)seconds);
+    atomic_store(&counting, 0);
+    done = atomic_load(&completed);
+    handshakes = atomic_load(&accepted);
+    result->ok = true;
+    result->kb = held_kb - idle_kb;
+    result->handshakes = done ? (double)handshakes / done : 0;
+    printf("  {\"path\": \"%s\", \"apps\": %d, \"apps_per_endpoint\": %d, "
+           "\"ssh_sessions\": %u, \"kb_per_session\": %.1f, \"sessions_per_sec\": %.1f, "
+           "\"handshakes_per_session\": %.2f, \"failed\": %u}",
+           name, num_apps, per_endpoint, result->ssh_sessions,
+           (double)result->kb / num_apps, done * 1000.0 / (double)(bench_now_ms() - started),
+           result->handshakes, atomic_load(&failed));
+    fflush(stdout);
+    bench_stop_ncchd(pid);
+}
+
+
+/*****************************************************************************
+   MAIN
+ *****************************************************************************/
+
+int main(int argc, char* argv[]) {
+    int            num_apps = DEFAULT_APPS;
+    int            seconds = DEFAULT_SECONDS;
+    const char*    ncchd_arg = DEFAULT_NCCHD;
+    int            per_endpoint = DEFAULT_PER_ENDPOINT;
+    char           ncchd[PATH_MAX];
+    char           ncchd_dir[PATH_MAX];
+    char           dir[PATH_MAX];
+    char           authorized_keys[PATH_MAX + 32];
+    char           command[PATH_MAX * 3];
+    struct passwd* pwd = getpwuid(getuid());
+    uint16_t       ports[MAX_ENDPOINTS];
+    uint16_t       closed_ports[MAX_ENDPOINTS];
+    PathResult     results[3];
+    pthread_t      thread;
+    int            closed_fd;
+    int            idx;
+
+    if (argc > 1) {
+        num_apps = atoi(argv[1]);
+    }
+    if (argc > 2) {
+        seconds = atoi(argv[2]);
+    }
+    if (argc > 3) {
+        ncchd_arg = argv[3];
+    }
+    if (argc > 4) {
+        per_endpoint = atoi(argv[4]);
+    }
+    if (num_apps <= 0 || num_apps > MAX_QUEUE || seconds <= 0 ||
+        per_endpoint <= 0 || per_endpoint > SSH_CHANNELS_MAX ||
+        (num_endpoints = (num_apps + per_endpoint - 1) / per_endpoint) > MAX_ENDPOINTS) {
+        printf("usage: %s [num-apps [seconds [path-to-ncchd [apps-per-endpoint]]]]\n", argv[0]);
+        return 1;
+    }
+    if (bench_find_ncchd("transport", ncchd_arg, ncchd) != 0) {
+        return 1;
+    }
+    if (pwd == NULL) {
+        printf("{\"benchmark\": \"transport\", \"error\": \"who am I?\"}\n");
+        return 1;
+    }
+    snprintf(user, sizeof(user), "%s", pwd->pw_name);
+    snprintf(ncchd_dir, sizeof(ncchd_dir), "%s", ncchd);
+    signal(SIGPIPE, SIG_IGN);
+
+    held = (ssh_session*)calloc(num_apps, sizeof(ssh_session));
+    if (held == NULL || getcwd(dir, sizeof(dir) - 32) == NULL) {
+        printf("{\"benchmark\": \"transport\", \"error\": \"out of memory\"}\n");
+        return 1;
+    }
+    strcat(dir, "/bench_transport.XXXXXX");
+    if (bench_scratch_open(dir) != 0) {
+        printf("{\"benchmark\": \"transport\", \"error\": \"could not set up a scratch directory\"}\n");
+        return 1;
+    }
+    // the exec path's sshd runs netconfd from ncchd's cwd
+    snprintf(command, sizeof(command),
+             "ssh-keygen -q -N '' -m PEM -t ecdsa -b 256 -f hostkey && "
+             "ssh-keygen -q -N '' -m PEM -t ecdsa -b 256 -f nms_key && "
+             "cp nms_key.pub authorized_keys && chmod 600 authorized_keys && "
+             "ln -s %s/netconfd netconfd", dirname(ncchd_dir));
+    if (system(command) != 0 ||
+        ssh_pki_import_privkey_file("nms_key", NULL, NULL, NULL, &nms_key) != SSH_OK) {
+        printf("{\"benchmark\": \"transport\", \"error\": \"could not make keys\"}\n");
+        return 1;
+    }
+    snprintf(authorized_keys, sizeof(authorized_keys), "%s/authorized_keys", dir);
+
+    // a port nothing listens on, for the idle ncchd
+    closed_fd = bench_listen_loopback(&closed_ports[0]);
+    if (closed_fd == -1) {
+        printf("{\"benchmark\": \"transport\", \"error\": \"could not listen on loopback\"}\n");
+        return 1;
+    }
+    close(closed_fd);
+    for (idx=0; idx<num_endpoints; idx++) {
+        closed_ports[idx] = closed_ports[0];
+        if ((listen_fds[idx] = bench_listen_loopback(&ports[idx])) == -1) {
+            printf("{\"benchmark\": \"transport\", \"error\": \"could not listen on loopback\"}\n");
+            return 1;
+        }
+    }
+    if (pthread_create(&thread, NULL, nms_accept, NULL) != 0) {
+        printf("{\"benchmark\": \"transport\", \"error\": \"could not start the NMS\"}\n");
+        return 1;
+    }
+    for (idx=0; idx<NMS_WORKERS; idx++) {
+        if (pthread_create(&thread, NULL, nms_worker, NULL) != 0) {
+            printf("{\"benchmark\": \"transport\", \"error\": \"could not start the NMS\"}\n");
+            return 1;
+        }
+    }
+
+    printf("{\"benchmark\": \"transport\", \"results\": [\n");
+    for (idx=PATH_SSHD_EXEC; idx<=PATH_SHARED; idx++) {
+        bench_path(ncchd, authorized_keys, num_apps, per_endpoint, seconds, ports, closed_ports,
+                   (enum PATH)idx, &results[idx]);
+        printf(idx < PATH_SHARED ? ",\n" : "\n]");
+    }
+    // what sharing the connection saved
+    if (results[PATH_IN_PROCESS].ok && results[PATH_SHARED].ok) {
+        printf(",\n \"shared_saved\": {\"ssh_sessions\": %d, \"handshakes_per_session\": %.2f, "
+               "\"kb\": %ld}",
+               (int)results[PATH_IN_PROCESS].ssh_sessions - (int)results[PATH_SHARED].ssh_sessions,
+               results[PATH_IN_PROCESS].handshakes - results[PATH_SHARED].handshakes,
+               results[PATH_IN_PROCESS].kb - results[PATH_SHARED].kb);
+    }
+    printf("}\n");
+
+    bench_scratch_close(dir, 1);
+    return 0;
+}
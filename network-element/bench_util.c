@@ -0,0 +1,306 @@
+/*****************************************************************************
+Copyright (c) 2014-2016, Juniper Networks, Inc.
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions
+are met:
+
+1. Redistributions of source code must retain the above copyright 
+   notice, this list of conditions and the following disclaimer.
+
+2. Redistributions in binary form must reproduce the above copyright
+   notice, this list of conditions and the following disclaimer in the
+   documentation and/or other materials provided with the distribution.
+
+3. Neither the name of the copyright holder nor the names of its 
+   contributors may be used to endorse or promote products derived 
+   from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS 
+"AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT 
+LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS 
+FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE 
+COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, 
+INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, 
+BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; 
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER 
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT 
+LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN 
+ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE 
+POSSIBILITY OF SUCH DAMAGE.
+ *****************************************************************************/
+
+
+
+/*****************************************************************************
+   OVERVIEW
+
+   This file implements what the benchmarks share, declared in
+   bench_util.h.  All of them time with the monotonic clock
+   (bench_now_ns() and friends), and the ones reporting percentiles sort
+   their samples with bench_compare_ns().  Most of the rest is the
+   harness of the benchmarks that run the real ncchd binary rather than
+   link its code.
+
+   Each runs ncchd in a scratch directory (bench_scratch_open()), which
+   is removed afterwards unless the run failed, so its ncchd.log can be
+   looked at.  The config.xml there is the benchmark's own: its apps call
+   home to NMSs the benchmark plays itself, on loopback ports
+   (bench_listen_loopback()).  Most use relay-mode apps (see relay.c),
+   which keep sshd's fork/exec and handshake out of the numbers, where
+   they'd dominate; an NMS that only counts connections accepts and
+   resets them (bench_accept_and_reset()), leaving no TIME_WAIT behind,
+   so a long run doesn't run out of loopback ports.
+
+   ncchd is started with its output appended to ncchd.log and the
+   environment the benchmark asks for (NCCHD_WORKERS, NCCHD_LOG_LEVEL,
+   ...), and stopped with SIGINT, which it must exit 0 on.
+
+   The benchmarks of netconf.c and netconfd (bench_get_config and
+   bench_netconfd) serve a config.xml of apps shaped like a deployment's
+   instead (bench_write_config()).
+ *****************************************************************************/
+
+
+/*****************************************************************************
+   INCLUDES AND EXTERNS
+ *****************************************************************************/
+
+#define _GNU_SOURCE  // accept4()
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdarg.h>
+#include <string.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include "bench_util.h"
+
+
+/*****************************************************************************
+   EXTERNS
+ *****************************************************************************/
+
+int64_t
+bench_now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+
+int64_t
+bench_now_us(void) {
+    return bench_now_ns() / 1000;
+}
+
+
+int64_t
+bench_now_ms(void) {
+    return bench_now_ns() / 1000000;
+}
+
+
+// qsort() order for int64_t times
+int
+bench_compare_ns(const void* a, const void* b) {
+    int64_t x = *(const int64_t*)a;
+    int64_t y = *(const int64_t*)b;
+    return (x > y) - (x < y);
+}
+
+
+int // -1 on error, listening socket otherwise
+bench_listen_loopback(uint16_t* port) {
+    struct sockaddr_in addr;
+    socklen_t          len = sizeof(addr);
+    int                fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+
+    if (fd == -1) {
+        return -1;
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (bind(fd, (struct sockaddr*)&addr, sizeof(addr)) != 0 ||
+        listen(fd, 4096) != 0 ||
+        getsockname(fd, (struct sockaddr*)&addr, &len) != 0) {
+        close(fd);
+        return -1;
+    }
+    *port = ntohs(addr.sin_port);
+    return fd;
+}
+
+
+// accept a connection and reset it, leaving no TIME_WAIT behind
+int // 0=OK, -1 if accept() failed
+bench_accept_and_reset(int listen_fd) {
+    struct linger linger = { 1, 0 };
+    int           fd = accept4(listen_fd, NULL, NULL, SOCK_CLOEXEC);
+
+    if (fd == -1) {
+        return -1;
+    }
+    setsockopt(fd, SOL_SOCKET, SO_LINGER, &linger, sizeof(linger));
+    close(fd);
+    return 0;
+}
+
+
+// the absolute path of the ncchd binary `arg` (`ncchd` has room for
+// PATH_MAX), printing the benchmark's JSON error if there's none
+int // 0=OK, 1=ERROR
+bench_find_ncchd(const char* benchmark, const char* arg, char* ncchd) {
+    if (realpath(arg, ncchd) == NULL || access(ncchd, X_OK) != 0) {
+        printf("{\"benchmark\": \"%s\", \"error\": \"no ncchd at \\\"%s\\\"\"}\n",
+               benchmark, arg);
+        return 1;
+    }
+    return 0;
+}
+
+
+// make a directory from the mkdtemp() template `dir`, and move into it
+int // 0=OK, 1=ERROR
+bench_scratch_open(char* dir) {
+    return (mkdtemp(dir) == NULL || chdir(dir) != 0) ? 1 : 0;
+}
+
+
+// remove the scratch directory, unless the run failed (`ok` 0)
+void
+bench_scratch_close(const char* dir, int ok) {
+    char command[PATH_MAX + 16];
+
+    if (!ok) {
+        fprintf(stderr, "run failed, ncchd.log kept in \"%s\"\n", dir);
+        return;
+    }
+    snprintf(command, sizeof(command), "rm -rf %s", dir);
+    if (chdir("/") != 0 || system(command) != 0) {
+        fprintf(stderr, "could not remove \"%s\"\n", dir);
+    }
+}
+
+
+// forget what the last ncchd run left behind: state files, sockets
+int // 0=OK, 1=ERROR
+bench_clear_state(void) {
+    return system("rm -f .*.state .ncchd.*") == 0 ? 0 : 1;
+}
+
+
+// start a config.xml, the caller writing its <application>s
+FILE* // NULL on error
+bench_config_open(void) {
+    FILE* file = fopen("config.xml", "w");
+
+    if (file != NULL) {
+        fprintf(file, "<netconf xmlns=\"urn:ietf:params:xml:ns:yang:ietf-netconf-server\">\n"
+                      "  <call-home>\n"
+                      "    <applications>\n");
+    }
+    return file;
+}
+
+
+int // 0=OK, 1=ERROR
+bench_config_close(FILE* file) {
+    fprintf(file, "    </applications>\n"
+                  "  </call-home>\n"
+                  "</netconf>\n");
+    return fclose(file) == 0 ? 0 : 1;
+}
+
+
+// A config.xml at `path` of `num_apps` apps as a deployment might have
+// them (two servers, a host key, keep-alive and reconnect strategies),
+// for the benchmarks that read or serve one rather than run ncchd on it.
+int // 0=OK, 1=ERROR
+bench_write_config(const char* path, int num_apps) {
+    FILE* file = fopen(path, "w");
+    int   idx;
+
+    if (file == NULL) {
+        return 1;
+    }
+    fprintf(file, "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n"
+                  "<netconf xmlns=\"urn:ietf:params:xml:ns:yang:ietf-netconf-server\">\n"
+                  "  <call-home>\n"
+                  "    <applications>\n");
+    for (idx=0; idx<num_apps; idx++) {
+        fprintf(file,
+                "      <application>\n"
+                "        <name>app-%d</name>\n"
+                "        <servers>\n"
+                "          <server><address>10.%d.%d.%d</address><port>4334</port></server>\n"
+                "          <server><address>nms-backup.example.com</address></server>\n"
+                "        </servers>\n"
+                "        <transport><ssh><host-keys>"
+                "<host-key><name>ssh_hostkey.pem</name></host-key>"
+                "</host-keys></ssh></transport>\n"
+                "        <keep-alive-strategy><interval-secs>15</interval-secs>"
+                "<count-max>3</count-max></keep-alive-strategy>\n"
+                "        <reconnect-strategy><start-with>last-connected</start-with>"
+                "<interval-secs>5</interval-secs><count-max>3</count-max></reconnect-strategy>\n"
+                "      </application>\n",
+                idx, (idx >> 16) & 0xff, (idx >> 8) & 0xff, idx & 0xff);
+    }
+    fprintf(file, "    </applications>\n"
+                  "  </call-home>\n"
+                  "</netconf>\n");
+    return fclose(file) == 0 ? 0 : 1;
+}
+
+
+// Start ncchd in the scratch directory, with the environment variables
+// given as name, value pairs ending with NULL, e.g.
+//
+//     bench_start_ncchd(ncchd, "NCCHD_LOG_LEVEL", "error", (char*)NULL)
+pid_t // -1 on error
+bench_start_ncchd(const char* ncchd, ...) {
+    pid_t pid = fork();
+
+    if (pid == 0) {
+        int         log_fd = open("ncchd.log", O_WRONLY | O_CREAT | O_APPEND, 0644);
+        const char* name;
+        va_list     args;
+
+        if (log_fd != -1) {
+            dup2(log_fd, STDOUT_FILENO);
+            dup2(log_fd, STDERR_FILENO);
+        }
+        va_start(args, ncchd);
+        while ((name = va_arg(args, const char*)) != NULL) {
+            setenv(name, va_arg(args, const char*), 1);
+        }
+        va_end(args);
+        execl(ncchd, ncchd, (char*)NULL);
+        _exit(1);
+    }
+    return pid;
+}
+
+
+// stop ncchd, as Ctrl-C would
+int // 0=OK, 1 if it didn't exit cleanly
+bench_stop_ncchd(pid_t pid) {
+    int status;
+
+    kill(pid, SIGINT);
+    if (waitpid(pid, &status, 0) != pid || !WIFEXITED(status) ||
+        WEXITSTATUS(status) != 0) {
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,67 @@
+/*****************************************************************************
+Copyright (c) 2014-2016, Juniper Networks, Inc.
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions
+are met:
+
+1. Redistributions of source code must retain the above copyright 
+   notice, this list of conditions and the following disclaimer.
+
+2. Redistributions in binary form must reproduce the above copyright
+   notice, this list of conditions and the following disclaimer in the
+   documentation and/or other materials provided with the distribution.
+
+3. Neither the name of the copyright holder nor the names of its 
+   contributors may be used to endorse or promote products derived 
+   from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS 
+"AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT 
+LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS 
+FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE 
+COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, 
+INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, 
+BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; 
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER 
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT 
+LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN 
+ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE 
+POSSIBILITY OF SUCH DAMAGE.
+ *****************************************************************************/
+
+
+
+/*****************************************************************************
+   OVERVIEW
+
+   This header file declares what the benchmarks share, see
+   bench_util.c: the clocks and sort order they all time with, the
+   harness of the ones that run the real ncchd binary (bench_shards,
+   bench_admission, bench_restart, bench_select, bench_transport, and
+   test_control), and the config.xml that bench_get_config and
+   bench_netconfd serve.
+ *****************************************************************************/
+
+
+/*****************************************************************************
+   EXTERNS
+ *****************************************************************************/
+
+// needs stdio.h and sys/types.h
+extern int64_t bench_now_ns(void);
+extern int64_t bench_now_us(void);
+extern int64_t bench_now_ms(void);
+extern int     bench_compare_ns(const void* a, const void* b);
+extern int     bench_listen_loopback(uint16_t* port);
+extern int     bench_accept_and_reset(int listen_fd);
+extern int     bench_find_ncchd(const char* benchmark, const char* arg, char* ncchd);
+extern int     bench_scratch_open(char* dir);
+extern void    bench_scratch_close(const char* dir, int ok);
+extern int     bench_clear_state(void);
+extern FILE*   bench_config_open(void);
+extern int     bench_config_close(FILE* file);
+extern int     bench_write_config(const char* path, int num_apps);
+extern pid_t   bench_start_ncchd(const char* ncchd, ...);
+extern int     bench_stop_ncchd(pid_t pid);
@@ -0,0 +1,192 @@
+/*****************************************************************************
+Copyright (c) 2014-2016, Juniper Networks, Inc.
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions
+are met:
+
+1. Redistributions of source code must retain the above copyright 
+   notice, this list of conditions and the following disclaimer.
+
+2. Redistributions in binary form must reproduce the above copyright
+   notice, this list of conditions and the following disclaimer in the
+   documentation and/or other materials provided with the distribution.
+
+3. Neither the name of the copyright holder nor the names of its 
+   contributors may be used to endorse or promote products derived 
+   from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS 
+"AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT 
+LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS 
+FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE 
+COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, 
+INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, 
+BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; 
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER 
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT 
+LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN 
+ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE 
+POSSIBILITY OF SUCH DAMAGE.
+ *****************************************************************************/
+
+
+
+/*****************************************************************************
+   OVERVIEW
+
+   This file implements the server-health table declared in breaker.h.
+
+   Each server an app has tried gets a circuit breaker, found by its
+   (interned) address and port in a hash table:
+
+     closed     connects go ahead; after NCCHD_BREAKER_FAILURES failures
+                in a row, from whichever apps, it opens
+     open       connects are skipped (and counted) until the open period
+                is over, then the next connect is let through as a trial
+                and the breaker is half-open
+     half-open  others are still skipped while the trial is out; if it
+                succeeds the breaker closes, if it fails it opens again
+                for twice as long (up to BREAKER_MAX_OPEN_MSECS)
+
+   Any success closes the breaker, so a connect that was already in
+   flight when it opened counts too.  A trial whose app went away without
+   reporting is given up on after BREAKER_TRIAL_MSECS.
+
+   The table is shared by ncchd's shard threads, so every call takes
+   `table_lock`.  It's only consulted once per connect attempt, never on
+   a session's path.  Entries (in a server_table.h table) hold a
+   reference on their address string and live until breaker_clear();
+   there's one per distinct server ever configured.
+ *****************************************************************************/
+
+
+/*****************************************************************************
+   INCLUDES AND EXTERNS
+ *****************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include "ncchd.h"
+#include "breaker.h"
+#include "server_table.h"
+#include "log.h"
+
+
+/*****************************************************************************
+   LOCAL/STATIC DEFINITIONS
+ *****************************************************************************/
+
+typedef struct Breaker Breaker;
+struct Breaker {
+    ServerEntry server;
+    uint8_t     state;          // enum BREAKER_STATE
+    uint32_t    failures;       // in a row
+    int64_t     open_ms;        // length of the current/last open period
+    int64_t     until_ms;       // open until, or the trial's deadline
+    uint64_t    avoided;        // connects skipped since it last opened
+};
+
+static pthread_mutex_t table_lock = PTHREAD_MUTEX_INITIALIZER;
+static ServerTable     table = SERVER_TABLE_INIT(Breaker);
+static uint32_t        open_after = BREAKER_FAILURES;
+
+
+/*****************************************************************************
+   EXTERNS
+ *****************************************************************************/
+
+// open breakers after `failures` failures in a row, 0 for never
+void
+breaker_init(uint32_t failures) {
+    open_after = failures;
+}
+
+
+// May an app connect to addr:port (interned) now?  If not, the connect
+// is counted as avoided.
+int64_t // 0 if it may, otherwise when to ask again (monotonic ms)
+breaker_check(const char* addr, uint16_t port, int64_t now) {
+    Breaker* breaker;
+    int64_t  result = 0;
+
+    if (open_after == 0) {
+        return 0;
+    }
+    pthread_mutex_lock(&table_lock);
+    breaker = (Breaker*)server_table_find(&table, addr, port);
+    if (breaker != NULL && breaker->state != BREAKER_CLOSED) {
+        if (now >= breaker->until_ms) {
+            // open period over, or the last trial got lost: this is the trial
+            if (breaker->state == BREAKER_OPEN) {
+                log_info("server %s:%u: trying it again (%llu connects avoided)",
+                         addr, port, (unsigned long long)breaker->avoided);
+            }
+            breaker->state = BREAKER_HALF_OPEN;
+            breaker->until_ms = now + BREAKER_TRIAL_MSECS;
+        } else {
+            breaker->avoided++;
+            result = (breaker->state == BREAKER_OPEN) ? breaker->until_ms
+                                                      : now + BREAKER_RECHECK_MSECS;
+        }
+    }
+    pthread_mutex_unlock(&table_lock);
+    return result;
+}
+
+
+// record how a connect to addr:port (interned) went
+void
+breaker_report(const char* addr, uint16_t port, int ok, int64_t now) {
+    Breaker* breaker;
+
+    if (open_after == 0) {
+        return;
+    }
+    pthread_mutex_lock(&table_lock);
+    breaker = (Breaker*)server_table_find(&table, addr, port);
+    if (breaker == NULL) {
+        // nothing to record it in, so it stays closed
+
+    } else if (ok) {
+        if (breaker->state != BREAKER_CLOSED) {
+            log_info("server %s:%u is back, circuit closed (%llu connects avoided)",
+                     addr, port, (unsigned long long)breaker->avoided);
+        }
+        breaker->state = BREAKER_CLOSED;
+        breaker->failures = 0;
+        breaker->open_ms = 0;
+
+    } else if (breaker->state == BREAKER_HALF_OPEN ||
+               (breaker->state == BREAKER_CLOSED && ++breaker->failures >= open_after)) {
+        // a failed trial doubles the open period
+        if (breaker->state == BREAKER_HALF_OPEN) {
+            breaker->open_ms *= 2;
+            if (breaker->open_ms > BREAKER_MAX_OPEN_MSECS) {
+                breaker->open_ms = BREAKER_MAX_OPEN_MSECS;
+            }
+        } else {
+            breaker->open_ms = BREAKER_OPEN_MSECS;
+            breaker->avoided = 0;
+        }
+        breaker->state = BREAKER_OPEN;
+        breaker->until_ms = now + breaker->open_ms;
+        log_warn("server %s:%u failing, circuit open for %llds", addr, port,
+                 (long long)(breaker->open_ms / 1000));
+    }
+    pthread_mutex_unlock(&table_lock);
+}
+
+
+// forget every server
+void
+breaker_clear(void) {
+    pthread_mutex_lock(&table_lock);
+    server_table_clear(&table);
+    pthread_mutex_unlock(&table_lock);
+}
@@ -0,0 +1,73 @@
+/*****************************************************************************
+Copyright (c) 2014-2016, Juniper Networks, Inc.
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions
+are met:
+
+1. Redistributions of source code must retain the above copyright 
+   notice, this list of conditions and the following disclaimer.
+
+2. Redistributions in binary form must reproduce the above copyright
+   notice, this list of conditions and the following disclaimer in the
+   documentation and/or other materials provided with the distribution.
+
+3. Neither the name of the copyright holder nor the names of its 
+   contributors may be used to endorse or promote products derived 
+   from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS 
+"AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT 
+LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS 
+FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE 
+COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, 
+INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, 
+BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; 
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER 
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT 
+LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN 
+ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE 
+POSSIBILITY OF SUCH DAMAGE.
+ *****************************************************************************/
+
+
+
+/*****************************************************************************
+   OVERVIEW
+
+   This header file declares the server-health table: one circuit breaker
+   per NMS (address and port), shared by every app and shard, so that
+   once a server has failed, apps listing it skip it instead of each
+   making its own count-max attempts, until a single trial connect finds
+   it back.
+ *****************************************************************************/
+
+
+/*****************************************************************************
+   MACROS
+ *****************************************************************************/
+
+#define BREAKER_FAILURES       1        // NCCHD_BREAKER_FAILURES, 0 for no breakers
+#define BREAKER_OPEN_MSECS     2000     // first time open, doubles per failed trial
+#define BREAKER_MAX_OPEN_MSECS 60000
+#define BREAKER_TRIAL_MSECS    30000    // a trial not reported by then is retried
+#define BREAKER_RECHECK_MSECS  500      // how soon to ask again during a trial
+
+
+/*****************************************************************************
+   STRUCTS
+ *****************************************************************************/
+
+enum BREAKER_STATE { BREAKER_CLOSED, BREAKER_OPEN, BREAKER_HALF_OPEN };
+
+
+
+/*****************************************************************************
+   EXTERNS
+ *****************************************************************************/
+
+extern void    breaker_init(uint32_t failures);
+extern int64_t breaker_check(const char* addr, uint16_t port, int64_t now);
+extern void    breaker_report(const char* addr, uint16_t port, int ok, int64_t now);
+extern void    breaker_clear(void);
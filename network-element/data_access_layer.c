@@ -43,7 +43,8 @@ POSSIBILITY OF SUCH DAMAGE.
 
   The current implementation uses two files:
 
-    config.xml - the system's current "running" config
+    config.xml - the system's current "running" config, rewritten when
+                 apps are changed through ncchd's control socket
     .<app_name>.state - the persisted operational state for the named app
 
  *****************************************************************************/
@@ -56,103 +57,235 @@ POSSIBILITY OF SUCH DAMAGE.
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
+#include <stddef.h>
 #include <string.h>
 #include <assert.h>    // use -DNDEBUG compiler option to remove asserts
 #include <errno.h>
+#include <limits.h>
 #include <unistd.h>
+#include <sys/types.h>
 #include "roxml.h"
 #include "ncchd.h"
+#include "ssh_profile.h"
+#include "log.h"
 
 
 /*****************************************************************************
    CUSTOMIZABLE DEFINITIONS (modify these for your runtime enviroment)
  *****************************************************************************/
 
-// This routine returns the system's current configuration, same as a
-// NETCONF server's "running" datastore.  The routine is executed once
-// on startup and again for each SIGHUP
-int  // 0 on success, 1 on error
-get_incoming_config(Configuration* incoming_config) {
+// replace the string in `*field` with the interned copy of `content`
+static int  // 0 on success, 1 on error
+intern_field(const char **field, const char *content) {
+    const char *interned = intern_string(content);
 
-    // This reference implementation simply reads the configuration 
-    // from a local file called "config.xml" and builds an C-based
-    // in-memory datastructure.
+    if (interned == NULL) {
+        log_error("could not intern \"%s\"", content);
+        return 1;
+    }
+    intern_release(*field);
+    *field = interned;
+    return 0;
+}
 
-    node_t *root = roxml_load_doc("config.xml");
-    node_t *cur_node;
-    cur_node = roxml_get_chld(root, NULL, 0);      // <netconf>
-    cur_node = roxml_get_chld(cur_node, NULL, 0);  // <call-home>
-    cur_node = roxml_get_chld(cur_node, NULL, 0);  // <applications>
 
-    incoming_config->num_apps = roxml_get_chld_nb(cur_node);
-    incoming_config->apps = (Application*)calloc(incoming_config->num_apps, sizeof(Application));
-    if (incoming_config->apps == NULL) {
-        printf("could not alloc apps struct\n");
-        roxml_release(RELEASE_ALL);
-        roxml_close(root);
-        return 1;
+
+// fill in `profile` from a <crypto-profile> element
+static int  // 0 on success, 1 on error
+parse_crypto_profile(node_t *profile_node, SshCryptoProfile *profile) {
+    int idx;
+
+    for (idx=0; idx<roxml_get_chld_nb(profile_node); idx++) {
+        node_t     *cur_node = roxml_get_chld(profile_node, NULL, idx);
+        const char *name = roxml_get_name(cur_node, NULL, 0);
+        node_t     *text = roxml_get_txt(cur_node, 0);
+        const char *content = roxml_get_content(text, NULL, 0, NULL);
+        const char **field = NULL;
+
+        if (strcmp("kex", name)==0) {
+            field = &profile->kex;
+        } else if (strcmp("ciphers", name)==0) {
+            field = &profile->ciphers;
+        } else if (strcmp("macs", name)==0) {
+            field = &profile->macs;
+        } else if (strcmp("host-key-algorithms", name)==0) {
+            field = &profile->host_key_algorithms;
+        } else if (strcmp("x509-key-algorithm", name)==0) {
+            field = &profile->x509_key_algorithm;
+        } else if (strcmp("compression", name)==0) {
+            if (strcmp("no", content)==0) {
+                profile->compression = COMPRESSION_NO;
+            } else if (strcmp("yes", content)==0) {
+                profile->compression = COMPRESSION_YES;
+            } else if (strcmp("delayed", content)==0) {
+                profile->compression = COMPRESSION_DELAYED;
+            } else {
+                log_error("Unrecognized crypto-profile compression in config file (%s)", content);
+                return 1;
+            }
+            continue;
+        } else {
+            log_error("Unrecognized crypto-profile element in config file (%s)", name);
+            return 1;
+        }
+        if (intern_field(field, content) != 0) {
+            return 1;
+        }
     }
+    return 0;
+}
 
-    int app_idx;
-    for (app_idx=0; app_idx<roxml_get_chld_nb(cur_node); app_idx++) {
 
-        Application *app = &(incoming_config->apps[app_idx]);
 
-        node_t *cur_app_node = roxml_get_chld(cur_node, NULL, app_idx);
-        assert(strcmp(roxml_get_name(cur_app_node, NULL, 0), "application")==0);
-
-
-        // init defaults (from YANG module definition)
-        app->connection_type = PERSISTENT;
-        app->reconnect_strategy.start_with = FIRST_LISTED;
-        app->reconnect_strategy.interval_secs = 5;
-        app->periodic_connect_info.timeout_mins = 5;
-        app->periodic_connect_info.linger_secs = 30;
-        app->keep_alive_strategy.interval_secs = 15;
-        app->keep_alive_strategy.count_max = 3;
-
-        // init "operational state"
-        app->connecting_pid = -1;
-
-        // now parse DOM, filling in mandatory attributes and 
-        // potentially overriding defaults
-
-        int chld_idx;
-        for (chld_idx=0; chld_idx<roxml_get_chld_nb(cur_app_node); chld_idx++) {
-            node_t *cur_chld_node =roxml_get_chld(cur_app_node, NULL, chld_idx);
-            if (strcmp("name", roxml_get_name(cur_chld_node, NULL, 0))==0) {
-                node_t *text =  roxml_get_txt(cur_chld_node, 0);
-                strcpy(app->name, roxml_get_content(text, NULL, 0, NULL));
-            } else if (strcmp("description", roxml_get_name(cur_chld_node, NULL, 0))==0) {
-                // do nothing, just iterate over it
-            } else if (strcmp("servers", roxml_get_name(cur_chld_node, NULL, 0))==0){
-                int idx2;
-                app->num_servers = roxml_get_chld_nb(cur_chld_node);
-                app->servers = (Server*)calloc(app->num_servers, sizeof(Server));
-                for (idx2=0; idx2<roxml_get_chld_nb(cur_chld_node); idx2++) {
-                    node_t *cur_idx2_node=roxml_get_chld(cur_chld_node, NULL, idx2);
-                    int idx3;
-                    for (idx3=0; idx3<roxml_get_chld_nb(cur_idx2_node); idx3++) {
-                        node_t *cur_idx3_node=roxml_get_chld(cur_idx2_node, NULL, idx3);
-                        if (strcmp("address", roxml_get_name(cur_idx3_node, NULL, 0))==0) {
-                            node_t *text =  roxml_get_txt(cur_idx3_node, 0);
-                            strcpy(app->servers[idx2].addr, roxml_get_content(text, NULL, 0, NULL));
-                        } else if (strcmp("port", roxml_get_name(cur_idx3_node, NULL, 0))==0) {
-                            node_t *text =  roxml_get_txt(cur_idx3_node, 0);
-                            app->servers[idx2].port = atoi(roxml_get_content(text, NULL, 0, NULL));
+// fill in `profile` from a <socket-profile> element
+static int  // 0 on success, 1 on error
+parse_socket_profile(node_t *profile_node, SocketProfile *profile) {
+    int idx;
+
+    for (idx=0; idx<roxml_get_chld_nb(profile_node); idx++) {
+        node_t     *cur_node = roxml_get_chld(profile_node, NULL, idx);
+        const char *name = roxml_get_name(cur_node, NULL, 0);
+        node_t     *text = roxml_get_txt(cur_node, 0);
+
+        if (strcmp("tcp-nodelay", name)==0) {
+            profile->nodelay = 1;
+        } else if (strcmp("tcp-quickack", name)==0) {
+            profile->quickack = 1;
+        } else if (strcmp("tcp-fast-open", name)==0) {
+            profile->fast_open = 1;
+        } else if (strcmp("send-buffer", name)==0) {
+            profile->send_buffer = strtoul(roxml_get_content(text, NULL, 0, NULL), NULL, 10);
+        } else if (strcmp("receive-buffer", name)==0) {
+            profile->receive_buffer = strtoul(roxml_get_content(text, NULL, 0, NULL), NULL, 10);
+        } else {
+            log_error("Unrecognized socket-profile element in config file (%s)", name);
+            return 1;
+        }
+    }
+    return 0;
+}
+
+
+
+// This routine fills in `app` from an <application> element, applying
+// the YANG module's defaults for anything the element leaves out
+static int  // 0 on success, 1 on error
+parse_application(node_t *cur_app_node, Application *app) {
+
+    assert(strcmp(roxml_get_name(cur_app_node, NULL, 0), "application")==0);
+
+    // init defaults (from YANG module definition)
+    app->connection_type = PERSISTENT;
+    app->reconnect_strategy.start_with = FIRST_LISTED;
+    app->reconnect_strategy.interval_secs = 5;
+    app->reconnect_strategy.probe_interval_secs = 60;
+    app->reconnect_strategy.drain_secs = 5;
+    app->periodic_connect_info.timeout_mins = 5;
+    app->periodic_connect_info.linger_secs = 30;
+    app->keep_alive_strategy.interval_secs = 15;
+    app->keep_alive_strategy.count_max = 3;
+
+    // now parse DOM, filling in mandatory attributes and 
+    // potentially overriding defaults
+
+    int chld_idx;
+    for (chld_idx=0; chld_idx<roxml_get_chld_nb(cur_app_node); chld_idx++) {
+        node_t *cur_chld_node =roxml_get_chld(cur_app_node, NULL, chld_idx);
+        if (strcmp("name", roxml_get_name(cur_chld_node, NULL, 0))==0) {
+            node_t *text =  roxml_get_txt(cur_chld_node, 0);
+            if (intern_field(&app->name, roxml_get_content(text, NULL, 0, NULL)) != 0) {
+                return 1;
+            }
+        } else if (strcmp("description", roxml_get_name(cur_chld_node, NULL, 0))==0) {
+            // do nothing, just iterate over it
+        } else if (strcmp("priority", roxml_get_name(cur_chld_node, NULL, 0))==0) {
+            // not in the YANG module: orders queued connect attempts (0-255)
+            node_t *text =  roxml_get_txt(cur_chld_node, 0);
+            app->priority = atoi(roxml_get_content(text, NULL, 0, NULL));
+        } else if (strcmp("socket-profile", roxml_get_name(cur_chld_node, NULL, 0))==0) {
+            // not in the YANG module, see tcp_profile.c
+            if (parse_socket_profile(cur_chld_node, &app->tcp) != 0) {
+                return 1;
+            }
+        } else if (strcmp("servers", roxml_get_name(cur_chld_node, NULL, 0))==0){
+            int idx2;
+            app->num_servers = roxml_get_chld_nb(cur_chld_node);
+            app->servers = (Server*)calloc(app->num_servers, sizeof(Server));
+            if (app->servers == NULL) {
+                app->num_servers = 0;
+                log_error("could not alloc servers");
+                return 1;
+            }
+            for (idx2=0; idx2<roxml_get_chld_nb(cur_chld_node); idx2++) {
+                node_t *cur_idx2_node=roxml_get_chld(cur_chld_node, NULL, idx2);
+                int idx3;
+                for (idx3=0; idx3<roxml_get_chld_nb(cur_idx2_node); idx3++) {
+                    node_t *cur_idx3_node=roxml_get_chld(cur_idx2_node, NULL, idx3);
+                    if (strcmp("address", roxml_get_name(cur_idx3_node, NULL, 0))==0) {
+                        node_t *text =  roxml_get_txt(cur_idx3_node, 0);
+                        if (intern_field(&app->servers[idx2].addr,
+                                         roxml_get_content(text, NULL, 0, NULL)) != 0) {
+                            return 1;
                         }
+                    } else if (strcmp("port", roxml_get_name(cur_idx3_node, NULL, 0))==0) {
+                        node_t *text =  roxml_get_txt(cur_idx3_node, 0);
+                        app->servers[idx2].port = atoi(roxml_get_content(text, NULL, 0, NULL));
                     }
                 }
-            } else if (strcmp("transport", roxml_get_name(cur_chld_node, NULL, 0))==0){
-                int idx2;
-                for (idx2=0; idx2<roxml_get_chld_nb(cur_chld_node); idx2++) {
-                    node_t *cur_idx2_node=roxml_get_chld(cur_chld_node, NULL, idx2);
-                    if (strcmp("ssh", roxml_get_name(cur_idx2_node, NULL, 0))==0) {
-                        app->transport_type = SSH;
-                        node_t *hostkeys_node=roxml_get_chld(cur_idx2_node, NULL, 0);
+            }
+        } else if (strcmp("transport", roxml_get_name(cur_chld_node, NULL, 0))==0){
+            int idx2;
+            for (idx2=0; idx2<roxml_get_chld_nb(cur_chld_node); idx2++) {
+                node_t *cur_idx2_node=roxml_get_chld(cur_chld_node, NULL, idx2);
+                if (strcmp("ssh", roxml_get_name(cur_idx2_node, NULL, 0))==0) {
+                    app->transport_type = SSH;
+                    int ssh_idx;
+                    for (ssh_idx=0; ssh_idx<roxml_get_chld_nb(cur_idx2_node); ssh_idx++) {
+                        node_t *hostkeys_node=roxml_get_chld(cur_idx2_node, NULL, ssh_idx);
+                        if (strcmp("relay-to", roxml_get_name(hostkeys_node, NULL, 0))==0) {
+                            // sessions go to a NETCONF server already running
+                            // on this box rather than to a new sshd
+                            app->relay_to.port = 830;
+                            int idx3;
+                            for (idx3=0; idx3<roxml_get_chld_nb(hostkeys_node); idx3++) {
+                                node_t *cur_idx3_node=roxml_get_chld(hostkeys_node, NULL, idx3);
+                                node_t *text = roxml_get_txt(cur_idx3_node, 0);
+                                if (strcmp("address", roxml_get_name(cur_idx3_node, NULL, 0))==0) {
+                                    if (intern_field(&app->relay_to.addr,
+                                                     roxml_get_content(text, NULL, 0, NULL)) != 0) {
+                                        return 1;
+                                    }
+                                } else if (strcmp("port", roxml_get_name(cur_idx3_node, NULL, 0))==0) {
+                                    app->relay_to.port = atoi(roxml_get_content(text, NULL, 0, NULL));
+                                }
+                            }
+                            continue;
+                        }
+                        if (strcmp("in-process", roxml_get_name(hostkeys_node, NULL, 0))==0) {
+                            // not in the YANG module, see ssh_server.c
+                            app->in_process = 1;
+                            continue;
+                        }
+                        if (strcmp("shared-connection", roxml_get_name(hostkeys_node, NULL, 0))==0) {
+                            // not in the YANG module either, see ncchd.c
+                            app->shared = 1;
+                            continue;
+                        }
+                        if (strcmp("crypto-profile", roxml_get_name(hostkeys_node, NULL, 0))==0) {
+                            // not in the YANG module, see ssh_profile.c
+                            if (parse_crypto_profile(hostkeys_node, &app->crypto) != 0) {
+                                return 1;
+                            }
+                            continue;
+                        }
                         assert(strcmp(roxml_get_name(hostkeys_node, NULL, 0), "host-keys")==0);
                         app->num_host_keys = roxml_get_chld_nb(hostkeys_node);
                         app->host_keys = (HostKey*)calloc(app->num_host_keys, sizeof(HostKey));
+                        if (app->host_keys == NULL) {
+                            app->num_host_keys = 0;
+                            log_error("could not alloc host-keys");
+                            return 1;
+                        }
                         int idx3;
                         for (idx3=0; idx3 < app->num_host_keys; idx3++) {
                             node_t *cur_idx3_node=roxml_get_chld(hostkeys_node, NULL, idx3);
@@ -160,110 +293,230 @@ get_incoming_config(Configuration* incoming_config) {
                             node_t *name_node=roxml_get_chld(cur_idx3_node, NULL, 0);
                             assert(strcmp(roxml_get_name(name_node, NULL, 0), "name")==0);
                             node_t *text =  roxml_get_txt(name_node, 0);
-                            strcpy(app->host_keys[idx3].name, 
-                                   roxml_get_content(text, NULL, 0, NULL));
+                            if (intern_field(&app->host_keys[idx3].name,
+                                             roxml_get_content(text, NULL, 0, NULL)) != 0) {
+                                return 1;
+                            }
                         }
-                    } else if (strcmp("tls", roxml_get_name(cur_idx2_node, NULL, 0))==0) {
-                        app->transport_type = TLS;
-                    } else {
-                        printf("Unrecognized transport type config file (%s) [2]\n",
-                                                    roxml_get_name(cur_chld_node, NULL, 0));
-                        roxml_release(RELEASE_ALL);
-                        roxml_close(root);
-                        return 1;
-                   }
+                    }
+                } else if (strcmp("tls", roxml_get_name(cur_idx2_node, NULL, 0))==0) {
+                    app->transport_type = TLS;
+                } else {
+                    log_error("Unrecognized transport type config file (%s) [2]",
+                                                roxml_get_name(cur_chld_node, NULL, 0));
+                    return 1;
                }
-            } else if (strcmp("connection-type", roxml_get_name(cur_chld_node, NULL, 0))==0){
-                int idx2;
-                for (idx2=0; idx2<roxml_get_chld_nb(cur_chld_node); idx2++) {
-                    node_t *cur_idx2_node=roxml_get_chld(cur_chld_node, NULL, idx2);
-                    if (strcmp("persistent", roxml_get_name(cur_idx2_node, NULL, 0))==0) {
-                        app->connection_type = PERSISTENT;
-                        if (roxml_get_chld_nb(cur_idx2_node) != 0) {
-                            node_t *keepalives_node=roxml_get_chld(cur_idx2_node, NULL, 0);
-                            assert(strcmp(roxml_get_name(keepalives_node, NULL, 0), "keep-alives")==0);
+           }
+        } else if (strcmp("connection-type", roxml_get_name(cur_chld_node, NULL, 0))==0){
+            int idx2;
+            for (idx2=0; idx2<roxml_get_chld_nb(cur_chld_node); idx2++) {
+                node_t *cur_idx2_node=roxml_get_chld(cur_chld_node, NULL, idx2);
+                if (strcmp("persistent", roxml_get_name(cur_idx2_node, NULL, 0))==0) {
+                    app->connection_type = PERSISTENT;
+                    if (roxml_get_chld_nb(cur_idx2_node) != 0) {
+                        node_t *keepalives_node=roxml_get_chld(cur_idx2_node, NULL, 0);
+                        assert(strcmp(roxml_get_name(keepalives_node, NULL, 0), "keep-alives")==0);
 
-                            int idx3;
-                            for (idx3=0; idx3<roxml_get_chld_nb(keepalives_node); idx3++) {
-                                node_t *cur_idx3_node=roxml_get_chld(keepalives_node, NULL, idx3);
-                                if (strcmp("interval-secs", roxml_get_name(cur_idx3_node, NULL, 0))==0) {
-                                    node_t *text = roxml_get_txt(cur_idx3_node, 0);
-                                    app->keep_alive_strategy.interval_secs= atoi(roxml_get_content(text, NULL, 0, NULL));
-                                } else if (strcmp("count-max", roxml_get_name(cur_idx3_node, NULL, 0))==0) {
-                                    node_t *text = roxml_get_txt(cur_idx3_node, 0);
-                                    app->keep_alive_strategy.count_max= atoi(roxml_get_content(text, NULL, 0, NULL));
-                                } else {
-                                    printf("Unrecognized keep-alives decendent element in config file (%s) [3]\n",
-                                                         roxml_get_name(cur_idx3_node, NULL, 0));
-                                    roxml_release(RELEASE_ALL);
-                                    roxml_close(root);
-                                    return 1;
-                                }
+                        int idx3;
+                        for (idx3=0; idx3<roxml_get_chld_nb(keepalives_node); idx3++) {
+                            node_t *cur_idx3_node=roxml_get_chld(keepalives_node, NULL, idx3);
+                            if (strcmp("interval-secs", roxml_get_name(cur_idx3_node, NULL, 0))==0) {
+                                node_t *text = roxml_get_txt(cur_idx3_node, 0);
+                                app->keep_alive_strategy.interval_secs= atoi(roxml_get_content(text, NULL, 0, NULL));
+                            } else if (strcmp("count-max", roxml_get_name(cur_idx3_node, NULL, 0))==0) {
+                                node_t *text = roxml_get_txt(cur_idx3_node, 0);
+                                app->keep_alive_strategy.count_max= atoi(roxml_get_content(text, NULL, 0, NULL));
+                            } else {
+                                log_error("Unrecognized keep-alives decendent element in config file (%s) [3]",
+                                                     roxml_get_name(cur_idx3_node, NULL, 0));
+                                return 1;
                             }
-
                         }
 
+                    }
+
 
 /*
-            } else if (strcmp("keep-alive-strategy", roxml_get_name(cur_chld_node, NULL, 0))==0){
-                int idx2;
-                for (idx2=0; idx2<roxml_get_chld_nb(cur_chld_node); idx2++) {
-                    node_t *cur_idx2_node=roxml_get_chld(cur_chld_node, NULL, idx2);
-                    if (strcmp("interval-secs", roxml_get_name(cur_idx2_node, NULL, 0))==0) {
-                        node_t *text =  roxml_get_txt(cur_idx2_node, 0);
-                        app->keep_alive_strategy.interval_secs = atoi(roxml_get_content(text, NULL, 0, NULL));
-                    } else if (strcmp("count-max", roxml_get_name(cur_idx2_node, NULL, 0))==0) {
-                        node_t *text =  roxml_get_txt(cur_idx2_node, 0);
-                        app->keep_alive_strategy.count_max = atoi(roxml_get_content(text, NULL, 0, NULL));
-                    }
+        } else if (strcmp("keep-alive-strategy", roxml_get_name(cur_chld_node, NULL, 0))==0){
+            int idx2;
+            for (idx2=0; idx2<roxml_get_chld_nb(cur_chld_node); idx2++) {
+                node_t *cur_idx2_node=roxml_get_chld(cur_chld_node, NULL, idx2);
+                if (strcmp("interval-secs", roxml_get_name(cur_idx2_node, NULL, 0))==0) {
+                    node_t *text =  roxml_get_txt(cur_idx2_node, 0);
+                    app->keep_alive_strategy.interval_secs = atoi(roxml_get_content(text, NULL, 0, NULL));
+                } else if (strcmp("count-max", roxml_get_name(cur_idx2_node, NULL, 0))==0) {
+                    node_t *text =  roxml_get_txt(cur_idx2_node, 0);
+                    app->keep_alive_strategy.count_max = atoi(roxml_get_content(text, NULL, 0, NULL));
                 }
+            }
 */
 
 
 
 
 
-                    } else if (strcmp("periodic", roxml_get_name(cur_idx2_node, NULL, 0))==0) {
-                        app->connection_type = PERIODIC;
-                        int idx3;
-                        for (idx3=0; idx3<roxml_get_chld_nb(cur_idx2_node); idx3++) {
-                            node_t *cur_idx3_node=roxml_get_chld(cur_idx2_node, NULL, idx3);
-                            if (strcmp("timeout-mins", roxml_get_name(cur_idx3_node, NULL, 0))==0) {
-                                node_t *text =  roxml_get_txt(cur_idx3_node, 0);
-                                app->periodic_connect_info.timeout_mins = atoi(roxml_get_content(text, NULL, 0, NULL));
-                            } else if (strcmp("linger-secs", roxml_get_name(cur_idx3_node, NULL, 0))==0) {
-                                node_t *text =  roxml_get_txt(cur_idx3_node, 0);
-                                app->periodic_connect_info.linger_secs = atoi(roxml_get_content(text, NULL, 0, NULL));
-                            }
+                } else if (strcmp("periodic", roxml_get_name(cur_idx2_node, NULL, 0))==0) {
+                    app->connection_type = PERIODIC;
+                    int idx3;
+                    for (idx3=0; idx3<roxml_get_chld_nb(cur_idx2_node); idx3++) {
+                        node_t *cur_idx3_node=roxml_get_chld(cur_idx2_node, NULL, idx3);
+                        if (strcmp("timeout-mins", roxml_get_name(cur_idx3_node, NULL, 0))==0) {
+                            node_t *text =  roxml_get_txt(cur_idx3_node, 0);
+                            app->periodic_connect_info.timeout_mins = atoi(roxml_get_content(text, NULL, 0, NULL));
+                        } else if (strcmp("linger-secs", roxml_get_name(cur_idx3_node, NULL, 0))==0) {
+                            node_t *text =  roxml_get_txt(cur_idx3_node, 0);
+                            app->periodic_connect_info.linger_secs = atoi(roxml_get_content(text, NULL, 0, NULL));
                         }
                     }
                 }
-            } else if (strcmp("reconnect-strategy", roxml_get_name(cur_chld_node, NULL, 0))==0){
-                int idx2;
-                for (idx2=0; idx2<roxml_get_chld_nb(cur_chld_node); idx2++) {
-                    node_t *cur_idx2_node=roxml_get_chld(cur_chld_node, NULL, idx2);
-                    if (strcmp("start-with", roxml_get_name(cur_idx2_node, NULL, 0))==0) {
-                        node_t *text =  roxml_get_txt(cur_idx2_node, 0);
-                        if (strcmp("first-listed", roxml_get_content(text, NULL, 0, NULL))==0) {
-                            app->reconnect_strategy.start_with = FIRST_LISTED;
-                        } else {
-                            app->reconnect_strategy.start_with = LAST_CONNECTED;
-                        }
-                    } else if (strcmp("interval-secs", roxml_get_name(cur_idx2_node, NULL, 0))==0) {
-                        node_t *text =  roxml_get_txt(cur_idx2_node, 0);
-                        app->reconnect_strategy.interval_secs = atoi(roxml_get_content(text, NULL, 0, NULL));
-                    } else if (strcmp("count-max", roxml_get_name(cur_idx2_node, NULL, 0))==0) {
-                        node_t *text =  roxml_get_txt(cur_idx2_node, 0);
-                        app->reconnect_strategy.count_max = atoi(roxml_get_content(text, NULL, 0, NULL));
+            }
+        } else if (strcmp("reconnect-strategy", roxml_get_name(cur_chld_node, NULL, 0))==0){
+            int idx2;
+            for (idx2=0; idx2<roxml_get_chld_nb(cur_chld_node); idx2++) {
+                node_t *cur_idx2_node=roxml_get_chld(cur_chld_node, NULL, idx2);
+                if (strcmp("start-with", roxml_get_name(cur_idx2_node, NULL, 0))==0) {
+                    node_t *text =  roxml_get_txt(cur_idx2_node, 0);
+                    if (strcmp("first-listed", roxml_get_content(text, NULL, 0, NULL))==0) {
+                        app->reconnect_strategy.start_with = FIRST_LISTED;
+                    } else if (strcmp("lowest-latency", roxml_get_content(text, NULL, 0, NULL))==0) {
+                        // not in the YANG module, see DESIGN.txt
+                        app->reconnect_strategy.start_with = LOWEST_LATENCY;
+                    } else {
+                        app->reconnect_strategy.start_with = LAST_CONNECTED;
                     }
+                } else if (strcmp("interval-secs", roxml_get_name(cur_idx2_node, NULL, 0))==0) {
+                    node_t *text =  roxml_get_txt(cur_idx2_node, 0);
+                    app->reconnect_strategy.interval_secs = atoi(roxml_get_content(text, NULL, 0, NULL));
+                } else if (strcmp("count-max", roxml_get_name(cur_idx2_node, NULL, 0))==0) {
+                    node_t *text =  roxml_get_txt(cur_idx2_node, 0);
+                    app->reconnect_strategy.count_max = atoi(roxml_get_content(text, NULL, 0, NULL));
+                } else if (strcmp("probe-interval-secs", roxml_get_name(cur_idx2_node, NULL, 0))==0) {
+                    node_t *text =  roxml_get_txt(cur_idx2_node, 0);
+                    app->reconnect_strategy.probe_interval_secs = atoi(roxml_get_content(text, NULL, 0, NULL));
+                } else if (strcmp("drain-secs", roxml_get_name(cur_idx2_node, NULL, 0))==0) {
+                    node_t *text =  roxml_get_txt(cur_idx2_node, 0);
+                    app->reconnect_strategy.drain_secs = atoi(roxml_get_content(text, NULL, 0, NULL));
                 }
-            } else {
-                printf("Unrecognized XML element in config file (%s) [1]\n",
-                                                         roxml_get_name(cur_chld_node, NULL, 0));
-                roxml_release(RELEASE_ALL);
-                roxml_close(root);
-                return 1;
             }
+        } else {
+            log_error("Unrecognized XML element in config file (%s) [1]",
+                                                     roxml_get_name(cur_chld_node, NULL, 0));
+            return 1;
+        }
+    }
+    return 0;
+}
+
+
+
+// deep-free the Application structure's members (the struct itself
+// lives in its Configuration's apps array), releasing its interned strings
+void
+free_application(Application* app) {
+    uint32_t idx;
+
+    for (idx=0; idx<app->num_host_keys; idx++) {
+        intern_release(app->host_keys[idx].name);
+    }
+    free(app->host_keys);
+    app->host_keys = NULL;
+    app->num_host_keys = 0;
+    for (idx=0; idx<app->num_servers; idx++) {
+        intern_release(app->servers[idx].addr);
+    }
+    free(app->servers);
+    app->servers = NULL;
+    app->num_servers = 0;
+    intern_release(app->relay_to.addr);
+    app->relay_to.addr = NULL;
+    intern_release(app->crypto.kex);
+    intern_release(app->crypto.ciphers);
+    intern_release(app->crypto.macs);
+    intern_release(app->crypto.host_key_algorithms);
+    intern_release(app->crypto.x509_key_algorithm);
+    memset(&app->crypto, 0, sizeof(SshCryptoProfile));
+    intern_release(app->name);
+    app->name = NULL;
+}
+
+
+
+// deep-copy an Application, sharing its interned strings.  On error
+// `dst` holds nothing that needs freeing.
+int  // 0 on success, 1 on error
+copy_application(Application* dst, const Application* src) {
+    uint32_t idx;
+
+    memcpy(dst, src, sizeof(Application));
+    dst->servers = (Server*)malloc((src->num_servers ? src->num_servers : 1) * sizeof(Server));
+    dst->host_keys = (HostKey*)malloc((src->num_host_keys ? src->num_host_keys : 1) * sizeof(HostKey));
+    if (dst->servers == NULL || dst->host_keys == NULL) {
+        free(dst->servers);
+        free(dst->host_keys);
+        memset(dst, 0, sizeof(Application));
+        return 1;
+    }
+    for (idx=0; idx<src->num_servers; idx++) {
+        dst->servers[idx].addr = intern_ref(src->servers[idx].addr);
+        dst->servers[idx].port = src->servers[idx].port;
+    }
+    for (idx=0; idx<src->num_host_keys; idx++) {
+        dst->host_keys[idx].name = intern_ref(src->host_keys[idx].name);
+    }
+    dst->relay_to.addr = intern_ref(src->relay_to.addr);
+    dst->crypto.kex = intern_ref(src->crypto.kex);
+    dst->crypto.ciphers = intern_ref(src->crypto.ciphers);
+    dst->crypto.macs = intern_ref(src->crypto.macs);
+    dst->crypto.host_key_algorithms = intern_ref(src->crypto.host_key_algorithms);
+    dst->crypto.x509_key_algorithm = intern_ref(src->crypto.x509_key_algorithm);
+    dst->name = intern_ref(src->name);
+    return 0;
+}
+
+
+
+// This routine returns the system's current configuration, same as a
+// NETCONF server's "running" datastore.  The routine is executed once
+// on startup and again for each SIGHUP
+int  // 0 on success, 1 on error
+get_incoming_config(Configuration* incoming_config) {
+
+    // This reference implementation simply reads the configuration 
+    // from a local file called "config.xml" and builds an C-based
+    // in-memory datastructure.
+
+    node_t *root = roxml_load_doc("config.xml");
+    node_t *cur_node;
+    cur_node = roxml_get_chld(root, NULL, 0);      // <netconf>
+    cur_node = roxml_get_chld(cur_node, NULL, 0);  // <call-home>
+    cur_node = roxml_get_chld(cur_node, NULL, 0);  // <applications>
+
+    incoming_config->num_apps = roxml_get_chld_nb(cur_node);
+    incoming_config->apps = (Application*)calloc(incoming_config->num_apps, sizeof(Application));
+    if (incoming_config->apps == NULL) {
+        log_error("could not alloc apps struct");
+        roxml_release(RELEASE_ALL);
+        roxml_close(root);
+        return 1;
+    }
+
+    uint32_t app_idx;
+    for (app_idx=0; app_idx<incoming_config->num_apps; app_idx++) {
+
+        Application *app = &(incoming_config->apps[app_idx]);
+
+        node_t *cur_app_node = roxml_get_chld(cur_node, NULL, app_idx);
+        if (parse_application(cur_app_node, app) != 0) {
+            // drop what was parsed so far, apps past this one are zeroed
+            for (app_idx=0; app_idx<incoming_config->num_apps; app_idx++) {
+                free_application(&(incoming_config->apps[app_idx]));
+            }
+            free(incoming_config->apps);
+            incoming_config->apps = NULL;
+            incoming_config->num_apps = 0;
+            roxml_release(RELEASE_ALL);
+            roxml_close(root);
+            return 1;
         }
     }
     roxml_release(RELEASE_ALL);
@@ -274,9 +527,238 @@ get_incoming_config(Configuration* incoming_config) {
 
 
 
+// This routine parses a single <application> element, as received on
+// ncchd's control socket, into `app`.  Same rules as get_incoming_config()
+int  // 0 on success, 1 on error
+get_incoming_application(char* xml, Application* app) {
+    node_t *root = roxml_load_buf(xml);
+    node_t *app_node;
+    int     result;
+
+    if (root == NULL) {
+        log_error("could not parse <application> element");
+        return 1;
+    }
+    app_node = roxml_get_chld(root, NULL, 0);
+    if (app_node == NULL ||
+        strcmp(roxml_get_name(app_node, NULL, 0), "application") != 0) {
+        log_error("expected an <application> element");
+        roxml_release(RELEASE_ALL);
+        roxml_close(root);
+        return 1;
+    }
+    result = parse_application(app_node, app);
+    roxml_release(RELEASE_ALL);
+    roxml_close(root);
+    if (result == 0 && app->name == NULL) {
+        log_error("<application> element has no <name>");
+        return 1;
+    }
+    return result;
+}
+
+
+
+// write `text` as <tag>'s character data, on a line of its own.  Names
+// and addresses come over the control socket, with roxml decoding any
+// entities in them, so they're escaped again here.
+static void
+write_element(FILE* file, const char* indent, const char* tag, const char* text) {
+    fprintf(file, "%s<%s>", indent, tag);
+    for (; *text != '\0'; text++) {
+        switch (*text) {
+            case '&': fputs("&amp;", file); break;
+            case '<': fputs("&lt;", file);  break;
+            case '>': fputs("&gt;", file);  break;
+            default:  fputc(*text, file);   break;
+        }
+    }
+    fprintf(file, "</%s>\n", tag);
+}
+
+
+
+// write `profile` as a <crypto-profile> element, if it sets anything
+static void
+write_crypto_profile(FILE* file, const SshCryptoProfile* profile) {
+    if (profile->kex == NULL && profile->ciphers == NULL && profile->macs == NULL &&
+        profile->host_key_algorithms == NULL && profile->x509_key_algorithm == NULL &&
+        profile->compression == COMPRESSION_DEFAULT) {
+        return;
+    }
+    fprintf(file, "              <crypto-profile>\n");
+    if (profile->kex != NULL) {
+        write_element(file, "                 ", "kex", profile->kex);
+    }
+    if (profile->ciphers != NULL) {
+        write_element(file, "                 ", "ciphers", profile->ciphers);
+    }
+    if (profile->macs != NULL) {
+        write_element(file, "                 ", "macs", profile->macs);
+    }
+    if (profile->host_key_algorithms != NULL) {
+        write_element(file, "                 ", "host-key-algorithms",
+                      profile->host_key_algorithms);
+    }
+    if (profile->x509_key_algorithm != NULL) {
+        write_element(file, "                 ", "x509-key-algorithm",
+                      profile->x509_key_algorithm);
+    }
+    if (profile->compression != COMPRESSION_DEFAULT) {
+        fprintf(file, "                 <compression>%s</compression>\n",
+                ssh_profile_compression_name(profile->compression));
+    }
+    fprintf(file, "              </crypto-profile>\n");
+}
+
+
+
+// write `profile` as a <socket-profile> element, if it sets anything
+static void
+write_socket_profile(FILE* file, const SocketProfile* profile) {
+    if (!profile->nodelay && !profile->quickack && !profile->fast_open &&
+        profile->send_buffer == 0 && profile->receive_buffer == 0) {
+        return;
+    }
+    fprintf(file, "        <socket-profile>\n");
+    if (profile->nodelay) {
+        fprintf(file, "           <tcp-nodelay/>\n");
+    }
+    if (profile->quickack) {
+        fprintf(file, "           <tcp-quickack/>\n");
+    }
+    if (profile->fast_open) {
+        fprintf(file, "           <tcp-fast-open/>\n");
+    }
+    if (profile->send_buffer != 0) {
+        fprintf(file, "           <send-buffer>%u</send-buffer>\n", profile->send_buffer);
+    }
+    if (profile->receive_buffer != 0) {
+        fprintf(file, "           <receive-buffer>%u</receive-buffer>\n",
+                profile->receive_buffer);
+    }
+    fprintf(file, "        </socket-profile>\n");
+}
+
+
+
+// This routine writes `config` back to the system as its new "running"
+// config, so that changes made at runtime survive a restart.  It is the
+// inverse of get_incoming_config(), though descriptions are not kept.
+int  // 0 on success, 1 on error
+set_incoming_config(Configuration* config) {
+
+    // This reference implementation writes "config.xml.tmp" and then
+    // renames it over "config.xml", so a crash never leaves a partial file
+
+    FILE*    file;
+    uint32_t app_idx;
+
+    file = fopen("config.xml.tmp", "w");
+    if (file == NULL) {
+        return 1;
+    }
+
+    fprintf(file, "<netconf xmlns=\"urn:ietf:params:xml:ns:yang:ietf-netconf-server\">\n");
+    fprintf(file, "  <call-home>\n");
+    fprintf(file, "    <applications>\n");
+    for (app_idx=0; app_idx<config->num_apps; app_idx++) {
+        Application* app = &(config->apps[app_idx]);
+        uint32_t     idx;
+
+        fprintf(file, "      <application>\n");
+        write_element(file, "        ", "name", app->name);
+        fprintf(file, "        <servers>\n");
+        for (idx=0; idx<app->num_servers; idx++) {
+            fprintf(file, "           <server>\n");
+            write_element(file, "              ", "address", app->servers[idx].addr);
+            fprintf(file, "              <port>%u</port>\n", app->servers[idx].port);
+            fprintf(file, "           </server>\n");
+        }
+        fprintf(file, "        </servers>\n");
+        fprintf(file, "        <transport>\n");
+        if (app->transport_type == SSH) {
+            fprintf(file, "           <ssh>\n");
+            fprintf(file, "              <host-keys>\n");
+            for (idx=0; idx<app->num_host_keys; idx++) {
+                fprintf(file, "                 <host-key>\n");
+                write_element(file, "                    ", "name", app->host_keys[idx].name);
+                fprintf(file, "                 </host-key>\n");
+            }
+            fprintf(file, "              </host-keys>\n");
+            if (app->relay_to.addr != NULL) {
+                fprintf(file, "              <relay-to>\n");
+                write_element(file, "                 ", "address", app->relay_to.addr);
+                fprintf(file, "                 <port>%u</port>\n", app->relay_to.port);
+                fprintf(file, "              </relay-to>\n");
+            }
+            write_crypto_profile(file, &app->crypto);
+            if (app->in_process) {
+                fprintf(file, "              <in-process/>\n");
+            }
+            if (app->shared) {
+                fprintf(file, "              <shared-connection/>\n");
+            }
+            fprintf(file, "           </ssh>\n");
+        } else {
+            fprintf(file, "           <tls/>\n");
+        }
+        fprintf(file, "        </transport>\n");
+        fprintf(file, "        <connection-type>\n");
+        if (app->connection_type == PERSISTENT) {
+            fprintf(file, "          <persistent>\n");
+            fprintf(file, "            <keep-alives>\n");
+            fprintf(file, "              <interval-secs>%u</interval-secs>\n", app->keep_alive_strategy.interval_secs);
+            fprintf(file, "              <count-max>%u</count-max>\n", app->keep_alive_strategy.count_max);
+            fprintf(file, "            </keep-alives>\n");
+            fprintf(file, "          </persistent>\n");
+        } else {
+            fprintf(file, "          <periodic>\n");
+            fprintf(file, "            <timeout-mins>%u</timeout-mins>\n", app->periodic_connect_info.timeout_mins);
+            fprintf(file, "            <linger-secs>%u</linger-secs>\n", app->periodic_connect_info.linger_secs);
+            fprintf(file, "          </periodic>\n");
+        }
+        fprintf(file, "        </connection-type>\n");
+        fprintf(file, "        <reconnect-strategy>\n");
+        fprintf(file, "           <start-with>%s</start-with>\n",
+                app->reconnect_strategy.start_with == FIRST_LISTED ? "first-listed" :
+                app->reconnect_strategy.start_with == LOWEST_LATENCY ? "lowest-latency" :
+                                                                      "last-connected");
+        fprintf(file, "           <interval-secs>%u</interval-secs>\n", app->reconnect_strategy.interval_secs);
+        fprintf(file, "           <count-max>%u</count-max>\n", app->reconnect_strategy.count_max);
+        fprintf(file, "           <probe-interval-secs>%u</probe-interval-secs>\n", app->reconnect_strategy.probe_interval_secs);
+        fprintf(file, "           <drain-secs>%u</drain-secs>\n", app->reconnect_strategy.drain_secs);
+        fprintf(file, "        </reconnect-strategy>\n");
+        if (app->priority != 0) {
+            fprintf(file, "        <priority>%u</priority>\n", app->priority);
+        }
+        write_socket_profile(file, &app->tcp);
+        fprintf(file, "      </application>\n");
+    }
+    fprintf(file, "    </applications>\n");
+    fprintf(file, "  </call-home>\n");
+    fprintf(file, "</netconf>\n");
+
+    if (fflush(file) != 0 || fsync(fileno(file)) != 0) {
+        log_error("could not write config.xml.tmp");
+        fclose(file);
+        unlink("config.xml.tmp");
+        return 1;
+    }
+    fclose(file);
+    if (rename("config.xml.tmp", "config.xml") != 0) {
+        log_error("rename(config.xml.tmp, config.xml) failed");
+        return 1;
+    }
+    return 0;
+}
+
+
+
 // This routine persists the state for the specified app.   Right now, 
-// the persisted state is just the last server connected, which enables
-// the "last connected" reconnection strategy to work across restarts.
+// the persisted state is the last server connected, which enables
+// the "last connected" reconnection strategy to work across restarts,
+// and the per-server stats behind "lowest latency" (see server_stats.c).
 int // 0=OK, 1=ERROR
 set_persisted_state(const char* appname, PersistedState* state) {
 
@@ -284,16 +766,18 @@ set_persisted_state(const char* appname, PersistedState* state) {
   // struct from a hidden file called ".<app-name>.state"
 
   FILE*  file;
-  char   filename[32];
+  char   filename[PATH_MAX];
   size_t size;
-  sprintf(filename, ".%s.state", appname);
+  if (snprintf(filename, sizeof(filename), ".%s.state", appname) >= (int)sizeof(filename)) {
+    return 1;
+  }
   file = fopen(filename, "w");
   if (file == NULL) {
     return 1;
   }
   size = fwrite(state, sizeof(PersistedState), 1, file);
   if (size != 1) {
-    printf("fwrite() failed\n");
+    log_error("fwrite() failed");
     fclose(file);
     return 1;
   }
@@ -307,9 +791,10 @@ set_persisted_state(const char* appname, PersistedState* state) {
 
 
 // This routine returns the persisted state for the specified app.
-// Right now, the persisted state is just the last server connected,
-// which enables the "last connected" reconnection strategy to work
-// even across restarts.
+// Right now, the persisted state is the last server connected and the
+// per-server stats, which enable the "last connected" and "lowest
+// latency" reconnection strategies to work even across restarts.  A
+// file written before there were stats reads as having none.
 int // 0=OK, 1=ERROR, 2=NOTFOUND
 get_persisted_state(const char* appname, PersistedState* state) {
 
@@ -317,18 +802,21 @@ get_persisted_state(const char* appname, PersistedState* state) {
   // struct to a hidden file called ".<app-name>.state"
 
   FILE*  file;
-  char   filename[32];
+  char   filename[PATH_MAX];
   size_t size;
-  sprintf(filename, ".%s.state", appname);
+  if (snprintf(filename, sizeof(filename), ".%s.state", appname) >= (int)sizeof(filename)) {
+    return 1;
+  }
   file = fopen(filename, "r");
   if (file == NULL) {
     if (errno == ENOENT)
       return 2;
     return 1;
   }
-  size = fread(state, sizeof(PersistedState), 1, file);
-  if (size != 1) {
-    printf("fread() failed\n");
+  memset(state, 0, sizeof(PersistedState));
+  size = fread(state, 1, sizeof(PersistedState), file);
+  if (size < offsetof(PersistedState, last_connected_port) + sizeof(uint16_t)) {
+    log_error("fread() failed");
     fclose(file);
     return 1;
   }
@@ -0,0 +1,480 @@
+/*****************************************************************************
+Copyright (c) 2014-2016, Juniper Networks, Inc.
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions
+are met:
+
+1. Redistributions of source code must retain the above copyright 
+   notice, this list of conditions and the following disclaimer.
+
+2. Redistributions in binary form must reproduce the above copyright
+   notice, this list of conditions and the following disclaimer in the
+   documentation and/or other materials provided with the distribution.
+
+3. Neither the name of the copyright holder nor the names of its 
+   contributors may be used to endorse or promote products derived 
+   from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS 
+"AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT 
+LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS 
+FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE 
+COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, 
+INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, 
+BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; 
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER 
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT 
+LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN 
+ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE 
+POSSIBILITY OF SUCH DAMAGE.
+ *****************************************************************************/
+
+
+
+/*****************************************************************************
+   OVERVIEW
+
+   This file implements the flight recorder described in flight.h.  Each
+   attempt keeps its events in order; a span that is still open when the
+   attempt ends (or when there is no room left for more than its end) is
+   closed there and then, innermost first, so a dump never holds a begin
+   without its end except for attempts still in progress.
+
+   Timestamps are microseconds on the monotonic clock; the dump records
+   the offset to the epoch so a trace can be lined up with the logs.
+ *****************************************************************************/
+
+
+/*****************************************************************************
+   INCLUDES AND EXTERNS
+ *****************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <limits.h>
+#include <time.h>
+#include <unistd.h>
+#include "flight.h"
+#include "log.h"
+
+
+/*****************************************************************************
+   MACROS
+ *****************************************************************************/
+
+// a dump gives up on an attempt after this many torn reads, which the
+// shard writing it would have to be doing flat out to cause
+#define FLIGHT_READ_MAX_RETRIES 1000
+
+#define FLIGHT_INDEX(attempt) ((uint32_t)((attempt) & 0xffffffff))
+#define FLIGHT_GEN(attempt)   ((uint32_t)((attempt) >> 32))
+
+
+/*****************************************************************************
+   LOCAL/STATIC DEFINITIONS
+ *****************************************************************************/
+
+// how each kind appears in a trace, and what its events' arg means
+static const struct {
+    const char* name;
+    const char* begin_arg;   // NULL if the arg means nothing
+    const char* end_arg;
+} kinds[FLIGHT_KINDS] = {
+    [FLIGHT_ATTEMPT]    = { "attempt",            NULL,       NULL },
+    [FLIGHT_QUEUED]     = { "admission_queue",    NULL,       NULL },
+    [FLIGHT_BREAKER]    = { "breaker_open",       "server",   NULL },
+    [FLIGHT_DNS]        = { "dns",                NULL,       "gai_error" },
+    [FLIGHT_TCP]        = { "tcp_connect",        NULL,       "errno" },
+    [FLIGHT_FAST_OPEN]  = { "tcp_fast_open",      NULL,       NULL },
+    [FLIGHT_GREETING]   = { "nms_greeting",       NULL,       "errno" },
+    [FLIGHT_FORK]       = { "fork",               NULL,       "pid" },
+    [FLIGHT_EXEC]       = { "sshd_exec",          NULL,       NULL },
+    [FLIGHT_SSH_KEX]    = { "ssh_kex",            NULL,       NULL },
+    [FLIGHT_SSH_AUTH]   = { "ssh_auth",           NULL,       NULL },
+    [FLIGHT_SUBSYSTEM]  = { "netconf_subsystem",  NULL,       NULL },
+    [FLIGHT_HELLO]      = { "netconf_hello",      NULL,       NULL },
+    [FLIGHT_SSHD]       = { "sshd",               "pid",      "exit_status" },
+    [FLIGHT_RELAY]      = { "relay",              NULL,       "exit_status" },
+    [FLIGHT_IN_PROCESS] = { "in_process_session", NULL,       "exit_status" },
+    [FLIGHT_MIGRATED]   = { "migrated",           NULL,       NULL },
+};
+
+
+static int64_t
+now_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+
+// the attempt a handle names, NULL if it's gone or over
+static FlightAttempt*
+attempt_of(FlightRecorder* recorder, uint64_t attempt) {
+    FlightAttempt* a;
+
+    if (recorder == NULL || attempt == 0 ||
+        FLIGHT_INDEX(attempt) >= recorder->num_attempts) {
+        return NULL;
+    }
+    a = &(recorder->attempts[FLIGHT_INDEX(attempt)]);
+    if (a->gen != FLIGHT_GEN(attempt) || a->done) {
+        return NULL;
+    }
+    return a;
+}
+
+
+static void
+write_begin(FlightAttempt* a) {
+    __atomic_store_n(&a->seq, a->seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+
+static void
+write_end(FlightAttempt* a) {
+    __atomic_store_n(&a->seq, a->seq + 1, __ATOMIC_RELEASE);
+}
+
+
+static void
+append(FlightAttempt* a, int64_t ts_us, enum FLIGHT_KIND kind, char phase, int32_t arg) {
+    FlightEvent* event = &(a->events[a->num_events++]);
+
+    event->ts_us = ts_us;
+    event->arg = arg;
+    event->kind = kind;
+    event->phase = phase;
+    event->pad = 0;
+}
+
+
+// end every open span, innermost first
+static void
+close_spans(FlightAttempt* a, int64_t ts_us) {
+    int i;
+
+    for (i=a->num_events-1; i>=0 && a->open; i--) {
+        FlightEvent* event = &(a->events[i]);
+        if (event->phase == 'B' && (a->open & (1u << event->kind))) {
+            a->open &= ~(1u << event->kind);
+            append(a, ts_us, event->kind, 'E', 0);
+        }
+    }
+}
+
+
+static void
+copy_text(char* to, const char* from) {
+    strncpy(to, from, FLIGHT_TEXT_MAX - 1);
+    to[FLIGHT_TEXT_MAX - 1] = '\0';
+}
+
+
+/*****************************************************************************
+   RECORDING
+ *****************************************************************************/
+
+FlightRecorder* // NULL if num_attempts is 0 or on error
+flight_create(uint32_t num_attempts) {
+    FlightRecorder* recorder;
+
+    if (num_attempts == 0) {
+        return NULL;
+    }
+    recorder = calloc(1, sizeof(FlightRecorder) + num_attempts * sizeof(FlightAttempt));
+    if (recorder == NULL) {
+        log_error("could not alloc a flight recorder of %u attempts", num_attempts);
+        return NULL;
+    }
+    recorder->num_attempts = num_attempts;
+    return recorder;
+}
+
+
+void
+flight_destroy(FlightRecorder* recorder) {
+    free(recorder);
+}
+
+
+// Start recording an attempt in the oldest slot, displacing whatever
+// was there, and begin its span.
+uint64_t // the attempt's handle, 0 if there's no recorder
+flight_begin(FlightRecorder* recorder, const char* app) {
+    FlightAttempt* a;
+    uint32_t       index;
+
+    if (recorder == NULL) {
+        return 0;
+    }
+    index = recorder->next;
+    __atomic_store_n(&recorder->next, (index + 1) % recorder->num_attempts, __ATOMIC_RELAXED);
+    a = &(recorder->attempts[index]);
+
+    write_begin(a);
+    a->gen = (a->gen + 1) ? a->gen + 1 : 1;
+    a->open = 1u << FLIGHT_ATTEMPT;
+    a->num_events = 0;
+    a->dropped = 0;
+    a->done = 0;
+    a->failed = 0;
+    copy_text(a->app, app);
+    a->server[0] = '\0';
+    a->error[0] = '\0';
+    append(a, now_us(), FLIGHT_ATTEMPT, 'B', 0);
+    write_end(a);
+    return ((uint64_t)a->gen << 32) | index;
+}
+
+
+// note which server the attempt is trying now
+void
+flight_server(FlightRecorder* recorder, uint64_t attempt, const char* addr, uint16_t port) {
+    FlightAttempt* a = attempt_of(recorder, attempt);
+
+    if (a == NULL) {
+        return;
+    }
+    write_begin(a);
+    snprintf(a->server, sizeof(a->server), "%s:%u", addr, port);
+    write_end(a);
+}
+
+
+// Record one event.  A span is only begun (and an instant recorded) if
+// there will still be room to end it and everything else open; a span
+// that isn't open can't be ended or begun again.
+void
+flight_event(FlightRecorder* recorder, uint64_t attempt,
+             enum FLIGHT_KIND kind, char phase, int32_t arg) {
+    FlightAttempt* a = attempt_of(recorder, attempt);
+    uint32_t       bit = 1u << kind;
+    uint32_t       needed;
+
+    if (a == NULL) {
+        return;
+    }
+    if (phase == 'E') {
+        if (!(a->open & bit)) {
+            return;
+        }
+        needed = 0;
+    } else if (phase == 'B' && (a->open & bit)) {
+        return;
+    } else {
+        needed = __builtin_popcount(a->open) + (phase == 'B' ? 2 : 1);
+        if (a->num_events + needed > FLIGHT_EVENTS) {
+            write_begin(a);
+            a->dropped++;
+            write_end(a);
+            return;
+        }
+    }
+
+    write_begin(a);
+    if (phase == 'B') {
+        a->open |= bit;
+    } else if (phase == 'E') {
+        a->open &= ~bit;
+    }
+    append(a, now_us(), kind, phase, arg);
+    write_end(a);
+}
+
+
+// Finish an attempt, ending whatever is still open; it failed if there
+// is an error.
+void
+flight_end(FlightRecorder* recorder, uint64_t attempt, const char* error) {
+    FlightAttempt* a = attempt_of(recorder, attempt);
+
+    if (a == NULL) {
+        return;
+    }
+    write_begin(a);
+    close_spans(a, now_us());
+    if (error) {
+        copy_text(a->error, error);
+        a->failed = 1;
+    }
+    a->done = 1;
+    write_end(a);
+    if (error) {
+        __atomic_add_fetch(&recorder->failures, 1, __ATOMIC_RELAXED);
+    }
+}
+
+
+uint32_t
+flight_failures(const FlightRecorder* recorder) {
+    return recorder ? __atomic_load_n(&recorder->failures, __ATOMIC_RELAXED) : 0;
+}
+
+
+/*****************************************************************************
+   DUMPING
+ *****************************************************************************/
+
+// copy out a consistent attempt; 0=OK, 1=UNUSED OR TORN
+static int
+read_attempt(const FlightAttempt* a, FlightAttempt* copy) {
+    int retries;
+
+    for (retries=0; retries<FLIGHT_READ_MAX_RETRIES; retries++) {
+        uint32_t seq1 = __atomic_load_n(&a->seq, __ATOMIC_ACQUIRE);
+        if (seq1 & 1) {
+            continue;
+        }
+        memcpy(copy, a, sizeof(FlightAttempt));
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&a->seq, __ATOMIC_RELAXED) == seq1) {
+            return copy->gen == 0 || copy->num_events == 0;
+        }
+    }
+    return 1;
+}
+
+
+static void
+write_string(FILE* file, const char* s) {
+    fputc('"', file);
+    for (; *s; s++) {
+        unsigned char c = *s;
+        if (c == '"' || c == '\\') {
+            fprintf(file, "\\%c", c);
+        } else if (c < 0x20) {
+            fprintf(file, "\\u%04x", c);
+        } else {
+            fputc(c, file);
+        }
+    }
+    fputc('"', file);
+}
+
+
+// an app's track, stable across dumps (FNV-1a)
+static uint32_t
+app_tid(const char* app) {
+    uint32_t hash = 2166136261u;
+
+    for (; *app; app++) {
+        hash = (hash ^ (unsigned char)*app) * 16777619u;
+    }
+    return hash & 0x7fffffff;
+}
+
+
+static void
+write_attempt(FILE* file, const FlightAttempt* a, uint32_t pid, int* first) {
+    uint32_t tid = app_tid(a->app);
+    int      i;
+
+    fprintf(file, "%s\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%u,\"tid\":%u,"
+            "\"args\":{\"name\":", *first ? "" : ",", pid, tid);
+    write_string(file, a->app);
+    fprintf(file, "}}");
+    *first = 0;
+
+    for (i=0; i<a->num_events; i++) {
+        const FlightEvent* event = &(a->events[i]);
+        const char*        arg = (event->phase == 'E') ? kinds[event->kind].end_arg
+                                                       : kinds[event->kind].begin_arg;
+
+        fprintf(file, ",\n{\"name\":\"%s\",\"cat\":\"ncchd\",\"ph\":\"%c\",%s"
+                "\"ts\":%lld,\"pid\":%u,\"tid\":%u,\"args\":{",
+                kinds[event->kind].name, event->phase,
+                (event->phase == 'i') ? "\"s\":\"t\"," : "",
+                (long long)event->ts_us, pid, tid);
+        if (event->kind == FLIGHT_ATTEMPT) {
+            fprintf(file, "\"server\":");
+            write_string(file, a->server);
+            if (event->phase == 'E') {
+                fprintf(file, ",\"error\":");
+                write_string(file, a->error);
+                fprintf(file, ",\"dropped\":%u", a->dropped);
+            }
+        } else if (arg) {
+            fprintf(file, "\"%s\":%d", arg, event->arg);
+        }
+        fprintf(file, "}}");
+    }
+}
+
+
+// Write the attempts of every recorder (shards, in order) to path as
+// Chrome trace-event JSON: a process per shard and a thread per app.
+// Only an app's attempts are written if it's not NULL, and only the
+// failed ones if failed_only.  The file is replaced atomically.
+int // 0=OK, 1=ERROR
+flight_dump(FlightRecorder* const* recorders, uint32_t count,
+            const char* app, int failed_only, const char* path,
+            uint32_t* num_dumped) {
+    char            tmp_path[PATH_MAX];
+    FlightAttempt*  copy;
+    FILE*           file;
+    struct timespec mono, real;
+    int64_t         offset_us;
+    uint32_t        shard, i, oldest, dumped = 0;
+    int             first = 1;
+
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path);
+    file = fopen(tmp_path, "w");
+    if (file == NULL) {
+        log_error("could not write trace \"%s\"", tmp_path);
+        return 1;
+    }
+    copy = malloc(sizeof(FlightAttempt));
+    if (copy == NULL) {
+        fclose(file);
+        unlink(tmp_path);
+        return 1;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &mono);
+    clock_gettime(CLOCK_REALTIME, &real);
+    offset_us = ((int64_t)real.tv_sec - mono.tv_sec) * 1000000 +
+                (real.tv_nsec - mono.tv_nsec) / 1000;
+
+    fprintf(file, "{\"traceEvents\":[");
+    for (shard=0; shard<count; shard++) {
+        const FlightRecorder* recorder = recorders[shard];
+        if (recorder == NULL) {
+            continue;
+        }
+        fprintf(file, "%s\n{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%u,"
+                "\"args\":{\"name\":\"ncchd shard %u\"}}", first ? "" : ",",
+                shard + 1, shard);
+        first = 0;
+        // oldest first, from the slot the next attempt will take
+        oldest = __atomic_load_n(&recorder->next, __ATOMIC_RELAXED);
+        for (i=0; i<recorder->num_attempts; i++) {
+            uint32_t index = (oldest + i) % recorder->num_attempts;
+            if (read_attempt(&(recorder->attempts[index]), copy) ||
+                (failed_only && !copy->failed) ||
+                (app && strcmp(app, copy->app))) {
+                continue;
+            }
+            write_attempt(file, copy, shard + 1, &first);
+            dumped++;
+        }
+    }
+    fprintf(file, "\n],\"displayTimeUnit\":\"ms\",\"otherData\":{\"clock\":\"monotonic\","
+            "\"epoch_offset_us\":%lld,\"attempts\":%u}}\n", (long long)offset_us, dumped);
+    free(copy);
+
+    if (fclose(file) != 0 || rename(tmp_path, path) != 0) {
+        log_error("could not write trace \"%s\"", path);
+        unlink(tmp_path);
+        return 1;
+    }
+    if (num_dumped) {
+        *num_dumped = dumped;
+    }
+    return 0;
+}
@@ -0,0 +1,148 @@
+/*****************************************************************************
+Copyright (c) 2014-2016, Juniper Networks, Inc.
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions
+are met:
+
+1. Redistributions of source code must retain the above copyright 
+   notice, this list of conditions and the following disclaimer.
+
+2. Redistributions in binary form must reproduce the above copyright
+   notice, this list of conditions and the following disclaimer in the
+   documentation and/or other materials provided with the distribution.
+
+3. Neither the name of the copyright holder nor the names of its 
+   contributors may be used to endorse or promote products derived 
+   from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS 
+"AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT 
+LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS 
+FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE 
+COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, 
+INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, 
+BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; 
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER 
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT 
+LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN 
+ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE 
+POSSIBILITY OF SUCH DAMAGE.
+ *****************************************************************************/
+
+
+
+/*****************************************************************************
+   OVERVIEW
+
+   This header file declares ncchd's flight recorder: a timestamped trace
+   of each connect attempt an app makes, from the admission queue through
+   DNS, the TCP connect, sshd's fork and exec (or the in-process SSH
+   server, or the relay) and the SSH handshake, to the session's end, so
+   the time a device takes to come up on its NMS can be broken down.
+
+   Each shard owns one recorder, a fixed array of attempts reused oldest
+   first, and is the only thread writing to it; recording an event is a
+   few stores, with no lock, allocation or system call.  Every attempt is
+   guarded by a sequence lock, like the status table's slots, so the main
+   thread can copy attempts out at any time and write them as Chrome
+   trace-event JSON (chrome://tracing, Perfetto) with flight_dump().
+
+   An attempt is named by a handle, which goes stale once its slot is
+   reused; events recorded against a stale handle (or 0) are dropped.
+ *****************************************************************************/
+
+
+/*****************************************************************************
+   MACROS
+ *****************************************************************************/
+
+#define FLIGHT_ATTEMPTS       1024   // per shard, NCCHD_TRACE_ATTEMPTS, 0 for none
+#define FLIGHT_EVENTS         40     // per attempt, later ones are dropped
+#define FLIGHT_TEXT_MAX       64     // app name, server and error, cut short
+
+
+/*****************************************************************************
+   STRUCTS
+ *****************************************************************************/
+
+// what an event is about; spans begin ('B') and end ('E'), the rest
+// are instants ('i')
+enum FLIGHT_KIND {
+  FLIGHT_ATTEMPT,          // the whole attempt
+  FLIGHT_QUEUED,           // waiting for admission control
+  FLIGHT_BREAKER,          // servers skipped, their circuit open (instant)
+  FLIGHT_DNS,              // getaddrinfo()
+  FLIGHT_TCP,              // connect() to one address
+  FLIGHT_FAST_OPEN,        // TCP Fast Open: the SYN goes with the first write (instant)
+  FLIGHT_GREETING,         // waiting for the NMS's first byte
+  FLIGHT_FORK,             // fork() of sshd
+  FLIGHT_EXEC,             // sshd's exec, until its first line of output
+  FLIGHT_SSH_KEX,          // SSH key exchange
+  FLIGHT_SSH_AUTH,         // SSH user authentication
+  FLIGHT_SUBSYSTEM,        // the NMS asked for the netconf subsystem (instant)
+  FLIGHT_HELLO,            // sending the NETCONF <hello>
+  FLIGHT_SSHD,             // the session: sshd's lifetime
+  FLIGHT_RELAY,            // the session: relayed
+  FLIGHT_IN_PROCESS,       // the session: served by the in-process SSH server
+  FLIGHT_MIGRATED,         // moved to a preferred server (instant)
+  FLIGHT_KINDS
+};
+
+typedef struct FlightEvent FlightEvent;
+struct FlightEvent {
+  int64_t  ts_us;          // monotonic
+  int32_t  arg;            // errno, pid, exit status... see flight.c
+  uint8_t  kind;           // enum FLIGHT_KIND
+  char     phase;          // 'B', 'E' or 'i'
+  uint16_t pad;
+};
+
+typedef struct FlightAttempt FlightAttempt;
+struct FlightAttempt {
+  uint32_t    seq;         // odd while the shard is writing it
+  uint32_t    gen;         // bumped each time the slot is reused, 0 if unused
+  uint32_t    open;        // spans begun and not yet ended, a bit per kind
+  uint16_t    num_events;
+  uint16_t    dropped;     // events that did not fit
+  uint8_t     done;
+  uint8_t     failed;
+  uint16_t    pad;
+  char        app[FLIGHT_TEXT_MAX];
+  char        server[FLIGHT_TEXT_MAX];   // address:port
+  char        error[FLIGHT_TEXT_MAX];    // why it failed
+  FlightEvent events[FLIGHT_EVENTS];
+};
+
+typedef struct FlightRecorder FlightRecorder;
+struct FlightRecorder {
+  uint32_t      num_attempts;
+  uint32_t      next;      // the slot the next attempt takes
+  uint32_t      failures;  // attempts that have failed, ever
+  uint32_t      pad;
+  FlightAttempt attempts[];
+};
+
+
+/*****************************************************************************
+   EXTERNS
+ *****************************************************************************/
+
+extern FlightRecorder* flight_create(uint32_t num_attempts);
+extern void            flight_destroy(FlightRecorder* recorder);
+
+// the owning shard's side
+extern uint64_t        flight_begin(FlightRecorder* recorder, const char* app);
+extern void            flight_server(FlightRecorder* recorder, uint64_t attempt,
+                                     const char* addr, uint16_t port);
+extern void            flight_event(FlightRecorder* recorder, uint64_t attempt,
+                                    enum FLIGHT_KIND kind, char phase, int32_t arg);
+extern void            flight_end(FlightRecorder* recorder, uint64_t attempt,
+                                  const char* error);
+
+// any thread's
+extern uint32_t        flight_failures(const FlightRecorder* recorder);
+extern int             flight_dump(FlightRecorder* const* recorders, uint32_t count,
+                                   const char* app, int failed_only, const char* path,
+                                   uint32_t* num_dumped);
@@ -0,0 +1,247 @@
+/*****************************************************************************
+Copyright (c) 2014-2016, Juniper Networks, Inc.
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions
+are met:
+
+1. Redistributions of source code must retain the above copyright 
+   notice, this list of conditions and the following disclaimer.
+
+2. Redistributions in binary form must reproduce the above copyright
+   notice, this list of conditions and the following disclaimer in the
+   documentation and/or other materials provided with the distribution.
+
+3. Neither the name of the copyright holder nor the names of its 
+   contributors may be used to endorse or promote products derived 
+   from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS 
+"AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT 
+LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS 
+FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE 
+COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, 
+INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, 
+BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; 
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER 
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT 
+LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN 
+ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE 
+POSSIBILITY OF SUCH DAMAGE.
+ *****************************************************************************/
+
+
+
+/*****************************************************************************
+   OVERVIEW
+
+   This file implements a reference-counted string pool.  App names,
+   server addresses and host-key names are interned when the config is
+   parsed, so each distinct string is stored once however many apps use
+   it, and two interned strings are equal exactly when their pointers
+   are.  Each intern_string() must be matched by an intern_release().
+
+   The pool is shared by ncchd's shard threads, so every call takes
+   `pool_lock`; interning only happens on config changes, never on a
+   session's path.
+ *****************************************************************************/
+
+
+/*****************************************************************************
+   INCLUDES AND EXTERNS
+ *****************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include "ncchd.h"
+
+
+/*****************************************************************************
+   LOCAL/STATIC DEFINITIONS
+ *****************************************************************************/
+
+typedef struct InternNode InternNode;
+struct InternNode {
+    InternNode* next;     // bucket chain
+    uint32_t    hash;
+    uint32_t    refs;
+    char        str[];
+};
+
+static InternNode** buckets = NULL;
+static uint32_t     num_buckets = 0;
+static uint32_t     num_strings = 0;
+
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+
+
+// FNV-1a
+static uint32_t
+hash_string(const char* str) {
+    uint32_t hash = 2166136261u;
+    while (*str != '\0') {
+        hash ^= (unsigned char)*str++;
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+
+// double the bucket array once the chains average more than one node
+static void
+grow_buckets(void) {
+    uint32_t     new_num = num_buckets ? num_buckets * 2 : 1024;
+    InternNode** new_buckets;
+    uint32_t     idx;
+
+    new_buckets = (InternNode**)calloc(new_num, sizeof(InternNode*));
+    if (new_buckets == NULL) {
+        return;  // keep the longer chains, still correct
+    }
+    for (idx=0; idx<num_buckets; idx++) {
+        InternNode* node = buckets[idx];
+        while (node != NULL) {
+            InternNode* next = node->next;
+            node->next = new_buckets[node->hash & (new_num-1)];
+            new_buckets[node->hash & (new_num-1)] = node;
+            node = next;
+        }
+    }
+    free(buckets);
+    buckets = new_buckets;
+    num_buckets = new_num;
+}
+
+
+static const char*
+pool_add(const char* str) {
+    uint32_t    hash = hash_string(str);
+    InternNode* node;
+    size_t      len;
+
+    if (num_strings >= num_buckets) {
+        grow_buckets();
+        if (num_buckets == 0) {
+            return NULL;
+        }
+    }
+    for (node=buckets[hash & (num_buckets-1)]; node!=NULL; node=node->next) {
+        if (node->hash == hash && strcmp(node->str, str) == 0) {
+            node->refs++;
+            return node->str;
+        }
+    }
+
+    len = strlen(str);
+    node = (InternNode*)malloc(sizeof(InternNode) + len + 1);
+    if (node == NULL) {
+        return NULL;
+    }
+    node->hash = hash;
+    node->refs = 1;
+    memcpy(node->str, str, len + 1);
+    node->next = buckets[hash & (num_buckets-1)];
+    buckets[hash & (num_buckets-1)] = node;
+    num_strings++;
+    return node->str;
+}
+
+
+static const char*
+pool_find(const char* str) {
+    uint32_t    hash = hash_string(str);
+    InternNode* node;
+
+    if (num_buckets == 0) {
+        return NULL;
+    }
+    for (node=buckets[hash & (num_buckets-1)]; node!=NULL; node=node->next) {
+        if (node->hash == hash && strcmp(node->str, str) == 0) {
+            return node->str;
+        }
+    }
+    return NULL;
+}
+
+
+static void
+pool_drop(const char* str) {
+    InternNode*  node;
+    InternNode** link;
+
+    node = (InternNode*)((uintptr_t)str - offsetof(InternNode, str));
+    if (--node->refs != 0) {
+        return;
+    }
+    for (link=&buckets[node->hash & (num_buckets-1)]; *link!=NULL; link=&(*link)->next) {
+        if (*link == node) {
+            *link = node->next;
+            break;
+        }
+    }
+    num_strings--;
+    free(node);
+}
+
+
+/*****************************************************************************
+   INTERFACE
+ *****************************************************************************/
+
+// return the pooled copy of `str`, adding it if needed
+const char* // NULL if out of memory
+intern_string(const char* str) {
+    const char* pooled;
+
+    pthread_mutex_lock(&pool_lock);
+    pooled = pool_add(str);
+    pthread_mutex_unlock(&pool_lock);
+    return pooled;
+}
+
+
+// return the pooled copy of `str` if there is one, without taking a
+// reference, so it's only good while the caller holds one some other way
+const char* // NULL if not interned
+intern_lookup(const char* str) {
+    const char* pooled;
+
+    pthread_mutex_lock(&pool_lock);
+    pooled = pool_find(str);
+    pthread_mutex_unlock(&pool_lock);
+    return pooled;
+}
+
+
+// take another reference to an already interned string, NULL is ignored
+const char*
+intern_ref(const char* str) {
+    InternNode* node;
+
+    if (str == NULL) {
+        return NULL;
+    }
+    node = (InternNode*)((uintptr_t)str - offsetof(InternNode, str));
+    pthread_mutex_lock(&pool_lock);
+    node->refs++;
+    pthread_mutex_unlock(&pool_lock);
+    return str;
+}
+
+
+// drop a reference taken by intern_string() or intern_ref(), NULL is ignored
+void
+intern_release(const char* str) {
+    if (str == NULL) {
+        return;
+    }
+    pthread_mutex_lock(&pool_lock);
+    pool_drop(str);
+    pthread_mutex_unlock(&pool_lock);
+}
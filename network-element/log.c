@@ -0,0 +1,550 @@
+/*****************************************************************************
+Copyright (c) 2014-2016, Juniper Networks, Inc.
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions
+are met:
+
+1. Redistributions of source code must retain the above copyright 
+   notice, this list of conditions and the following disclaimer.
+
+2. Redistributions in binary form must reproduce the above copyright
+   notice, this list of conditions and the following disclaimer in the
+   documentation and/or other materials provided with the distribution.
+
+3. Neither the name of the copyright holder nor the names of its 
+   contributors may be used to endorse or promote products derived 
+   from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS 
+"AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT 
+LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS 
+FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE 
+COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, 
+INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, 
+BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; 
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER 
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT 
+LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN 
+ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE 
+POSSIBILITY OF SUCH DAMAGE.
+ *****************************************************************************/
+
+
+
+/*****************************************************************************
+   OVERVIEW
+
+   This file implements the logger declared in log.h.
+
+   The ring is a bounded multi-producer queue: each slot carries a
+   sequence number, a producer claims the next slot with one
+   compare-and-swap on `ring_head`, formats its message into the slot and
+   then publishes it by advancing the slot's sequence.  The flusher is
+   the only consumer; it takes published slots in order, adds the
+   timestamp and level, and writes them to stdout in batches.  Neither
+   side ever takes a lock.
+
+   The flusher sleeps on a pipe when the ring is empty.  A producer only
+   writes to that pipe when it finds the flusher asleep, so a busy
+   logger costs no system calls beyond the flusher's batched writes.
+ *****************************************************************************/
+
+
+/*****************************************************************************
+   INCLUDES AND EXTERNS
+ *****************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdarg.h>
+#include <stdatomic.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include "log.h"
+
+
+/*****************************************************************************
+   MACROS
+ *****************************************************************************/
+
+#define LOG_FLUSH_BUFFER       65536
+#define LOG_STREAM_READ_ROUNDS 16      // so one chatty child can't starve the rest
+
+
+/*****************************************************************************
+   LOCAL/STATIC DEFINITIONS
+ *****************************************************************************/
+
+typedef struct LogSlot LogSlot;
+struct LogSlot {
+    _Atomic uint64_t seq;       // == position when free, position+1 once published
+    int64_t          wall_ms;
+    uint8_t          level;
+    uint16_t         len;
+    char             text[LOG_LINE_MAX];
+};
+
+static LogSlot          ring[LOG_RING_SLOTS];
+static _Atomic uint64_t ring_head;          // next position producers claim
+static uint64_t         ring_tail;          // next position the flusher writes
+static _Atomic uint64_t ring_dropped;       // messages lost to a full ring
+
+static _Atomic int      level_threshold = LOG_LEVEL_INFO;
+static _Atomic int      flusher_running = 0; // else messages are written synchronously
+static _Atomic int      flusher_sleeping = 0;
+static _Atomic int      flusher_stopping = 0;
+static pthread_t        flusher;
+static int              wake_pipe[2] = { -1, -1 };
+
+static const char* level_names[] = { "error", "warn", "info", "debug" };
+static const char* level_labels[] = { "ERROR", "WARN ", "INFO ", "DEBUG" };
+
+
+static int64_t
+wall_now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+
+static int64_t
+monotonic_now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+
+// the formatted message's length, truncated to the slot and without the
+// trailing newline printf-style callers may have left on it
+static uint16_t
+message_length(int n, const char* text) {
+    size_t len = (n < 0) ? 0 : (n >= LOG_LINE_MAX) ? LOG_LINE_MAX - 1 : (size_t)n;
+
+    while (len > 0 && text[len-1] == '\n') {
+        len--;
+    }
+    return (uint16_t)len;
+}
+
+
+// "2016-05-04 10:11:12.345 INFO  <text>\n", at most LOG_LINE_MAX + 32 bytes
+static size_t
+format_line(char* out, int64_t wall_ms, int level, const char* text, size_t len) {
+    time_t    secs = (time_t)(wall_ms / 1000);
+    struct tm tm;
+    size_t    n;
+
+    localtime_r(&secs, &tm);
+    n = strftime(out, 32, "%Y-%m-%d %H:%M:%S", &tm);
+    n += sprintf(out + n, ".%03d %s ", (int)(wall_ms % 1000), level_labels[level]);
+    memcpy(out + n, text, len);
+    n += len;
+    out[n++] = '\n';
+    return n;
+}
+
+
+static void
+write_all(const char* buf, size_t len) {
+    while (len > 0) {
+        ssize_t n = write(STDOUT_FILENO, buf, len);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return;  // nowhere to log that stdout is gone
+        }
+        buf += n;
+        len -= n;
+    }
+}
+
+
+static void
+wake_flusher(void) {
+    if (atomic_exchange(&flusher_sleeping, 0)) {
+        ssize_t n = write(wake_pipe[1], "", 1);
+        (void)n;  // a full pipe wakes it just the same
+    }
+}
+
+
+static void
+ring_put(enum LOG_LEVEL level, const char* format, va_list args) {
+    uint64_t pos = atomic_load_explicit(&ring_head, memory_order_relaxed);
+    LogSlot* slot;
+    int      n;
+
+    for (;;) {
+        int64_t diff;
+
+        slot = &ring[pos & (LOG_RING_SLOTS - 1)];
+        diff = (int64_t)(atomic_load_explicit(&slot->seq, memory_order_acquire) - pos);
+        if (diff == 0) {
+            if (atomic_compare_exchange_weak_explicit(&ring_head, &pos, pos + 1,
+                                   memory_order_relaxed, memory_order_relaxed)) {
+                break;
+            }
+        } else if (diff < 0) {
+            // the flusher hasn't caught up with a full ring, don't wait for it
+            atomic_fetch_add_explicit(&ring_dropped, 1, memory_order_relaxed);
+            wake_flusher();
+            return;
+        } else {
+            pos = atomic_load_explicit(&ring_head, memory_order_relaxed);
+        }
+    }
+
+    slot->wall_ms = wall_now_ms();
+    slot->level = level;
+    n = vsnprintf(slot->text, sizeof(slot->text), format, args);
+    slot->len = message_length(n, slot->text);
+    atomic_store_explicit(&slot->seq, pos + 1, memory_order_release);
+
+    // pairs with the flusher's fence between going to sleep and checking
+    // the ring one last time
+    atomic_thread_fence(memory_order_seq_cst);
+    wake_flusher();
+}
+
+
+static void
+write_sync(enum LOG_LEVEL level, const char* format, va_list args) {
+    char text[LOG_LINE_MAX];
+    char line[LOG_LINE_MAX + 32];
+    int  n;
+
+    n = vsnprintf(text, sizeof(text), format, args);
+    write_all(line, format_line(line, wall_now_ms(), level, text, message_length(n, text)));
+}
+
+
+static int
+ring_ready(void) {
+    LogSlot* slot = &ring[ring_tail & (LOG_RING_SLOTS - 1)];
+
+    return atomic_load_explicit(&slot->seq, memory_order_acquire) == ring_tail + 1;
+}
+
+
+static void*
+flusher_main(void* arg) {
+    static char buf[LOG_FLUSH_BUFFER];
+
+    for (;;) {
+        struct pollfd pfd;
+        uint64_t      dropped;
+        size_t        len = 0;
+        char          scratch[64];
+
+        while (len + LOG_LINE_MAX + 32 <= sizeof(buf) - 128 && ring_ready()) {
+            LogSlot* slot = &ring[ring_tail & (LOG_RING_SLOTS - 1)];
+
+            len += format_line(buf + len, slot->wall_ms, slot->level, slot->text, slot->len);
+            atomic_store_explicit(&slot->seq, ring_tail + LOG_RING_SLOTS, memory_order_release);
+            ring_tail++;
+        }
+        dropped = atomic_exchange(&ring_dropped, 0);
+        if (dropped > 0) {
+            int n = snprintf(scratch, sizeof(scratch), "%llu log messages dropped (ring full)",
+                             (unsigned long long)dropped);
+            len += format_line(buf + len, wall_now_ms(), LOG_LEVEL_WARN, scratch, (size_t)n);
+        }
+        if (len > 0) {
+            write_all(buf, len);
+            continue;
+        }
+        if (atomic_load(&flusher_stopping)) {
+            break;
+        }
+
+        atomic_store(&flusher_sleeping, 1);
+        atomic_thread_fence(memory_order_seq_cst);
+        if (ring_ready() || atomic_load(&flusher_stopping)) {
+            atomic_store(&flusher_sleeping, 0);
+            continue;
+        }
+        pfd.fd = wake_pipe[0];
+        pfd.events = POLLIN;
+        poll(&pfd, 1, 1000);
+        while (read(wake_pipe[0], scratch, sizeof(scratch)) > 0) {
+            // drain wakeups
+        }
+        atomic_store(&flusher_sleeping, 0);
+    }
+    return NULL;
+}
+
+
+// the flusher thread doesn't survive fork(), so a child (e.g. one about
+// to exec sshd) logs synchronously
+static void
+forked_child(void) {
+    atomic_store(&flusher_running, 0);
+}
+
+
+/*****************************************************************************
+   INTERFACE
+ *****************************************************************************/
+
+// start the background flusher.  On failure, logging stays synchronous.
+int // 0=OK, 1=ERROR
+log_start(void) {
+    static int registered = 0;
+    uint64_t   pos;
+    sigset_t   signals;
+    sigset_t   saved;
+    int        result;
+
+    if (atomic_load(&flusher_running)) {
+        return 0;
+    }
+    if (pipe(wake_pipe) != 0) {
+        return 1;
+    }
+    fcntl(wake_pipe[0], F_SETFD, FD_CLOEXEC);
+    fcntl(wake_pipe[1], F_SETFD, FD_CLOEXEC);
+    fcntl(wake_pipe[0], F_SETFL, O_NONBLOCK);
+    fcntl(wake_pipe[1], F_SETFL, O_NONBLOCK);
+
+    for (pos=0; pos<LOG_RING_SLOTS; pos++) {
+        atomic_store(&ring[pos].seq, pos);
+    }
+    atomic_store(&ring_head, 0);
+    ring_tail = 0;
+    atomic_store(&flusher_stopping, 0);
+
+    // the daemon's signals are for its main thread, not the flusher
+    sigfillset(&signals);
+    pthread_sigmask(SIG_BLOCK, &signals, &saved);
+    result = pthread_create(&flusher, NULL, flusher_main, NULL);
+    pthread_sigmask(SIG_SETMASK, &saved, NULL);
+    if (result != 0) {
+        close(wake_pipe[0]);
+        close(wake_pipe[1]);
+        wake_pipe[0] = wake_pipe[1] = -1;
+        return 1;
+    }
+    if (!registered) {
+        pthread_atfork(NULL, NULL, forked_child);
+        atexit(log_stop);
+        registered = 1;
+    }
+    atomic_store(&flusher_running, 1);
+    return 0;
+}
+
+
+// write out whatever is still in the ring and stop the flusher
+void
+log_stop(void) {
+    if (!atomic_load(&flusher_running)) {
+        return;
+    }
+    atomic_store(&flusher_running, 0);
+    atomic_store(&flusher_stopping, 1);
+    atomic_store(&flusher_sleeping, 1);
+    wake_flusher();
+    pthread_join(flusher, NULL);
+    close(wake_pipe[0]);
+    close(wake_pipe[1]);
+    wake_pipe[0] = wake_pipe[1] = -1;
+}
+
+
+int // 0=OK, 1=ERROR (unknown level)
+log_set_level(const char* name) {
+    int level;
+
+    for (level=LOG_LEVEL_ERROR; level<=LOG_LEVEL_DEBUG; level++) {
+        if (strcmp(name, level_names[level]) == 0) {
+            atomic_store(&level_threshold, level);
+            return 0;
+        }
+    }
+    return 1;
+}
+
+
+const char*
+log_level_name(void) {
+    return level_names[atomic_load(&level_threshold)];
+}
+
+
+// lets callers skip building expensive messages (e.g. config dumps)
+int // 1 if messages at `level` are logged, 0 otherwise
+log_enabled(enum LOG_LEVEL level) {
+    return (int)level <= atomic_load_explicit(&level_threshold, memory_order_relaxed);
+}
+
+
+void
+log_msg(enum LOG_LEVEL level, const char* format, ...) {
+    va_list args;
+
+    if (!log_enabled(level)) {
+        return;
+    }
+    va_start(args, format);
+    if (atomic_load_explicit(&flusher_running, memory_order_relaxed)) {
+        ring_put(level, format, args);
+    } else {
+        write_sync(level, format, args);
+    }
+    va_end(args);
+}
+
+
+/*****************************************************************************
+   STREAMS
+ *****************************************************************************/
+
+// true if the stream's buffered line contains `mark`
+static int
+line_has(LogStream* stream, const char* mark) {
+    size_t mark_len = strlen(mark);
+    size_t idx;
+
+    for (idx=0; idx+mark_len<=stream->len; idx++) {
+        if (memcmp(stream->line + idx, mark, mark_len) == 0) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+
+// log the stream's buffered line, unless it's over its rate limit
+static void
+stream_line(LogStream* stream) {
+    int64_t  now = monotonic_now_ms();
+    uint32_t idx;
+
+    for (idx=0; idx<stream->num_marks; idx++) {
+        if (!(stream->seen & (1u << idx)) && line_has(stream, stream->marks[idx])) {
+            stream->seen |= 1u << idx;
+            stream->fresh |= 1u << idx;
+        }
+    }
+
+    if (now - stream->window_ms >= 1000) {
+        if (stream->suppressed > 0) {
+            log_warn("app \"%s\" session %u: %u sshd lines suppressed (rate limit)",
+                     stream->app, stream->session, stream->suppressed);
+        }
+        stream->window_ms = now;
+        stream->window_lines = 0;
+        stream->suppressed = 0;
+    }
+    if (stream->window_lines >= LOG_STREAM_LINES_PER_SEC) {
+        stream->suppressed++;
+    } else {
+        stream->window_lines++;
+        log_info("app \"%s\" session %u sshd: %.*s", stream->app, stream->session,
+                 (int)stream->len, stream->line);
+    }
+    stream->len = 0;
+}
+
+
+// take over `fd`, the read end of a child's stderr pipe
+LogStream* // NULL on error, with `fd` closed
+log_stream_open(int fd, const char* app, uint32_t session) {
+    LogStream* stream = (LogStream*)calloc(1, sizeof(LogStream));
+
+    if (stream == NULL || (stream->app = strdup(app)) == NULL) {
+        free(stream);
+        close(fd);
+        return NULL;
+    }
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    stream->fd = fd;
+    stream->session = session;
+    stream->window_ms = monotonic_now_ms();
+    return stream;
+}
+
+
+// log whatever complete lines the child has written, without blocking
+int // 0=still open, 1=EOF or error (the caller closes it)
+log_stream_read(LogStream* stream) {
+    char buf[4096];
+    int  round;
+
+    for (round=0; round<LOG_STREAM_READ_ROUNDS; round++) {
+        ssize_t n = read(stream->fd, buf, sizeof(buf));
+        ssize_t idx;
+
+        if (n == 0) {
+            return 1;
+        }
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return (errno == EAGAIN || errno == EWOULDBLOCK) ? 0 : 1;
+        }
+        for (idx=0; idx<n; idx++) {
+            if (buf[idx] == '\n') {
+                stream_line(stream);
+            } else if (buf[idx] != '\r') {
+                stream->line[stream->len++] = buf[idx];
+                if (stream->len == sizeof(stream->line)) {
+                    stream_line(stream);  // overlong, split it
+                }
+            }
+        }
+    }
+    return 0;
+}
+
+
+// watch for up to 32 marks, which must outlive the stream
+void
+log_stream_marks(LogStream* stream, const char* const* marks, uint32_t count) {
+    stream->marks = marks;
+    stream->num_marks = (count < 32) ? count : 32;
+}
+
+
+// the marks seen since the last call, bit i for marks[i]
+uint32_t
+log_stream_take_marks(LogStream* stream) {
+    uint32_t fresh = stream->fresh;
+
+    stream->fresh = 0;
+    return fresh;
+}
+
+
+// log what's left of the stream and release it
+void
+log_stream_close(LogStream* stream) {
+    if (stream == NULL) {
+        return;
+    }
+    log_stream_read(stream);
+    if (stream->len > 0) {
+        stream_line(stream);
+    }
+    if (stream->suppressed > 0) {
+        log_warn("app \"%s\" session %u: %u sshd lines suppressed (rate limit)",
+                 stream->app, stream->session, stream->suppressed);
+    }
+    close(stream->fd);
+    free(stream->app);
+    free(stream);
+}
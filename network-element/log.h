@@ -0,0 +1,109 @@
+/*****************************************************************************
+Copyright (c) 2014-2016, Juniper Networks, Inc.
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions
+are met:
+
+1. Redistributions of source code must retain the above copyright 
+   notice, this list of conditions and the following disclaimer.
+
+2. Redistributions in binary form must reproduce the above copyright
+   notice, this list of conditions and the following disclaimer in the
+   documentation and/or other materials provided with the distribution.
+
+3. Neither the name of the copyright holder nor the names of its 
+   contributors may be used to endorse or promote products derived 
+   from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS 
+"AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT 
+LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS 
+FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE 
+COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, 
+INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, 
+BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; 
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER 
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT 
+LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN 
+ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE 
+POSSIBILITY OF SUCH DAMAGE.
+ *****************************************************************************/
+
+
+
+/*****************************************************************************
+   OVERVIEW
+
+   This header file declares ncchd's logger.  Messages are formatted by
+   the caller straight into a slot of a lock-free ring buffer and written
+   out by a background flusher thread, so logging never blocks the event
+   loop (or the host-key threads) on stdout.  When the ring is full,
+   messages are dropped and counted rather than waited for.
+
+   Until log_start() is called, and in forked children, messages are
+   written synchronously instead.
+
+   A LogStream turns a child's stderr pipe into log lines tagged with the
+   app and session they came from, rate-limited per stream so a chatty
+   `sshd -ddd` can't flood the log.  It can also watch for marks, lines
+   showing how far the child has got, whatever the rate limit lets through.
+ *****************************************************************************/
+
+
+/*****************************************************************************
+   MACROS
+ *****************************************************************************/
+
+#define LOG_RING_SLOTS          4096   // must be a power of 2
+#define LOG_LINE_MAX            240    // longer messages are truncated
+#define LOG_STREAM_LINES_PER_SEC 100   // per LogStream, the rest are counted
+
+#define log_error(...) log_msg(LOG_LEVEL_ERROR, __VA_ARGS__)
+#define log_warn(...)  log_msg(LOG_LEVEL_WARN, __VA_ARGS__)
+#define log_info(...)  log_msg(LOG_LEVEL_INFO, __VA_ARGS__)
+#define log_debug(...) log_msg(LOG_LEVEL_DEBUG, __VA_ARGS__)
+
+
+/*****************************************************************************
+   STRUCTS
+ *****************************************************************************/
+
+enum LOG_LEVEL { LOG_LEVEL_ERROR, LOG_LEVEL_WARN, LOG_LEVEL_INFO, LOG_LEVEL_DEBUG };
+
+typedef struct LogStream LogStream;
+struct LogStream {
+  int       fd;                     // read end of the child's stderr pipe
+  uint32_t  session;
+  char*     app;
+  int64_t   window_ms;              // start of the current rate-limit second
+  uint32_t  window_lines;           // lines logged in it
+  uint32_t  suppressed;             // lines dropped by the rate limit
+  const char* const* marks;         // substrings to watch for, "" for the first line
+  uint32_t  num_marks;
+  uint32_t  seen;                   // marks seen, a bit each
+  uint32_t  fresh;                  // ...and not yet taken
+  uint16_t  len;                    // of the partial line in `line`
+  char      line[LOG_LINE_MAX];
+};
+
+
+/*****************************************************************************
+   EXTERNS
+ *****************************************************************************/
+
+extern int         log_start(void);
+extern void        log_stop(void);
+extern int         log_set_level(const char* name);
+extern const char* log_level_name(void);
+extern int         log_enabled(enum LOG_LEVEL level);
+extern void        log_msg(enum LOG_LEVEL level, const char* format, ...)
+                                     __attribute__((format(printf, 2, 3)));
+
+extern LogStream*  log_stream_open(int fd, const char* app, uint32_t session);
+extern int         log_stream_read(LogStream* stream);
+extern void        log_stream_close(LogStream* stream);
+extern void        log_stream_marks(LogStream* stream, const char* const* marks,
+                                    uint32_t count);
+extern uint32_t    log_stream_take_marks(LogStream* stream);
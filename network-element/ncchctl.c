@@ -0,0 +1,387 @@
+/*****************************************************************************
+Copyright (c) 2014-2016, Juniper Networks, Inc.
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions
+are met:
+
+1. Redistributions of source code must retain the above copyright 
+   notice, this list of conditions and the following disclaimer.
+
+2. Redistributions in binary form must reproduce the above copyright
+   notice, this list of conditions and the following disclaimer in the
+   documentation and/or other materials provided with the distribution.
+
+3. Neither the name of the copyright holder nor the names of its 
+   contributors may be used to endorse or promote products derived 
+   from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS 
+"AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT 
+LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS 
+FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE 
+COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, 
+INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, 
+BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; 
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER 
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT 
+LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN 
+ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE 
+POSSIBILITY OF SUCH DAMAGE.
+ *****************************************************************************/
+
+
+
+/*****************************************************************************
+   OVERVIEW
+
+   This file defines `ncchctl`, a command-line tool for inspecting and
+   changing a running `ncchd`.  The "status" command maps the daemon's
+   status table (see status_table.h) read-only and prints one line per
+   app, so it never takes a lock or sends anything to the daemon.  The
+   "upsert", "delete", "log-level", "restart" and "trace" commands send
+   a single request over the daemon's control socket.  "restart" has the
+   daemon re-exec its binary, keeping every established session.  "trace"
+   has it write its recent connect attempts (or an app's) to
+   .ncchd.trace.json in its directory, for chrome://tracing.  "notify"
+   publishes an event notification in netconfd's ring (see notify.h),
+   for every subscribed NETCONF session to send on.
+
+   Usage:
+
+       ncchctl [-f <status-file>] status [<app-name>]
+       ncchctl [-s <control-socket>] upsert <application.xml | ->
+       ncchctl [-s <control-socket>] delete <app-name>
+       ncchctl [-s <control-socket>] log-level <error|warn|info|debug>
+       ncchctl [-s <control-socket>] restart
+       ncchctl [-s <control-socket>] trace [<app-name>]
+       ncchctl [-n <event-ring>] notify <event.xml | ->
+ *****************************************************************************/
+
+
+/*****************************************************************************
+   INCLUDES
+ *****************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "status_table.h"
+#include "notify.h"
+
+
+/*****************************************************************************
+   MACROS
+ *****************************************************************************/
+
+#define CONTROL_SOCKET_PATH  ".ncchd.ctl"     // must match ncchd.c
+#define CONTROL_MAX_REQUEST  65536
+
+
+/*****************************************************************************
+   LOCAL/STATIC DEFINITIONS
+ *****************************************************************************/
+
+static void
+usage(const char* progname) {
+    fprintf(stderr, "usage: %s [-f <status-file>] status [<app-name>]\n", progname);
+    fprintf(stderr, "       %s [-s <control-socket>] upsert <application.xml | ->\n", progname);
+    fprintf(stderr, "       %s [-s <control-socket>] delete <app-name>\n", progname);
+    fprintf(stderr, "       %s [-s <control-socket>] log-level <error|warn|info|debug>\n", progname);
+    fprintf(stderr, "       %s [-s <control-socket>] restart\n", progname);
+    fprintf(stderr, "       %s [-s <control-socket>] trace [<app-name>]\n", progname);
+    fprintf(stderr, "       %s [-n <event-ring>] notify <event.xml | ->\n", progname);
+}
+
+
+// render a duration compactly, e.g. "42s", "7m03s", "5h12m", "3d04h"
+static void
+format_duration(int64_t secs, char* buf, size_t size) {
+    if (secs < 0) {
+        snprintf(buf, size, "-");
+    } else if (secs < 60) {
+        snprintf(buf, size, "%llds", (long long)secs);
+    } else if (secs < 3600) {
+        snprintf(buf, size, "%lldm%02llds", (long long)secs/60, (long long)secs%60);
+    } else if (secs < 86400) {
+        snprintf(buf, size, "%lldh%02lldm", (long long)secs/3600, (long long)(secs%3600)/60);
+    } else {
+        snprintf(buf, size, "%lldd%02lldh", (long long)secs/86400, (long long)(secs%86400)/3600);
+    }
+}
+
+
+static int // 0=OK, 1=ERROR, 2=NOTFOUND
+print_status(StatusTable* table, const char* appname) {
+    uint32_t high_water;
+    uint32_t slot;
+    int      found = 0;
+    time_t   now = time(NULL);
+
+    high_water = __atomic_load_n(&table->header.high_water, __ATOMIC_ACQUIRE);
+    if (high_water > table->header.num_slots) {
+        high_water = table->header.num_slots;
+    }
+
+    printf("%-24s %-10s %-28s %8s %10s %8s %8s %8s %4s %9s %5s  %s\n", "APP",
+           "STATE", "SERVER", "FOR", "CONNECTED", "SESSIONS", "FAILURES",
+           "SKIPPED", "MIGR", "LAST-SESS", "EXIT", "LAST-ERROR");
+
+    for (slot=0; slot<high_water; slot++) {
+        AppStatus status;
+        char      server[96];
+        char      state_for[24];
+        char      connected_for[24];
+        char      last_session[24];
+        char      last_exit[16];
+
+        status_read(&(table->slots[slot]), &status);
+        if (status.state == APP_FREE) {
+            continue;
+        }
+        status.name[sizeof(status.name)-1] = '\0';
+        status.addr[sizeof(status.addr)-1] = '\0';
+        status.last_error[sizeof(status.last_error)-1] = '\0';
+        if (appname != NULL && strcmp(appname, status.name) != 0) {
+            continue;
+        }
+        found++;
+
+        if (status.addr[0] == '\0') {
+            snprintf(server, sizeof(server), "-");
+        } else {
+            snprintf(server, sizeof(server), "%s:%u", status.addr, status.port);
+        }
+        format_duration(now - status.state_since, state_for, sizeof(state_for));
+        if (status.state == APP_CONNECTED) {
+            format_duration(now - status.connected_since, connected_for,
+                                                          sizeof(connected_for));
+        } else {
+            snprintf(connected_for, sizeof(connected_for), "-");
+        }
+
+        if (status.sessions_ended == 0) {
+            snprintf(last_session, sizeof(last_session), "-");
+            snprintf(last_exit, sizeof(last_exit), "-");
+        } else {
+            format_duration(status.last_session_secs, last_session,
+                                                      sizeof(last_session));
+            if (status.last_exit < 0) {
+                snprintf(last_exit, sizeof(last_exit), "sig%d", -status.last_exit);
+            } else {
+                snprintf(last_exit, sizeof(last_exit), "%d", status.last_exit);
+            }
+        }
+
+        printf("%-24s %-10s %-28s %8s %10s %8u %8u %8u %4u %9s %5s  %s\n",
+               status.name, status_state_name(status.state), server,
+               state_for, connected_for, status.connects, status.failures,
+               status.skipped, status.migrations, last_session, last_exit,
+               status.last_error);
+    }
+
+    if (appname != NULL && found == 0) {
+        fprintf(stderr, "no such app \"%s\"\n", appname);
+        return 2;
+    }
+    return 0;
+}
+
+
+// send one request to ncchd's control socket and print its reply
+static int // 0=OK, 1=ERROR
+send_control_request(const char* path, const char* request, size_t len) {
+    struct sockaddr_un addr;
+    char               reply[256];
+    size_t             reply_len = 0;
+    ssize_t            n;
+    int                sockfd;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", path);
+
+    sockfd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (sockfd == -1 || connect(sockfd, (struct sockaddr*)&addr, sizeof(addr)) != 0) {
+        fprintf(stderr, "could not connect to \"%s\" (is ncchd running?)\n", path);
+        if (sockfd != -1) {
+            close(sockfd);
+        }
+        return 1;
+    }
+
+    while (len > 0 && (n = write(sockfd, request, len)) > 0) {
+        request += n;
+        len -= n;
+    }
+    shutdown(sockfd, SHUT_WR);  // marks the end of the request
+
+    while (reply_len < sizeof(reply)-1 &&
+           (n = read(sockfd, reply+reply_len, sizeof(reply)-1-reply_len)) > 0) {
+        reply_len += n;
+    }
+    reply[reply_len] = '\0';
+    close(sockfd);
+
+    printf("%s", reply);
+    return strncmp(reply, "ok", 2) == 0 ? 0 : 1;
+}
+
+
+// read an <application> element from a file ("-" for stdin) and send it
+static int // 0=OK, 1=ERROR
+upsert(const char* path, const char* filename) {
+    static char request[CONTROL_MAX_REQUEST];
+    size_t      len;
+    FILE*       file;
+
+    file = (strcmp(filename, "-") == 0) ? stdin : fopen(filename, "r");
+    if (file == NULL) {
+        fprintf(stderr, "could not open \"%s\"\n", filename);
+        return 1;
+    }
+    strcpy(request, "upsert\n");
+    len = strlen(request);
+    len += fread(request+len, 1, sizeof(request)-len, file);
+    if (file != stdin) {
+        fclose(file);
+    }
+    if (len == sizeof(request)) {
+        fprintf(stderr, "\"%s\" is too large\n", filename);
+        return 1;
+    }
+    return send_control_request(path, request, len);
+}
+
+
+// read an event's XML from a file ("-" for stdin) and publish it
+static int // 0=OK, 1=ERROR
+notify(const char* path, const char* filename) {
+    char        event[NOTIFY_EVENT_MAX + 1];
+    size_t      len;
+    FILE*       file;
+    NotifyRing* ring;
+    int         result;
+
+    file = (strcmp(filename, "-") == 0) ? stdin : fopen(filename, "r");
+    if (file == NULL) {
+        fprintf(stderr, "could not open \"%s\"\n", filename);
+        return 1;
+    }
+    len = fread(event, 1, sizeof(event), file);
+    if (file != stdin) {
+        fclose(file);
+    }
+    while (len > 0 && (event[len-1] == '\n' || event[len-1] == '\r' ||
+                       event[len-1] == ' ' || event[len-1] == '\t')) {
+        len--;
+    }
+    if (len > NOTIFY_EVENT_MAX) {
+        fprintf(stderr, "\"%s\" is too large (%d bytes at most)\n", filename,
+                NOTIFY_EVENT_MAX);
+        return 1;
+    }
+    ring = notify_ring_open(path, 1);
+    if (ring == NULL) {
+        fprintf(stderr, "could not open event ring \"%s\"\n", path);
+        return 1;
+    }
+    result = notify_publish(ring, event, len);
+    notify_ring_close(ring);
+    return result;
+}
+
+
+/*****************************************************************************
+   MAIN
+ *****************************************************************************/
+
+int // 0=OK, 1=ERROR, 2=NOTFOUND
+main(int argc, char* argv[]) {
+    const char*  path = STATUS_TABLE_PATH;
+    const char*  control_path = CONTROL_SOCKET_PATH;
+    const char*  events_path = NOTIFY_RING_PATH;
+    const char*  appname = NULL;
+    StatusTable* table;
+    size_t       size;
+    int          opt;
+    int          result;
+    static char  outbuf[1 << 16];
+
+    while ((opt = getopt(argc, argv, "f:s:n:h")) != -1) {
+        switch (opt) {
+            case 'f':
+                path = optarg;
+                break;
+            case 's':
+                control_path = optarg;
+                break;
+            case 'n':
+                events_path = optarg;
+                break;
+            default:
+                usage(argv[0]);
+                return 1;
+        }
+    }
+    if (optind >= argc) {
+        usage(argv[0]);
+        return 1;
+    }
+    if (strcmp(argv[optind], "upsert") == 0 && optind + 1 < argc) {
+        return upsert(control_path, argv[optind + 1]);
+    }
+    if (strcmp(argv[optind], "delete") == 0 && optind + 1 < argc) {
+        char request[128];
+        snprintf(request, sizeof(request), "delete %s\n", argv[optind + 1]);
+        return send_control_request(control_path, request, strlen(request));
+    }
+    if (strcmp(argv[optind], "log-level") == 0 && optind + 1 < argc) {
+        char request[128];
+        snprintf(request, sizeof(request), "log-level %s\n", argv[optind + 1]);
+        return send_control_request(control_path, request, strlen(request));
+    }
+    if (strcmp(argv[optind], "notify") == 0 && optind + 1 < argc) {
+        return notify(events_path, argv[optind + 1]);
+    }
+    if (strcmp(argv[optind], "restart") == 0) {
+        return send_control_request(control_path, "restart\n", 8);
+    }
+    if (strcmp(argv[optind], "trace") == 0) {
+        char request[128];
+        if (optind + 1 < argc) {
+            snprintf(request, sizeof(request), "trace %s\n", argv[optind + 1]);
+        } else {
+            snprintf(request, sizeof(request), "trace\n");
+        }
+        return send_control_request(control_path, request, strlen(request));
+    }
+    if (strcmp(argv[optind], "status") != 0) {
+        usage(argv[0]);
+        return 1;
+    }
+    if (optind + 1 < argc) {
+        appname = argv[optind + 1];
+    }
+
+    table = status_table_map(path, &size);
+    if (table == NULL) {
+        fprintf(stderr, "could not map status table \"%s\" (is ncchd running?)\n", path);
+        return 1;
+    }
+
+    // one big buffer, so dumping 10k apps is a handful of write()s
+    setvbuf(stdout, outbuf, _IOFBF, sizeof(outbuf));
+
+    result = print_status(table, appname);
+    fflush(stdout);
+    munmap(table, size);
+    return result;
+}
@@ -40,6 +40,31 @@ POSSIBILITY OF SUCH DAMAGE.
    system's current "running config" and then maintain connections to
    NMSs as specified in the configuration.  This code forks/execs `sshd`
    as soon as its TCP connection is accepted by the NMS.
+
+   Apps are sharded by name over NCCHD_WORKERS threads (default 1).  Each
+   shard's event loop maintains its apps: connects are non-blocking,
+   retries are timers, and each sshd is watched through a pidfd so that
+   it's reaped (and its exit recorded) as soon as it exits.  The main
+   thread reads the config, serves the control socket and hands each
+   shard its share of every change through a lock-free queue.
+
+   Connect attempts are admitted through a token bucket and a cap on
+   concurrent handshakes, so a start or reload of many apps ramps up at
+   a steady rate instead of all at once; apps waiting their turn queue
+   by priority, then first come first served.
+
+   In-process apps marked <shared-connection/> that call the same NMS
+   with the same host keys share one SSH connection, a NETCONF channel
+   each; see SHARED CONNECTIONS below.
+
+   Each shard records a trace of its apps' recent connect attempts, from
+   the connect through sshd's handshake to the session's end, which
+   `ncchctl trace` writes out for chrome://tracing (see flight.h); the
+   failed ones are also written out every few seconds when there are new.
+
+   On SIGUSR2 (or `ncchctl restart`) ncchd re-execs its binary in place,
+   handing every live session to the new image, so a restart or upgrade
+   drops none of them; see HANDOFF below.
  *****************************************************************************/
 
 
@@ -47,23 +72,48 @@ POSSIBILITY OF SUCH DAMAGE.
    INCLUDES AND EXTERNS
  *****************************************************************************/
 
+#ifdef __linux__
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE     // pthread_setaffinity_np()
+#endif
+#endif
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
 #include <string.h>
 #include <assert.h>   // use -DNDEBUG compiler option to remove asserts
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
 #include <fcntl.h>
 #include <netdb.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <errno.h>
+#include <limits.h>
 #include <sys/wait.h>
+#include <sys/syscall.h>
 #include <signal.h>
 #include <unistd.h>
+#include <poll.h>
+#include <time.h>
 #include "roxml.h"
 #include "ncchd.h"
+#include "status_table.h"
+#include "host_keys.h"
+#include "relay.h"
+#include "server_stats.h"
+#include "breaker.h"
+#include "tcp_profile.h"
+#include "ssh_profile.h"
+#include "ssh_server.h"
+#include "flight.h"
+#include "log.h"
 
 
 /*****************************************************************************
@@ -76,10 +126,58 @@ typedef unsigned int       bool;
 
 #define PATH_SSHD "/usr/local/pkixssh-9.2/sbin/sshd"
 
-// prints sshd's stderr to the screen, comment to direct
-// output to the log file specified in the sshd_config file
+// how long a connect to a server may take before it counts as failed,
+// and how long a stopped session's sshd gets to exit before SIGKILL
+#define CONNECT_TIMEOUT_SECS 30
+#define ORPHAN_KILL_SECS     5
+
+// how long a background probe of a preferred server may take, and how
+// far the probe interval backs off while it stays unreachable
+#define PROBE_TIMEOUT_MSECS 2000
+#define PROBE_MAX_BACKOFF   8
+
+// Unix-domain socket accepting per-app upsert/delete requests, see
+// handle_control_request()
+#define CONTROL_SOCKET_PATH  ".ncchd.ctl"
+#define CONTROL_MAX_REQUEST  65536
+#define CONTROL_TIMEOUT_SECS 2
+
+// where `netconfd -d`, run from ncchd's directory, takes sessions
+#define NETCONFD_SOCKET_PATH ".netconfd.sock"   // must match netconfd.c
+#define NETCONFD_EVENTS_PATH ".netconfd.events"  // must match notify.h
+
+// shards (worker threads) the apps are spread over, see SHARDS below
+#define MAX_SHARDS           64
+#define SHARD_QUEUE_SIZE     256    // must be a power of 2
+
+// admission control defaults, see ADMISSION CONTROL below.  An sshd
+// counts as handshaking for HANDSHAKE_MSECS after it's started, as ncchd
+// can't see when its SSH handshake is done.
+#define ADMIT_RATE_PER_SEC   100    // NCCHD_CONNECT_RATE, 0 for no limit
+#define ADMIT_BURST          20     // NCCHD_CONNECT_BURST
+#define ADMIT_MAX_HANDSHAKES 64     // NCCHD_MAX_HANDSHAKES, 0 for no cap
+#define HANDSHAKE_MSECS      1000
+
+// a shard's shared connections are looked up in a table this size, see
+// SHARED CONNECTIONS below
+#define SHARED_BUCKETS       256
+
+// ncchd re-exec'd by handoff_exec() finds its sessions through this fd
+#define HANDOFF_ENV          "NCCHD_HANDOFF_FD"
+#define HANDOFF_MAGIC        0x6e636868    // "ncch"
+#define HANDOFF_VERSION      1
+
+// runs sshd with debug output (-ddd -e), which reaches the log through
+// its stderr pipe, comment to run it quietly
 #define DEBUG_SSHD
 
+// connect attempts each shard's flight recorder keeps (see flight.h), and
+// how often the failed ones are written out if there are new ones
+#define TRACE_ATTEMPTS_ENV        "NCCHD_TRACE_ATTEMPTS"
+#define TRACE_PATH                ".ncchd.trace.json"
+#define TRACE_FAILURES_PATH       ".ncchd.failures.json"
+#define TRACE_FAILURES_SECS       10
+
 
 /*****************************************************************************
    LOCAL/STATIC DEFINITIONS
@@ -87,151 +185,313 @@ typedef unsigned int       bool;
 
 static bool shutting_down = false; // only true if sigint delivered
 static bool restarting    = false; // only true if sighup delivered
+static bool upgrading     = false; // only true if sigusr2 delivered
+
+// how to re-exec ncchd for a handoff, see main()
+static char   self_path[PATH_MAX];
+static char** self_argv = NULL;
+
+// why the last connect attempt failed, for the status table (per shard)
+static __thread char connect_error[64];
+
+// the shard's flight recorder, NULL on the main thread or if there's none
+static __thread FlightRecorder* flight = NULL;
+
+// control socket, see handle_control_request()
+static int control_fd = -1;
+
+// tags each sshd's stderr lines in the log
+static _Atomic uint32_t last_session_id = 0;
+
+// lines of sshd's debug output marking its progress, bit i of the
+// stream's marks each, as trace_progress() reads them
+#define SSHD_MARKS 4
+static const char* const sshd_marks[SSHD_MARKS] = {
+    "",                              // exec'd
+    "SSH2_MSG_NEWKEYS received",     // key exchange done
+    "Accepted ",                     // NMS authenticated
+    "subsystem request for ",        // netconf subsystem started
+};
+
+// child writing the active config back after control socket changes
+static Child persist_child   = { -1, -1, 0, NULL };
+static bool  persist_pending = false;
 
 
 static void
 signal_handler(int sig) {
     if (sig == SIGINT) {
-        printf("SIGINT CAUGHT!!! in pid 0x%x (ppid 0x%x)\n", getpid(), getppid());
+        log_info("SIGINT CAUGHT!!! in pid 0x%x (ppid 0x%x)", getpid(), getppid());
         shutting_down = true;
 
     } else if (sig == SIGHUP) {
 
-        printf("SIGHUP CAUGHT!!!\n");
+        log_info("SIGHUP CAUGHT!!!");
         restarting = true;
         signal(SIGHUP, signal_handler);
+
+    } else if (sig == SIGUSR2) {
+        log_info("SIGUSR2 CAUGHT!!!");
+        upgrading = true;
+        signal(SIGUSR2, signal_handler);
     }
 }
 
 
-#ifdef DEBUG_SSHD
-// this is simple utility to dump the Configuration structure to stdout
+// this is simple utility to dump the Configuration structure to the log
 static void
 print_config(Configuration* config) {
-    uint8_t app_idx;
+    uint32_t app_idx;
     for (app_idx=0; app_idx<config->num_apps; app_idx++) {
         Application* app = &(config->apps[app_idx]);
-        printf("  - app %d\n", app_idx);
-        printf("     - name = %s\n", app->name);
-        printf("     - servers\n");
-        uint8_t svr_idx;
+        log_debug("  - app %u", app_idx);
+        log_debug("     - name = %s", app->name);
+        log_debug("     - servers");
+        uint32_t svr_idx;
         for (svr_idx=0; svr_idx<app->num_servers; svr_idx++) {
             Server* svr = &(app->servers[svr_idx]);
-            printf("        - svr\n");
-            printf("           - addr = %s\n", svr->addr);
-            printf("           - port = %d\n", svr->port);
+            log_debug("        - svr");
+            log_debug("           - addr = %s", svr->addr);
+            log_debug("           - port = %d", svr->port);
         }
         if (app->transport_type == SSH) {
-            printf("     - transport: ssh\n");
-            printf("        - host_keys\n");
-            uint8_t key_idx;
+            log_debug("     - transport: ssh");
+            log_debug("        - host_keys");
+            uint32_t key_idx;
             for (key_idx=0; key_idx<app->num_host_keys; key_idx++) {
                 HostKey *host_key = &(app->host_keys[key_idx]);
-                printf("           - host_key: %s\n", host_key->name);
+                log_debug("           - host_key: %s", host_key->name);
+            }
+            if (app->relay_to.addr != NULL) {
+                log_debug("        - relay_to = %s:%d", app->relay_to.addr, app->relay_to.port);
+            }
+            if (app->in_process) {
+                log_debug("        - in_process");
+            }
+            if (app->shared) {
+                log_debug("        - shared");
             }
+            if (app->crypto.kex != NULL) {
+                log_debug("        - kex = %s", app->crypto.kex);
+            }
+            if (app->crypto.ciphers != NULL) {
+                log_debug("        - ciphers = %s", app->crypto.ciphers);
+            }
+            if (app->crypto.macs != NULL) {
+                log_debug("        - macs = %s", app->crypto.macs);
+            }
+            if (app->crypto.host_key_algorithms != NULL) {
+                log_debug("        - host_key_algorithms = %s", app->crypto.host_key_algorithms);
+            }
+            if (app->crypto.x509_key_algorithm != NULL) {
+                log_debug("        - x509_key_algorithm = %s", app->crypto.x509_key_algorithm);
+            }
+            log_debug("        - compression = %s",
+                      ssh_profile_compression_name(app->crypto.compression));
         } else {
-            printf("     - transport: tls\n");
+            log_debug("     - transport: tls");
         }
         if (app->connection_type == PERSISTENT) {
-            printf("     - connection_type = persistent\n");
-            printf("          - keep_alive_strategy\n");
-            printf("               - interval_secs = %d\n", app->keep_alive_strategy.interval_secs);
-            printf("               - count_max = %d\n", app->keep_alive_strategy.count_max);
+            log_debug("     - connection_type = persistent");
+            log_debug("          - keep_alive_strategy");
+            log_debug("               - interval_secs = %d", app->keep_alive_strategy.interval_secs);
+            log_debug("               - count_max = %d", app->keep_alive_strategy.count_max);
 
         } else {
-            printf("     - connection_type = periodic\n");
-            printf("        - timeout_mins = %d\n", app->periodic_connect_info.timeout_mins);
-            printf("        - linger_secs = %d\n", app->periodic_connect_info.linger_secs);
+            log_debug("     - connection_type = periodic");
+            log_debug("        - timeout_mins = %d", app->periodic_connect_info.timeout_mins);
+            log_debug("        - linger_secs = %d", app->periodic_connect_info.linger_secs);
         }
-        printf("     - reconnect strategy\n");
+        log_debug("     - reconnect strategy");
         if (app->reconnect_strategy.start_with == FIRST_LISTED) {
-            printf("          - starts_with = first_listed\n");
+            log_debug("          - starts_with = first_listed");
+        } else if (app->reconnect_strategy.start_with == LOWEST_LATENCY) {
+            log_debug("          - starts_with = lowest_latency");
         } else {
-            printf("          - starts_with = last_connected\n");
+            log_debug("          - starts_with = last_connected");
+        }
+        log_debug("          - interval_secs = %d", app->reconnect_strategy.interval_secs);
+        log_debug("          - count_max = %d", app->reconnect_strategy.count_max);
+        log_debug("          - probe_interval_secs = %d", app->reconnect_strategy.probe_interval_secs);
+        log_debug("          - drain_secs = %d", app->reconnect_strategy.drain_secs);
+        log_debug("     - priority = %d", app->priority);
+        if (app->tcp.nodelay || app->tcp.quickack || app->tcp.fast_open ||
+            app->tcp.send_buffer != 0 || app->tcp.receive_buffer != 0) {
+            log_debug("     - socket profile");
+            log_debug("          - nodelay = %d, quickack = %d, fast_open = %d",
+                      app->tcp.nodelay, app->tcp.quickack, app->tcp.fast_open);
+            log_debug("          - send_buffer = %u, receive_buffer = %u",
+                      app->tcp.send_buffer, app->tcp.receive_buffer);
         }
-        printf("          - interval_secs = %d\n", app->reconnect_strategy.interval_secs);
-        printf("          - count_max = %d\n", app->reconnect_strategy.count_max);
     }
-    printf("\n");
 }
-#endif
 
 
-// This routine verifies values provided by the data access layer
+// This routine verifies values provided by the data access layer.  `full`
+// is true for a whole new config, false for a single upserted app.
 static int // 0=OK, 1=ERROR
-verify_incoming_config(Configuration *config) {
+verify_incoming_config(Configuration *config, bool full) {
 
-    uint8_t app_idx;
+    uint32_t app_idx;
     for (app_idx=0; app_idx<config->num_apps; app_idx++) {
         Application* app = &(config->apps[app_idx]);
+        uint32_t     svr_idx;
+
+        if (app->name == NULL) {
+            log_error("app %u has no name!", app_idx);
+            return 1;
+        }
+
+        // it names files in the working directory (".<name>.state", ...)
+        if (app->name[0] == '\0' || app->name[0] == '.' || strchr(app->name, '/') != NULL) {
+            log_error("app \"%s\": a name can't be empty, start with '.' or contain '/'",
+                      app->name);
+            return 1;
+        }
+
+        if (app->num_servers == 0) {
+            log_error("app \"%s\" has no servers!", app->name);
+            return 1;
+        }
+        for (svr_idx=0; svr_idx<app->num_servers; svr_idx++) {
+            if (app->servers[svr_idx].addr == NULL) {
+                log_error("app \"%s\" server %u has no address!", app->name, svr_idx);
+                return 1;
+            }
+        }
 
         if (app->transport_type == SSH) {
-            uint8_t key_idx;
+            uint32_t key_idx;
             for (key_idx=0; key_idx<app->num_host_keys; key_idx++) {
                 HostKey *host_key = &(app->host_keys[key_idx]);
 
-                // make sure file exists. Per the conf file passed into
-                // OpenSSH, file neems to be in current directory
-                struct stat stat_buf;
-                if (stat(host_key->name, &stat_buf) != 0) {
-                    printf ("HostKey file \"%s\" doesn't exist in current directory!\n",
-                            host_key->name);
+                if (host_key->name == NULL) {
+                    log_error("app \"%s\" host-key %u has no name!", app->name, key_idx);
                     return 1;
                 }
             }
+            if (ssh_profile_verify(app->name, &app->crypto) != 0) {
+                return 1;
+            }
+        }
+
+        if (app->relay_to.addr != NULL && !relay_supported()) {
+            log_error("app \"%s\": relay-to isn't supported on this platform", app->name);
+            return 1;
+        }
+
+        if (app->in_process && !ssh_server_supported()) {
+            log_error("app \"%s\": in-process needs ncchd built with libssh", app->name);
+            return 1;
+        }
+
+        if (app->in_process && app->relay_to.addr != NULL) {
+            log_error("app \"%s\": in-process and relay-to don't go together", app->name);
+            return 1;
+        }
+
+        if (app->shared && !app->in_process) {
+            log_error("app \"%s\": shared-connection needs in-process", app->name);
+            return 1;
+        }
+
+        if (app->tcp.fast_open && !tcp_fast_open_supported()) {
+            log_warn("app \"%s\": no TCP Fast Open on this platform, "
+                     "connecting the usual way", app->name);
         }
 
         if (app->transport_type == TLS) {
-            printf("Sorry, the TLS transport type isn't supported yet...\n");
+            log_error("Sorry, the TLS transport type isn't supported yet...");
             return 1;
         }
 
         if (app->connection_type == PERIODIC) {
-            printf("Sorry, the PERIODIC connection type isn't supported yet...\n");
+            log_error("Sorry, the PERIODIC connection type isn't supported yet...");
             return 1;
         }
     }
-    return 0;
-}
 
-
-// deep-free the Application structure
-static void
-free_application(Application* app) {
-    int idx;
-    for (idx=0; idx<app->num_host_keys; idx++) {
-        free(&app->host_keys[idx]);
-    }
-    for (idx=0; idx<app->num_servers; idx++) {
-        free(&app->servers[idx]);
-    }
-    free(app);
+    // check each distinct host-key file once, however many apps share it
+    return host_keys_verify(config, full);
 }
 
 
-
 // deep-free the Configuration structure
 static void
 free_configuration(Configuration* config) {
-    int app_idx;
+    uint32_t app_idx;
     for (app_idx=0; app_idx<config->num_apps; app_idx++) {
         Application *app = &config->apps[app_idx];
         free_application(app);
     }
+    free(config->apps);
+    free(config->runtime);
     free(config);
 }
 
 
 
+// true if both apps have the same configuration.  Strings are interned,
+// so they're equal exactly when their pointers are.
+static bool
+app_config_equal(Application* a, Application* b) {
+    uint32_t idx;
+
+    if (a->name != b->name ||
+        a->num_servers != b->num_servers ||
+        a->transport_type != b->transport_type ||
+        a->num_host_keys != b->num_host_keys ||
+        a->relay_to.addr != b->relay_to.addr ||
+        a->relay_to.port != b->relay_to.port ||
+        memcmp(&a->crypto, &b->crypto, sizeof(SshCryptoProfile)) != 0 ||
+        a->in_process != b->in_process ||
+        a->shared != b->shared ||
+        a->connection_type != b->connection_type ||
+        a->priority != b->priority ||
+        memcmp(&a->tcp, &b->tcp, sizeof(SocketProfile)) != 0 ||
+        memcmp(&a->keep_alive_strategy, &b->keep_alive_strategy,
+                                        sizeof(KeepAliveStrategy)) != 0 ||
+        memcmp(&a->periodic_connect_info, &b->periodic_connect_info,
+                                          sizeof(PeriodicConnectInfo)) != 0 ||
+        memcmp(&a->reconnect_strategy, &b->reconnect_strategy,
+                                       sizeof(ReconnectStrategy)) != 0) {
+        return false;
+    }
+    for (idx=0; idx<a->num_servers; idx++) {
+        if (a->servers[idx].addr != b->servers[idx].addr ||
+            a->servers[idx].port != b->servers[idx].port) {
+            return false;
+        }
+    }
+    for (idx=0; idx<a->num_host_keys; idx++) {
+        if (a->host_keys[idx].name != b->host_keys[idx].name) {
+            return false;
+        }
+    }
+    return true;
+}
+
+
+
+// the name of the app's "sshd_config" file
+static int // 0=OK, 1=ERROR (name too long)
+sshd_config_filename(Application *app, char* filename, size_t size) {
+    int len = snprintf(filename, size, ".%s.sshd_config_file", app->name);
+    return (len < 0 || (size_t)len >= size) ? 1 : 0;
+}
+
+
 // This routine writes out an OpenSSH "sshd_config" file that is passed into
 // `sshd` when it is executed.   This routine is NOT in data_access_layer.c
 static int // 0=OK, 1=ERROR
 set_sshd_config_file(Application *app) {
     FILE*  file;
-    char   filename[32];
-    char   buff[1024];
+    char   filename[PATH_MAX];
+    char   buff[PATH_MAX+64];
 
-    sprintf(filename, ".%s.sshd_config_file", app->name);
+    if (sshd_config_filename(app, filename, sizeof(filename)) != 0) {
+        return 1;
+    }
     file = fopen(filename, "w");
     if (file == NULL) {
         return 1;
@@ -250,379 +510,3612 @@ set_sshd_config_file(Application *app) {
     sprintf(buff,"ClientAliveCountMax %d\n", app->keep_alive_strategy.count_max);
     fwrite(buff, strlen(buff), 1, file);
 
-    char cwd[512];
+    char cwd[PATH_MAX];
     getcwd(cwd, sizeof(cwd));
-    sprintf(buff,"Subsystem netconf %s/netconfd\n", cwd);
-    fwrite(buff, strlen(buff), 1, file);
+    // the shim, which hands the session to `netconfd -d` if it's running
+    fprintf(file, "Subsystem netconf %s/netconfd -c %s/config.xml -n %s/%s %s/%s\n",
+            cwd, cwd, cwd, NETCONFD_EVENTS_PATH, cwd, NETCONFD_SOCKET_PATH);
 
-    int      host_key_idx;
+    uint32_t host_key_idx;
     for (host_key_idx=0; host_key_idx<app->num_host_keys; host_key_idx++) {
         HostKey* host_key;
         host_key = &(app->host_keys[host_key_idx]);
-        sprintf(buff,"HostKey %s\n", host_key->name);
-        fwrite(buff, strlen(buff), 1, file);
+        fprintf(file, "HostKey %s\n", host_key->name);
     }
 
     //sprintf(buff,"HostCertificate signed_cert.pem\n");
     //fwrite(buff, strlen(buff), 1, file);
 
+    // KexAlgorithms, Ciphers, MACs, ..., and X509KeyAlgorithm
+    ssh_profile_render(&app->crypto, file);
 
-    //sprintf(buff,"X509KeyAlgorithm x509v3-ecdsa-sha2-nistp384,sha384,ecdsa-sha2-nistp384\n");
-    sprintf(buff,"X509KeyAlgorithm x509v3-ecdsa-sha2-nistp256,sha256,ecdsa-sha2-nistp256\n");
-    fwrite(buff, strlen(buff), 1, file);
+    // where the in-process server looks too
+    if (getenv(AUTHORIZED_KEYS_ENV) != NULL && getenv(AUTHORIZED_KEYS_ENV)[0] != '\0') {
+        fprintf(file, "AuthorizedKeysFile %s\n", getenv(AUTHORIZED_KEYS_ENV));
+    }
 
     fclose(file);
     return 0;
 }
 
 
-// return connected TCP socket for specified hostname, which
-// may be a name or a v4/v6 address string
-static int // -1=error, OK otherwise
-connect_client(const char* hostname, uint16_t port) {
-    struct addrinfo hints, *res, *ressave;
-    int n, sockfd;
-    char   port_str[16];
-
-    sprintf(port_str, "%u", port);
-    memset(&hints, 0, sizeof(struct addrinfo));
-    hints.ai_family = AF_UNSPEC;
-    hints.ai_socktype = SOCK_STREAM;
+// current time on the monotonic clock, for timers
+static int64_t
+now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
 
-    
-    n = getaddrinfo(hostname, port_str, &hints, &res);
-    if (n <0 ) {
-        fprintf(stderr, "getaddrinfo error:: [%s]\n", gai_strerror(n));
-        return -1;
-    }
 
-    ressave = res;
+// ...and finer, for measuring connects
+static int64_t
+now_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
 
-    sockfd=-1;
-    while (res) {
-        sockfd = socket(res->ai_family,
-                        res->ai_socktype,
-                        res->ai_protocol);
 
-        if (!(sockfd < 0)) {
-            if (connect(sockfd, res->ai_addr, res->ai_addrlen) == 0)
-                break;
+/*****************************************************************************
+   CHILD PROCESSES
+ *****************************************************************************/
 
-            close(sockfd);
-            sockfd=-1;
-        }
-    res=res->ai_next;
+// start watching a just-forked child.  Opening the pidfd before the
+// child is reaped means it can only ever refer to this child.
+static void
+child_track(Child* child, pid_t pid) {
+    child->pid = pid;
+    child->pidfd = -1;
+    child->started_ms = now_ms();
+    child->log = NULL;
+#ifdef SYS_pidfd_open
+    child->pidfd = syscall(SYS_pidfd_open, pid, 0);
+    if (child->pidfd != -1) {
+        fcntl(child->pidfd, F_SETFD, FD_CLOEXEC);
     }
-
-    freeaddrinfo(ressave);
-    return sockfd;
+#endif
 }
 
 
-
-// use forked proc to try to maintain a persistent connection to app...
-static int // 0=ok, 1=error
-connect_to_application(Application* app) {
-
-    // fork a process so as to not block main thread 
-    // from connecting to other apps...
-  
-    app->connecting_pid = fork();
-    if (app->connecting_pid == -1) {
-        printf("fork() failed\n");
-        return 1;
+static void
+child_signal(Child* child, int sig) {
+    if (child->pid == -1) {
+        return;
     }
-  
-    if (app->connecting_pid != 0) {
-        // this is the parent process
-        return 0; // do nothing
+#ifdef SYS_pidfd_send_signal
+    if (child->pidfd != -1) {
+        syscall(SYS_pidfd_send_signal, child->pidfd, sig, NULL, 0);
+        return;
     }
-    // child process logic below
- 
-    // restore default signal handlers  (WORKING ON MAC?)
-    if (signal(SIGINT, SIG_DFL) == SIG_ERR) {
-        printf("signal() failed\n");
-        return 1;
+#endif
+    kill(child->pid, sig);
+}
+
+
+// reap the child if it has exited, without blocking
+static bool // true if reaped (and `child` cleared)
+child_reap(Child* child, int* status) {
+    if (child->pid == -1 || waitpid(child->pid, status, WNOHANG) != child->pid) {
+        return false;
     }
-    if (signal(SIGHUP, SIG_DFL) == SIG_ERR) {
-        printf("signal() failed\n");
-        return 1;
+    if (child->pidfd != -1) {
+        close(child->pidfd);
     }
-  
-    // continually try to connect 
-    bool start_over = true;
-    //while (1) {
-    {
-        uint8_t            retry_count;
-        uint8_t            svr_idx=0;
-        int                sockfd;
+    log_stream_close(child->log);
+    child->pid = -1;
+    child->pidfd = -1;
+    child->log = NULL;
+    return true;
+}
 
-        // find server to connect to (svr_idx)
-        if (start_over == true) {
 
-            // toggle flag in case server connection fails
-            start_over = false;
+// Children whose app was stopped are asked to exit and then reaped here,
+// escalating to SIGKILL if they don't go within ORPHAN_KILL_SECS.  Each
+// shard reaps its own.
+typedef struct Orphan Orphan;
+struct Orphan {
+    Child   child;
+    int64_t kill_deadline_ms;
+};
+static __thread Orphan* orphans = NULL;
+static __thread int     num_orphans = 0;
 
-            if (app->reconnect_strategy.start_with == FIRST_LISTED) {
-                // start with first server
-                svr_idx = 0;
-            } else {
-                // must be LAST_CONNECTED, try to determine which it was/is
-
-                PersistedState state;
-                int            result;
-
-                result = get_persisted_state(app->name, &state);
-                if (result == 2) {
-                    // no persisted state found, start with first server
-                    svr_idx = 0;
-                } else if (result == 1) {
-                    printf("get_persisted_state(\"%s\") failed (ignoring)\n", app->name);
-                    svr_idx = 0; // set as if no persisted state found
-                } else {
-                    // find the svr_idx having matching addr/port
-                    for (svr_idx=0; svr_idx<app->num_servers; svr_idx++) {
-                        if (memcmp(&(app->servers[svr_idx]), 
-                                    &state.last_connected, sizeof(Server))==0) {
-                            // found it!
-                            break;
-                        }
-                    }
-                    if (svr_idx == app->num_servers) {
-                        // must have not been found, start with first
-                        svr_idx = 0;
-                    }
-                }
-            }
 
-        } else {
+static void
+orphan_adopt(Child* child) {
+    Orphan* grown;
 
-            // try "next" server
-            svr_idx++;
-            if (svr_idx == app->num_servers) {
-                // end of list, loop back to '0'
-                svr_idx = 0;
-            }
+    if (child->pid == -1) {
+        return;
+    }
+    // nobody reads its stderr from here on
+    log_stream_close(child->log);
+    child->log = NULL;
+    child_signal(child, SIGTERM);
+    grown = (Orphan*)realloc(orphans, (num_orphans+1) * sizeof(Orphan));
+    if (grown == NULL) {
+        // can't track it, make sure it's gone and reap it now
+        int status;
+        child_signal(child, SIGKILL);
+        waitpid(child->pid, &status, 0);
+        if (child->pidfd != -1) {
+            close(child->pidfd);
+        }
+    } else {
+        orphans = grown;
+        orphans[num_orphans].child = *child;
+        orphans[num_orphans].kill_deadline_ms = now_ms() + ORPHAN_KILL_SECS*1000;
+        num_orphans++;
+    }
+    child->pid = -1;
+    child->pidfd = -1;
+}
 
+
+static void
+orphans_reap(int64_t now) {
+    int idx = 0;
+
+    while (idx < num_orphans) {
+        int status;
+        if (child_reap(&orphans[idx].child, &status)) {
+            orphans[idx] = orphans[--num_orphans];
+            continue;
         }
+        if (now >= orphans[idx].kill_deadline_ms) {
+            child_signal(&orphans[idx].child, SIGKILL);
+            orphans[idx].kill_deadline_ms = INT64_MAX;
+        }
+        idx++;
+    }
+}
 
-        // got the svr_idx to try to connect to, do it now...
-        retry_count = 0;
-        while (retry_count < app->reconnect_strategy.count_max) {
 
-            // addr can a be hostname or v4/v6 addess string
-            sockfd = connect_client(app->servers[svr_idx].addr,
-                                    app->servers[svr_idx].port);
-            if (sockfd == -1) {
-                printf("connect failed...\n");
+/*****************************************************************************
+   CONNECTORS
+ *****************************************************************************/
 
-                // connect failed
-                if (retry_count == app->reconnect_strategy.count_max) {
-                    break;
-                } else {
-                    retry_count++;
-                    sleep(app->reconnect_strategy.interval_secs);
-                }
+static void
+connector_cancel(Connector* c) {
+    if (c->fd != -1) {
+        close(c->fd);
+        c->fd = -1;
+    }
+    if (c->ai_list != NULL) {
+        freeaddrinfo(c->ai_list);
+        c->ai_list = NULL;
+        c->ai_cur = NULL;
+    }
+}
 
-            } else {   // connect succeeded
-                PersistedState state;
-                int            result;
-                pid_t          pid;
-                pid_t          retpid;
-                int            status;
-
-                // set persisted state
-                assert(sizeof(PersistedState) == sizeof(Server));
-                memcpy(&state, &(app->servers[svr_idx]), sizeof(Server));
-                result = set_persisted_state(app->name, &state);
-                if (result == 1) {
-                    printf("set_persisted_state(\"%s\") failed (ignoring)\n", app->name);
-                }
 
-                // fork exec sshd 
-                // FIXME: TLS-based transport logic should be added here
-                if ((pid = fork()) == 0) { // child to exec sshd
-                    char sshd_config_filename[64];
-      
-                    // write out the app's config-file
-                    if (set_sshd_config_file(app) != 0) {
-                        printf ("set_sshd_config_file(%s) failed\n", app->name);
-                        exit(1);  // just the child process exits
-                    }
+// start a non-blocking connect to c->ai_cur or the addresses after it
+static int // 0=in progress, 1=ERROR (no address left, see connect_error)
+connector_next(Connector* c) {
+    while (c->ai_cur != NULL) {
+        struct addrinfo* res = c->ai_cur;
 
-                    // store config filename in a var
-                    sprintf(sshd_config_filename, ".%s.sshd_config_file", 
-                                                  app->name);
+        // atomic CLOEXEC: another shard may fork() an sshd at any moment
+        c->fd = socket(res->ai_family, res->ai_socktype | SOCK_CLOEXEC,
+                       res->ai_protocol);
+        if (c->fd != -1) {
+            int rc;
 
+            fcntl(c->fd, F_SETFL, fcntl(c->fd, F_GETFL, 0) | O_NONBLOCK);
+            tcp_profile_apply(c->profile, c->fd);
+            if (c->fast_open && tcp_fast_open(c->fd) != 0) {
+                c->fast_open = false;
+            }
+            c->dialed_us = now_us();
+            flight_event(flight, c->flight, FLIGHT_TCP, 'B', 0);
+            rc = connect(c->fd, res->ai_addr, res->ai_addrlen);
+            if (rc == 0 || errno == EINPROGRESS) {
+                // with a Fast Open cookie for the server, connect() returns
+                // at once and the SYN goes with the session's first write
+                c->deferred = (rc == 0 && c->fast_open);
+                return 0;  // poll() reports POLLOUT once it's done
+            }
+            flight_event(flight, c->flight, FLIGHT_TCP, 'E', errno);
+            snprintf(connect_error, sizeof(connect_error), "%s", strerror(errno));
+            close(c->fd);
+            c->fd = -1;
+        }
+        c->ai_cur = res->ai_next;
+    }
+    connector_cancel(c);
+    return 1;
+}
 
 
-                    // dup stdin/stdout/stderr for reading/writing the client
-                    if (dup2(sockfd, 0) == -1) {
-                        printf("dup2(sockfd, 0) failed\n");
-                        exit(1);  // just the child process exits
-                    }
-                    if (dup2(sockfd, 1) == -1) {
-                        printf("dup2(sockfd, 1) failed\n");
-                        exit(1);  // just the child process exits
-                    }
-#ifndef DEBUG_SSHD
-                    if (dup2(sockfd, 2) == -1) {
-                        printf("dup2(sockfd, 2) failed\n");
-                        exit(1);  // just the child process exits
-                    }
-                    execl(PATH_SSHD, PATH_SSHD, "-i", "-f",
-                                                sshd_config_filename, NULL);
-#else
-                    execl(PATH_SSHD, PATH_SSHD, "-ddd", "-e", "-i", "-f", 
-                                                sshd_config_filename, NULL);
-#endif
+// Begin connecting to hostname, which may be a name or a v4/v6 address
+// string, with the socket options in `profile` (NULL for none) and, if
+// `fast_open`, TCP Fast Open.  Name resolution is still synchronous.
+static int // 0=in progress, 1=ERROR (see connect_error)
+connector_start(Connector* c, const char* hostname, uint16_t port, int timeout_ms,
+                const SocketProfile* profile, bool fast_open) {
+    struct addrinfo hints;
+    char            port_str[16];
+    int             n;
+
+    c->fd = -1;
+    c->ai_list = NULL;
+    c->ai_cur = NULL;
+    c->deadline_ms = now_ms() + timeout_ms;
+    c->greeting = false;
+    c->connected = false;
+    c->rtt_us = 0;
+    c->profile = profile;
+    c->fast_open = fast_open;
+    c->deferred = false;
 
-                    // logic should never get here
-                    assert(0);  // ok for -DNDEBUG to remove
-
-                } // end child fork
-
-                // this is the parent
-                retpid = waitpid(pid, &status, 0); // wait for child process to end
-                if (retpid != pid) {
-                    if (retpid == -1) {
-                        printf("errno(%d) [%s]\n", errno, strerror(errno));
-                    } else {
-                        printf("pid != retpid (%d)\n", retpid);
-                        if (WIFCONTINUED(status)) printf("WIFCONTINUED\n");
-                        if (WIFEXITED(status)) printf("WIFEXITED\n");
-                        if (WIFSIGNALED(status)) printf("WIFSIGNALED\n");
-                        if (WIFSTOPPED(status)) printf("WIFSTOPPED\n");
-                    }
-                }
-                close(sockfd);
-                break;
-            }
-        } // end while trying to connect to server
+    sprintf(port_str, "%u", port);
+    memset(&hints, 0, sizeof(struct addrinfo));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
 
-        if (retry_count < app->reconnect_strategy.count_max) {
-            // we were connected to something, what we connect to next is
-            // driven by the reconnect_strategy.start_with value...
-            start_over = true;
-        }
+    flight_event(flight, c->flight, FLIGHT_DNS, 'B', 0);
+    n = getaddrinfo(hostname, port_str, &hints, &c->ai_list);
+    flight_event(flight, c->flight, FLIGHT_DNS, 'E', n);
+    if (n != 0) {
+        snprintf(connect_error, sizeof(connect_error), "%s", gai_strerror(n));
+        c->ai_list = NULL;
+        return 1;
+    }
+    c->ai_cur = c->ai_list;
+    return connector_next(c);
+}
 
-    } // end while(1)
 
-    // logic never gets here
-    assert(0);  // OK for -DNDEBUG to compile out
-    return 1;
+// the events to poll the connector's socket for
+static short
+connector_events(Connector* c) {
+    return c->connected ? POLLIN : POLLOUT;
 }
 
 
+// Called once poll() reports connector_events().  With c->greeting, a
+// connection counts once the peer has sent something (an SSH client, as
+// the NMS is, speaks first), which is left unread for the session, and
+// c->rtt_us is the time that took.
+static int // 0=connected (c->fd is a blocking socket), 1=ERROR, 2=in progress
+connector_finish(Connector* c) {
+    int       err = 0;
+    socklen_t len = sizeof(err);
+    char      byte;
 
+    if (c->connected) {
+        ssize_t peeked = recv(c->fd, &byte, 1, MSG_PEEK | MSG_DONTWAIT);
 
-// PSEUDOCODE
-//   for each app in active
-//       if also in incoming
-//           - do not disconnect, just copy it's pid into incoming
-//       else
-//           - disconnect it
-//   copy all the incoming app pointers to active
-//   for each app in "new" active
-//       if pid not set
-//           - connect app
-static int // 0=OK, 1=ERROR
-apply_incoming_config(Configuration* active, Configuration* incoming) {
-    int          incoming_app_idx;
-    int          active_app_idx;
-    Application* incoming_app;
-    Application* active_app;
+        if (peeked == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            return 2;
+        }
+        if (peeked != 1) {
+            flight_event(flight, c->flight, FLIGHT_GREETING, 'E', peeked == 0 ? 0 : errno);
+            snprintf(connect_error, sizeof(connect_error), "%s",
+                     peeked == 0 ? "closed before greeting" : strerror(errno));
+            connector_cancel(c);
+            return 1;
+        }
+        flight_event(flight, c->flight, FLIGHT_GREETING, 'E', 0);
+        c->rtt_us = (uint32_t)(now_us() - c->dialed_us);
+        c->connected = false;
+        tcp_profile_connected(c->profile, c->fd);
+        fcntl(c->fd, F_SETFL, fcntl(c->fd, F_GETFL, 0) & ~O_NONBLOCK);
+        return 0;
+    }
 
-    // iterate over apps in active
-    for (active_app_idx=0; active_app_idx<active->num_apps; active_app_idx++) {
+    if (getsockopt(c->fd, SOL_SOCKET, SO_ERROR, &err, &len) == 0 && err == 0) {
+        flight_event(flight, c->flight, FLIGHT_TCP, 'E', 0);
+        if (c->deferred) {
+            flight_event(flight, c->flight, FLIGHT_FAST_OPEN, 'i', 0);
+        }
+        freeaddrinfo(c->ai_list);
+        c->ai_list = NULL;
+        c->ai_cur = NULL;
+        if (c->greeting) {
+            flight_event(flight, c->flight, FLIGHT_GREETING, 'B', 0);
+            c->connected = true;
+            return 2;
+        }
+        // sshd expects a blocking socket
+        tcp_profile_connected(c->profile, c->fd);
+        fcntl(c->fd, F_SETFL, fcntl(c->fd, F_GETFL, 0) & ~O_NONBLOCK);
+        return 0;
+    }
 
-        active_app = &(active->apps[active_app_idx]);
-        assert(active_app->connecting_pid != -1);
+    // this address failed, move on to the next one
+    flight_event(flight, c->flight, FLIGHT_TCP, 'E', err);
+    snprintf(connect_error, sizeof(connect_error), "%s", strerror(err));
+    close(c->fd);
+    c->fd = -1;
+    c->ai_cur = c->ai_cur->ai_next;
+    return connector_next(c) == 0 ? 2 : 1;
+}
 
-        // see if it's also in the incoming config
-        for (incoming_app_idx=0; incoming_app_idx<incoming->num_apps; incoming_app_idx++) {
 
-            incoming_app = &(incoming->apps[incoming_app_idx]);
+/*****************************************************************************
+   ADMISSION CONTROL
+ *****************************************************************************/
+
+// Every connect attempt (start, retry, reconnect) takes a token from a
+// bucket refilled at NCCHD_CONNECT_RATE per second, and holds one of
+// NCCHD_MAX_HANDSHAKES slots from the connect until its sshd has had
+// HANDSHAKE_MSECS to finish the SSH handshake (a relay's right away).
+// The budget is split evenly over the shards, so they need not share
+// anything.  Apps that can't go yet wait in a heap ordered by priority,
+// then by arrival, and are let through as tokens and slots free up.
+// Probes aren't admitted: they're already jittered and backed off.
+
+typedef struct AdmitEntry AdmitEntry;
+struct AdmitEntry {
+    uint64_t key;       // (255 - priority) << 56 | arrival, smallest first
+    uint32_t app_idx;
+};
+
+typedef struct Admission Admission;
+struct Admission {
+    double         rate;            // tokens per msec, 0 for no limit
+    double         burst;
+    double         tokens;
+    int64_t        refilled_ms;
+    uint32_t       max_handshakes;  // 0 for no cap
+    uint32_t       handshakes;      // slots held
+    uint64_t       arrivals;
+    Configuration* active;          // the shard's apps, queue entries index them
+    AdmitEntry*    queue;           // min-heap on key
+    uint32_t       queue_len;
+    uint32_t       queue_cap;
+    bool           stale;           // apps renumbered, rebuild from the runtime
+};
+
+// global budget, from the environment (see main())
+static uint32_t admit_rate = ADMIT_RATE_PER_SEC;
+static uint32_t admit_burst = ADMIT_BURST;
+static uint32_t admit_max_handshakes = ADMIT_MAX_HANDSHAKES;
+
+// each shard's share; all zeroes (no limits) on a thread that never
+// called admission_init()
+static __thread Admission admission;
 
-            // match only if *entire* definition (not including pid) is
-            // the same (too conservative?)
-            if (memcmp(incoming_app, active_app, sizeof(Application)-sizeof(pid_t)) == 0) {
-                // found it, just copy its pid to the incoming struct
-                incoming_app->connecting_pid = active_app->connecting_pid;
-                active_app->connecting_pid = -1;
-                break;  // no need to keep looking for it
-            }
+
+static void
+admission_init(Configuration* active, uint32_t shards) {
+    memset(&admission, 0, sizeof(admission));
+    admission.active = active;
+    if (admit_rate != 0) {
+        admission.rate = (double)admit_rate / shards / 1000.0;
+        admission.burst = (double)admit_burst / shards;
+        if (admission.burst < 1.0) {
+            admission.burst = 1.0;
         }
+        admission.tokens = admission.burst;
+    }
+    if (admit_max_handshakes != 0) {
+        admission.max_handshakes = (admit_max_handshakes + shards - 1) / shards;
+    }
+    admission.refilled_ms = now_ms();
+}
 
-        // if app was NOT found, disconnect it
-        if (incoming_app_idx == incoming->num_apps) {
-            // app not found in incoming, disconnect it
-            kill(active_app->connecting_pid, SIGKILL);
-            active_app->connecting_pid = -1;
+
+// take a token and a handshake slot, if both are available
+static bool
+admission_take(int64_t now) {
+    if (admission.max_handshakes != 0 &&
+        admission.handshakes >= admission.max_handshakes) {
+        return false;
+    }
+    if (admission.rate != 0) {
+        admission.tokens += (now - admission.refilled_ms) * admission.rate;
+        if (admission.tokens > admission.burst) {
+            admission.tokens = admission.burst;
         }
+        admission.refilled_ms = now;
+        if (admission.tokens < 1.0) {
+            return false;
+        }
+        admission.tokens -= 1.0;
+    }
+    admission.handshakes++;
+    return true;
+}
 
-#ifdef DEBUG_SSHD
-        // one way or the other, the pid should now be -1
-        assert(active_app->connecting_pid == -1);
-#endif
 
-        // free this active app's memory
-        free_application(active_app);
+// the app's handshake is over (or never happened), give its slot back
+static void
+handshake_end(AppRuntime* rt) {
+    if (rt->handshaking) {
+        rt->handshaking = false;
+        admission.handshakes--;
     }
+}
 
-    // copy all the incoming app pointers to active
-    memcpy(active, incoming, sizeof(Configuration));
 
-    // iterate over apps in "new" active, for those with no PID
-    for (active_app_idx=0; active_app_idx<active->num_apps; active_app_idx++) {
-        active_app = &(active->apps[active_app_idx]);
+static void
+admission_push(uint64_t key, uint32_t app_idx) {
+    AdmitEntry entry = { key, app_idx };
+    uint32_t   idx;
+
+    if (admission.queue_len == admission.queue_cap) {
+        uint32_t    cap = admission.queue_cap ? admission.queue_cap * 2 : 64;
+        AdmitEntry* queue = (AdmitEntry*)realloc(admission.queue,
+                                                 cap * sizeof(AdmitEntry));
+        if (queue == NULL) {
+            // the app stays PHASE_QUEUED and is found on the next rebuild
+            admission.stale = true;
+            return;
+        }
+        admission.queue = queue;
+        admission.queue_cap = cap;
+    }
+    idx = admission.queue_len++;
+    while (idx > 0 && admission.queue[(idx-1)/2].key > key) {
+        admission.queue[idx] = admission.queue[(idx-1)/2];
+        idx = (idx-1)/2;
+    }
+    admission.queue[idx] = entry;
+}
 
-        // ensure app isn't already connected
-        if (active_app->connecting_pid != -1) {
-            break;  // nothing to do
+
+static void
+admission_pop(void) {
+    AdmitEntry last = admission.queue[--admission.queue_len];
+    uint32_t   idx = 0;
+
+    for (;;) {
+        uint32_t child = 2*idx + 1;
+        if (child >= admission.queue_len) {
+            break;
+        }
+        if (child+1 < admission.queue_len &&
+            admission.queue[child+1].key < admission.queue[child].key) {
+            child++;
         }
+        if (last.key <= admission.queue[child].key) {
+            break;
+        }
+        admission.queue[idx] = admission.queue[child];
+        idx = child;
+    }
+    admission.queue[idx] = last;
+}
 
-        // connect to this app now
-        int result = connect_to_application(active_app);
-        if (result != 0) {
-            printf("could not fork process to connect app \"%s\"\n", active_app->name);
-            return 1;
+
+// config changes move apps around, queue the waiting ones again by index
+static void
+admission_rebuild(Configuration* active) {
+    uint32_t app_idx;
+
+    admission.stale = false;
+    admission.queue_len = 0;
+    for (app_idx=0; app_idx<active->num_apps; app_idx++) {
+        if (active->runtime[app_idx].phase == PHASE_QUEUED) {
+            admission_push(active->runtime[app_idx].admit_key, app_idx);
         }
     }
-    return 0;
+}
+
+
+// when the bucket will next have a token for the head of the queue,
+// INT64_MAX if nothing's waiting on one
+static int64_t
+admission_next_ms(int64_t now) {
+    int64_t next;
+
+    if (admission.queue_len == 0 || admission.rate == 0 ||
+        (admission.max_handshakes != 0 &&
+         admission.handshakes >= admission.max_handshakes)) {
+        return INT64_MAX;  // a slot freeing up wakes the loop anyway
+    }
+    next = admission.refilled_ms + (int64_t)((1.0 - admission.tokens) / admission.rate) + 1;
+    return next > now ? next : now;
 }
 
 
 /*****************************************************************************
-   MAIN
+   SHARED CONNECTIONS
  *****************************************************************************/
 
+// In-process apps with <shared-connection/> whose servers, host keys and
+// crypto-profile are the same share one SSH connection, with a NETCONF
+// channel each, rather than each making its own connection and key
+// exchange.  They're put in the same shard (see app_shard()), which keeps
+// a SharedConnection for them.  One member, the host, connects and holds
+// the session as any app would, under its own reconnect-strategy, socket
+// profile and priority; the others ride on it (PHASE_SHARED), making no
+// connects, and their status follows the host's.  The session lets the
+// NMS open a channel per member.  When the host stops (deleted or
+// changed), the event loop's next pass makes one of the riders the host.
+
+typedef struct SharedConnection SharedConnection;
+struct SharedConnection {
+    SharedConnection* next;          // in its shared_table bucket
+    Application       key;           // the first member's config, a copy
+    uint32_t          members;       // apps started in the group
+    const char*       host;          // the member holding the session (a reference
+                                     // is held), NULL until a new one is picked
+    struct SshServer* server;        // the host's session, NULL if none
+    uint32_t          svr_idx;       // the host's server
+    int*              riders;        // the other members' status slots
+    uint32_t          num_riders;
+    uint32_t          riders_size;
+};
+
+static __thread SharedConnection* shared_table[SHARED_BUCKETS];
+static __thread bool              shared_orphaned = false;  // some connection lost its host
+
+static void status_publish(int slot, Server* svr, uint32_t svr_idx,
+                           enum APP_STATE state, pid_t session_pid, const char* error);
+
+
+// the bucket for what makes apps share a connection.  Strings are
+// interned, so their pointers will do.
+static uint32_t
+shared_bucket(const Application* app) {
+    uint64_t hash = 14695981039346656037ULL;
+    uint32_t idx;
 
-// returns 0 on graceful shutdown; 1 otherwise 
-int main(int argc, char* argv[]) {
-    Configuration* active_config;
-    Configuration* incoming_config;
-    int            result;
-    int            app_idx;
+    for (idx=0; idx<app->num_servers; idx++) {
+        hash = (hash ^ (uintptr_t)app->servers[idx].addr) * 1099511628211ULL;
+        hash = (hash ^ app->servers[idx].port) * 1099511628211ULL;
+    }
+    for (idx=0; idx<app->num_host_keys; idx++) {
+        hash = (hash ^ (uintptr_t)app->host_keys[idx].name) * 1099511628211ULL;
+    }
+    return (uint32_t)(hash >> 32) % SHARED_BUCKETS;
+}
 
 
-    // register handler for graceful shutdown 
-    if (signal(SIGINT, signal_handler) == SIG_ERR) {
-      printf("signal() failed\n");
-      return 1;
+// true if `app` shares `conn`'s connection
+static bool
+shared_match(const SharedConnection* conn, const Application* app) {
+    const Application* key = &(conn->key);
+    uint32_t           idx;
+
+    if (key->num_servers != app->num_servers ||
+        key->num_host_keys != app->num_host_keys ||
+        memcmp(&key->crypto, &app->crypto, sizeof(SshCryptoProfile)) != 0) {
+        return false;
+    }
+    for (idx=0; idx<key->num_servers; idx++) {
+        if (key->servers[idx].addr != app->servers[idx].addr ||
+            key->servers[idx].port != app->servers[idx].port) {
+            return false;
+        }
+    }
+    for (idx=0; idx<key->num_host_keys; idx++) {
+        if (key->host_keys[idx].name != app->host_keys[idx].name) {
+            return false;
+        }
     }
+    return true;
+}
 
-    // register handler to reload config
-    if (signal(SIGHUP, signal_handler) == SIG_ERR) {
-      printf("signal() failed\n");
-      return 1;
+
+// let the NMS open a channel per member on the host's session
+static void
+shared_set_channels(SharedConnection* conn) {
+    if (conn->server != NULL) {
+        conn->server->max_channels = (conn->members < SSH_SERVER_MAX_CHANNELS) ?
+                                      conn->members : SSH_SERVER_MAX_CHANNELS;
     }
+}
 
-    // alloc active-config.  Outside while-loop below since
+
+// the host's session is now rt->ssh_server (NULL if it has none)
+static void
+shared_attach(AppRuntime* rt) {
+    if (rt->shared != NULL) {
+        rt->shared->server = rt->ssh_server;
+        shared_set_channels(rt->shared);
+    }
+}
+
+
+// the host's state, for its riders' status
+static void
+shared_report(SharedConnection* conn, enum APP_STATE state, const char* error) {
+    Server*  svr = &(conn->key.servers[conn->svr_idx]);
+    uint32_t idx;
+
+    for (idx=0; idx<conn->num_riders; idx++) {
+        status_publish(conn->riders[idx], svr, conn->svr_idx, state, -1, error);
+    }
+}
+
+
+// take the rider with `status_slot` off the connection's list
+static void
+shared_unride(SharedConnection* conn, int status_slot) {
+    uint32_t idx;
+
+    for (idx=0; idx<conn->num_riders; idx++) {
+        if (conn->riders[idx] == status_slot) {
+            conn->riders[idx] = conn->riders[--conn->num_riders];
+            return;
+        }
+    }
+}
+
+
+// Add a starting app to its group's connection, making the group if it's
+// the first.  Returns true if the app rides on the connection, false if
+// it's to connect itself: as the host, or unshared if that failed.
+static bool
+shared_join(Application* app, AppRuntime* rt) {
+    uint32_t          bucket = shared_bucket(app);
+    SharedConnection* conn;
+    char              error[64];
+
+    // a full group's like-minded apps make another
+    for (conn=shared_table[bucket]; conn!=NULL; conn=conn->next) {
+        if (shared_match(conn, app) && conn->members < SSH_SERVER_MAX_CHANNELS) {
+            break;
+        }
+    }
+    if (conn == NULL) {
+        conn = (SharedConnection*)calloc(1, sizeof(SharedConnection));
+        if (conn == NULL || copy_application(&(conn->key), app) != 0) {
+            log_error("app \"%s\": could not alloc its shared connection, "
+                      "connecting on its own", app->name);
+            free(conn);
+            return false;
+        }
+        conn->next = shared_table[bucket];
+        shared_table[bucket] = conn;
+    }
+    if (conn->host == NULL) {
+        conn->host = intern_ref(app->name);
+        conn->members++;
+        rt->shared = conn;
+        return false;
+    }
+
+    if (conn->num_riders == conn->riders_size) {
+        uint32_t size = conn->riders_size ? conn->riders_size * 2 : 8;
+        int*     riders = (int*)realloc(conn->riders, size * sizeof(int));
+
+        if (riders == NULL) {
+            log_error("app \"%s\": could not alloc its shared connection, "
+                      "connecting on its own", app->name);
+            return false;
+        }
+        conn->riders = riders;
+        conn->riders_size = size;
+    }
+    conn->riders[conn->num_riders++] = rt->status_slot;
+    conn->members++;
+    rt->shared = conn;
+    rt->phase = PHASE_SHARED;
+    shared_set_channels(conn);
+    log_info("app \"%s\": sharing \"%s\"'s connection", app->name, conn->host);
+    snprintf(error, sizeof(error), "sharing \"%s\"'s connection", conn->host);
+    status_publish(rt->status_slot, &(conn->key.servers[conn->svr_idx]), conn->svr_idx,
+                   conn->server != NULL ? APP_CONNECTED : APP_CONNECTING, -1, error);
+    return true;
+}
+
+
+// take a stopping app out of its group, freeing the group if it was the
+// last, or leaving it for shared_handover() if it was the host
+static void
+shared_leave(Application* app, AppRuntime* rt) {
+    SharedConnection*  conn = rt->shared;
+    SharedConnection** link;
+
+    rt->shared = NULL;
+    conn->members--;
+    if (rt->phase == PHASE_SHARED) {
+        shared_unride(conn, rt->status_slot);
+        shared_set_channels(conn);
+    } else {
+        intern_release(conn->host);
+        conn->host = NULL;
+        conn->server = NULL;
+        if (conn->members > 0) {
+            shared_report(conn, APP_CONNECTING, "host stopped");
+            shared_orphaned = true;
+        }
+    }
+    if (conn->members > 0) {
+        return;
+    }
+    for (link=&(shared_table[shared_bucket(&(conn->key))]); *link!=conn;
+         link=&((*link)->next)) {
+    }
+    *link = conn->next;
+    free_application(&(conn->key));
+    free(conn->riders);
+    free(conn);
+}
+
+
+/*****************************************************************************
+   APPLICATION STATE MACHINE
+ *****************************************************************************/
+
+// publish a connection state to an app's slot in the status table
+static void
+status_publish(int slot, Server* svr, uint32_t svr_idx, enum APP_STATE state,
+               pid_t session_pid, const char* error) {
+    AppStatus* status;
+    time_t     now;
+
+    status = status_write_begin(slot);
+    if (status == NULL) {
+        return;
+    }
+    now = time(NULL);
+    if (status->state != state) {
+        status->state_since = now;
+    }
+    status->state = state;
+    status->svr_idx = svr_idx;
+    status->port = svr->port;
+    snprintf(status->addr, sizeof(status->addr), "%s", svr->addr);
+    status->session_pid = session_pid;
+    if (state == APP_CONNECTING) {
+        status->last_attempt = now;
+    } else if (state == APP_CONNECTED) {
+        status->connects++;
+        status->connected_since = now;
+    } else if (state == APP_RETRY_WAIT) {
+        status->failures++;
+    }
+    if (error != NULL) {
+        snprintf(status->last_error, sizeof(status->last_error), "%s", error);
+    }
+    status_write_end(status);
+}
+
+
+// publish an app's connection state to the shared status table, and a
+// shared connection's host's to its riders too
+static void
+report_status(Application* app, AppRuntime* rt, enum APP_STATE state,
+              pid_t session_pid, const char* error) {
+    Server* svr = &(app->servers[rt->svr_idx]);
+
+    status_publish(rt->status_slot, svr, rt->svr_idx, state, session_pid, error);
+    if (rt->shared != NULL) {
+        rt->shared->svr_idx = rt->svr_idx;
+        shared_report(rt->shared, state, error);
+    }
+}
+
+
+// count connects the app didn't make, their server's circuit being open
+static void
+report_skipped(AppRuntime* rt, uint32_t count) {
+    AppStatus* status = status_write_begin(rt->status_slot);
+
+    if (status == NULL) {
+        return;
+    }
+    status->skipped += count;
+    status_write_end(status);
+}
+
+
+// publish how a session ended and how long it lasted
+static void
+record_session_end(AppRuntime* rt, int32_t exit_code, int64_t duration_ms) {
+    AppStatus* status = status_write_begin(rt->status_slot);
+
+    if (status == NULL) {
+        return;
+    }
+    status->last_exit = exit_code;
+    status->last_session_secs = duration_ms / 1000;
+    status->sessions_ended++;
+    status_write_end(status);
+}
+
+
+// record how an sshd exited and how long its session lasted
+static int32_t // the exit status, or minus the signal that killed it
+report_session_end(Application* app, AppRuntime* rt, Child* sshd, int wait_status) {
+    int64_t    duration_ms = now_ms() - sshd->started_ms;
+    int32_t    exit_code;
+
+    if (WIFSIGNALED(wait_status)) {
+        exit_code = -WTERMSIG(wait_status);
+        log_info("app \"%s\" sshd (pid %d) killed by signal %d after %llds",
+                 app->name, sshd->pid, WTERMSIG(wait_status),
+                 (long long)duration_ms/1000);
+    } else {
+        exit_code = WEXITSTATUS(wait_status);
+        log_info("app \"%s\" sshd (pid %d) exited with status %d after %llds",
+                 app->name, sshd->pid, exit_code, (long long)duration_ms/1000);
+    }
+    record_session_end(rt, exit_code, duration_ms);
+    return exit_code;
+}
+
+
+// record how a relayed session ended, then close it.  `result` is
+// relay_pump()'s, a relay closed by ncchd itself passes 0.
+static int32_t // the exit status recorded, as an sshd's would be
+report_relay_end(Application* app, AppRuntime* rt, struct Relay* relay, int result) {
+    int64_t duration_ms = now_ms() - relay->started_ms;
+
+    log_info("app \"%s\" relay to %s:%d %s after %llds (%llu bytes in, %llu out)",
+             app->name, app->relay_to.addr, app->relay_to.port,
+             result == 2 ? "failed" : "closed", (long long)duration_ms/1000,
+             (unsigned long long)relay->bytes[RELAY_NMS],
+             (unsigned long long)relay->bytes[RELAY_LOCAL]);
+    record_session_end(rt, result == 2 ? 1 : 0, duration_ms);
+    relay_close(relay);
+    return result == 2 ? 1 : 0;
+}
+
+
+// record how an in-process session ended, then close it.  `result` is
+// ssh_server_pump()'s, a session closed by ncchd itself passes 0.
+static int32_t // the exit status recorded, as an sshd's would be
+report_ssh_server_end(Application* app, AppRuntime* rt, struct SshServer* server,
+                      int result) {
+    int64_t duration_ms = now_ms() - server->started_ms;
+
+    log_info("app \"%s\" session %u %s after %llds (%llu bytes in, %llu out)",
+             app->name, server->session_id,
+             result == 2 ? "failed" : "closed", (long long)duration_ms/1000,
+             (unsigned long long)server->bytes[0],
+             (unsigned long long)server->bytes[1]);
+    record_session_end(rt, result == 2 ? 1 : 0, duration_ms);
+    ssh_server_close(server);
+    return result == 2 ? 1 : 0;
+}
+
+
+
+
+// returns the probe interval scaled by the backoff with +/-25% jitter, so
+// that apps sharing the same servers don't probe them in lock-step
+static int64_t
+jittered_probe_interval_ms(Application* app, AppRuntime* rt) {
+    int64_t     interval = (int64_t)app->reconnect_strategy.probe_interval_secs * 1000
+                                                                * rt->probe_backoff;
+    int64_t     jitter = interval / 4;
+
+    if (jitter == 0) {
+        return interval;
+    }
+    return interval - jitter + (rand_r(&rt->seed) % (2 * jitter + 1));
+}
+
+
+// fork/exec `sshd -i` on the already-connected socket, with its stderr
+// on a pipe whose read end is returned in `*stderr_fd` (-1 if the pipe
+// couldn't be made, then sshd keeps ncchd's stderr).  The caller still
+// owns (and must close) its copy of `sockfd`.
+static pid_t // -1=error, sshd's pid otherwise
+launch_sshd(Application* app, int sockfd, int* stderr_fd) {
+    int   errpipe[2] = { -1, -1 };
+    pid_t pid;
+
+    *stderr_fd = -1;
+    if (pipe2(errpipe, O_CLOEXEC) != 0) {  // dup2() clears it for sshd
+        errpipe[0] = errpipe[1] = -1;
+    }
+
+    // FIXME: TLS-based transport logic should be added here
+    if ((pid = fork()) == 0) { // child to exec sshd
+        char config_filename[PATH_MAX];
+      
+        // write out the app's config-file
+        if (set_sshd_config_file(app) != 0) {
+            log_error("set_sshd_config_file(%s) failed", app->name);
+            exit(1);  // just the child process exits
+        }
+
+        // store config filename in a var
+        sshd_config_filename(app, config_filename, sizeof(config_filename));
+
+        // sshd starts with the default signal mask and handlers
+        signal(SIGINT, SIG_DFL);
+        signal(SIGHUP, SIG_DFL);
+
+        // dup stdin/stdout/stderr for reading/writing the client
+        if (dup2(sockfd, 0) == -1) {
+            log_error("dup2(sockfd, 0) failed");
+            exit(1);  // just the child process exits
+        }
+        if (dup2(sockfd, 1) == -1) {
+            log_error("dup2(sockfd, 1) failed");
+            exit(1);  // just the child process exits
+        }
+        if (errpipe[1] != -1 && dup2(errpipe[1], 2) == -1) {
+            log_error("dup2(errpipe, 2) failed");
+            exit(1);  // just the child process exits
+        }
+#ifndef DEBUG_SSHD
+        execl(PATH_SSHD, PATH_SSHD, "-i", "-f",
+                                    config_filename, NULL);
+#else
+        execl(PATH_SSHD, PATH_SSHD, "-ddd", "-e", "-i", "-f", 
+                                    config_filename, NULL);
+#endif
+
+        // logic should only get here if the exec failed
+        log_error("execl(%s) failed", PATH_SSHD);
+        _exit(1);
+
+    } // end child fork
+
+    if (errpipe[1] != -1) {
+        close(errpipe[1]);
+    }
+    if (pid == -1) {
+        log_error("fork() failed");
+        if (errpipe[0] != -1) {
+            close(errpipe[0]);
+        }
+    } else {
+        *stderr_fd = errpipe[0];
+    }
+    return pid;
+}
+
+
+// there's no sshd sending ClientAlive messages, so the keep-alive
+// strategy is applied as TCP keep-alives instead
+static void
+tcp_keepalives(Application* app, int sockfd) {
+    int on = 1;
+    int idle = app->keep_alive_strategy.interval_secs;
+    int count = app->keep_alive_strategy.count_max;
+
+    setsockopt(sockfd, SOL_SOCKET, SO_KEEPALIVE, &on, sizeof(on));
+#ifdef TCP_KEEPIDLE
+    if (idle > 0 && count > 0) {
+        setsockopt(sockfd, IPPROTO_TCP, TCP_KEEPIDLE, &idle, sizeof(idle));
+        setsockopt(sockfd, IPPROTO_TCP, TCP_KEEPINTVL, &idle, sizeof(idle));
+        setsockopt(sockfd, IPPROTO_TCP, TCP_KEEPCNT, &count, sizeof(count));
+    }
+#endif
+}
+
+
+// start a session on a connected socket: exec sshd on it, serve it
+// in-process, or relay it to the app's local server, recording it in the
+// `trace` attempt.  The caller still owns (and must close) `sockfd`
+// unless a relay or SshServer took it over.
+static int // 0=OK, 1=ERROR (see connect_error)
+session_start(Application* app, Child* sshd, struct Relay** relay,
+              struct SshServer** ssh_server, int* sockfd, uint64_t trace) {
+    pid_t pid;
+    int   stderr_fd;
+
+    if (app->in_process) {
+        tcp_keepalives(app, *sockfd);
+        flight_event(flight, trace, FLIGHT_IN_PROCESS, 'B', 0);
+        if (ssh_server_open(ssh_server, *sockfd, app,
+                            atomic_fetch_add(&last_session_id, 1) + 1,
+                            connect_error, sizeof(connect_error)) != 0) {
+            return 1;
+        }
+        flight_event(flight, trace, FLIGHT_SSH_KEX, 'B', 0);
+        *sockfd = -1;  // the SshServer owns it now
+        return 0;
+    }
+    if (app->relay_to.addr != NULL) {
+        tcp_keepalives(app, *sockfd);
+        flight_event(flight, trace, FLIGHT_RELAY, 'B', 0);
+        if (relay_open(relay, *sockfd, app->relay_to.addr, app->relay_to.port,
+                       connect_error, sizeof(connect_error)) != 0) {
+            return 1;
+        }
+        *sockfd = -1;  // the relay owns it now
+        return 0;
+    }
+    flight_event(flight, trace, FLIGHT_FORK, 'B', 0);
+    pid = launch_sshd(app, *sockfd, &stderr_fd);
+    flight_event(flight, trace, FLIGHT_FORK, 'E', pid);
+    if (pid == -1) {
+        snprintf(connect_error, sizeof(connect_error), "fork() failed");
+        return 1;
+    }
+    flight_event(flight, trace, FLIGHT_SSHD, 'B', pid);
+    child_track(sshd, pid);
+    if (stderr_fd != -1) {
+        sshd->log = log_stream_open(stderr_fd, app->name,
+                                    atomic_fetch_add(&last_session_id, 1) + 1);
+#ifdef DEBUG_SSHD
+        // sshd's debug output shows how far its handshake has got
+        if (sshd->log != NULL && trace != 0) {
+            log_stream_marks(sshd->log, sshd_marks, SSHD_MARKS);
+            flight_event(flight, trace, FLIGHT_EXEC, 'B', 0);
+        }
+#endif
+    }
+    return 0;
+}
+
+
+// Record how far the app's session has got, from its sshd's marks or
+// its SshServer's, which share their bits: the first line from sshd
+// (it's exec'd), the key exchange done, the NMS authenticated, the
+// netconf subsystem started, and (in-process only) the <hello> sent.
+static void
+trace_progress(AppRuntime* rt, uint32_t marks) {
+    if (marks & 0x01) {
+        flight_event(flight, rt->flight, FLIGHT_EXEC, 'E', 0);
+        flight_event(flight, rt->flight, FLIGHT_SSH_KEX, 'B', 0);
+    }
+    if (marks & SSH_SERVER_KEX_DONE) {
+        flight_event(flight, rt->flight, FLIGHT_SSH_KEX, 'E', 0);
+        flight_event(flight, rt->flight, FLIGHT_SSH_AUTH, 'B', 0);
+    }
+    if (marks & SSH_SERVER_AUTHENTICATED) {
+        flight_event(flight, rt->flight, FLIGHT_SSH_AUTH, 'E', 0);
+    }
+    if (marks & SSH_SERVER_SUBSYSTEM) {
+        flight_event(flight, rt->flight, FLIGHT_SUBSYSTEM, 'i', 0);
+        if (rt->ssh_server != NULL) {
+            flight_event(flight, rt->flight, FLIGHT_HELLO, 'B', 0);
+        }
+    }
+    if (marks & SSH_SERVER_HELLO_SENT) {
+        flight_event(flight, rt->flight, FLIGHT_HELLO, 'E', 0);
+    }
+}
+
+
+// the app's persisted state, zeroed if it has none (or it can't be read)
+static void
+load_persisted_state(Application* app, PersistedState* state) {
+    int result = get_persisted_state(app->name, state);
+
+    if (result == 1) {
+        log_warn("get_persisted_state(\"%s\") failed (ignoring)", app->name);
+    }
+    if (result != 0) {
+        memset(state, 0, sizeof(PersistedState));
+    }
+}
+
+
+// Record the server an app is connected to, for LAST_CONNECTED, and for
+// LOWEST_LATENCY how long it took to answer (`rtt_us`).  Only a
+// LOWEST_LATENCY app's stats are kept, the rest aren't read back first.
+static void
+save_last_connected(Application* app, Server* svr, uint32_t rtt_us) {
+    PersistedState state;
+
+    if (app->reconnect_strategy.start_with == LOWEST_LATENCY) {
+        load_persisted_state(app, &state);
+        server_stats_record(&state, svr, true, rtt_us, time(NULL));
+    } else {
+        memset(&state, 0, sizeof(state));
+    }
+    snprintf(state.last_connected_addr, sizeof(state.last_connected_addr),
+             "%s", svr->addr);
+    state.last_connected_port = svr->port;
+    if (set_persisted_state(app->name, &state) == 1) {
+        log_warn("set_persisted_state(\"%s\") failed (ignoring)", app->name);
+    }
+}
+
+
+// record a failed connect to a LOWEST_LATENCY app's server
+static void
+save_connect_failure(Application* app, Server* svr) {
+    PersistedState state;
+
+    load_persisted_state(app, &state);
+    server_stats_record(&state, svr, false, 0, time(NULL));
+    if (set_persisted_state(app->name, &state) == 1) {
+        log_warn("set_persisted_state(\"%s\") failed (ignoring)", app->name);
+    }
+}
+
+
+// pick the server to start with, per the app's reconnect-strategy
+static uint32_t
+select_start_server(Application* app) {
+    PersistedState state;
+    int            result;
+    uint32_t       svr_idx;
+
+    if (app->reconnect_strategy.start_with == FIRST_LISTED) {
+        // start with first server
+        return 0;
+    }
+
+    if (app->reconnect_strategy.start_with == LOWEST_LATENCY) {
+        // start with the fastest, most reliable server so far
+        load_persisted_state(app, &state);
+        return server_stats_pick(app, &state, app->num_servers, time(NULL));
+    }
+
+    // must be LAST_CONNECTED, try to determine which it was/is
+    result = get_persisted_state(app->name, &state);
+    if (result == 2) {
+        // no persisted state found, start with first server
+        return 0;
+    } else if (result == 1) {
+        log_warn("get_persisted_state(\"%s\") failed (ignoring)", app->name);
+        return 0; // set as if no persisted state found
+    }
+
+    // find the svr_idx having matching addr/port
+    for (svr_idx=0; svr_idx<app->num_servers; svr_idx++) {
+        if (app->servers[svr_idx].port == state.last_connected_port &&
+            strncmp(app->servers[svr_idx].addr, state.last_connected_addr,
+                    sizeof(state.last_connected_addr)) == 0) {
+            // found it!
+            return svr_idx;
+        }
+    }
+    // must have not been found, start with first
+    return 0;
+}
+
+
+static void app_connect_failed(Application* app, AppRuntime* rt);
+static void app_server_failed(Application* app, AppRuntime* rt);
+static void app_schedule(Application* app, AppRuntime* rt);
+
+
+// Begin connecting to the app's next server, per its reconnect-strategy.
+// Servers whose circuit breaker is open are skipped, without a connect or
+// a DNS lookup; if every one is, the app waits until one may be tried.
+static void
+app_dial(Application* app, AppRuntime* rt) {
+    int64_t  now = now_ms();
+    int64_t  retry_ms = INT64_MAX;
+    int64_t  wait_ms;
+    uint32_t skipped = 0;
+    bool     greeting;
+    bool     fast_open;
+
+    flight_event(flight, rt->flight, FLIGHT_QUEUED, 'E', 0);
+    if (rt->start_over) {
+        rt->start_over = false;
+        rt->svr_idx = select_start_server(app);
+        rt->retry_count = 0;
+    }
+
+    while ((wait_ms = breaker_check(app->servers[rt->svr_idx].addr,
+                                    app->servers[rt->svr_idx].port, now)) != 0) {
+        flight_event(flight, rt->flight, FLIGHT_BREAKER, 'i', rt->svr_idx);
+        if (wait_ms < retry_ms) {
+            retry_ms = wait_ms;
+        }
+        if (++skipped == app->num_servers) {
+            break;
+        }
+        rt->retry_count = 0;
+        rt->svr_idx = (rt->svr_idx + 1) % app->num_servers;
+    }
+    if (skipped > 0) {
+        report_skipped(rt, skipped);
+    }
+    if (skipped == app->num_servers) {
+        handshake_end(rt);
+        rt->phase = PHASE_RETRY_WAIT;
+        rt->wakeup_ms = now + app->reconnect_strategy.interval_secs * 1000;
+        if (retry_ms > rt->wakeup_ms) {
+            rt->wakeup_ms = retry_ms;
+        }
+        report_status(app, rt, APP_RETRY_WAIT, -1, "every server's circuit is open");
+        flight_end(flight, rt->flight, "every server's circuit is open");
+        rt->flight = 0;
+        return;
+    }
+
+    rt->phase = PHASE_CONNECTING;
+    report_status(app, rt, APP_CONNECTING, -1, NULL);
+    flight_server(flight, rt->flight, app->servers[rt->svr_idx].addr,
+                  app->servers[rt->svr_idx].port);
+    rt->connector.flight = rt->flight;
+
+    // addr can a be hostname or v4/v6 addess string.  Waiting for the
+    // NMS's greeting rules out Fast Open, whose SYN waits for our first write.
+    greeting = (app->reconnect_strategy.start_with == LOWEST_LATENCY);
+    fast_open = app->tcp.fast_open && !greeting &&
+                fast_open_check(app->servers[rt->svr_idx].addr,
+                                app->servers[rt->svr_idx].port, now);
+    if (connector_start(&rt->connector, app->servers[rt->svr_idx].addr,
+                        app->servers[rt->svr_idx].port,
+                        CONNECT_TIMEOUT_SECS*1000, &app->tcp, fast_open) != 0) {
+        app_server_failed(app, rt);
+        return;
+    }
+    rt->connector.greeting = greeting;
+}
+
+
+// connect to the app's next server as soon as admission control lets it,
+// which is right away unless others are already waiting
+static void
+app_connect(Application* app, AppRuntime* rt) {
+    rt->flight = flight_begin(flight, app->name);
+    if (admission.queue_len == 0 && admission.stale == false &&
+        admission_take(now_ms())) {
+        rt->handshaking = true;
+        rt->handshake_end_ms = INT64_MAX;
+        app_dial(app, rt);
+        return;
+    }
+    rt->phase = PHASE_QUEUED;
+    rt->admit_key = ((uint64_t)(255 - app->priority) << 56) |
+                    (admission.arrivals++ & 0x00FFFFFFFFFFFFFFULL);
+    admission_push(rt->admit_key, (uint32_t)(rt - admission.active->runtime));
+    report_status(app, rt, APP_QUEUED, -1, NULL);
+    flight_event(flight, rt->flight, FLIGHT_QUEUED, 'B', 0);
+}
+
+
+// connect failed, wait interval-secs then retry the same server until
+// count-max attempts have been made, then move on to the next server
+static void
+app_connect_failed(Application* app, AppRuntime* rt) {
+    uint8_t     count_max = app->reconnect_strategy.count_max;
+
+    handshake_end(rt);
+    log_warn("app \"%s\" connect to %s:%d failed: %s", app->name,
+             app->servers[rt->svr_idx].addr, app->servers[rt->svr_idx].port, connect_error);
+    connector_cancel(&rt->connector);
+    report_status(app, rt, APP_RETRY_WAIT, -1, connect_error);
+    flight_end(flight, rt->flight, connect_error);
+    rt->flight = 0;
+    if (app->reconnect_strategy.start_with == LOWEST_LATENCY) {
+        save_connect_failure(app, &(app->servers[rt->svr_idx]));
+    }
+
+    rt->retry_count++;
+    if (rt->retry_count >= count_max) {
+        // try "next" server
+        rt->retry_count = 0;
+        if (app->reconnect_strategy.start_with == LOWEST_LATENCY) {
+            // the best of the others, by their stats
+            PersistedState state;
+            load_persisted_state(app, &state);
+            rt->svr_idx = server_stats_pick(app, &state, rt->svr_idx, time(NULL));
+        } else {
+            rt->svr_idx++;
+            if (rt->svr_idx == app->num_servers) {
+                // end of list, loop back to '0'
+                rt->svr_idx = 0;
+            }
+        }
+    }
+    rt->phase = PHASE_RETRY_WAIT;
+    rt->wakeup_ms = now_ms() + app->reconnect_strategy.interval_secs * 1000;
+}
+
+
+// the server didn't answer (as opposed to our end failing to start a
+// session on it), which other apps listing it should know
+static void
+app_server_failed(Application* app, AppRuntime* rt) {
+    breaker_report(app->servers[rt->svr_idx].addr, app->servers[rt->svr_idx].port,
+                   false, now_ms());
+    app_connect_failed(app, rt);
+}
+
+
+// TCP connection accepted by the NMS, hand it to a new sshd
+static void
+app_connected(Application* app, AppRuntime* rt) {
+    int         result;
+
+    // set persisted state, and let other apps know the server is up
+    save_last_connected(app, &(app->servers[rt->svr_idx]), rt->connector.rtt_us);
+    breaker_report(app->servers[rt->svr_idx].addr, app->servers[rt->svr_idx].port,
+                   true, now_ms());
+
+    // fork exec sshd, serve in-process, or relay to the local server
+    rt->fast_open_session = rt->connector.deferred;
+    result = session_start(app, &rt->sshd, &rt->relay, &rt->ssh_server,
+                           &rt->connector.fd, rt->flight);
+    connector_cancel(&rt->connector);
+    if (result != 0) {
+        app_connect_failed(app, rt);
+        return;
+    }
+    if (rt->relay != NULL) {
+        handshake_end(rt);  // the local server does its own
+    } else {
+        rt->handshake_end_ms = now_ms() + HANDSHAKE_MSECS;
+    }
+    rt->phase = PHASE_CONNECTED;
+    rt->probe_backoff = 1;
+    rt->next_probe_ms = now_ms() + jittered_probe_interval_ms(app, rt);
+    shared_attach(rt);
+    report_status(app, rt, APP_CONNECTED, rt->sshd.pid, NULL);
+}
+
+
+// the session (started at `started_ms`) ended with `exit_code` and has
+// been reported, reconnect per the reconnect-strategy
+static void
+app_session_ended(Application* app, AppRuntime* rt, int64_t started_ms,
+                  int32_t exit_code) {
+    int64_t     interval_ms = app->reconnect_strategy.interval_secs * 1000;
+    int64_t     duration_ms = now_ms() - started_ms;
+    bool        short_lived;
+    char        error[64];
+
+    short_lived = (duration_ms < interval_ms);
+    if (rt->fast_open_session) {
+        // its connect never showed the server was reachable, so if it died
+        // young the next ones are made the usual way
+        fast_open_report(app->servers[rt->svr_idx].addr, app->servers[rt->svr_idx].port,
+                         !short_lived, now_ms());
+        rt->fast_open_session = false;
+    }
+    flight_event(flight, rt->flight, FLIGHT_SSHD, 'E', exit_code);
+    flight_event(flight, rt->flight, FLIGHT_RELAY, 'E', exit_code);
+    flight_event(flight, rt->flight, FLIGHT_IN_PROCESS, 'E', exit_code);
+    if (short_lived) {
+        snprintf(error, sizeof(error), "session ended after %lldms, exit status %d",
+                 (long long)duration_ms, exit_code);
+    }
+    flight_end(flight, rt->flight, short_lived ? error : NULL);
+    rt->flight = 0;
+    handshake_end(rt);
+    connector_cancel(&rt->probe);
+    orphan_adopt(&rt->draining);
+    relay_close(rt->relay_draining);
+    rt->relay_draining = NULL;
+    ssh_server_close(rt->ssh_server_draining);
+    rt->ssh_server_draining = NULL;
+    shared_attach(rt);
+
+    // what we connect to next is driven by the reconnect_strategy.start_with
+    // value.  A session that died right away (e.g. sshd failed to start)
+    // waits interval-secs first, so it can't spin.
+    rt->start_over = true;
+    if (short_lived) {
+        rt->phase = PHASE_RETRY_WAIT;
+        rt->wakeup_ms = now_ms() + interval_ms;
+        report_status(app, rt, APP_RETRY_WAIT, -1, "session ended");
+    } else {
+        report_status(app, rt, APP_CONNECTING, -1, "session ended");
+        app_connect(app, rt);
+    }
+}
+
+
+// A preferred server accepted the probe's connection.  Start the new
+// session on it first, then let the old one drain for drain-secs, so
+// management traffic moves back without a gap.
+static void
+app_probe_succeeded(Application* app, AppRuntime* rt) {
+    Server*       svr = &(app->servers[rt->probe_idx]);
+    Child         sshd = { -1, -1, 0, NULL };
+    struct Relay* relay = NULL;
+    struct SshServer* ssh_server = NULL;
+    uint64_t      trace;
+    int           result;
+
+    // the new session is an attempt of its own, starting here
+    breaker_report(svr->addr, svr->port, true, now_ms());
+    trace = flight_begin(flight, app->name);
+    flight_server(flight, trace, svr->addr, svr->port);
+    flight_event(flight, trace, FLIGHT_MIGRATED, 'i', 0);
+    result = session_start(app, &sshd, &relay, &ssh_server, &rt->probe.fd, trace);
+    connector_cancel(&rt->probe);
+    if (result != 0) {
+        flight_end(flight, trace, connect_error);
+        return;
+    }
+    // ...and the old one's ends, its session left draining
+    flight_event(flight, rt->flight, FLIGHT_MIGRATED, 'i', 0);
+    flight_event(flight, rt->flight, FLIGHT_SSHD, 'E', -1);
+    flight_event(flight, rt->flight, FLIGHT_RELAY, 'E', -1);
+    flight_event(flight, rt->flight, FLIGHT_IN_PROCESS, 'E', -1);
+    flight_end(flight, rt->flight, NULL);
+    rt->flight = trace;
+    log_info("app \"%s\" migrating from %s:%d to %s:%d", app->name,
+             app->servers[rt->svr_idx].addr, app->servers[rt->svr_idx].port,
+             svr->addr, svr->port);
+    save_last_connected(app, svr, rt->probe.rtt_us);
+
+    rt->draining = rt->sshd;
+    rt->relay_draining = rt->relay;
+    rt->ssh_server_draining = rt->ssh_server;
+    rt->drain_signal = 0;
+    rt->drain_deadline_ms = now_ms() + app->reconnect_strategy.drain_secs * 1000;
+    rt->sshd = sshd;
+    rt->relay = relay;
+    rt->ssh_server = ssh_server;
+    rt->svr_idx = rt->probe_idx;
+    rt->probe_backoff = 1;
+    rt->fast_open_session = false;  // probes connect the usual way
+    shared_attach(rt);
+
+    report_status(app, rt, APP_CONNECTED, rt->sshd.pid, NULL);
+    AppStatus* app_status = status_write_begin(rt->status_slot);
+    if (app_status != NULL) {
+        app_status->migrations++;
+        status_write_end(app_status);
+    }
+}
+
+
+// probe the next server listed ahead of the current one, or, if they've
+// all been tried, back off until the next probe round
+static void
+app_probe_next(Application* app, AppRuntime* rt) {
+    connector_cancel(&rt->probe);
+    while (rt->probe_idx < rt->svr_idx) {
+        Server* svr = &(app->servers[rt->probe_idx]);
+        if (breaker_check(svr->addr, svr->port, now_ms()) != 0) {
+            report_skipped(rt, 1);
+        } else if (connector_start(&rt->probe, svr->addr, svr->port,
+                                   PROBE_TIMEOUT_MSECS, NULL, false) == 0) {
+            return;
+        } else {
+            breaker_report(svr->addr, svr->port, false, now_ms());
+        }
+        rt->probe_idx++;
+    }
+
+    // back off while the preferred servers stay unreachable
+    if (rt->probe_backoff < PROBE_MAX_BACKOFF) {
+        rt->probe_backoff *= 2;
+    }
+    rt->next_probe_ms = now_ms() + jittered_probe_interval_ms(app, rt);
+}
+
+
+// the probe's server didn't answer, try the next one
+static void
+app_probe_failed(Application* app, AppRuntime* rt) {
+    Server* svr = &(app->servers[rt->probe_idx]);
+
+    breaker_report(svr->addr, svr->port, false, now_ms());
+    rt->probe_idx++;
+    app_probe_next(app, rt);
+}
+
+
+// start maintaining a connection to the app
+static void
+app_start(Application* app, AppRuntime* rt) {
+    int status_slot = rt->status_slot;
+
+    memset(rt, 0, sizeof(AppRuntime));
+    rt->connector.fd = -1;
+    rt->probe.fd = -1;
+    rt->sshd.pid = -1;
+    rt->sshd.pidfd = -1;
+    rt->draining.pid = -1;
+    rt->draining.pidfd = -1;
+    rt->relay = NULL;
+    rt->relay_draining = NULL;
+    rt->ssh_server = NULL;
+    rt->ssh_server_draining = NULL;
+    rt->start_over = true;
+    rt->probe_backoff = 1;
+    rt->status_slot = status_slot;
+    rt->seed = (unsigned int)(getpid() ^ time(NULL) ^ (uintptr_t)rt);
+    if (app->shared && shared_join(app, rt)) {
+        app_schedule(app, rt);
+        return;  // riding on another member's connection
+    }
+    app_connect(app, rt);
+    app_schedule(app, rt);
+}
+
+
+// stop maintaining the app's connection, closing its session(s)
+static void
+app_stop(Application* app, AppRuntime* rt) {
+    if (rt->phase == PHASE_IDLE) {
+        return;
+    }
+    handshake_end(rt);  // a queued app's heap entry is dropped as stale
+    connector_cancel(&rt->connector);
+    connector_cancel(&rt->probe);
+    orphan_adopt(&rt->sshd);
+    orphan_adopt(&rt->draining);
+    if (rt->relay != NULL) {
+        report_relay_end(app, rt, rt->relay, 0);
+        rt->relay = NULL;
+    }
+    relay_close(rt->relay_draining);
+    rt->relay_draining = NULL;
+    if (rt->ssh_server != NULL) {
+        report_ssh_server_end(app, rt, rt->ssh_server, 0);
+        rt->ssh_server = NULL;
+    }
+    ssh_server_close(rt->ssh_server_draining);
+    rt->ssh_server_draining = NULL;
+    if (rt->shared != NULL) {
+        shared_leave(app, rt);
+    }
+    flight_end(flight, rt->flight, NULL);
+    rt->flight = 0;
+    rt->phase = PHASE_IDLE;
+    rt->next_timer_ms = INT64_MAX;
+}
+
+
+// act on the app's timers
+static void
+app_timers(Application* app, AppRuntime* rt, int64_t now) {
+    if (rt->handshaking && now >= rt->handshake_end_ms) {
+        handshake_end(rt);
+    }
+
+    if (rt->phase == PHASE_RETRY_WAIT && now >= rt->wakeup_ms) {
+        app_connect(app, rt);
+
+    } else if (rt->phase == PHASE_CONNECTING && now >= rt->connector.deadline_ms) {
+        snprintf(connect_error, sizeof(connect_error), "connect timed out");
+        app_server_failed(app, rt);
+
+    } else if (rt->phase == PHASE_CONNECTED) {
+        if (rt->relay_draining != NULL && now >= rt->drain_deadline_ms) {
+            // drain period over, the old relay just closes
+            report_relay_end(app, rt, rt->relay_draining, 0);
+            rt->relay_draining = NULL;
+        }
+        if (rt->ssh_server_draining != NULL &&
+            (now >= rt->drain_deadline_ms || now >= rt->ssh_server_draining->deadline_ms)) {
+            report_ssh_server_end(app, rt, rt->ssh_server_draining, 0);
+            rt->ssh_server_draining = NULL;
+        }
+        if (rt->ssh_server != NULL && now >= rt->ssh_server->deadline_ms) {
+            // no subsystem within the login grace time, or no hang-up
+            // after <close-session>
+            struct SshServer* ended = rt->ssh_server;
+            int64_t started_ms = ended->started_ms;
+            int32_t exit_code;
+            rt->ssh_server = NULL;
+            exit_code = report_ssh_server_end(app, rt, ended, ended->closing ? 1 : 2);
+            app_session_ended(app, rt, started_ms, exit_code);
+            return;
+        }
+        if (rt->draining.pid != -1 && now >= rt->drain_deadline_ms) {
+            // drain period over, ask old sshd to close its session, and
+            // insist if it hasn't after ORPHAN_KILL_SECS
+            rt->drain_signal = (rt->drain_signal == 0) ? SIGTERM : SIGKILL;
+            child_signal(&rt->draining, rt->drain_signal);
+            rt->drain_deadline_ms = (rt->drain_signal == SIGTERM) ?
+                                     now + ORPHAN_KILL_SECS*1000 : INT64_MAX;
+        }
+
+        if (rt->probe.fd != -1 && now >= rt->probe.deadline_ms) {
+            app_probe_failed(app, rt);
+        } else if (rt->probe.fd == -1 && rt->svr_idx > 0 &&
+                   rt->draining.pid == -1 && rt->relay_draining == NULL &&
+                   rt->ssh_server_draining == NULL && now >= rt->next_probe_ms &&
+                   app->reconnect_strategy.start_with == FIRST_LISTED &&
+                   app->reconnect_strategy.probe_interval_secs != 0) {
+            rt->probe_idx = 0;
+            app_probe_next(app, rt);
+        }
+    }
+}
+
+
+// Work out the earliest time app_timers() has something to do.  Called
+// whenever the app's state changes, so the event loop can find due apps
+// by scanning the runtime array alone.
+static void
+app_schedule(Application* app, AppRuntime* rt) {
+    int64_t next = INT64_MAX;
+
+    if (rt->phase == PHASE_RETRY_WAIT) {
+        next = rt->wakeup_ms;
+    } else if (rt->phase == PHASE_CONNECTING) {
+        next = rt->connector.deadline_ms;
+    } else if (rt->phase == PHASE_CONNECTED) {
+        if ((rt->draining.pid != -1 || rt->relay_draining != NULL ||
+             rt->ssh_server_draining != NULL) &&
+            rt->drain_deadline_ms < next) {
+            next = rt->drain_deadline_ms;
+        }
+        if (rt->ssh_server != NULL && rt->ssh_server->deadline_ms < next) {
+            next = rt->ssh_server->deadline_ms;
+        }
+        if (rt->ssh_server_draining != NULL && rt->ssh_server_draining->deadline_ms < next) {
+            next = rt->ssh_server_draining->deadline_ms;
+        }
+        if (rt->probe.fd != -1) {
+            if (rt->probe.deadline_ms < next) {
+                next = rt->probe.deadline_ms;
+            }
+        } else if (rt->svr_idx > 0 &&
+                   app->reconnect_strategy.start_with == FIRST_LISTED &&
+                   app->reconnect_strategy.probe_interval_secs != 0 &&
+                   rt->next_probe_ms < next) {
+            next = rt->next_probe_ms;
+        }
+    }
+    if (rt->handshaking && rt->handshake_end_ms < next) {
+        next = rt->handshake_end_ms;
+    }
+    rt->next_timer_ms = next;
+}
+
+
+// let queued apps connect, as far as tokens and handshake slots allow
+static void
+admission_dispatch(Configuration* active, int64_t now) {
+    if (admission.stale) {
+        admission_rebuild(active);
+    }
+    while (admission.queue_len > 0) {
+        uint32_t    app_idx = admission.queue[0].app_idx;
+        AppRuntime* rt = &(active->runtime[app_idx]);
+
+        if (app_idx >= active->num_apps || rt->phase != PHASE_QUEUED ||
+            rt->admit_key != admission.queue[0].key) {
+            admission_pop();  // stopped since
+            continue;
+        }
+        if (admission_take(now) == false) {
+            break;
+        }
+        admission_pop();
+        rt->handshaking = true;
+        rt->handshake_end_ms = INT64_MAX;
+        app_dial(&(active->apps[app_idx]), rt);
+        app_schedule(&(active->apps[app_idx]), rt);
+    }
+}
+
+
+// make a rider the host of each shared connection whose host has stopped
+static void
+shared_handover(Configuration* active) {
+    uint32_t app_idx;
+    char     error[64];
+
+    if (shared_orphaned == false) {
+        return;
+    }
+    shared_orphaned = false;
+    for (app_idx=0; app_idx<active->num_apps; app_idx++) {
+        Application*      app = &(active->apps[app_idx]);
+        AppRuntime*       rt = &(active->runtime[app_idx]);
+        SharedConnection* conn = rt->shared;
+
+        if (rt->phase != PHASE_SHARED || conn->host != NULL) {
+            continue;
+        }
+        shared_unride(conn, rt->status_slot);
+        conn->host = intern_ref(app->name);
+        log_info("app \"%s\": taking over the shared connection", app->name);
+        snprintf(error, sizeof(error), "sharing \"%s\"'s connection", conn->host);
+        shared_report(conn, APP_CONNECTING, error);
+        app_connect(app, rt);
+        app_schedule(app, rt);
+    }
+}
+
+
+/*****************************************************************************
+   SHARDS
+ *****************************************************************************/
+
+// Each shard is a thread running the event loop below over the apps
+// whose name hashes to it (see app_shard()), so sessions are spread over
+// cores and never share state.  The main thread owns the config: it sends each shard
+// copies of its apps as messages, on a single-producer single-consumer
+// ring (no locks), and wakes the shard through a pipe.
+enum SHARD_MSG { SHARD_APPLY, SHARD_UPSERT, SHARD_DELETE, SHARD_STOP,
+                 SHARD_HANDOFF };
+
+typedef struct ShardMsg ShardMsg;
+struct ShardMsg {
+    enum SHARD_MSG   type;
+    Configuration*   config;      // SHARD_APPLY, the shard's part of a reload
+    Application      app;         // SHARD_UPSERT
+    const char*      name;        // SHARD_DELETE, interned (a reference is held)
+};
+
+typedef struct Shard Shard;
+struct Shard {
+    Configuration    active;      // this shard's apps and their runtime
+    pthread_t        thread;
+    int              cpu;         // pinned to, -1 if not pinned
+    uint32_t         of;          // shards started, each gets 1/of of the budget
+    int              wake[2];     // pipe, written after posting a message
+    bool             stopping;    // only touched by the shard itself
+    bool             handing_off; // stopping, but keep the sessions
+    FlightRecorder*  flight;      // its apps' connect attempts, NULL if not kept
+    ShardMsg*        queue[SHARD_QUEUE_SIZE];
+    _Atomic uint32_t queue_head;  // next message the main thread posts
+    _Atomic uint32_t queue_tail;  // next message the shard takes
+};
+
+static Shard*   shards = NULL;
+static uint32_t num_shards = 0;
+static uint32_t trace_attempts = FLIGHT_ATTEMPTS;
+
+
+// FNV-1a of the name, so an app always lands on the same shard
+static uint32_t
+shard_of(const char* name) {
+    uint32_t hash = 2166136261u;
+
+    while (*name != '\0') {
+        hash = (hash ^ (uint8_t)*name++) * 16777619u;
+    }
+    return hash % num_shards;
+}
+
+
+// The shard an app belongs to: by its name, or for one that may share its
+// connection, by its first server, so it's with the apps it would share
+// it with.
+static uint32_t
+app_shard(const Application* app) {
+    const char* addr;
+    uint32_t    hash = 2166136261u;
+
+    if (!app->shared) {
+        return shard_of(app->name);
+    }
+    for (addr=app->servers[0].addr; *addr!='\0'; addr++) {
+        hash = (hash ^ (uint8_t)*addr) * 16777619u;
+    }
+    hash = (hash ^ (app->servers[0].port & 0xFF)) * 16777619u;
+    hash = (hash ^ (app->servers[0].port >> 8)) * 16777619u;
+    return hash % num_shards;
+}
+
+
+// queue `msg` for its shard, which takes ownership of it (main thread only)
+static void
+shard_post(Shard* shard, ShardMsg* msg) {
+    uint32_t head = atomic_load_explicit(&shard->queue_head, memory_order_relaxed);
+    ssize_t  n;
+
+    // full only if the shard is far behind, wait for it rather than drop
+    // a config change
+    while (head - atomic_load_explicit(&shard->queue_tail, memory_order_acquire)
+                                                            == SHARD_QUEUE_SIZE) {
+        poll(NULL, 0, 1);
+    }
+    shard->queue[head & (SHARD_QUEUE_SIZE - 1)] = msg;
+    atomic_store_explicit(&shard->queue_head, head + 1, memory_order_release);
+    n = write(shard->wake[1], "", 1);
+    (void)n;  // a full pipe wakes it just the same
+}
+
+
+// the next message posted to `shard`, if any (shard thread only)
+static ShardMsg* // NULL if there is none
+shard_take(Shard* shard) {
+    uint32_t  tail = atomic_load_explicit(&shard->queue_tail, memory_order_relaxed);
+    ShardMsg* msg;
+
+    if (tail == atomic_load_explicit(&shard->queue_head, memory_order_acquire)) {
+        return NULL;
+    }
+    msg = shard->queue[tail & (SHARD_QUEUE_SIZE - 1)];
+    atomic_store_explicit(&shard->queue_tail, tail + 1, memory_order_release);
+    return msg;
+}
+
+
+static void shard_handle(Shard* shard, ShardMsg* msg);
+
+
+/*****************************************************************************
+   EVENT LOOP
+ *****************************************************************************/
+
+enum POLL_KIND { POLL_WAKE, POLL_ORPHAN, POLL_CONNECTOR,
+                 POLL_PROBE, POLL_SSHD, POLL_DRAINING, POLL_RELAY,
+                 POLL_RELAY_DRAINING, POLL_SSHD_LOG, POLL_DRAINING_LOG,
+                 POLL_SSH_SERVER, POLL_SSH_SERVER_DRAINING };
+
+typedef struct PollOwner PollOwner;
+struct PollOwner {
+    enum POLL_KIND kind;
+    int            idx;   // app or orphan index
+};
+
+// each shard polls its own set
+static __thread struct pollfd* poll_fds = NULL;
+static __thread PollOwner*     poll_owners = NULL;
+static __thread int            poll_capacity = 0;
+static __thread int            num_poll_fds = 0;
+
+
+static void
+poll_add(int fd, short events, enum POLL_KIND kind, int idx) {
+    if (fd == -1) {
+        return;
+    }
+    if (num_poll_fds == poll_capacity) {
+        int            capacity = poll_capacity ? poll_capacity * 2 : 64;
+        struct pollfd* fds = (struct pollfd*)realloc(poll_fds,
+                                               capacity * sizeof(struct pollfd));
+        PollOwner*     owners;
+        if (fds == NULL) {
+            return;  // fd is still covered by the 1 second poll() cap
+        }
+        poll_fds = fds;
+        owners = (PollOwner*)realloc(poll_owners, capacity * sizeof(PollOwner));
+        if (owners == NULL) {
+            return;
+        }
+        poll_owners = owners;
+        poll_capacity = capacity;
+    }
+    poll_fds[num_poll_fds].fd = fd;
+    poll_fds[num_poll_fds].events = events;
+    poll_fds[num_poll_fds].revents = 0;
+    poll_owners[num_poll_fds].kind = kind;
+    poll_owners[num_poll_fds].idx = idx;
+    num_poll_fds++;
+}
+
+
+// poll both of a relay's sockets for whatever it's waiting on
+static void
+relay_poll_add(struct Relay* relay, enum POLL_KIND kind, int idx) {
+    short events;
+
+    events = relay_events(relay, RELAY_NMS);
+    if (events != 0) {
+        poll_add(relay->fd[RELAY_NMS], events, kind, idx);
+    }
+    events = relay_events(relay, RELAY_LOCAL);
+    if (events != 0) {
+        poll_add(relay->fd[RELAY_LOCAL], events, kind, idx);
+    }
+}
+
+
+// Drive every app of the shard until it's told to stop.  Connects are
+// non-blocking, sshd children are watched through pidfds, and all
+// waiting (retry intervals, probes, drains) is done with timers, so one
+// thread maintains all of a shard's apps.
+static void
+run_event_loop(Shard* shard) {
+    Configuration* active = &(shard->active);
+
+    while (shard->stopping == false) {
+        int64_t  now = now_ms();
+        int64_t  next = now + 1000;  // pidfd-less children are reaped at least this often
+        bool     sweep = false;      // some child has no pidfd
+        uint32_t app_idx;
+        int      idx;
+        int      timeout;
+        ShardMsg* msg;
+
+        // config changes first, as they may add or remove apps, which
+        // renumbers them
+        while ((msg = shard_take(shard)) != NULL) {
+            shard_handle(shard, msg);
+        }
+        if (shard->stopping) {
+            break;
+        }
+        shared_handover(active);
+
+        // this pass reads only the runtime array, never the app configs
+        num_poll_fds = 0;
+        for (app_idx=0; app_idx<active->num_apps; app_idx++) {
+            AppRuntime* rt = &(active->runtime[app_idx]);
+
+            poll_add(rt->connector.fd, connector_events(&rt->connector),
+                     POLL_CONNECTOR, app_idx);
+            poll_add(rt->sshd.pidfd, POLLIN, POLL_SSHD, app_idx);
+            poll_add(rt->probe.fd, POLLOUT, POLL_PROBE, app_idx);
+            poll_add(rt->draining.pidfd, POLLIN, POLL_DRAINING, app_idx);
+            if (rt->sshd.log != NULL) {
+                poll_add(rt->sshd.log->fd, POLLIN, POLL_SSHD_LOG, app_idx);
+            }
+            if (rt->draining.log != NULL) {
+                poll_add(rt->draining.log->fd, POLLIN, POLL_DRAINING_LOG, app_idx);
+            }
+            if (rt->relay != NULL) {
+                relay_poll_add(rt->relay, POLL_RELAY, app_idx);
+            }
+            if (rt->relay_draining != NULL) {
+                relay_poll_add(rt->relay_draining, POLL_RELAY_DRAINING, app_idx);
+            }
+            if (rt->ssh_server != NULL) {
+                poll_add(rt->ssh_server->fd, ssh_server_events(rt->ssh_server),
+                         POLL_SSH_SERVER, app_idx);
+            }
+            if (rt->ssh_server_draining != NULL) {
+                poll_add(rt->ssh_server_draining->fd,
+                         ssh_server_events(rt->ssh_server_draining),
+                         POLL_SSH_SERVER_DRAINING, app_idx);
+            }
+            if (rt->next_timer_ms < next) {
+                next = rt->next_timer_ms;
+            }
+            if ((rt->sshd.pid != -1 && rt->sshd.pidfd == -1) ||
+                (rt->draining.pid != -1 && rt->draining.pidfd == -1)) {
+                sweep = true;
+            }
+        }
+        for (idx=0; idx<num_orphans; idx++) {
+            poll_add(orphans[idx].child.pidfd, POLLIN, POLL_ORPHAN, idx);
+        }
+        poll_add(shard->wake[0], POLLIN, POLL_WAKE, 0);
+        if (admission_next_ms(now) < next) {
+            next = admission_next_ms(now);
+        }
+
+        timeout = (next <= now) ? 0 : (int)(next - now);
+        if (poll(poll_fds, num_poll_fds, timeout) < 0 && errno != EINTR) {
+            log_error("poll() failed: %s", strerror(errno));
+            sleep(1);
+            continue;
+        }
+
+        // I/O and child exits, messages are taken at the top of the next pass
+        for (idx=0; idx<num_poll_fds; idx++) {
+            Application* app;
+            AppRuntime*  rt;
+            Child        exited;
+            int          wait_status;
+            int          result;
+
+            if (poll_fds[idx].revents == 0) {
+                continue;
+            }
+            if (poll_owners[idx].kind == POLL_WAKE) {
+                char drain[64];
+                while (read(shard->wake[0], drain, sizeof(drain)) > 0) {
+                    // messages are taken above
+                }
+                continue;
+            }
+            if (poll_owners[idx].kind == POLL_ORPHAN) {
+                continue;  // reaped below
+            }
+
+            app = &(active->apps[poll_owners[idx].idx]);
+            rt = &(active->runtime[poll_owners[idx].idx]);
+            switch (poll_owners[idx].kind) {
+                case POLL_WAKE:
+                case POLL_ORPHAN:
+                    break;
+                case POLL_CONNECTOR:
+                    switch (connector_finish(&rt->connector)) {
+                        case 0:  app_connected(app, rt);      break;
+                        case 1:  app_server_failed(app, rt);  break;
+                        default: break;  // trying next address
+                    }
+                    break;
+                case POLL_PROBE:
+                    switch (connector_finish(&rt->probe)) {
+                        case 0:
+                            app_probe_succeeded(app, rt);
+                            break;
+                        case 1:
+                            app_probe_failed(app, rt);
+                            break;
+                        default:
+                            break;
+                    }
+                    break;
+                case POLL_SSHD:
+                    // the pidfd may belong to a session that migrated
+                    // earlier in this pass, then it's reaped as draining
+                    exited = rt->sshd;
+                    if (child_reap(&rt->sshd, &wait_status)) {
+                        app_session_ended(app, rt, exited.started_ms,
+                                          report_session_end(app, rt, &exited, wait_status));
+                    }
+                    break;
+                case POLL_DRAINING:
+                    exited = rt->draining;
+                    if (child_reap(&rt->draining, &wait_status)) {
+                        report_session_end(app, rt, &exited, wait_status);
+                    }
+                    break;
+                case POLL_RELAY:
+                    // both of a relay's fds may have fired
+                    if (rt->relay != NULL && (result = relay_pump(rt->relay)) != 0) {
+                        int64_t started_ms = rt->relay->started_ms;
+                        int32_t exit_code = report_relay_end(app, rt, rt->relay, result);
+                        rt->relay = NULL;
+                        app_session_ended(app, rt, started_ms, exit_code);
+                    }
+                    break;
+                case POLL_RELAY_DRAINING:
+                    if (rt->relay_draining != NULL &&
+                        (result = relay_pump(rt->relay_draining)) != 0) {
+                        report_relay_end(app, rt, rt->relay_draining, result);
+                        rt->relay_draining = NULL;
+                    }
+                    break;
+                case POLL_SSH_SERVER:
+                    if (rt->ssh_server == NULL) {
+                        break;
+                    }
+                    result = ssh_server_pump(rt->ssh_server);
+                    trace_progress(rt, ssh_server_take_marks(rt->ssh_server));
+                    if (result != 0) {
+                        int64_t started_ms = rt->ssh_server->started_ms;
+                        int32_t exit_code = report_ssh_server_end(app, rt, rt->ssh_server,
+                                                                  result);
+                        rt->ssh_server = NULL;
+                        app_session_ended(app, rt, started_ms, exit_code);
+                    }
+                    break;
+                case POLL_SSH_SERVER_DRAINING:
+                    if (rt->ssh_server_draining != NULL &&
+                        (result = ssh_server_pump(rt->ssh_server_draining)) != 0) {
+                        report_ssh_server_end(app, rt, rt->ssh_server_draining, result);
+                        rt->ssh_server_draining = NULL;
+                    }
+                    break;
+                case POLL_SSHD_LOG:
+                    // the stream may already be gone with its reaped sshd
+                    if (rt->sshd.log == NULL) {
+                        break;
+                    }
+                    result = log_stream_read(rt->sshd.log);
+                    trace_progress(rt, log_stream_take_marks(rt->sshd.log));
+                    if (result != 0) {
+                        log_stream_close(rt->sshd.log);
+                        rt->sshd.log = NULL;
+                    }
+                    break;
+                case POLL_DRAINING_LOG:
+                    if (rt->draining.log != NULL && log_stream_read(rt->draining.log) != 0) {
+                        log_stream_close(rt->draining.log);
+                        rt->draining.log = NULL;
+                    }
+                    break;
+            }
+            app_schedule(app, rt);
+        }
+
+        // timers, and reaping children the platform gave no pidfd
+        now = now_ms();
+        for (app_idx=0; app_idx<active->num_apps; app_idx++) {
+            AppRuntime*  rt = &(active->runtime[app_idx]);
+            Application* app;
+            Child        exited;
+            int          wait_status;
+
+            if (sweep == false && now < rt->next_timer_ms) {
+                continue;
+            }
+            app = &(active->apps[app_idx]);
+            if (rt->draining.pid != -1 && rt->draining.pidfd == -1) {
+                exited = rt->draining;
+                if (child_reap(&rt->draining, &wait_status)) {
+                    report_session_end(app, rt, &exited, wait_status);
+                }
+            }
+            if (rt->sshd.pid != -1 && rt->sshd.pidfd == -1) {
+                exited = rt->sshd;
+                if (child_reap(&rt->sshd, &wait_status)) {
+                    app_session_ended(app, rt, exited.started_ms,
+                                      report_session_end(app, rt, &exited, wait_status));
+                }
+            }
+            if (now >= rt->next_timer_ms) {
+                app_timers(app, rt, now);
+            }
+            app_schedule(app, rt);
+        }
+        admission_dispatch(active, now);
+        orphans_reap(now);
+    }
+}
+
+
+
+
+// Open-addressing index of a config's apps by name, so matching a reload
+// against the active config is linear however many apps there are.
+// Names are interned, so the pointer is the key.  Slots hold app index+1,
+// 0 marks an empty slot.
+typedef struct NameIndex NameIndex;
+struct NameIndex {
+    uint32_t* slots;
+    uint32_t  mask;
+};
+
+
+static uint32_t
+name_hash(const char* name) {
+    uintptr_t key = (uintptr_t)name;
+    return (uint32_t)((key >> 4) ^ (key >> 32)) * 2654435761u;
+}
+
+
+static int // 0=OK, 1=ERROR
+name_index_build(NameIndex* index, Configuration* config) {
+    uint32_t size = 16;
+    uint32_t app_idx;
+
+    while (size < config->num_apps * 2) {
+        size *= 2;
+    }
+    index->slots = (uint32_t*)calloc(size, sizeof(uint32_t));
+    if (index->slots == NULL) {
+        return 1;
+    }
+    index->mask = size - 1;
+    for (app_idx=0; app_idx<config->num_apps; app_idx++) {
+        uint32_t slot = name_hash(config->apps[app_idx].name) & index->mask;
+        while (index->slots[slot] != 0) {
+            slot = (slot + 1) & index->mask;
+        }
+        index->slots[slot] = app_idx + 1;
+    }
+    return 0;
+}
+
+
+// returns the index of the first app named `name` whose runtime hasn't
+// been claimed yet, -1 if there is none
+static int64_t
+name_index_find(NameIndex* index, Configuration* config, const char* name) {
+    uint32_t slot = name_hash(name) & index->mask;
+
+    while (index->slots[slot] != 0) {
+        uint32_t app_idx = index->slots[slot] - 1;
+        if (config->apps[app_idx].name == name &&
+            config->runtime[app_idx].phase == PHASE_IDLE) {
+            return app_idx;
+        }
+        slot = (slot + 1) & index->mask;
+    }
+    return -1;
+}
+
+
+
+
+// PSEUDOCODE
+//   for each app in active
+//       if also in incoming
+//           - do not disconnect, just move its runtime into incoming
+//       else
+//           - disconnect it
+//   copy all the incoming app pointers to active
+//   for each app in "new" active
+//       if not started
+//           - connect app
+//
+// Takes ownership of incoming's apps, the caller frees only the
+// Configuration struct itself.  If incoming already has a runtime array
+// (sessions adopted in a handoff), its apps that aren't idle are kept.
+static int // 0=OK, 1=ERROR
+apply_incoming_config(Configuration* active, Configuration* incoming) {
+    NameIndex    index;
+    uint32_t     incoming_app_idx;
+    uint32_t     active_app_idx;
+    Application* active_app;
+
+    // the incoming apps' runtime, filled in from the active apps that
+    // are unchanged, and started afresh for the rest
+    if (incoming->runtime == NULL) {
+        incoming->runtime = (AppRuntime*)calloc(incoming->num_apps ? incoming->num_apps : 1,
+                                                sizeof(AppRuntime));
+    }
+    if (incoming->runtime == NULL || name_index_build(&index, incoming) != 0) {
+        log_error("could not alloc runtime for %u apps", incoming->num_apps);
+        for (incoming_app_idx=0; incoming_app_idx<incoming->num_apps; incoming_app_idx++) {
+            free_application(&(incoming->apps[incoming_app_idx]));
+        }
+        free(incoming->apps);
+        free(incoming->runtime);
+        return 1;
+    }
+
+    // iterate over apps in active
+    for (active_app_idx=0; active_app_idx<active->num_apps; active_app_idx++) {
+        AppRuntime* active_rt = &(active->runtime[active_app_idx]);
+        int64_t     found;
+
+        active_app = &(active->apps[active_app_idx]);
+        assert(active_rt->phase != PHASE_IDLE);
+
+        // see if it's also in the incoming config
+        found = name_index_find(&index, incoming, active_app->name);
+
+        // match only if *entire* definition (not including the
+        // operational state) is the same (too conservative?)
+        if (found != -1 && app_config_equal(&(incoming->apps[found]), active_app)) {
+            // found it, just move its runtime state (and status slot)
+            // to the incoming app
+            incoming->runtime[found] = *active_rt;
+            active_rt->phase = PHASE_IDLE;
+
+        } else {
+            // if app was NOT found, disconnect it
+            app_stop(active_app, active_rt);
+            status_slot_free(active_rt->status_slot);
+        }
+
+#ifdef DEBUG_SSHD
+        // one way or the other, the app should now be idle
+        assert(active_rt->phase == PHASE_IDLE);
+#endif
+
+        // free this active app's memory
+        free_application(active_app);
+    }
+    free(active->apps);
+    free(active->runtime);
+    free(index.slots);
+
+    // copy all the incoming app pointers to active
+    memcpy(active, incoming, sizeof(Configuration));
+
+    // iterate over apps in "new" active, for those not yet started
+    for (active_app_idx=0; active_app_idx<active->num_apps; active_app_idx++) {
+        AppRuntime* active_rt = &(active->runtime[active_app_idx]);
+
+        active_app = &(active->apps[active_app_idx]);
+
+        // ensure app isn't already connected
+        if (active_rt->phase != PHASE_IDLE) {
+            continue;  // nothing to do
+        }
+
+        // connect to this app now
+        active_rt->status_slot = status_slot_alloc(active_app->name);
+        app_start(active_app, active_rt);
+    }
+    return 0;
+}
+
+
+
+// Add `incoming` (already verified) to the active config, or replace the
+// active app having the same name.  Unlike apply_incoming_config(), no
+// other app is touched.  Takes ownership of incoming's servers and host-keys.
+static int // 0=OK, 1=ERROR
+upsert_application(Configuration* active, Application* incoming) {
+    Application*  active_app = NULL;
+    AppRuntime*   active_rt = NULL;
+    uint32_t      app_idx;
+
+    // names are interned, a pointer compare will do
+    for (app_idx=0; app_idx<active->num_apps; app_idx++) {
+        if (active->apps[app_idx].name == incoming->name) {
+            active_app = &(active->apps[app_idx]);
+            active_rt = &(active->runtime[app_idx]);
+            break;
+        }
+    }
+
+    if (active_app != NULL) {
+        if (app_config_equal(active_app, incoming)) {
+            free_application(incoming);
+            return 0; // nothing changed, leave the session alone
+        }
+        // changed, tear down the old connection but keep its status slot
+        app_stop(active_app, active_rt);
+        free_application(active_app);
+        memcpy(active_app, incoming, sizeof(Application));
+
+    } else {
+        Application* apps;
+        AppRuntime*  runtime;
+
+        apps = (Application*)realloc(active->apps,
+                                     (active->num_apps+1) * sizeof(Application));
+        if (apps != NULL) {
+            active->apps = apps;
+        }
+        runtime = (AppRuntime*)realloc(active->runtime,
+                                       (active->num_apps+1) * sizeof(AppRuntime));
+        if (runtime != NULL) {
+            active->runtime = runtime;
+        }
+        if (apps == NULL || runtime == NULL) {
+            log_error("could not alloc apps struct");
+            free_application(incoming);
+            return 1;
+        }
+        active_app = &(active->apps[active->num_apps]);
+        active_rt = &(active->runtime[active->num_apps]);
+        memcpy(active_app, incoming, sizeof(Application));
+        active_rt->status_slot = status_slot_alloc(active_app->name);
+        active->num_apps++;
+    }
+
+    app_start(active_app, active_rt);
+    return 0;
+}
+
+
+
+// Disconnect and remove the app with the (interned) name from the active
+// config
+static int // 0=OK, 1=ERROR, 2=NOTFOUND
+delete_application(Configuration* active, const char* name) {
+    uint32_t    app_idx;
+
+    for (app_idx=0; app_idx<active->num_apps; app_idx++) {
+        Application* app = &(active->apps[app_idx]);
+        AppRuntime*  rt = &(active->runtime[app_idx]);
+
+        if (app->name == name) {
+            app_stop(app, rt);
+            status_slot_free(rt->status_slot);
+            free_application(app);
+
+            // fill the hole with the last app, order doesn't matter
+            active->num_apps--;
+            if (app_idx != active->num_apps) {
+                memcpy(app, &(active->apps[active->num_apps]), sizeof(Application));
+                memcpy(rt, &(active->runtime[active->num_apps]), sizeof(AppRuntime));
+            }
+            return 0;
+        }
+    }
+    return 2;
+}
+
+
+
+// Record `app` (already verified) in the main thread's copy of the
+// config, replacing the app with the same name.  Takes ownership of it.
+static int // 0=OK, 1=ERROR
+config_upsert(Configuration* config, Application* app) {
+    Application* apps;
+    uint32_t     app_idx;
+
+    for (app_idx=0; app_idx<config->num_apps; app_idx++) {
+        if (config->apps[app_idx].name == app->name) {
+            free_application(&(config->apps[app_idx]));
+            memcpy(&(config->apps[app_idx]), app, sizeof(Application));
+            return 0;
+        }
+    }
+    apps = (Application*)realloc(config->apps, (config->num_apps+1) * sizeof(Application));
+    if (apps == NULL) {
+        log_error("could not alloc apps struct");
+        free_application(app);
+        return 1;
+    }
+    config->apps = apps;
+    memcpy(&(config->apps[config->num_apps]), app, sizeof(Application));
+    config->num_apps++;
+    return 0;
+}
+
+
+// the index of the app with the (interned) name in the main thread's
+// copy of the config
+static int64_t // -1 if there's none
+config_find(Configuration* config, const char* name) {
+    uint32_t app_idx;
+
+    for (app_idx=0; app_idx<config->num_apps; app_idx++) {
+        if (config->apps[app_idx].name == name) {
+            return app_idx;
+        }
+    }
+    return -1;
+}
+
+
+// drop apps[app_idx] from the main thread's copy of the config
+static void
+config_remove(Configuration* config, uint32_t app_idx) {
+    free_application(&(config->apps[app_idx]));
+    config->num_apps--;
+    if (app_idx != config->num_apps) {
+        memcpy(&(config->apps[app_idx]), &(config->apps[config->num_apps]),
+               sizeof(Application));
+    }
+}
+
+
+// carry out a message from the main thread (shard thread only)
+static void
+shard_handle(Shard* shard, ShardMsg* msg) {
+    switch (msg->type) {
+        case SHARD_APPLY:
+            if (apply_incoming_config(&(shard->active), msg->config) != 0) {
+                log_error("shard %u: apply_incoming_config() failed",
+                          (unsigned)(shard - shards));
+            }
+            free(msg->config);
+            break;
+        case SHARD_UPSERT:
+            upsert_application(&(shard->active), &(msg->app));
+            break;
+        case SHARD_DELETE:
+            delete_application(&(shard->active), msg->name);
+            intern_release(msg->name);
+            break;
+        case SHARD_STOP:
+            shard->stopping = true;
+            break;
+        case SHARD_HANDOFF:
+            shard->stopping = true;
+            shard->handing_off = true;
+            break;
+    }
+    admission.stale = true;  // apps may have moved
+    free(msg);
+}
+
+
+static void*
+shard_main(void* arg) {
+    Shard*   shard = (Shard*)arg;
+    uint32_t app_idx;
+    int      idx;
+
+#ifdef __linux__
+    if (shard->cpu != -1) {
+        cpu_set_t cpus;
+        CPU_ZERO(&cpus);
+        CPU_SET(shard->cpu, &cpus);
+        if (pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus) != 0) {
+            log_warn("shard %u: could not pin to CPU %d (ignoring)",
+                     (unsigned)(shard - shards), shard->cpu);
+        }
+    }
+#endif
+
+    flight = shard->flight;
+    admission_init(&(shard->active), shard->of);
+    run_event_loop(shard);
+
+    if (shard->handing_off) {
+        // re-exec'ing, see handoff_exec().  Sessions are kept as they are,
+        // anything half-done is dropped and retried.
+        int64_t now = now_ms();
+
+        for (app_idx=0; app_idx<shard->active.num_apps; app_idx++) {
+            AppRuntime* rt = &(shard->active.runtime[app_idx]);
+
+            connector_cancel(&rt->connector);
+            connector_cancel(&rt->probe);
+            handshake_end(rt);
+            if (rt->phase == PHASE_CONNECTING || rt->phase == PHASE_QUEUED) {
+                flight_end(flight, rt->flight, "handed off");
+                rt->flight = 0;
+                rt->phase = PHASE_RETRY_WAIT;
+                rt->wakeup_ms = now;
+            }
+            rt->next_timer_ms = now;
+        }
+        // sessions already on their way out aren't worth handing off
+        for (idx=0; idx<num_orphans; idx++) {
+            child_signal(&orphans[idx].child, SIGKILL);
+        }
+        while (num_orphans > 0) {
+            orphans_reap(now_ms());
+            poll(NULL, 0, 10);
+        }
+        free(admission.queue);
+        free(orphans);
+        free(poll_fds);
+        free(poll_owners);
+        return NULL;
+    }
+
+    // shutting down - close every session, and reap the sshds (killing
+    // any that don't exit within ORPHAN_KILL_SECS)
+    for (app_idx=0; app_idx<shard->active.num_apps; app_idx++) {
+        app_stop(&(shard->active.apps[app_idx]), &(shard->active.runtime[app_idx]));
+        free_application(&(shard->active.apps[app_idx]));
+    }
+    while (num_orphans > 0) {
+        orphans_reap(now_ms());
+        poll(NULL, 0, 50);
+    }
+    free(shard->active.apps);
+    free(shard->active.runtime);
+    free(admission.queue);
+    free(orphans);
+    free(poll_fds);
+    free(poll_owners);
+    return NULL;
+}
+
+
+// Start `count` shards, pinned to CPUs round-robin if `pin`.  They're
+// started with SIGINT and SIGHUP blocked, so those reach the main thread.
+static int // 0=OK, 1=ERROR
+shards_start(uint32_t count, bool pin) {
+    long     cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    sigset_t signals;
+    sigset_t saved;
+    uint32_t idx;
+
+    shards = (Shard*)calloc(count, sizeof(Shard));
+    if (shards == NULL) {
+        return 1;
+    }
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGINT);
+    sigaddset(&signals, SIGHUP);
+    sigaddset(&signals, SIGUSR2);
+    pthread_sigmask(SIG_BLOCK, &signals, &saved);
+    for (idx=0; idx<count; idx++) {
+        Shard* shard = &(shards[idx]);
+
+        shard->cpu = (pin && cpus > 0) ? (int)(idx % cpus) : -1;
+        shard->of = count;  // num_shards isn't set until they've all started
+        shard->flight = flight_create(trace_attempts);
+        if (pipe(shard->wake) != 0) {
+            flight_destroy(shard->flight);
+            break;
+        }
+        fcntl(shard->wake[0], F_SETFD, FD_CLOEXEC);
+        fcntl(shard->wake[1], F_SETFD, FD_CLOEXEC);
+        fcntl(shard->wake[0], F_SETFL, O_NONBLOCK);
+        fcntl(shard->wake[1], F_SETFL, O_NONBLOCK);
+        if (pthread_create(&(shard->thread), NULL, shard_main, shard) != 0) {
+            close(shard->wake[0]);
+            close(shard->wake[1]);
+            flight_destroy(shard->flight);
+            break;
+        }
+    }
+    pthread_sigmask(SIG_SETMASK, &saved, NULL);
+    num_shards = idx;
+    if (num_shards < count) {
+        log_warn("only %u of %u shards started", num_shards, count);
+    }
+    return num_shards == 0 ? 1 : 0;
+}
+
+
+// tell every shard to stop its apps, and wait until they have
+static void
+shards_stop(void) {
+    uint32_t idx;
+
+    for (idx=0; idx<num_shards; idx++) {
+        ShardMsg* msg;
+        while ((msg = (ShardMsg*)calloc(1, sizeof(ShardMsg))) == NULL) {
+            poll(NULL, 0, 100);
+        }
+        msg->type = SHARD_STOP;
+        shard_post(&(shards[idx]), msg);
+    }
+    for (idx=0; idx<num_shards; idx++) {
+        pthread_join(shards[idx].thread, NULL);
+        close(shards[idx].wake[0]);
+        close(shards[idx].wake[1]);
+        flight_destroy(shards[idx].flight);
+    }
+    free(shards);
+    shards = NULL;
+    num_shards = 0;
+}
+
+
+static bool handoff_adopt(Application* app, AppRuntime* rt);
+
+
+// Stop the shards for a handoff: each one keeps its apps' sessions and
+// runtime in shard->active, for handoff_exec() to pass on
+static void
+shards_freeze(void) {
+    uint32_t idx;
+
+    for (idx=0; idx<num_shards; idx++) {
+        ShardMsg* msg;
+        while ((msg = (ShardMsg*)calloc(1, sizeof(ShardMsg))) == NULL) {
+            poll(NULL, 0, 100);
+        }
+        msg->type = SHARD_HANDOFF;
+        shard_post(&(shards[idx]), msg);
+    }
+    for (idx=0; idx<num_shards; idx++) {
+        pthread_join(shards[idx].thread, NULL);
+    }
+}
+
+
+// restart frozen shards where they left off, after a failed handoff
+static int // 0=OK, 1=ERROR
+shards_thaw(void) {
+    sigset_t signals;
+    sigset_t saved;
+    uint32_t idx;
+    int      result = 0;
+
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGINT);
+    sigaddset(&signals, SIGHUP);
+    sigaddset(&signals, SIGUSR2);
+    pthread_sigmask(SIG_BLOCK, &signals, &saved);
+    for (idx=0; idx<num_shards; idx++) {
+        shards[idx].stopping = false;
+        shards[idx].handing_off = false;
+        if (pthread_create(&(shards[idx].thread), NULL, shard_main, &(shards[idx])) != 0) {
+            log_error("could not restart shard %u", idx);
+            result = 1;
+        }
+    }
+    pthread_sigmask(SIG_SETMASK, &saved, NULL);
+    return result;
+}
+
+
+// Hand each shard a copy of its part of a verified config, and make the
+// config the main thread's copy.  Takes ownership of incoming's apps.
+static int // 0=OK, 1=ERROR
+shards_apply(Configuration* master, Configuration* incoming) {
+    Configuration* parts[MAX_SHARDS];
+    ShardMsg*      msgs[MAX_SHARDS];
+    uint32_t*      owner;
+    uint32_t       app_idx;
+    uint32_t       idx;
+    bool           failed = false;
+
+    memset(parts, 0, sizeof(parts));
+    memset(msgs, 0, sizeof(msgs));
+    owner = (uint32_t*)malloc((incoming->num_apps ? incoming->num_apps : 1) * sizeof(uint32_t));
+    failed = (owner == NULL);
+    for (idx=0; idx<num_shards && !failed; idx++) {
+        parts[idx] = (Configuration*)calloc(1, sizeof(Configuration));
+        msgs[idx] = (ShardMsg*)calloc(1, sizeof(ShardMsg));
+        failed = (parts[idx] == NULL || msgs[idx] == NULL);
+    }
+
+    // size each shard's part, then copy its apps in
+    for (app_idx=0; app_idx<incoming->num_apps && !failed; app_idx++) {
+        owner[app_idx] = app_shard(&(incoming->apps[app_idx]));
+        parts[owner[app_idx]]->num_apps++;
+    }
+    for (idx=0; idx<num_shards && !failed; idx++) {
+        uint32_t size = parts[idx]->num_apps ? parts[idx]->num_apps : 1;
+        parts[idx]->apps = (Application*)calloc(size, sizeof(Application));
+        parts[idx]->runtime = (AppRuntime*)calloc(size, sizeof(AppRuntime));
+        parts[idx]->num_apps = 0;
+        failed = (parts[idx]->apps == NULL || parts[idx]->runtime == NULL);
+    }
+    for (app_idx=0; app_idx<incoming->num_apps && !failed; app_idx++) {
+        Configuration* part = parts[owner[app_idx]];
+        failed = copy_application(&(part->apps[part->num_apps]),
+                                  &(incoming->apps[app_idx])) != 0;
+        if (!failed) {
+            // a session handed over by the previous image carries on
+            handoff_adopt(&(part->apps[part->num_apps]),
+                          &(part->runtime[part->num_apps]));
+            part->num_apps++;
+        }
+    }
+    free(owner);
+
+    if (failed) {
+        log_error("could not alloc shards' configs");
+        for (idx=0; idx<num_shards; idx++) {
+            if (parts[idx] != NULL) {
+                free_configuration(parts[idx]);
+            }
+            free(msgs[idx]);
+        }
+        for (app_idx=0; app_idx<incoming->num_apps; app_idx++) {
+            free_application(&(incoming->apps[app_idx]));
+        }
+        free(incoming->apps);
+        return 1;
+    }
+
+    for (idx=0; idx<num_shards; idx++) {
+        msgs[idx]->type = SHARD_APPLY;
+        msgs[idx]->config = parts[idx];
+        shard_post(&(shards[idx]), msgs[idx]);
+    }
+
+    for (app_idx=0; app_idx<master->num_apps; app_idx++) {
+        free_application(&(master->apps[app_idx]));
+    }
+    free(master->apps);
+    master->apps = incoming->apps;
+    master->num_apps = incoming->num_apps;
+    master->runtime = NULL;
+    return 0;
+}
+
+
+// Write the active config back through the data access layer without
+// blocking the event loop.  A forked child writes its copy-on-write
+// snapshot; changes made while it runs are coalesced into one more write.
+static void
+persist_active_config(Configuration* active) {
+    pid_t pid;
+
+    if (persist_child.pid != -1) {
+        persist_pending = true; // still writing, go again when done
+        return;
+    }
+
+    persist_pending = false;
+    pid = fork();
+    if (pid == -1) {
+        log_error("fork() failed, config.xml not updated");
+        persist_pending = true;  // try again later
+        return;
+    }
+    if (pid == 0) {
+        _exit(set_incoming_config(active));
+    }
+    child_track(&persist_child, pid);
+}
+
+
+// the child forked by persist_active_config() is done
+static void
+persist_reaped(int wait_status) {
+    if (!WIFEXITED(wait_status) || WEXITSTATUS(wait_status) != 0) {
+        log_error("set_incoming_config() failed, config.xml not updated");
+    }
+}
+
+
+
+// create the control socket, only root (or whoever runs ncchd) may use it
+static int // -1=error, listening socket otherwise
+open_control_socket(const char* path) {
+    struct sockaddr_un addr;
+    int                sockfd;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        log_error("control socket path \"%s\" too long", path);
+        return -1;
+    }
+    strcpy(addr.sun_path, path);
+
+    sockfd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (sockfd == -1) {
+        log_error("socket() failed");
+        return -1;
+    }
+    unlink(path);
+    if (bind(sockfd, (struct sockaddr*)&addr, sizeof(addr)) != 0 ||
+        chmod(path, 0600) != 0 ||
+        listen(sockfd, 16) != 0) {
+        log_error("could not listen on control socket \"%s\"", path);
+        close(sockfd);
+        return -1;
+    }
+    fcntl(sockfd, F_SETFD, FD_CLOEXEC);
+    return sockfd;
+}
+
+
+// Write the connect attempts the shards' flight recorders hold (just
+// `app`'s unless it's NULL, just the failed ones if `failed_only`) to
+// `path`, as Chrome trace-event JSON.  The shards keep recording.
+static int // 0=OK, 1=ERROR, 2=NONE KEPT
+trace_dump(const char* app, bool failed_only, const char* path, uint32_t* count) {
+    FlightRecorder* recorders[MAX_SHARDS];
+    uint32_t        idx;
+
+    if (trace_attempts == 0) {
+        return 2;
+    }
+    for (idx=0; idx<num_shards; idx++) {
+        recorders[idx] = shards[idx].flight;
+    }
+    return flight_dump(recorders, num_shards, app, failed_only, path, count);
+}
+
+
+// the shards' failed attempts, ever
+static uint64_t
+trace_failures(void) {
+    uint64_t failures = 0;
+    uint32_t idx;
+
+    for (idx=0; idx<num_shards; idx++) {
+        failures += flight_failures(shards[idx].flight);
+    }
+    return failures;
+}
+
+
+// Serve one request from the control socket.  The client writes a single
+// request and then shuts down its write side; the request is either
+//
+//     delete <app-name>
+//     log-level <error|warn|info|debug>
+//     restart
+//     trace [<app-name>]
+//
+// or "upsert" on a line by itself, followed by an <application> element
+// in the same format as config.xml.  The reply is "ok" or "error: <why>";
+// for "trace", which writes the recorded connect attempts to
+// TRACE_PATH, it also says how many there were.  `master` is the main
+// thread's copy of the config; the change is passed on to the app's shard.
+static void
+handle_control_request(Configuration* master, int listenfd) {
+    static char    request[CONTROL_MAX_REQUEST+1];
+    static char    message[128];
+    struct timeval timeout = { CONTROL_TIMEOUT_SECS, 0 };
+    const char*    reply = "ok\n";
+    size_t         len = 0;
+    ssize_t        n;
+    int            connfd;
+    bool           changed = false;
+    ShardMsg*      msg;
+
+    // CLOEXEC so sshds the shards start don't hold it
+    connfd = accept4(listenfd, NULL, NULL, SOCK_CLOEXEC);
+    if (connfd == -1) {
+        return;
+    }
+    // a stalled client must not stall the daemon
+    setsockopt(connfd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    setsockopt(connfd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+    while (len < CONTROL_MAX_REQUEST &&
+           (n = read(connfd, request+len, CONTROL_MAX_REQUEST-len)) > 0) {
+        len += n;
+    }
+    request[len] = '\0';
+
+    if (strncmp(request, "delete ", 7) == 0) {
+        char*       appname = request + 7;
+        const char* name;
+        int64_t     found = -1;
+
+        appname[strcspn(appname, "\r\n")] = '\0';
+        name = intern_lookup(appname);
+        if (name != NULL) {
+            found = config_find(master, name);
+        }
+        if (found == -1) {
+            reply = "error: no such app\n";
+        } else if ((msg = (ShardMsg*)calloc(1, sizeof(ShardMsg))) == NULL) {
+            reply = "error: could not delete application\n";
+        } else {
+            // the shard's reference keeps the name alive once it's gone here
+            uint32_t shard = app_shard(&(master->apps[found]));
+            msg->type = SHARD_DELETE;
+            msg->name = intern_ref(name);
+            config_remove(master, found);
+            shard_post(&(shards[shard]), msg);
+            log_info("control: deleted app \"%s\"", appname);
+            changed = true;
+        }
+
+    } else if (strncmp(request, "upsert\n", 7) == 0) {
+        Application   app;
+        Configuration single;
+
+        memset(&app, 0, sizeof(app));
+        single.apps = &app;
+        single.runtime = NULL;
+        single.num_apps = 1;
+        msg = NULL;
+        if (get_incoming_application(request + 7, &app) != 0) {
+            free_application(&app);
+            reply = "error: invalid <application> element\n";
+
+        // same checks as a full reload, against just this app
+        } else if (verify_incoming_config(&single, false) != 0 ||
+                   (msg = (ShardMsg*)calloc(1, sizeof(ShardMsg))) == NULL ||
+                   copy_application(&(msg->app), &app) != 0) {
+            free(msg);
+            free_application(&app);
+            reply = "error: could not apply application\n";
+
+        } else {
+            // the master copy keeps the name alive once upserted
+            const char* appname = app.name;
+            int64_t     found = config_find(master, appname);
+            uint32_t    shard = app_shard(&app);
+            uint32_t    old_shard = (found == -1) ? shard : app_shard(&(master->apps[found]));
+            ShardMsg*   moved = NULL;
+
+            // sharing a connection or not (or with other apps) can move it
+            // to another shard, which the old one has to let go of first
+            if ((old_shard != shard &&
+                 (moved = (ShardMsg*)calloc(1, sizeof(ShardMsg))) == NULL) ||
+                config_upsert(master, &app) != 0) {
+                free(moved);
+                free_application(&(msg->app));
+                free(msg);
+                reply = "error: could not apply application\n";
+            } else {
+                if (moved != NULL) {
+                    moved->type = SHARD_DELETE;
+                    moved->name = intern_ref(appname);
+                    shard_post(&(shards[old_shard]), moved);
+                }
+                msg->type = SHARD_UPSERT;
+                shard_post(&(shards[shard]), msg);
+                log_info("control: upserted app \"%s\"", appname);
+                changed = true;
+            }
+        }
+
+    } else if (strncmp(request, "log-level ", 10) == 0) {
+        char* level = request + 10;
+        level[strcspn(level, "\r\n")] = '\0';
+        if (log_set_level(level) != 0) {
+            reply = "error: unknown log level\n";
+        } else {
+            log_info("control: log level set to %s", log_level_name());
+        }
+
+    } else if (strcmp(request, "restart\n") == 0) {
+        log_info("control: restart requested");
+        upgrading = true;  // once this request is answered, see handoff_exec()
+
+    } else if (strcmp(request, "trace\n") == 0 || strncmp(request, "trace ", 6) == 0) {
+        char*    appname = (request[5] == ' ') ? request + 6 : NULL;
+        uint32_t count = 0;
+
+        if (appname != NULL) {
+            appname[strcspn(appname, "\r\n")] = '\0';
+        }
+        switch (trace_dump(appname, false, TRACE_PATH, &count)) {
+            case 0:
+                snprintf(message, sizeof(message), "ok, %u attempts in %s\n",
+                         count, TRACE_PATH);
+                reply = message;
+                break;
+            case 2:
+                reply = "error: no attempts are kept (" TRACE_ATTEMPTS_ENV " is 0)\n";
+                break;
+            default:
+                reply = "error: could not write " TRACE_PATH "\n";
+                break;
+        }
+
+    } else {
+        reply = "error: unknown request\n";
+    }
+
+    n = write(connfd, reply, strlen(reply));
+    close(connfd);
+
+    if (changed) {
+        persist_active_config(master);
+    }
+}
+
+
+// Serve the control socket and reap the config-writing child until SIGINT
+// or SIGHUP, while the shards maintain the apps
+static void
+run_main_loop(Configuration* master) {
+    int64_t  next_failures_ms = now_ms() + TRACE_FAILURES_SECS*1000;
+    uint64_t failures_dumped = trace_failures();
+
+    while (shutting_down == false && restarting == false && upgrading == false) {
+        struct pollfd fds[2];
+        int           wait_status;
+
+        fds[0].fd = control_fd;
+        fds[0].events = POLLIN;
+        fds[0].revents = 0;
+        fds[1].fd = persist_child.pidfd;
+        fds[1].events = POLLIN;
+        fds[1].revents = 0;
+
+        // a pidfd-less child is reaped at least once a second
+        if (poll(fds, 2, 1000) < 0 && errno != EINTR) {
+            log_error("poll() failed: %s", strerror(errno));
+            sleep(1);
+            continue;
+        }
+        if (persist_child.pid != -1 && child_reap(&persist_child, &wait_status)) {
+            persist_reaped(wait_status);
+        }
+        if (persist_pending && persist_child.pid == -1) {
+            persist_active_config(master);
+        }
+        if (fds[0].revents & POLLIN) {
+            handle_control_request(master, control_fd);
+        }
+
+        // keep the latest failed attempts on disk, for a post-mortem
+        if (now_ms() >= next_failures_ms) {
+            uint64_t failures = trace_failures();
+            uint32_t count;
+
+            next_failures_ms = now_ms() + TRACE_FAILURES_SECS*1000;
+            if (failures != failures_dumped &&
+                trace_dump(NULL, true, TRACE_FAILURES_PATH, &count) == 0) {
+                log_debug("%u failed connect attempts in %s", count, TRACE_FAILURES_PATH);
+                failures_dumped = failures;
+            }
+        }
+    }
+}
+
+
+/*****************************************************************************
+   HANDOFF
+ *****************************************************************************/
+
+// A restart or upgrade (SIGUSR2, or `ncchctl restart`) keeps every
+// established session.  The shards stop without touching their sessions,
+// whose state is written to an unlinked file, and ncchd execv()s its
+// binary again (perhaps a new one by now), leaving the sessions' fds
+// (sshd pidfds and stderr pipes, relay sockets and pipes) and the control
+// socket open across the exec.  It's still the same process, so the
+// sshds are still its children.  The new image reads the file back (its
+// fd is in NCCHD_HANDOFF_FD) and adopts each session for its app, as long
+// as the app is still configured with the server it's connected to;
+// sessions of apps that are gone are closed.
+
+typedef struct HandoffHeader HandoffHeader;
+struct HandoffHeader {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t record_size;      // sizeof(HandoffSession) of the writer
+    int32_t  control_fd;
+    uint32_t num_sessions;
+    uint32_t last_session_id;
+};
+
+typedef struct HandoffChild HandoffChild;
+struct HandoffChild {
+    int32_t  pid;              // -1 if there's none
+    int32_t  pidfd;
+    int32_t  log_fd;           // -1 if its stderr isn't captured
+    uint32_t session;
+    int64_t  started_ms;       // monotonic, which the exec doesn't reset
+};
+
+// an app's session, followed in the file by the app's name and by the
+// address of the server it's connected to
+typedef struct HandoffSession HandoffSession;
+struct HandoffSession {
+    uint32_t     name_len;
+    uint32_t     addr_len;
+    uint32_t     svr_idx;
+    uint16_t     port;
+    uint8_t      has_relay;
+    uint8_t      has_relay_draining;
+    uint8_t      drain_signal;
+    int64_t      drain_deadline_ms;
+    HandoffChild sshd;
+    HandoffChild draining;
+    Relay        relay;
+    Relay        relay_draining;
+    AppStatus    status;
+};
+
+// a session read back by the new image, until its app adopts it
+typedef struct Inherited Inherited;
+struct Inherited {
+    const char*    name;       // interned
+    char*          addr;
+    bool           adopted;
+    HandoffSession session;
+};
+
+static Inherited* inherited = NULL;     // sorted by name pointer
+static uint32_t   num_inherited = 0;
+
+
+static void
+set_cloexec(int fd, bool on) {
+    if (fd != -1) {
+        fcntl(fd, F_SETFD, on ? FD_CLOEXEC : 0);
+    }
+}
+
+
+static void
+relay_fds_cloexec(struct Relay* relay, bool on) {
+    int side;
+
+    if (relay == NULL) {
+        return;
+    }
+    for (side=0; side<2; side++) {
+        set_cloexec(relay->fd[side], on);
+        set_cloexec(relay->pipe[side][0], on);
+        set_cloexec(relay->pipe[side][1], on);
+    }
+}
+
+
+// keep (on=false) or stop keeping the fds of an app's sessions across exec
+static void
+runtime_fds_cloexec(AppRuntime* rt, bool on) {
+    set_cloexec(rt->sshd.pidfd, on);
+    set_cloexec(rt->sshd.log != NULL ? rt->sshd.log->fd : -1, on);
+    set_cloexec(rt->draining.pidfd, on);
+    set_cloexec(rt->draining.log != NULL ? rt->draining.log->fd : -1, on);
+    relay_fds_cloexec(rt->relay, on);
+    relay_fds_cloexec(rt->relay_draining, on);
+}
+
+
+static void
+all_fds_cloexec(bool on) {
+    uint32_t idx;
+    uint32_t app_idx;
+
+    for (idx=0; idx<num_shards; idx++) {
+        for (app_idx=0; app_idx<shards[idx].active.num_apps; app_idx++) {
+            runtime_fds_cloexec(&(shards[idx].active.runtime[app_idx]), on);
+        }
+    }
+    set_cloexec(control_fd, on);
+}
+
+
+static void
+handoff_child_save(HandoffChild* saved, Child* child) {
+    saved->pid = child->pid;
+    saved->pidfd = child->pidfd;
+    saved->log_fd = child->log != NULL ? child->log->fd : -1;
+    saved->session = child->log != NULL ? child->log->session : 0;
+    saved->started_ms = child->started_ms;
+}
+
+
+static void
+handoff_child_restore(Child* child, HandoffChild* saved, const char* appname) {
+    child->pid = saved->pid;
+    child->pidfd = saved->pidfd;
+    child->started_ms = saved->started_ms;
+    child->log = NULL;
+    set_cloexec(child->pidfd, true);
+    if (saved->log_fd != -1) {
+        set_cloexec(saved->log_fd, true);
+        child->log = log_stream_open(saved->log_fd, appname, saved->session);
+    }
+}
+
+
+static struct Relay* // NULL if there's none
+handoff_relay_restore(uint8_t present, Relay* saved) {
+    struct Relay* relay;
+
+    if (!present || (relay = (struct Relay*)malloc(sizeof(Relay))) == NULL) {
+        return NULL;
+    }
+    memcpy(relay, saved, sizeof(Relay));
+    relay_fds_cloexec(relay, true);
+    return relay;
+}
+
+
+// write the frozen shards' sessions to `file`
+static int // 0=OK, 1=ERROR
+handoff_write(FILE* file, uint32_t* num_sessions) {
+    HandoffHeader header;
+    uint32_t      idx;
+    uint32_t      app_idx;
+
+    *num_sessions = 0;
+    for (idx=0; idx<num_shards; idx++) {
+        for (app_idx=0; app_idx<shards[idx].active.num_apps; app_idx++) {
+            AppRuntime* rt = &(shards[idx].active.runtime[app_idx]);
+            if (rt->sshd.pid != -1 || rt->relay != NULL) {
+                (*num_sessions)++;
+            }
+        }
+    }
+
+    memset(&header, 0, sizeof(header));
+    header.magic = HANDOFF_MAGIC;
+    header.version = HANDOFF_VERSION;
+    header.record_size = sizeof(HandoffSession);
+    header.control_fd = control_fd;
+    header.num_sessions = *num_sessions;
+    header.last_session_id = atomic_load(&last_session_id);
+    if (fwrite(&header, sizeof(header), 1, file) != 1) {
+        return 1;
+    }
+
+    for (idx=0; idx<num_shards; idx++) {
+        Configuration* active = &(shards[idx].active);
+
+        for (app_idx=0; app_idx<active->num_apps; app_idx++) {
+            Application*   app = &(active->apps[app_idx]);
+            AppRuntime*    rt = &(active->runtime[app_idx]);
+            Server*        svr = &(app->servers[rt->svr_idx]);
+            HandoffSession session;
+            AppStatus*     status;
+
+            if (rt->ssh_server != NULL) {
+                // its keys live in this image, the new one reconnects
+                log_info("app \"%s\": in-process session can't be handed over", app->name);
+            }
+            if (rt->sshd.pid == -1 && rt->relay == NULL) {
+                continue;  // not connected, the new image connects it
+            }
+            memset(&session, 0, sizeof(session));
+            session.name_len = strlen(app->name);
+            session.addr_len = strlen(svr->addr);
+            session.svr_idx = rt->svr_idx;
+            session.port = svr->port;
+            session.drain_signal = rt->drain_signal;
+            session.drain_deadline_ms = rt->drain_deadline_ms;
+            handoff_child_save(&(session.sshd), &(rt->sshd));
+            handoff_child_save(&(session.draining), &(rt->draining));
+            if (rt->relay != NULL) {
+                session.has_relay = true;
+                memcpy(&(session.relay), rt->relay, sizeof(Relay));
+            }
+            if (rt->relay_draining != NULL) {
+                session.has_relay_draining = true;
+                memcpy(&(session.relay_draining), rt->relay_draining, sizeof(Relay));
+            }
+            // the counters in the status table carry on too
+            if ((status = status_write_begin(rt->status_slot)) != NULL) {
+                memcpy(&(session.status), status, sizeof(AppStatus));
+                status_write_end(status);
+            }
+            if (fwrite(&session, sizeof(session), 1, file) != 1 ||
+                fwrite(app->name, 1, session.name_len, file) != session.name_len ||
+                fwrite(svr->addr, 1, session.addr_len, file) != session.addr_len) {
+                return 1;
+            }
+        }
+    }
+    return fflush(file) == 0 ? 0 : 1;
+}
+
+
+// Re-exec ncchd, handing it the live sessions.  Returns only if that
+// failed, with the shards running again as before.
+static void
+handoff_exec(Configuration* master) {
+    FILE*    file;
+    char     value[16];
+    uint32_t num_sessions;
+    int      wait_status;
+
+    // the new image reads config.xml, so it has to be current
+    while (persist_child.pid != -1 || persist_pending) {
+        if (persist_child.pid == -1) {
+            persist_active_config(master);
+        }
+        if (persist_child.pid != -1 && child_reap(&persist_child, &wait_status)) {
+            persist_reaped(wait_status);
+        } else {
+            poll(NULL, 0, 10);
+        }
+    }
+
+    file = tmpfile();
+    if (file == NULL) {
+        log_error("could not create the handoff file, not restarting");
+        return;
+    }
+    shards_freeze();
+    if (handoff_write(file, &num_sessions) != 0 ||
+        lseek(fileno(file), 0, SEEK_SET) != 0) {
+        log_error("could not write the handoff file, not restarting");
+
+    } else {
+        log_info("re-executing %s, handing over %u sessions", self_path, num_sessions);
+        all_fds_cloexec(false);
+        set_cloexec(fileno(file), false);
+        snprintf(value, sizeof(value), "%d", fileno(file));
+        setenv(HANDOFF_ENV, value, 1);
+        log_stop();
+        execv(self_path, self_argv);
+
+        // still here, so carry on as we were
+        log_start();
+        log_error("could not exec %s: %s, not restarting", self_path, strerror(errno));
+        unsetenv(HANDOFF_ENV);
+        all_fds_cloexec(true);
+    }
+    fclose(file);
+    if (shards_thaw() != 0) {
+        shutting_down = true;
+    }
+}
+
+
+static int
+inherited_compare(const void* a, const void* b) {
+    uintptr_t x = (uintptr_t)((const Inherited*)a)->name;
+    uintptr_t y = (uintptr_t)((const Inherited*)b)->name;
+    return (x > y) - (x < y);
+}
+
+
+// read back what the previous image handed over through `fd`
+static int // 0=OK, 1=ERROR
+handoff_load(int fd) {
+    HandoffHeader header;
+    FILE*         file = fdopen(fd, "r");
+    uint32_t      idx;
+
+    if (file == NULL) {
+        close(fd);
+        return 1;
+    }
+    if (fread(&header, sizeof(header), 1, file) != 1 ||
+        header.magic != HANDOFF_MAGIC) {
+        fclose(file);
+        return 1;
+    }
+    control_fd = header.control_fd;  // it's still listening
+    set_cloexec(control_fd, true);
+    if (header.version != HANDOFF_VERSION ||
+        header.record_size != sizeof(HandoffSession)) {
+        // nothing to read the sessions with; they stay open but unused
+        log_error("handoff version %u not understood, sessions are dropped",
+                  header.version);
+        fclose(file);
+        return 1;
+    }
+    atomic_store(&last_session_id, header.last_session_id);
+
+    inherited = (Inherited*)calloc(header.num_sessions ? header.num_sessions : 1,
+                                   sizeof(Inherited));
+    if (inherited == NULL) {
+        fclose(file);
+        return 1;
+    }
+    for (idx=0; idx<header.num_sessions; idx++) {
+        Inherited* in = &(inherited[num_inherited]);
+        char*      name;
+
+        if (fread(&(in->session), sizeof(HandoffSession), 1, file) != 1 ||
+            (name = (char*)calloc(1, in->session.name_len + 1)) == NULL) {
+            break;
+        }
+        in->addr = (char*)calloc(1, in->session.addr_len + 1);
+        if (in->addr == NULL ||
+            fread(name, 1, in->session.name_len, file) != in->session.name_len ||
+            fread(in->addr, 1, in->session.addr_len, file) != in->session.addr_len ||
+            (in->name = intern_string(name)) == NULL) {
+            free(name);
+            free(in->addr);
+            break;
+        }
+        free(name);
+        num_inherited++;
+    }
+    fclose(file);
+    qsort(inherited, num_inherited, sizeof(Inherited), inherited_compare);
+    if (num_inherited < header.num_sessions) {
+        log_error("handoff file truncated, read %u of %u sessions",
+                  num_inherited, header.num_sessions);
+    }
+    log_info("took over %u sessions", num_inherited);
+    return 0;
+}
+
+
+// If the previous image handed over a session of `app`, still on one of
+// its servers, take it on as `rt`
+static bool
+handoff_adopt(Application* app, AppRuntime* rt) {
+    Inherited  key;
+    Inherited* in;
+    AppStatus* status;
+    uint32_t   seq;
+
+    key.name = app->name;
+    in = (Inherited*)bsearch(&key, inherited, num_inherited, sizeof(Inherited),
+                             inherited_compare);
+    if (in == NULL || in->adopted ||
+        in->session.svr_idx >= app->num_servers ||
+        app->servers[in->session.svr_idx].port != in->session.port ||
+        strcmp(app->servers[in->session.svr_idx].addr, in->addr) != 0) {
+        return false;
+    }
+    in->adopted = true;
+
+    memset(rt, 0, sizeof(AppRuntime));
+    rt->connector.fd = -1;
+    rt->probe.fd = -1;
+    handoff_child_restore(&(rt->sshd), &(in->session.sshd), app->name);
+    handoff_child_restore(&(rt->draining), &(in->session.draining), app->name);
+    rt->relay = handoff_relay_restore(in->session.has_relay, &(in->session.relay));
+    rt->relay_draining = handoff_relay_restore(in->session.has_relay_draining,
+                                               &(in->session.relay_draining));
+    rt->drain_signal = in->session.drain_signal;
+    rt->drain_deadline_ms = in->session.drain_deadline_ms;
+    rt->svr_idx = in->session.svr_idx;
+    rt->probe_backoff = 1;
+    rt->seed = (unsigned int)(getpid() ^ time(NULL) ^ (uintptr_t)rt);
+    rt->next_probe_ms = now_ms() + jittered_probe_interval_ms(app, rt);
+    rt->phase = PHASE_CONNECTED;
+
+    rt->status_slot = status_slot_alloc(app->name);
+    if ((status = status_write_begin(rt->status_slot)) != NULL) {
+        seq = status->seq;
+        memcpy(status, &(in->session.status), sizeof(AppStatus));
+        status->seq = seq;
+        status_write_end(status);
+    }
+    app_schedule(app, rt);
+    return true;
+}
+
+
+// Close the handed-over sessions no app adopted, and forget the rest.
+// Their sshds are asked to exit all at once, and killed if they haven't
+// within ORPHAN_KILL_SECS.
+static void
+handoff_release(void) {
+    Child*   children = (Child*)calloc(2 * num_inherited + 1, sizeof(Child));
+    uint32_t num_children = 0;
+    uint32_t live;
+    uint32_t idx;
+    int64_t  deadline = now_ms() + ORPHAN_KILL_SECS * 1000;
+    int      status;
+
+    for (idx=0; idx<num_inherited; idx++) {
+        Inherited* in = &(inherited[idx]);
+
+        if (!in->adopted) {
+            log_info("app \"%s\" is gone, closing its handed-over session", in->name);
+            relay_close(handoff_relay_restore(in->session.has_relay,
+                                              &(in->session.relay)));
+            relay_close(handoff_relay_restore(in->session.has_relay_draining,
+                                              &(in->session.relay_draining)));
+            if (children != NULL) {
+                handoff_child_restore(&(children[num_children]),
+                                      &(in->session.sshd), in->name);
+                handoff_child_restore(&(children[num_children + 1]),
+                                      &(in->session.draining), in->name);
+                child_signal(&(children[num_children]), SIGTERM);
+                child_signal(&(children[num_children + 1]), SIGTERM);
+                num_children += 2;
+            }
+        }
+    }
+
+    do {
+        live = 0;
+        for (idx=0; idx<num_children; idx++) {
+            if (children[idx].pid != -1 && !child_reap(&(children[idx]), &status)) {
+                if (now_ms() >= deadline) {
+                    child_signal(&(children[idx]), SIGKILL);
+                }
+                live++;
+            }
+        }
+        if (live > 0) {
+            poll(NULL, 0, 10);
+        }
+    } while (live > 0);
+    free(children);
+
+    for (idx=0; idx<num_inherited; idx++) {
+        intern_release(inherited[idx].name);
+        free(inherited[idx].addr);
+    }
+    free(inherited);
+    inherited = NULL;
+    num_inherited = 0;
+}
+
+
+/*****************************************************************************
+   MAIN
+ *****************************************************************************/
+
+
+// a number from the environment, `dflt` if it's unset or isn't one
+static uint32_t
+env_number(const char* name, uint32_t dflt) {
+    const char*   value = getenv(name);
+    char*         end;
+    unsigned long number;
+
+    if (value == NULL) {
+        return dflt;
+    }
+    errno = 0;
+    number = strtoul(value, &end, 10);
+    if (*value == '\0' || *end != '\0' || errno != 0 || number > UINT32_MAX) {
+        log_warn("%s must be a number, using %u", name, dflt);
+        return dflt;
+    }
+    return (uint32_t)number;
+}
+
+
+// returns 0 on graceful shutdown; 1 otherwise 
+int main(int argc, char* argv[]) {
+    Configuration* active_config;
+    Configuration* incoming_config;
+    int            result;
+    const char*    log_level = getenv("NCCHD_LOG_LEVEL");
+    const char*    workers = getenv("NCCHD_WORKERS");
+    const char*    pin_cpus = getenv("NCCHD_PIN_CPUS");
+    const char*    handoff_fd = getenv(HANDOFF_ENV);
+    unsigned long  num_workers = 1;
+    bool           adopting = (handoff_fd != NULL);
+
+
+    // log through the ring buffer from here on
+    if (log_level != NULL && log_set_level(log_level) != 0) {
+        log_warn("unknown NCCHD_LOG_LEVEL \"%s\" (ignoring)", log_level);
+    }
+    if (log_start() != 0) {
+        log_warn("log flusher unavailable, logging synchronously");
+    }
+
+    // register handler for graceful shutdown 
+    if (signal(SIGINT, signal_handler) == SIG_ERR) {
+      log_error("signal() failed");
+      return 1;
+    }
+
+    // register handler to reload config
+    if (signal(SIGHUP, signal_handler) == SIG_ERR) {
+      log_error("signal() failed");
+      return 1;
+    }
+
+    // register handler to re-exec, keeping the sessions
+    if (signal(SIGUSR2, signal_handler) == SIG_ERR) {
+      log_error("signal() failed");
+      return 1;
+    }
+    self_argv = argv;
+    if (strchr(argv[0], '/') != NULL) {
+        snprintf(self_path, sizeof(self_path), "%s", argv[0]);
+    } else {
+        snprintf(self_path, sizeof(self_path), "/proc/self/exe");
+    }
+
+    // publish operational state for `ncchctl`, not fatal if this fails
+    if (status_table_create(STATUS_TABLE_PATH) != 0) {
+        log_warn("status table unavailable (ignoring)");
+    }
+
+    // take over the sessions (and control socket) of the image that
+    // exec'd this one, if it did
+    if (handoff_fd != NULL) {
+        if (handoff_load(atoi(handoff_fd)) != 0) {
+            log_error("could not read the handoff file, sessions are dropped");
+        }
+        unsetenv(HANDOFF_ENV);
+    }
+
+    // accept incremental changes from `ncchctl`, not fatal if this fails
+    if (control_fd == -1) {
+        control_fd = open_control_socket(CONTROL_SOCKET_PATH);
+    }
+    if (control_fd == -1) {
+        log_warn("control socket unavailable (ignoring)");
+    }
+
+    // the connect attempt budget, split over the shards
+    admit_rate = env_number("NCCHD_CONNECT_RATE", ADMIT_RATE_PER_SEC);
+    admit_burst = env_number("NCCHD_CONNECT_BURST", ADMIT_BURST);
+    admit_max_handshakes = env_number("NCCHD_MAX_HANDSHAKES", ADMIT_MAX_HANDSHAKES);
+
+    // failures after which apps skip a server, until it's back
+    breaker_init(env_number("NCCHD_BREAKER_FAILURES", BREAKER_FAILURES));
+
+    // connect attempts each shard keeps a trace of, see `ncchctl trace`
+    trace_attempts = env_number(TRACE_ATTEMPTS_ENV, FLIGHT_ATTEMPTS);
+
+    // start the shards that will run the apps
+    if (workers != NULL) {
+        num_workers = strtoul(workers, NULL, 10);
+        if (num_workers < 1 || num_workers > MAX_SHARDS) {
+            log_warn("NCCHD_WORKERS must be 1-%d, using 1", MAX_SHARDS);
+            num_workers = 1;
+        }
+    }
+    if (shards_start((uint32_t)num_workers,
+                     pin_cpus != NULL && strcmp(pin_cpus, "0") != 0) != 0) {
+        log_error("could not start shards");
+        return 1;
+    }
+
+    // alloc active-config, the main thread's copy of the running apps
+    // (the shards have their own).  Outside while-loop below since
     // handle persists across HUPs
     active_config  = (Configuration*)calloc(1, sizeof(Configuration));
     if (active_config == NULL) {
-      printf("could not alloc Configuration\n");
+      log_error("could not alloc Configuration");
       return 1;
     }
 
@@ -632,7 +4125,7 @@ int main(int argc, char* argv[]) {
         // alloc incoming-config
         incoming_config  = (Configuration*)calloc(1, sizeof(Configuration));
         if (incoming_config == NULL) {
-            printf("could not alloc Configuration\n");
+            log_error("could not alloc Configuration");
             sleep(5); 
             continue;    // try again ad infinitum
         } 
@@ -640,61 +4133,75 @@ int main(int argc, char* argv[]) {
         // fetch and verify latest config from system
         result = get_incoming_config(incoming_config);
         if (result != 0) {
-            printf("get_incoming_config() failed\n");
+            log_error("get_incoming_config() failed");
             free(incoming_config);
             sleep(5); 
             continue;    // try again ad infinitum
         }
-#ifdef DEBUG_SSHD
-        print_config(incoming_config);
-#endif
-        result = verify_incoming_config(incoming_config);
+        if (log_enabled(LOG_LEVEL_DEBUG)) {
+            print_config(incoming_config);
+        }
+        result = verify_incoming_config(incoming_config, true);
         if (result != 0) {
-            printf("verify_incoming_config() failed\n");
+            log_error("verify_incoming_config() failed");
             free_configuration(incoming_config);
             sleep(5); 
             continue;    // try again ad infinitum
         }
 
-        // activate the incoming config (kill/fork procs as needed)
-        result = apply_incoming_config(active_config, incoming_config);
+        // activate the incoming config on the shards (kill/fork procs as
+        // needed), which takes over the incoming apps either way
+        result = shards_apply(active_config, incoming_config);
+        free(incoming_config);
         if (result != 0) {
-            printf("apply_incoming_config() failed\n");
-            free_configuration(incoming_config);
+            log_error("apply_incoming_config() failed");
             sleep(5); 
             continue;    // try again ad infinitum
         }
-
-        // don't need this anymore
-        free_configuration(incoming_config);
-
-        // sleep until either SIGINT or SIGHUP delivered
-        while (shutting_down==false && restarting==false) {
-            sleep(300);
+        if (adopting) {
+            // the apps have claimed their sessions, close the others
+            handoff_release();
+            adopting = false;
         }
 
+        // serve control requests until SIGINT, SIGHUP or SIGUSR2 delivered
+        run_main_loop(active_config);
+
         // reset SIGHUP flag for next loop, if needed
         if (restarting == true) {
             restarting = false;
         }
+
+        // re-exec, only returns if that fails
+        if (upgrading == true) {
+            upgrading = false;
+            handoff_exec(active_config);
+        }
     }
 
     // if logic gets here, SIGINT signal must have been received
 
-    // shutting down - kill children
-    for (app_idx=0; app_idx<active_config->num_apps; app_idx++) {
-        Application *active_app;
-        active_app = &active_config->apps[app_idx];
-        if (active_app->connecting_pid != -1) {
-            kill(active_app->connecting_pid, SIGKILL);
-        }
+    // shutting down - the shards close every session and reap the sshds
+    shards_stop();
+
+    // let an in-flight config write finish
+    if (persist_child.pid != -1) {
+        int status;
+        waitpid(persist_child.pid, &status, 0);
     }
 
     // release memory
     free_configuration(active_config);
+    host_keys_clear();
+    breaker_clear();
+    fast_open_clear();
+    ssh_server_cleanup();
+    status_table_destroy(STATUS_TABLE_PATH);
+    log_stop();
+    if (control_fd != -1) {
+        close(control_fd);
+        unlink(CONTROL_SOCKET_PATH);
+    }
 
     return 0; // clean exit
 }
-
-
-
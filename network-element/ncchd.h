@@ -38,6 +38,10 @@ POSSIBILITY OF SUCH DAMAGE.
 
    This header file defines some structs and externs that are used
    between the files ncchd.c and data_access_layer.c
+
+   Strings in the config structs (app names, server addresses, host-key
+   names, algorithm lists) are interned, see intern.c, so apps sharing an NMS or a key
+   share one copy and can be compared by pointer.
  *****************************************************************************/
 
 
@@ -47,13 +51,38 @@ POSSIBILITY OF SUCH DAMAGE.
 
 typedef struct Server Server;
 struct Server {
-  char     addr[64]; // ip or domain name
-  uint16_t port;
+  const char *addr;  // ip or domain name (interned)
+  uint16_t    port;
 };
 
 typedef struct HostKey HostKey;
 struct HostKey {
-  char name[64];
+  const char *name;  // interned
+};
+
+// the algorithms an app's sshd offers (see ssh_profile.c).  Each is an
+// sshd_config style comma-separated list (interned), NULL for sshd's default
+enum SSH_COMPRESSION { COMPRESSION_DEFAULT, COMPRESSION_NO, COMPRESSION_YES,
+                       COMPRESSION_DELAYED };
+typedef struct SshCryptoProfile SshCryptoProfile;
+struct SshCryptoProfile {
+  const char *kex;
+  const char *ciphers;
+  const char *macs;
+  const char *host_key_algorithms;
+  const char *x509_key_algorithm;    // NULL for X509_KEY_ALGORITHM_DEFAULT
+  uint8_t     compression;           // enum SSH_COMPRESSION
+};
+
+// socket options for an app's call-home connects (see tcp_profile.c), all
+// zero for the kernel's defaults
+typedef struct SocketProfile SocketProfile;
+struct SocketProfile {
+  uint8_t  nodelay;           // TCP_NODELAY
+  uint8_t  quickack;          // TCP_QUICKACK, armed again once connected
+  uint8_t  fast_open;         // TCP Fast Open
+  uint32_t send_buffer;       // SO_SNDBUF bytes, 0 for the default
+  uint32_t receive_buffer;    // SO_RCVBUF bytes, 0 for the default
 };
 
 typedef struct PeriodicConnectInfo PeriodicConnectInfo;
@@ -62,12 +91,14 @@ struct PeriodicConnectInfo {
   uint8_t linger_secs;
 };
 
-enum START_WITH_ENUM { FIRST_LISTED, LAST_CONNECTED };
+enum START_WITH_ENUM { FIRST_LISTED, LAST_CONNECTED, LOWEST_LATENCY };
 typedef struct ReconnectStrategy ReconnectStrategy;
 struct ReconnectStrategy { 
   enum START_WITH_ENUM start_with;
   uint8_t              interval_secs;
   uint8_t              count_max;
+  uint8_t              probe_interval_secs;   // 0 disables probing (FIRST_LISTED only)
+  uint8_t              drain_secs;            // old session lingers this long after migration
 };
 
 typedef struct KeepAliveStrategy KeepAliveStrategy;
@@ -76,34 +107,123 @@ struct KeepAliveStrategy {
   uint8_t count_max;       // maps to ClientAliveCountMax
 };
 
+// a non-blocking TCP connect in progress, trying each resolved address
+typedef struct Connector Connector;
+struct Connector {
+  int              fd;                // -1 when no connect is in flight
+  struct addrinfo *ai_list;
+  struct addrinfo *ai_cur;            // address being tried
+  int64_t          deadline_ms;       // give up after this (monotonic)
+  uint8_t          greeting;          // once connected, wait for the peer's first byte
+  uint8_t          connected;         // ...which is what it's doing now
+  int64_t          dialed_us;         // connect() to ai_cur was called (monotonic)
+  uint32_t         rtt_us;            // dial to first byte, set when greeting
+  const SocketProfile *profile;       // for its sockets, NULL for none
+  uint8_t          fast_open;         // connect with TCP Fast Open
+  uint8_t          deferred;          // ...and the SYN waits for the first write
+  uint64_t         flight;            // attempt recorded into (see flight.h), 0 if none
+};
+
+// a child process watched through a pidfd, so it is reaped as soon as it
+// exits and can never be confused with a recycled pid
+typedef struct Child Child;
+struct Child {
+  pid_t            pid;               // -1 when there is no child
+  int              pidfd;             // -1 if the platform has no pidfds
+  int64_t          started_ms;
+  struct LogStream *log;              // its stderr (see log.h), NULL if not captured
+};
+
+// per-app operational state, kept apart from the config in a dense array
+// (Configuration.runtime) so the event loop's scan over all apps touches
+// only this; the members it reads every pass come first.  PHASE_SHARED is
+// an app riding on another's connection (see ncchd.c).
+enum APP_PHASE { PHASE_IDLE, PHASE_CONNECTING, PHASE_CONNECTED, PHASE_RETRY_WAIT,
+                 PHASE_QUEUED, PHASE_SHARED };
+typedef struct AppRuntime AppRuntime;
+struct AppRuntime {
+  int64_t          next_timer_ms;     // earliest of the timers below, INT64_MAX if none
+  uint8_t          phase;             // enum APP_PHASE, PHASE_IDLE until started
+  uint8_t          retry_count;
+  uint8_t          start_over;        // pick server per reconnect-strategy
+  uint8_t          probe_backoff;
+  uint8_t          drain_signal;      // last signal sent to the draining sshd
+  uint8_t          handshaking;       // holds one of the shard's handshake slots
+  uint8_t          fast_open_session; // its connect was deferred by TCP Fast Open
+  Connector        connector;         // to servers[svr_idx]
+  Child            sshd;              // serving the current session
+  Connector        probe;             // to servers[probe_idx]
+  Child            draining;          // previous session, after migrating
+  struct Relay    *relay;             // relayed session (see relay.h), instead of sshd
+  struct Relay    *relay_draining;    // previous relayed session, after migrating
+  struct SshServer *ssh_server;      // in-process session (see ssh_server.h), instead of sshd
+  struct SshServer *ssh_server_draining;  // previous in-process session, after migrating
+  struct SharedConnection *shared;    // its group, if app->shared (see ncchd.c)
+  uint32_t         svr_idx;           // server being connected/connected to
+  uint32_t         probe_idx;         // preferred server being probed
+  int              status_slot;       // index into the status table, -1 if none
+  unsigned int     seed;              // for probe jitter
+  int64_t          wakeup_ms;         // retry or reconnect due (monotonic)
+  int64_t          next_probe_ms;
+  int64_t          drain_deadline_ms;
+  int64_t          handshake_end_ms;  // handshake slot is given back then
+  uint64_t         admit_key;         // place in the admission queue (PHASE_QUEUED)
+  uint64_t         flight;            // current attempt's trace (see flight.h), 0 if none
+};
+
 enum TRANSPORT_TYPE { SSH, TLS };
 enum CONNECT_TYPE { PERSISTENT, PERIODIC };
 typedef struct Application Application;
 struct Application {
-  char                 name[64];              // unique across apps
-  uint8_t              num_servers;
+  const char          *name;                  // unique across apps (interned)
+  uint32_t             num_servers;
   Server              *servers;
   enum TRANSPORT_TYPE  transport_type;
-  uint8_t              num_host_keys;         // set when transport_type==SSH
+  uint32_t             num_host_keys;         // set when transport_type==SSH
   HostKey             *host_keys;             // set when transport_type==SSH
+  SshCryptoProfile     crypto;                // set when transport_type==SSH
+  Server               relay_to;              // local NETCONF server to relay
+                                              // sessions to instead of running
+                                              // sshd, addr is NULL if none
+  uint8_t              in_process;            // serve sessions with ncchd's own
+                                              // SSH server, not sshd (ssh_server.h)
+  uint8_t              shared;                // share one in-process connection with
+                                              // the apps having the same servers and
+                                              // host keys (see ncchd.c)
   enum CONNECT_TYPE    connection_type;
   KeepAliveStrategy    keep_alive_strategy;   // set when connection_type==PERSISTENT
   PeriodicConnectInfo  periodic_connect_info; // set when connection_type==PERIODIC
   ReconnectStrategy    reconnect_strategy;
-
-  // operational state (not config!)
-  pid_t                connecting_pid;
+  uint8_t              priority;              // higher is admitted first when
+                                              // connect attempts are queued
+  SocketProfile        tcp;                   // options for its connects
 };
 
 typedef struct Configuration Configuration;
 struct Configuration {
   Application   *apps;
-  uint8_t        num_apps;
+  AppRuntime    *runtime;   // runtime[i] belongs to apps[i], NULL until applied
+  uint32_t       num_apps;
+};
+
+// how one of an app's servers has been answering, for LOWEST_LATENCY;
+// see server_stats.c
+#define MAX_SERVER_STATS 8
+typedef struct ServerStats ServerStats;
+struct ServerStats {
+  uint64_t key;        // hash of the server's address and port, 0 if unused
+  int64_t  updated;    // wall-clock secs, the counts decay from then
+  uint32_t rtt_us;     // smoothed time from connect() to the NMS's first byte
+  float    successes;  // decayed counts
+  float    failures;
+  float    streak;     // failures since the last success, also decayed
 };
 
 typedef struct PersistedState PersistedState;
 struct PersistedState {
-  Server last_connected;
+  char        last_connected_addr[256];
+  uint16_t    last_connected_port;
+  ServerStats servers[MAX_SERVER_STATS];  // zeroed if read from an older file
 };
 
 
@@ -112,7 +232,15 @@ struct PersistedState {
    EXTERNS
  *****************************************************************************/
 
+extern const char* intern_string(const char* str);
+extern const char* intern_lookup(const char* str);
+extern const char* intern_ref(const char* str);
+extern void intern_release(const char* str);
+extern void free_application(Application* app);
+extern int copy_application(Application* dst, const Application* src);
 extern int get_incoming_config(Configuration* incoming_config);
+extern int get_incoming_application(char* xml, Application* app);
+extern int set_incoming_config(Configuration* config);
 extern int set_persisted_state(const char* appname, PersistedState* state);
 extern int get_persisted_state(const char* appname, PersistedState* state);
 
@@ -0,0 +1,1054 @@
+/*****************************************************************************
+Copyright (c) 2014-2016, Juniper Networks, Inc.
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions
+are met:
+
+1. Redistributions of source code must retain the above copyright 
+   notice, this list of conditions and the following disclaimer.
+
+2. Redistributions in binary form must reproduce the above copyright
+   notice, this list of conditions and the following disclaimer in the
+   documentation and/or other materials provided with the distribution.
+
+3. Neither the name of the copyright holder nor the names of its 
+   contributors may be used to endorse or promote products derived 
+   from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS 
+"AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT 
+LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS 
+FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE 
+COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, 
+INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, 
+BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; 
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER 
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT 
+LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN 
+ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE 
+POSSIBILITY OF SUCH DAMAGE.
+ *****************************************************************************/
+
+
+
+
+/*****************************************************************************
+   OVERVIEW
+
+   This file implements the NETCONF session declared in netconf.h, which
+   is what netconfd used to do in its main loop: send the <hello> (with
+   the session-id the caller chose), then read the client's messages line
+   by line (lines longer than NETCONF_MAX_LINE-1 are seen in pieces, as
+   with fgets()), saving the line after a <set-public-key> to the
+   authorized_keys file, and answering a <close-session> at the end of
+   its message.
+
+   <get-config> and <get> of the running datastore are answered with
+   config.xml, the file get_incoming_config() loads.  The file is read
+   once into a NetconfData and shared by every session (and shard) until
+   it changes, which a stat() per request notices (ncchd renames a new
+   config.xml into place).  A reply is never assembled: it's a list of
+   iovecs for its header, the cached text and its trailer, written with
+   as few writev()s as the caller's NetconfWrite takes, and cut into
+   NETCONF_CHUNK_SIZE chunks when chunked framing is in use.  There is
+   no state data, so <get> is <get-config>, and filters are ignored.
+
+   Both <hello>s having base:1.1 turns on RFC 6242 chunked framing, but
+   client messages ending in ]]>]]> (as SimpleNMS's do) are still taken.
+
+   <create-subscription> (RFC 5277) is offered when the session has a
+   NotifyRing, for the NETCONF stream only, without filters.  With a
+   <startTime>, the events still in the ring from then on are sent
+   first, then <replayComplete/>; either way it goes on with events as
+   they're published, until the <stopTime> if there is one.  Events are
+   sent in batches of up to NETCONF_NOTIFY_BATCH bytes, one write each,
+   so a client that is slow to read gets fewer, bigger writes while it
+   catches up; events it falls too far behind for are skipped and
+   counted.  Other RPCs are still answered while subscribed (the
+   interleave capability).
+ *****************************************************************************/
+
+
+/*****************************************************************************
+   INCLUDES
+ *****************************************************************************/
+
+#define _GNU_SOURCE  // timegm()
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include "netconf.h"
+#include "notify.h"
+
+
+/*****************************************************************************
+   MACROS
+ *****************************************************************************/
+
+#define DEFAULT_DATASTORE  "config.xml"
+#define BASE_1_1           "urn:ietf:params:netconf:base:1.1"
+#define NOTIFICATION_NS    "urn:ietf:params:xml:ns:netconf:notification:1.0"
+#define NOTIFY_MAX_FRAMED  (NOTIFY_EVENT_MAX + 256)   // an event as sent, at most
+#define MAX_WRITEV_IOV     1024   // IOV_MAX on Linux and the BSDs
+
+// where netconf_input() is in a chunk's framing, see RFC 6242
+enum DEFRAME { AT_MESSAGE, AT_CHUNK, AT_HASH, AT_SIZE, IN_SIZE, IN_CHUNK, AT_END };
+
+
+/*****************************************************************************
+   STRUCTS
+ *****************************************************************************/
+
+// config.xml, as served; freed when the last reply using it is sent
+struct NetconfData {
+  dev_t           dev;
+  ino_t           ino;
+  off_t           size;
+  struct timespec mtime;
+  char           *text;             // the file...
+  char           *body;             // ...less any <?xml ...?> declaration
+  size_t          body_len;
+  uint32_t        refs;             // the cache's, and replies'
+};
+
+
+/*****************************************************************************
+   GLOBAL VARIABLES
+ *****************************************************************************/
+
+static char server_hello[] = "\
+<hello xmlns=\"urn:ietf:params:xml:ns:netconf:base:1.0\">\n\
+  <capabilities>\n\
+    <capability>urn:ietf:params:netconf:base:1.0</capability>\n\
+    <capability>urn:ietf:params:netconf:base:1.1</capability>\n\
+%s%s\
+  </capabilities>\n\
+  <session-id>%u</session-id>\n\
+</hello>\n\
+]]>]]>\n\
+";
+
+static char server_ok_reply[] = "\
+<rpc-reply %s\n\
+           xmlns=\"urn:ietf:params:xml:ns:netconf:base:1.0\">\n\
+  <ok/>\n\
+</rpc-reply>\n\
+";
+
+static char notification_capabilities[] = "\
+    <capability>urn:ietf:params:netconf:capability:notification:1.0</capability>\n\
+    <capability>urn:ietf:params:netconf:capability:interleave:1.0</capability>\n\
+";
+
+static char server_notification[] = "\
+<notification xmlns=\"" NOTIFICATION_NS "\">\n\
+<eventTime>%s</eventTime>\n\
+%.*s\n\
+</notification>\n\
+";
+
+static char server_data_head[] = "\
+<rpc-reply %s\n\
+           xmlns=\"urn:ietf:params:xml:ns:netconf:base:1.0\">\n\
+<data>\n\
+";
+
+static char server_data_tail[] = "\
+</data>\n\
+</rpc-reply>\n\
+";
+
+static char server_error_reply[] = "\
+<rpc-reply %s\n\
+           xmlns=\"urn:ietf:params:xml:ns:netconf:base:1.0\">\n\
+  <rpc-error>\n\
+    <error-type>%s</error-type>\n\
+    <error-tag>%s</error-tag>\n\
+    <error-severity>error</error-severity>\n\
+    <error-message>%s</error-message>\n\
+  </rpc-error>\n\
+</rpc-reply>\n\
+";
+
+static pthread_mutex_t data_lock = PTHREAD_MUTEX_INITIALIZER;
+static NetconfData*    cached_data = NULL;
+static char            cached_path[PATH_MAX];
+
+
+/*****************************************************************************
+   LOCAL/STATIC DEFINITIONS
+ *****************************************************************************/
+
+// drop a reference, with data_lock held
+static void
+data_release_locked(NetconfData* data) {
+    if (--data->refs == 0) {
+        free(data->text);
+        free(data);
+    }
+}
+
+
+// read the file into a new NetconfData
+static NetconfData* // NULL on error
+data_load(const char* path, const struct stat* st) {
+    NetconfData* data = (NetconfData*)calloc(1, sizeof(NetconfData));
+    char*        body;
+    size_t       got = 0;
+    ssize_t      len;
+    int          fd;
+
+    if (data == NULL || (data->text = (char*)malloc((size_t)st->st_size + 1)) == NULL) {
+        free(data);
+        return NULL;
+    }
+    fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+        free(data->text);
+        free(data);
+        return NULL;
+    }
+    while (got < (size_t)st->st_size &&
+           (len = read(fd, data->text + got, (size_t)st->st_size - got)) > 0) {
+        got += (size_t)len;
+    }
+    close(fd);
+    data->text[got] = '\0';
+
+    // <data> can't hold an XML declaration
+    body = data->text + strspn(data->text, " \t\r\n");
+    if (strncmp(body, "<?xml", 5) == 0 && strstr(body, "?>") != NULL) {
+        body = strstr(body, "?>") + 2;
+        body += strspn(body, " \t\r\n");
+    }
+    data->body = body;
+    data->body_len = got - (size_t)(body - data->text);
+    data->dev = st->st_dev;
+    data->ino = st->st_ino;
+    data->size = st->st_size;
+    data->mtime = st->st_mtim;
+    data->refs = 1;
+    return data;
+}
+
+
+// the datastore at `path`, from the cache if the file hasn't changed;
+// the caller holds a reference until data_release()
+static NetconfData* // NULL on error (unreadable)
+data_get(const char* path) {
+    NetconfData* data = NULL;
+    struct stat  st;
+
+    if (stat(path, &st) != 0 || !S_ISREG(st.st_mode)) {
+        return NULL;
+    }
+    pthread_mutex_lock(&data_lock);
+    if (cached_data != NULL && strcmp(cached_path, path) == 0 &&
+        cached_data->dev == st.st_dev && cached_data->ino == st.st_ino &&
+        cached_data->size == st.st_size &&
+        cached_data->mtime.tv_sec == st.st_mtim.tv_sec &&
+        cached_data->mtime.tv_nsec == st.st_mtim.tv_nsec) {
+        data = cached_data;
+        data->refs++;
+    }
+    pthread_mutex_unlock(&data_lock);
+    if (data != NULL) {
+        return data;
+    }
+
+    // loaded outside the lock; racing loaders each serve their own copy
+    data = data_load(path, &st);
+    if (data == NULL) {
+        return NULL;
+    }
+    pthread_mutex_lock(&data_lock);
+    if (cached_data != NULL) {
+        data_release_locked(cached_data);
+    }
+    cached_data = data;
+    snprintf(cached_path, sizeof(cached_path), "%s", path);
+    data->refs++;
+    pthread_mutex_unlock(&data_lock);
+    return data;
+}
+
+
+static void
+data_release(NetconfData* data) {
+    pthread_mutex_lock(&data_lock);
+    data_release_locked(data);
+    pthread_mutex_unlock(&data_lock);
+}
+
+
+// the message-id="..." attribute to copy into the reply, if there was one
+static void
+id_attribute(const NetconfSession* session, char* out, size_t size) {
+    if (session->message_id[0] != '\0') {
+        snprintf(out, size, "message-id=\"%s\"", session->message_id);
+    } else {
+        out[0] = '\0';
+    }
+}
+
+
+// make `text` (in session->head) the next reply, framed
+static void
+reply_small(NetconfSession* session, const char* text) {
+    size_t len = strlen(text);
+
+    if (session->chunked) {
+        snprintf(session->tail, sizeof(session->tail), "\n#%zu\n", len);
+        memmove(session->head + strlen(session->tail), text, len + 1);
+        memcpy(session->head, session->tail, strlen(session->tail));
+        strcat(session->head, "\n##\n");
+    } else {
+        if (text != session->head) {
+            memmove(session->head, text, len + 1);
+        }
+        strcat(session->head, "]]>]]>\n");
+    }
+    session->iov = session->small_iov;
+    session->iov[0].iov_base = session->head;
+    session->iov[0].iov_len = strlen(session->head);
+    session->iov_count = 1;
+    session->iov_next = 0;
+}
+
+
+// an <rpc-error> reply
+static void
+reply_error(NetconfSession* session, const char* type, const char* tag,
+            const char* message) {
+    char id[NETCONF_MAX_ID + 16];
+    char text[sizeof(session->head) - 32];
+
+    id_attribute(session, id, sizeof(id));
+    snprintf(text, sizeof(text), server_error_reply, id, type, tag, message);
+    reply_small(session, text);
+}
+
+
+// a <data> reply with the datastore's text, as iovecs pointing into it
+static int // 0=OK, 1=ERROR (out of memory)
+reply_data(NetconfSession* session, NetconfData* data) {
+    char         id[NETCONF_MAX_ID + 16];
+    char         head[sizeof(session->head) - 32];
+    size_t       chunks = 0;
+    size_t       count;
+    size_t       offset;
+    struct iovec* iov;
+
+    id_attribute(session, id, sizeof(id));
+    snprintf(head, sizeof(head), server_data_head, id);
+
+    if (!session->chunked) {
+        count = 3;
+    } else {
+        chunks = (data->body_len + NETCONF_CHUNK_SIZE - 1) / NETCONF_CHUNK_SIZE;
+        count = 2 + chunks * 2;
+    }
+    iov = (count <= NETCONF_SMALL_IOV) ? session->small_iov
+                                       : (struct iovec*)malloc(sizeof(struct iovec) * count);
+    if (iov == NULL) {
+        return 1;
+    }
+
+    if (!session->chunked) {
+        snprintf(session->head, sizeof(session->head), "%s", head);
+        snprintf(session->tail, sizeof(session->tail), "%s]]>]]>\n", server_data_tail);
+        iov[0].iov_base = session->head;
+        iov[0].iov_len = strlen(session->head);
+        iov[1].iov_base = data->body;
+        iov[1].iov_len = data->body_len;
+        iov[2].iov_base = session->tail;
+        iov[2].iov_len = strlen(session->tail);
+    } else {
+        snprintf(session->head, sizeof(session->head), "\n#%zu\n%s", strlen(head), head);
+        snprintf(session->tail, sizeof(session->tail), "\n#%zu\n%s\n##\n",
+                 strlen(server_data_tail), server_data_tail);
+        snprintf(session->chunk_header[0], sizeof(session->chunk_header[0]), "\n#%u\n",
+                 (unsigned int)NETCONF_CHUNK_SIZE);
+        snprintf(session->chunk_header[1], sizeof(session->chunk_header[1]), "\n#%zu\n",
+                 data->body_len - (chunks - 1) * NETCONF_CHUNK_SIZE);
+        iov[0].iov_base = session->head;
+        iov[0].iov_len = strlen(session->head);
+        for (count=1, offset=0; offset<data->body_len; offset+=NETCONF_CHUNK_SIZE) {
+            char* header = session->chunk_header[offset + NETCONF_CHUNK_SIZE < data->body_len ? 0 : 1];
+
+            iov[count].iov_base = header;
+            iov[count++].iov_len = strlen(header);
+            iov[count].iov_base = data->body + offset;
+            iov[count++].iov_len = (offset + NETCONF_CHUNK_SIZE < data->body_len)
+                                   ? NETCONF_CHUNK_SIZE : data->body_len - offset;
+        }
+        iov[count].iov_base = session->tail;
+        iov[count++].iov_len = strlen(session->tail);
+    }
+    session->iov = iov;
+    session->iov_count = (int)count;
+    session->iov_next = 0;
+    session->data = data;
+    return 0;
+}
+
+
+// the reply to <get-config> or <get>
+static int // 0=OK, 1=ERROR
+reply_get(NetconfSession* session) {
+    NetconfData* data;
+
+    if (session->not_running) {
+        reply_error(session, "protocol", "invalid-value", "only the running datastore is supported");
+        return 0;
+    }
+    data = data_get(session->datastore != NULL ? session->datastore : DEFAULT_DATASTORE);
+    if (data == NULL) {
+        reply_error(session, "application", "operation-failed", "could not read the datastore");
+        return 0;
+    }
+    if (reply_data(session, data) != 0) {
+        data_release(data);
+        return 1;
+    }
+    return 0;
+}
+
+
+// done with the reply
+static void
+reply_done(NetconfSession* session) {
+    if (session->iov != session->small_iov) {
+        free(session->iov);
+    }
+    if (session->data != NULL) {
+        data_release(session->data);
+    }
+    session->iov = NULL;
+    session->iov_count = 0;
+    session->iov_next = 0;
+    session->data = NULL;
+}
+
+
+// RFC 3339, e.g. 2016-03-01T12:34:56.789Z or ...+01:00, to epoch ns
+static int // 0=OK, 1=ERROR
+parse_time(const char* text, int64_t* ns) {
+    struct tm   tm;
+    const char* rest;
+    int64_t     secs;
+    int64_t     frac = 0;
+    int64_t     scale = 1000000000;
+    int         offset_h = 0;
+    int         offset_m = 0;
+    int         len = 0;
+
+    memset(&tm, 0, sizeof(tm));
+    if (sscanf(text, "%4d-%2d-%2dT%2d:%2d:%2d%n", &tm.tm_year, &tm.tm_mon, &tm.tm_mday,
+               &tm.tm_hour, &tm.tm_min, &tm.tm_sec, &len) != 6) {
+        return 1;
+    }
+    rest = text + len;
+    if (*rest == '.') {
+        for (rest++; *rest >= '0' && *rest <= '9'; rest++) {
+            if (scale > 1) {
+                scale /= 10;
+                frac += (*rest - '0') * scale;
+            }
+        }
+    }
+    if (*rest == '+' || *rest == '-') {
+        if (sscanf(rest + 1, "%2d:%2d", &offset_h, &offset_m) != 2) {
+            return 1;
+        }
+        if (*rest == '-') {
+            offset_h = -offset_h;
+            offset_m = -offset_m;
+        }
+    } else if (*rest != 'Z' && *rest != 'z') {
+        return 1;
+    }
+    tm.tm_year -= 1900;
+    tm.tm_mon -= 1;
+    secs = (int64_t)timegm(&tm) - offset_h * 3600 - offset_m * 60;
+    if (secs >= INT64_MAX / 1000000000) {
+        return 1;   // past 2262
+    }
+    // 0 means there's no time; anything before 1970 is before every event
+    *ns = secs < 0 ? 1 : secs * 1000000000 + frac;
+    if (*ns == 0) {
+        *ns = 1;
+    }
+    return 0;
+}
+
+
+static void
+format_time(int64_t sec, int32_t nsec, char* out, size_t size) {
+    struct tm tm;
+    time_t    t = (time_t)sec;
+
+    gmtime_r(&t, &tm);
+    snprintf(out, size, "%04d-%02d-%02dT%02d:%02d:%02d.%06dZ", tm.tm_year + 1900,
+             tm.tm_mon + 1, tm.tm_mday, tm.tm_hour, tm.tm_min, tm.tm_sec, nsec / 1000);
+}
+
+
+static int64_t
+now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+
+static int64_t
+now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+
+// the text of <tag>...</tag> on `line`, if it's there
+static int // 0=OK, 1=ERROR (not there)
+element_text(const char* line, const char* tag, char* out, size_t size) {
+    const char* start = strstr(line, tag);
+    size_t      len;
+
+    if (start == NULL) {
+        return 1;
+    }
+    start += strlen(tag);
+    start += strspn(start, " \t\r\n");
+    len = strcspn(start, "< \t\r\n");
+    if (len >= size) {
+        len = size - 1;
+    }
+    memcpy(out, start, len);
+    out[len] = '\0';
+    return 0;
+}
+
+
+// the reply to <create-subscription>, which starts it
+static int // 0=OK, 1=ERROR
+reply_subscribe(NetconfSession* session) {
+    char id[NETCONF_MAX_ID + 16];
+    char text[sizeof(session->head) - 32];
+
+    if (session->events == NULL) {
+        reply_error(session, "protocol", "operation-not-supported", "no notifications here");
+        return 0;
+    }
+    if (session->subscribed) {
+        reply_error(session, "protocol", "operation-failed", "already subscribed");
+        return 0;
+    }
+    if (session->other_stream) {
+        reply_error(session, "protocol", "invalid-value", "only the NETCONF stream is supported");
+        return 0;
+    }
+    if (session->bad_time || session->start_time_ns > now_ns() ||
+        (session->stop_time_ns != 0 &&
+         (session->start_time_ns == 0 || session->stop_time_ns < session->start_time_ns))) {
+        reply_error(session, "protocol", "bad-element", "bad startTime or stopTime");
+        return 0;
+    }
+    if (session->batch == NULL &&
+        (session->batch = (char*)malloc(NETCONF_NOTIFY_BATCH)) == NULL) {
+        return 1;
+    }
+
+    session->subscribed = 1;
+    session->replay_from_ns = session->start_time_ns;
+    session->replay_stop_ns = session->stop_time_ns;
+    session->replay_end = notify_head(session->events);
+    if (session->start_time_ns != 0) {
+        session->replaying = 1;
+        session->notify_next = notify_oldest(session->events);
+    } else {
+        session->notify_next = session->replay_end;
+    }
+    id_attribute(session, id, sizeof(id));
+    snprintf(text, sizeof(text), server_ok_reply, id);
+    reply_small(session, text);
+    return 0;
+}
+
+
+// add a notification to the batch, framed
+static void
+batch_add(NetconfSession* session, size_t* len, const char* event_time,
+          const char* event, size_t event_len) {
+    char   text[NOTIFY_MAX_FRAMED];
+    size_t text_len;
+
+    text_len = (size_t)snprintf(text, sizeof(text), server_notification, event_time,
+                                (int)event_len, event);
+    if (text_len >= sizeof(text)) {
+        text_len = sizeof(text) - 1;
+    }
+    if (session->chunked) {
+        *len += (size_t)snprintf(session->batch + *len, NETCONF_NOTIFY_BATCH - *len,
+                                 "\n#%zu\n", text_len);
+        memcpy(session->batch + *len, text, text_len);
+        *len += text_len;
+        memcpy(session->batch + *len, "\n##\n", 4);
+        *len += 4;
+    } else {
+        memcpy(session->batch + *len, text, text_len);
+        *len += text_len;
+        memcpy(session->batch + *len, "]]>]]>\n", 7);
+        *len += 7;
+    }
+}
+
+
+// a <replayComplete/> or <notificationComplete/>, sent now
+static void
+batch_add_marker(NetconfSession* session, size_t* len, const char* marker) {
+    char    event_time[96];
+    int64_t now = now_ns();
+
+    format_time(now / 1000000000, (int32_t)(now % 1000000000), event_time, sizeof(event_time));
+    batch_add(session, len, event_time, marker, strlen(marker));
+}
+
+
+// write one batch of what's been published since, setting `full` if
+// that's all it had room for
+static int // 0=OK, 1=ERROR
+notify_batch(NetconfSession* session, int* full) {
+    NotifyEvent event;
+    char        event_time[96];
+    size_t      len = 0;
+    int64_t     event_ns;
+    int         complete = 0;   // past the <stopTime>
+
+    while (session->subscribed && len + NOTIFY_MAX_FRAMED <= NETCONF_NOTIFY_BATCH) {
+        uint64_t oldest;
+        int      result;
+
+        if (session->replaying && session->notify_next >= session->replay_end) {
+            session->replaying = 0;
+            batch_add_marker(session, &len, "<replayComplete/>");
+            continue;
+        }
+        result = notify_read(session->events, session->notify_next, &event);
+        if (result == 2) {
+            // overwritten: go on from the oldest event left
+            oldest = notify_oldest(session->events);
+            if (oldest <= session->notify_next) {
+                oldest = session->notify_next + 1;
+            }
+            session->notify_lost += oldest - session->notify_next;
+            session->notify_next = oldest;
+            session->stuck_since_ms = 0;
+            continue;
+        }
+        if (result == 1) {
+            // not published yet; if later ones are, its producer may have died
+            if (session->notify_next + 1 < notify_head(session->events)) {
+                if (session->stuck_since_ms == 0) {
+                    session->stuck_since_ms = now_ms();
+                } else if (now_ms() - session->stuck_since_ms > NETCONF_NOTIFY_STUCK_MSECS) {
+                    session->notify_lost++;
+                    session->notify_next++;
+                    session->stuck_since_ms = 0;
+                    continue;
+                }
+            }
+            complete = session->replay_stop_ns != 0 &&
+                       session->notify_next >= notify_head(session->events) &&
+                       now_ns() > session->replay_stop_ns;
+            break;
+        }
+        session->stuck_since_ms = 0;
+
+        event_ns = event.time_sec * 1000000000 + event.time_nsec;
+        if (session->replay_stop_ns != 0 && event_ns > session->replay_stop_ns) {
+            complete = 1;   // the rest are after it
+            break;
+        }
+        session->notify_next++;
+        if (event_ns < session->replay_from_ns) {
+            continue;
+        }
+        format_time(event.time_sec, event.time_nsec, event_time, sizeof(event_time));
+        batch_add(session, &len, event_time, event.text, event.len);
+        session->notify_sent++;
+    }
+    if (complete) {
+        if (session->replaying) {
+            session->replaying = 0;
+            batch_add_marker(session, &len, "<replayComplete/>");
+        }
+        batch_add_marker(session, &len, "<notificationComplete/>");
+        session->subscribed = 0;
+    }
+    *full = len + NOTIFY_MAX_FRAMED > NETCONF_NOTIFY_BATCH;
+    if (len == 0) {
+        return 0;
+    }
+    session->iov = session->small_iov;
+    session->iov[0].iov_base = session->batch;
+    session->iov[0].iov_len = len;
+    session->iov_count = 1;
+    session->iov_next = 0;
+    return netconf_output(session);
+}
+
+
+// save it to the authorized_keys file
+static void
+save_public_key(NetconfSession* session, const char* key) {
+    char   path[PATH_MAX];
+    FILE*  file;
+    size_t len = strlen(key);
+
+    if (session->authorized_keys_fd != -1) {
+        // opened O_APPEND, and a key is one write(), so keys saved by
+        // concurrent sessions don't interleave; failures go unreported,
+        // as when the file can't be opened
+        if (write(session->authorized_keys_fd, key, len) != (ssize_t)len) {
+            return;
+        }
+        return;
+    }
+    if (session->authorized_keys != NULL) {
+        snprintf(path, sizeof(path), "%s", session->authorized_keys);
+    } else {
+        snprintf(path, sizeof(path), "%s/.ssh/authorized_keys", getenv("HOME"));
+    }
+    file = fopen(path, "a");
+    if (file != NULL) {
+        fprintf(file, "%s", key);
+        fclose(file);
+    }
+}
+
+
+// act on the end of a message
+static int // 0=OK, 1=ERROR
+handle_message(NetconfSession* session) {
+    char id[NETCONF_MAX_ID + 16];
+    char text[sizeof(session->head) - 32];
+    int  result = 0;
+
+    if (session->hello) {
+        // always framed the old way; chunks, if any, start after it
+        if (!session->seen_hello) {
+            session->seen_hello = 1;
+            session->chunked = session->base_1_1;
+        }
+    } else if (session->close_session) {
+        id_attribute(session, id, sizeof(id));
+        snprintf(text, sizeof(text), server_ok_reply, id);
+        reply_small(session, text);
+        session->closed = 1;
+    } else if (session->get) {
+        result = reply_get(session);
+    } else if (session->create_subscription) {
+        result = reply_subscribe(session);
+    }
+
+    session->hello = 0;
+    session->base_1_1 = 0;
+    session->read_public_key = 0;
+    session->close_session = 0;
+    session->get = 0;
+    session->not_running = 0;
+    session->create_subscription = 0;
+    session->other_stream = 0;
+    session->bad_time = 0;
+    session->start_time_ns = 0;
+    session->stop_time_ns = 0;
+    session->message_id[0] = '\0';
+    return result;
+}
+
+
+// note what one line (or piece of one) from the client says
+static void
+handle_line(NetconfSession* session, const char* line) {
+    const char* id;
+    char        value[64];
+
+    if (session->read_public_key == 1) {
+        save_public_key(session, line);
+        session->read_public_key = 0;
+    }
+
+    if (strstr(line, "<set-public-key") != NULL) {
+        session->read_public_key = 1;
+    }
+
+    if (strstr(line, "close-session") != NULL) {
+        session->close_session = 1;
+    }
+
+    if (strstr(line, "<get-config") != NULL || strstr(line, "<get>") != NULL ||
+        strstr(line, "<get/>") != NULL || strstr(line, "<get ") != NULL) {
+        session->get = 1;
+    }
+
+    if (strstr(line, "<candidate") != NULL || strstr(line, "<startup") != NULL) {
+        session->not_running = 1;
+    }
+
+    if (strstr(line, "<hello") != NULL) {
+        session->hello = 1;
+    }
+
+    if (strstr(line, "<create-subscription") != NULL) {
+        session->create_subscription = 1;
+    }
+    if (element_text(line, "<stream>", value, sizeof(value)) == 0 &&
+        strcmp(value, "NETCONF") != 0) {
+        session->other_stream = 1;
+    }
+    if (element_text(line, "<startTime>", value, sizeof(value)) == 0 &&
+        parse_time(value, &session->start_time_ns) != 0) {
+        session->bad_time = 1;
+    }
+    if (element_text(line, "<stopTime>", value, sizeof(value)) == 0 &&
+        parse_time(value, &session->stop_time_ns) != 0) {
+        session->bad_time = 1;
+    }
+
+    if (strstr(line, BASE_1_1) != NULL) {
+        session->base_1_1 = 1;
+    }
+
+    if (session->message_id[0] == '\0' && (id = strstr(line, "message-id=\"")) != NULL) {
+        size_t len;
+
+        id += strlen("message-id=\"");
+        len = strcspn(id, "\"<>&\n");
+        if (len >= sizeof(session->message_id)) {
+            len = sizeof(session->message_id) - 1;
+        }
+        memcpy(session->message_id, id, len);
+        session->message_id[len] = '\0';
+    }
+}
+
+
+// the line so far is done: note it, and see if the message is over
+static int // 0=OK, 1=ERROR
+end_line(NetconfSession* session, int end_of_message) {
+    session->line[session->line_len] = '\0';
+    session->line_len = 0;
+    handle_line(session, session->line);
+    if (strstr(session->line, "]]>]]>") != NULL && (!session->chunked || session->eom_framed)) {
+        session->eom_framed = 0;
+        session->deframe = AT_MESSAGE;
+        end_of_message = 1;
+    }
+    return end_of_message ? handle_message(session) : 0;
+}
+
+
+// one byte of message text
+static int // 0=OK, 1=ERROR
+add_byte(NetconfSession* session, char byte) {
+    session->line[session->line_len++] = byte;
+    if (byte == '\n' || session->line_len == NETCONF_MAX_LINE - 1) {
+        return end_line(session, 0);
+    }
+    return 0;
+}
+
+
+// one byte from the client, chunk framing and all
+static int // 0=OK, 1=ERROR (including bad framing)
+take_byte(NetconfSession* session, char byte) {
+    if (!session->chunked || session->eom_framed) {
+        return add_byte(session, byte);
+    }
+    switch (session->deframe) {
+    case AT_MESSAGE:
+        if (byte != '\n') {
+            session->eom_framed = 1;   // a 1.0 client that said it was 1.1
+            return add_byte(session, byte);
+        }
+        session->deframe = AT_HASH;
+        return 0;
+    case AT_CHUNK:
+        if (byte != '\n') {
+            return 1;
+        }
+        session->deframe = AT_HASH;
+        return 0;
+    case AT_HASH:
+        if (byte != '#') {
+            return 1;
+        }
+        session->deframe = AT_SIZE;
+        return 0;
+    case AT_SIZE:
+        if (byte == '#') {
+            session->deframe = AT_END;
+            return 0;
+        }
+        if (byte < '1' || byte > '9') {
+            return 1;
+        }
+        session->chunk_left = (uint32_t)(byte - '0');
+        session->deframe = IN_SIZE;
+        return 0;
+    case IN_SIZE:
+        if (byte == '\n') {
+            session->deframe = IN_CHUNK;
+            return 0;
+        }
+        if (byte < '0' || byte > '9' || session->chunk_left > (UINT32_MAX - 9) / 10) {
+            return 1;
+        }
+        session->chunk_left = session->chunk_left * 10 + (uint32_t)(byte - '0');
+        return 0;
+    case IN_CHUNK:
+        if (--session->chunk_left == 0) {
+            session->deframe = AT_CHUNK;
+        }
+        return add_byte(session, byte);
+    case AT_END:
+        if (byte != '\n') {
+            return 1;
+        }
+        session->deframe = AT_MESSAGE;
+        return end_line(session, 1);
+    }
+    return 1;
+}
+
+
+/*****************************************************************************
+   EXTERNS
+ *****************************************************************************/
+
+// set up a session; the caller may then set authorized_keys,
+// authorized_keys_fd, datastore and capabilities before netconf_start()
+void
+netconf_init(NetconfSession* session, uint32_t session_id, NetconfWrite write,
+             void* ctx) {
+    memset(session, 0, sizeof(NetconfSession));
+    session->write = write;
+    session->ctx = ctx;
+    session->authorized_keys_fd = -1;
+    session->session_id = session_id;
+}
+
+
+// start the session: send the <hello>
+int // 0=OK, 1=ERROR
+netconf_start(NetconfSession* session) {
+    snprintf(session->head, sizeof(session->head), server_hello,
+             session->events != NULL ? notification_capabilities : "",
+             session->capabilities != NULL ? session->capabilities : "",
+             session->session_id);
+    session->iov = session->small_iov;
+    session->iov[0].iov_base = session->head;
+    session->iov[0].iov_len = strlen(session->head);
+    session->iov_count = 1;
+    session->iov_next = 0;
+    return netconf_output(session);
+}
+
+
+// Take up to `len` more bytes from the client, setting `used` to how
+// many were.  It stops short after a message whose reply couldn't all be
+// written: the rest is for after netconf_output() has finished it.
+int // 0=still open, 1=closed (<close-session> answered, maybe still pending), 2=ERROR
+netconf_input(NetconfSession* session, const char* data, size_t len, size_t* used) {
+    size_t idx;
+
+    for (idx=0; idx<len && !session->closed && !netconf_pending(session); idx++) {
+        if (take_byte(session, data[idx]) != 0 ||
+            (netconf_pending(session) && netconf_output(session) != 0)) {
+            *used = idx + 1;
+            return 2;
+        }
+    }
+    *used = idx;
+    return session->closed ? 1 : 0;
+}
+
+
+// write as much of the pending reply as the caller's NetconfWrite takes
+int // 0=OK (see netconf_pending()), 1=ERROR
+netconf_output(NetconfSession* session) {
+    while (session->iov_next < session->iov_count) {
+        struct iovec* iov = &session->iov[session->iov_next];
+        int           count = session->iov_count - session->iov_next;
+        ssize_t       written = session->write(session->ctx, iov,
+                                               count < MAX_WRITEV_IOV ? count : MAX_WRITEV_IOV);
+
+        if (written < 0) {
+            return 1;
+        }
+        if (written == 0) {
+            return 0;   // it would block
+        }
+        while (written > 0) {
+            if ((size_t)written >= iov->iov_len) {
+                written -= (ssize_t)iov->iov_len;
+                session->iov_next++;
+                iov++;
+            } else {
+                iov->iov_base = (char*)iov->iov_base + written;
+                iov->iov_len -= (size_t)written;
+                written = 0;
+            }
+        }
+    }
+    reply_done(session);
+    return 0;
+}
+
+
+// is a reply still being written?
+int // 0=no, 1=yes
+netconf_pending(const NetconfSession* session) {
+    return session->iov_next < session->iov_count ? 1 : 0;
+}
+
+
+// Send the notifications published since the last call, in batches,
+// unless a reply is still being written, and until the client stops
+// taking them.  Call it every NETCONF_NOTIFY_TICK_MSECS while subscribed,
+// and when a reply is done.
+int // 0=OK, 1=ERROR
+netconf_notify(NetconfSession* session) {
+    int full = 1;
+
+    while (full && session->subscribed && !netconf_pending(session)) {
+        if (notify_batch(session, &full) != 0) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+
+// let go of the session's reply, if it's being dropped unsent, and
+// anything else it holds
+void
+netconf_end(NetconfSession* session) {
+    reply_done(session);
+    free(session->batch);
+    session->batch = NULL;
+    session->subscribed = 0;
+}
@@ -0,0 +1,159 @@
+/*****************************************************************************
+Copyright (c) 2014-2016, Juniper Networks, Inc.
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions
+are met:
+
+1. Redistributions of source code must retain the above copyright 
+   notice, this list of conditions and the following disclaimer.
+
+2. Redistributions in binary form must reproduce the above copyright
+   notice, this list of conditions and the following disclaimer in the
+   documentation and/or other materials provided with the distribution.
+
+3. Neither the name of the copyright holder nor the names of its 
+   contributors may be used to endorse or promote products derived 
+   from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS 
+"AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT 
+LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS 
+FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE 
+COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, 
+INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, 
+BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; 
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER 
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT 
+LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN 
+ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE 
+POSSIBILITY OF SUCH DAMAGE.
+ *****************************************************************************/
+
+
+
+
+/*****************************************************************************
+   OVERVIEW
+
+   This header file declares the NETCONF side of a session, as served by
+   the "netconf" SSH subsystem: the <hello>, and the few messages from the
+   NETCONF client it knows (<get-config>, <get>, <create-subscription>,
+   <set-public-key> & <close-session>).
+
+   It is shared by netconfd, both when it serves a session on its own
+   stdin and stdout and when it serves many as a daemon (`netconfd -d`),
+   and by ncchd's in-process SSH server (see ssh_server.c), which feeds
+   it channel data.  Either way the caller hands it input as it arrives,
+   and it writes its output through the caller's NetconfWrite, which may
+   take less than it's given.  A reply that isn't all taken is left
+   pending: the caller calls netconf_output() when it can write again,
+   and holds further input back until then.  The caller picks the
+   session-id, unique among the sessions it serves.
+
+   Event notifications come from a NotifyRing (see notify.h), if the
+   caller gives the session one: once subscribed, the caller calls
+   netconf_notify() every NETCONF_NOTIFY_TICK_MSECS or so, and whenever
+   a reply is done, to send what has been published since, batched.
+ *****************************************************************************/
+
+
+/*****************************************************************************
+   MACROS
+ *****************************************************************************/
+
+#define NETCONF_MAX_LINE    2048    // longer lines are handled in pieces
+#define NETCONF_MAX_ID      64      // longer message-ids are cut short
+#define NETCONF_CHUNK_SIZE  65536   // a streamed reply's chunks, at most
+#define NETCONF_SMALL_IOV   4       // replies needing more allocate them
+#define NETCONF_NOTIFY_TICK_MSECS  10      // how often to look for new events
+#define NETCONF_NOTIFY_BATCH       65536   // notifications per write, in bytes
+#define NETCONF_NOTIFY_STUCK_MSECS 1000    // to wait on a producer mid-publish
+
+
+/*****************************************************************************
+   STRUCTS
+ *****************************************************************************/
+
+// 0 when it would block, -1 on error
+typedef ssize_t (*NetconfWrite)(void* ctx, const struct iovec* iov, int iovcnt);
+
+typedef struct NetconfData NetconfData;   // a cached config.xml, see netconf.c
+typedef struct NotifyRing NotifyRing;     // see notify.h
+
+typedef struct NetconfSession NetconfSession;
+struct NetconfSession {
+  NetconfWrite   write;
+  void          *ctx;
+  const char    *authorized_keys;   // where <set-public-key> saves keys, NULL
+                                    // for $HOME/.ssh/authorized_keys
+  int            authorized_keys_fd;// or the file, already open, if not -1
+  const char    *datastore;         // config.xml, NULL for "config.xml"
+  NotifyRing    *events;            // notifications, NULL if there are none
+  const char    *capabilities;      // more <capability> lines for the <hello>,
+                                    // NULL if none
+  uint32_t       session_id;
+
+  // input, line by line, out of RFC 6242 chunks once both sides are 1.1
+  char           line[NETCONF_MAX_LINE];
+  size_t         line_len;
+  uint8_t        chunked;           // both <hello>s had base:1.1
+  uint8_t        deframe;           // where it is in a chunk's framing
+  uint8_t        eom_framed;        // this message ends with ]]>]]> anyway
+  uint32_t       chunk_left;        // data left in the chunk (or its size, so far)
+
+  uint8_t        seen_hello;        // the client's <hello> is over
+
+  // the current message
+  uint8_t        hello;             // a <hello>
+  uint8_t        base_1_1;          // with base:1.1
+  uint8_t        read_public_key;   // the next line is the key
+  uint8_t        close_session;     // <close-session>
+  uint8_t        get;               // <get-config> or <get>
+  uint8_t        not_running;       // a <source> other than <running/>
+  uint8_t        create_subscription;
+  uint8_t        other_stream;      // a <stream> other than NETCONF
+  uint8_t        bad_time;          // a <startTime> or <stopTime> that won't parse
+  int64_t        start_time_ns;     // 0 if none
+  int64_t        stop_time_ns;
+  char           message_id[NETCONF_MAX_ID];
+  uint8_t        closed;            // <close-session> answered
+
+  // the subscription
+  uint8_t        subscribed;
+  uint8_t        replaying;         // sending events from before it
+  int64_t        replay_from_ns;    // its <startTime>
+  int64_t        replay_stop_ns;    // its <stopTime>, 0 if none
+  uint64_t       replay_end;        // the ring's head when it was made
+  uint64_t       notify_next;       // the next event to send
+  int64_t        stuck_since_ms;    // notify_next has been unpublished since
+  uint64_t       notify_sent;
+  uint64_t       notify_lost;       // overwritten before they could be sent
+  char          *batch;             // notifications being written
+
+  // the reply being sent
+  struct iovec  *iov;
+  int            iov_count;
+  int            iov_next;
+  struct iovec   small_iov[NETCONF_SMALL_IOV];
+  NetconfData   *data;              // held until it's sent
+  char           head[640];         // <rpc-reply ...> and framing
+  char           tail[64];
+  char           chunk_header[2][16];  // full chunks', and the last one's
+};
+
+
+/*****************************************************************************
+   EXTERNS
+ *****************************************************************************/
+
+extern void netconf_init(NetconfSession* session, uint32_t session_id,
+                         NetconfWrite write, void* ctx);
+extern int netconf_start(NetconfSession* session);
+extern int netconf_input(NetconfSession* session, const char* data, size_t len,
+                         size_t* used);
+extern int netconf_output(NetconfSession* session);
+extern int netconf_pending(const NetconfSession* session);
+extern int netconf_notify(NetconfSession* session);
+extern void netconf_end(NetconfSession* session);
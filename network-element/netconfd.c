@@ -38,7 +38,36 @@ POSSIBILITY OF SUCH DAMAGE.
 
    This is the "netconf" subsystem that SSHD will start when requested.
    It only knows how to send its <hello> message and process a few 
-   message from the NETCONF client (<set-public-key> & <close-session>) 
+   message from the NETCONF client (<get-config>, <get>, <set-public-key>
+   & <close-session>), see netconf.c, which ncchd's in-process SSH server
+   shares.  `-c path` names the config.xml that <get-config> returns
+   (default: config.xml, in the working directory), and `-n path` the
+   ring of event notifications <create-subscription> sends from (default
+   .netconfd.events, created if it isn't there; see notify.h).
+
+   It runs in one of three ways:
+
+     netconfd -d [-c path] [-n path] [-u user]... [socket-path]
+         the daemon: serves every session handed to it on the Unix
+         socket (default .netconfd.sock, in its working directory) from
+         a single poll loop, giving each a session-id unique among them.
+         Sessions are taken only from shims running as its own user, or
+         as a user given with -u (a name or uid, for every user SSHD
+         logs in as); sessions are served with the daemon's privileges,
+         <get-config> included, so anyone else's shim is refused, and
+         serves its session itself
+
+     netconfd [-c path] [-n path] <socket-path>
+         the shim, which is how ncchd's sshd_config runs it: passes its
+         stdin and stdout (and the user's authorized_keys file, opened as
+         the user) to the daemon with SCM_RIGHTS, then waits, doing no
+         I/O, until the daemon closes the connection at the session's
+         end.  It has to outlive the handover, as SSHD stops forwarding
+         the NETCONF client's data once the subsystem exits
+
+     netconfd [-c path] [-n path]
+         the session served right here, on stdin and stdout, as before.
+         The shim does this too when no daemon takes the session
  *****************************************************************************/
 
 
@@ -46,80 +75,677 @@ POSSIBILITY OF SUCH DAMAGE.
    INCLUDES
  *****************************************************************************/
 
+#define _GNU_SOURCE  // struct ucred
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
 #include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <pwd.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include "netconf.h"
+#include "notify.h"
+#include "log.h"
 
 
 /*****************************************************************************
-   GLOBAL VARIABLES
+   MACROS
  *****************************************************************************/
 
-static char server_hello[] = "\
-<hello xmlns=\"urn:ietf:params:xml:ns:netconf:base:1.0\">\n\
-  <capabilities>\n\
-    <capability>urn:ietf:params:netconf:base:1.1</capability>\n\
-  </capabilities>\n\
-  <session-id>1</session-id>\n\
-</hello>\n\
-]]>]]>\n\
-";
-
-static char server_close_reply[] = "\
-<rpc-reply message-id=\"%d\"\n\
-           xmlns=\"urn:ietf:params:xml:ns:netconf:base:1.0\">\n\
-  <ok/>\n\
-</rpc-reply>\n\
-]]>]]>\n\
-";
+#define NETCONFD_SOCKET_PATH  ".netconfd.sock"   // must match ncchd.c
+#define MAX_SESSIONS          4096   // the daemon's; past that, shims serve
+                                     // their sessions themselves
+#define HANDOVER_FDS          3      // stdin, stdout and authorized_keys
+#define HANDOVER_ACCEPTED     'y'    // the daemon's reply to a shim
+#define MAX_USERS             32     // -u
 
 
 /*****************************************************************************
-   MAIN
+   STRUCTS
  *****************************************************************************/
 
-int  // currently always returns 0
-main(int argc, char* argv[]) {
-    char buf[2048];
-    int  close_session = 0;
-    int  read_public_key = 0;
-    int  message_id = 101;  // should read messege-id from client
+// a session in the daemon's registry
+typedef struct Session Session;
+struct Session {
+  int             shim_fd;          // the shim's connection
+  int             in_fd;            // -1 until the shim has handed it over
+  int             out_fd;
+  int             keys_fd;          // the user's authorized_keys, or -1
+  uid_t           uid;              // the shim's, i.e. the user's
+  int64_t         started_ms;
+  char            in[4096];         // input held back while a reply is pending
+  size_t          in_len;
+  size_t          in_used;
+  uint8_t         ending;           // write what's left, then end
+  const char     *failed;           // why it must end now, or NULL
+  NetconfSession  netconf;
+};
+
+
+/*****************************************************************************
+   LOCAL/STATIC DEFINITIONS
+ *****************************************************************************/
+
+static Session*              sessions[MAX_SESSIONS];
+static uint32_t              num_sessions = 0;
+static uint32_t              next_session_id = 1;
+static const char*           datastore = NULL;   // -c
+static NotifyRing*           events = NULL;      // -n
+static volatile sig_atomic_t stopping = 0;
+static uid_t                 users[MAX_USERS];   // whose shims are served
+static int                   num_users = 0;
+
+
+static int64_t
+now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+
+// NetconfWrite to stdout, which blocks
+static ssize_t // -1 on error
+write_stdout(void* ctx, const struct iovec* iov, int iovcnt) {
+    ssize_t written;
+
+    do {
+        written = writev(1, iov, iovcnt);
+    } while (written == -1 && errno == EINTR);
+    return written;
+}
+
+
+// serve the session on stdin and stdout
+static void
+serve_stdio(void) {
+    NetconfSession session;
+    char           buf[4096];
+    ssize_t        len;
+    size_t         done;
+    size_t         used;
+    int            result = 0;
+
+    // without a daemon, the pid is unique enough among live sessions
+    netconf_init(&session, (uint32_t)getpid(), write_stdout, NULL);
+    session.datastore = datastore;
+    session.events = events;
+    if (netconf_start(&session) != 0) {
+        netconf_end(&session);
+        return;
+    }
+
+    while (result == 0) {
+        struct pollfd fds;
+
+        // while subscribed, look for new notifications between reads
+        fds.fd = 0;
+        fds.events = POLLIN;
+        if (poll(&fds, 1, session.subscribed ? NETCONF_NOTIFY_TICK_MSECS : -1) == 0) {
+            if (netconf_notify(&session) != 0) {
+                break;
+            }
+            continue;
+        }
+        if ((len = read(0, buf, sizeof(buf))) == 0) {
+            break;
+        }
+        if (len < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            break;
+        }
+        for (done=0; result==0 && done<(size_t)len; done+=used) {
+            result = netconf_input(&session, buf + done, (size_t)len - done, &used);
+            while (result != 2 && netconf_pending(&session)) {
+                if (netconf_output(&session) != 0) {
+                    result = 2;
+                }
+            }
+        }
+        // 1: <close-session> answered, 2: the reply couldn't be sent
+    }
+    netconf_end(&session);
+}
+
+
+// The shim: hand stdin and stdout to the daemon, and wait for it to be
+// done with them.  If it can't be reached, or won't take the session,
+// nothing has been read or written yet, so the caller can still serve it.
+static int // 0=OK (served by the daemon), 1=ERROR (serve it here)
+hand_over(const char* path) {
+    struct sockaddr_un addr;
+    struct msghdr      msg;
+    struct iovec       iov;
+    struct cmsghdr*    cmsg;
+    char               control[CMSG_SPACE(sizeof(int) * HANDOVER_FDS)];
+    char               keys_path[PATH_MAX];
+    int                fds[HANDOVER_FDS];
+    int                num_fds = 2;
+    int                sockfd;
+    int                null_fd;
+    char               byte = 0;
+    ssize_t            len;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        return 1;
+    }
+    strcpy(addr.sun_path, path);
+    sockfd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (sockfd == -1) {
+        return 1;
+    }
+    if (connect(sockfd, (struct sockaddr*)&addr, sizeof(addr)) != 0) {
+        close(sockfd);
+        return 1;
+    }
+
+    // opened here, as the user, so the daemon can only save keys for them
+    fds[0] = 0;
+    fds[1] = 1;
+    if (getenv("HOME") != NULL) {
+        snprintf(keys_path, sizeof(keys_path), "%s/.ssh/authorized_keys", getenv("HOME"));
+        fds[2] = open(keys_path, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0600);
+        if (fds[2] != -1) {
+            num_fds = 3;
+        }
+    }
+
+    memset(&msg, 0, sizeof(msg));
+    memset(control, 0, sizeof(control));
+    iov.iov_base = &byte;
+    iov.iov_len = 1;
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = CMSG_SPACE(sizeof(int) * num_fds);
+    cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int) * num_fds);
+    memcpy(CMSG_DATA(cmsg), fds, sizeof(int) * num_fds);
+
+    len = sendmsg(sockfd, &msg, MSG_NOSIGNAL);
+    if (num_fds == 3) {
+        close(fds[2]);
+    }
+    if (len != 1) {
+        close(sockfd);
+        return 1;
+    }
+    do {
+        len = read(sockfd, &byte, 1);
+    } while (len == -1 && errno == EINTR);
+    if (len != 1 || byte != HANDOVER_ACCEPTED) {
+        close(sockfd);
+        return 1;
+    }
+
+    // let go of our copies, so SSHD sees EOF when the daemon closes its own
+    null_fd = open("/dev/null", O_RDWR);
+    if (null_fd != -1) {
+        dup2(null_fd, 0);
+        dup2(null_fd, 1);
+        close(null_fd);
+    }
+    do {
+        len = read(sockfd, &byte, 1);
+    } while (len > 0 || (len == -1 && errno == EINTR));
+    close(sockfd);
+    return 0;
+}
+
+
+static void
+on_signal(int signo) {
+    stopping = 1;
+}
+
+
+static int // -1 on error, listening socket otherwise
+open_session_socket(const char* path) {
+    struct sockaddr_un addr;
+    int                sockfd;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        log_error("session socket path \"%s\" too long", path);
+        return -1;
+    }
+    strcpy(addr.sun_path, path);
+
+    sockfd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (sockfd == -1) {
+        log_error("socket() failed");
+        return -1;
+    }
+    unlink(path);
+    // the shims run as whichever user logged in, and accept_shim() checks
+    // that's one of `users`
+    if (bind(sockfd, (struct sockaddr*)&addr, sizeof(addr)) != 0 ||
+        chmod(path, (num_users > 1) ? 0666 : 0600) != 0 ||
+        listen(sockfd, 128) != 0) {
+        log_error("could not listen on session socket \"%s\"", path);
+        close(sockfd);
+        return -1;
+    }
+    return sockfd;
+}
+
+
+// NetconfWrite to a daemon session's stdout, which doesn't block
+static ssize_t // -1 on error
+write_session(void* ctx, const struct iovec* iov, int iovcnt) {
+    Session* session = (Session*)ctx;
+    ssize_t  written = writev(session->out_fd, iov, iovcnt);
+
+    if (written == -1 && (errno == EAGAIN || errno == EINTR)) {
+        return 0;
+    }
+    return written;
+}
+
+
+// true if sessions of `uid` may be served here
+static int
+user_allowed(uid_t uid) {
+    int idx;
+
+    for (idx=0; idx<num_users; idx++) {
+        if (users[idx] == uid) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+
+// a shim has connected: register it, its fds come next
+static void
+accept_shim(int listen_fd) {
+    Session*     session;
+    struct ucred cred;
+    socklen_t    cred_len = sizeof(cred);
+    int          fd = accept4(listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+
+    if (fd == -1) {
+        return;
+    }
+    if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &cred_len) != 0 ||
+        !user_allowed(cred.uid)) {
+        log_warn("refusing a session from uid %d, see -u", (int)cred.uid);
+        close(fd);
+        return;
+    }
+    // not answering makes the shim serve the session itself
+    if (num_sessions == MAX_SESSIONS ||
+        (session = (Session*)calloc(1, sizeof(Session))) == NULL) {
+        log_warn("%u sessions, serving no more", num_sessions);
+        close(fd);
+        return;
+    }
+    session->shim_fd = fd;
+    session->in_fd = -1;
+    session->out_fd = -1;
+    session->keys_fd = -1;
+    session->uid = cred.uid;
+    sessions[num_sessions++] = session;
+}
 
-    printf("%s", server_hello);
-    fflush(NULL);
 
-    while (fgets (buf, sizeof(buf), stdin) != NULL) {
+// take the fds the shim sent, and start the session on them
+static int // 0=OK, 1=ERROR
+receive_fds(Session* session) {
+    struct msghdr   msg;
+    struct iovec    iov;
+    struct cmsghdr* cmsg;
+    char            control[CMSG_SPACE(sizeof(int) * HANDOVER_FDS)];
+    int             fds[HANDOVER_FDS];
+    size_t          num_fds = 0;
+    size_t          idx;
+    char            byte;
+    ssize_t         len;
 
-        if (read_public_key == 1) {
-            // save it to the ~/.ssh/authorized_keys file
-            char path[512];
-            sprintf(path, "%s/.ssh/authorized_keys", getenv("HOME"));
-            FILE *file = fopen(path, "a");
-            fprintf(file, "%s", buf); 
-            fclose(file);
-            read_public_key = 0;
+    memset(&msg, 0, sizeof(msg));
+    iov.iov_base = &byte;
+    iov.iov_len = 1;
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    len = recvmsg(session->shim_fd, &msg, MSG_CMSG_CLOEXEC);
+    if (len == -1 && (errno == EAGAIN || errno == EINTR)) {
+        return 0;
+    }
+    if (len != 1) {
+        return 1;
+    }
+    for (cmsg=CMSG_FIRSTHDR(&msg); cmsg!=NULL; cmsg=CMSG_NXTHDR(&msg, cmsg)) {
+        if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+            num_fds = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+            if (num_fds > HANDOVER_FDS) {
+                num_fds = HANDOVER_FDS;   // the kernel would have truncated
+            }
+            memcpy(fds, CMSG_DATA(cmsg), num_fds * sizeof(int));
+            break;
         }
+    }
+    if (num_fds < 2) {
+        for (idx=0; idx<num_fds; idx++) {
+            close(fds[idx]);
+        }
+        return 1;
+    }
+    session->in_fd = fds[0];
+    session->out_fd = fds[1];
+    session->keys_fd = (num_fds == 3) ? fds[2] : -1;
+    fcntl(session->in_fd, F_SETFL, fcntl(session->in_fd, F_GETFL) | O_NONBLOCK);
+    fcntl(session->out_fd, F_SETFL, fcntl(session->out_fd, F_GETFL) | O_NONBLOCK);
+
+    byte = HANDOVER_ACCEPTED;
+    if (write(session->shim_fd, &byte, 1) != 1) {
+        return 1;   // the shim will serve it, or has gone
+    }
+    session->started_ms = now_ms();
+    netconf_init(&session->netconf, next_session_id++, write_session, session);
+    session->netconf.authorized_keys_fd = session->keys_fd;
+    session->netconf.datastore = datastore;
+    session->netconf.events = events;
+    if (netconf_start(&session->netconf) != 0) {
+        session->failed = "write failed";
+    }
+    log_info("session %u started for uid %d", session->netconf.session_id, (int)session->uid);
+    return 0;
+}
+
 
-        if (strstr(buf, "<set-public-key") != NULL) {
-            read_public_key = 1;
+// hand the session what the client sent, until a reply can't all be
+// written, leaving the rest for after
+static void
+input_session(Session* session) {
+    size_t used;
+
+    while (session->in_used < session->in_len && !netconf_pending(&session->netconf) &&
+           !session->ending && session->failed == NULL) {
+        switch (netconf_input(&session->netconf, session->in + session->in_used,
+                              session->in_len - session->in_used, &used)) {
+        case 0:
+            break;
+        case 1:
+            session->ending = 1;   // <close-session> answered
+            break;
+        default:
+            session->failed = "write failed";
+            break;
         }
+        session->in_used += used;
+    }
+}
+
+
+// read what the client sent
+static void
+read_session(Session* session) {
+    ssize_t len = read(session->in_fd, session->in, sizeof(session->in));
 
-        if (strstr(buf, "close-session") != NULL) {
-            close_session = 1;
+    if (len == -1) {
+        if (errno != EAGAIN && errno != EINTR) {
+            session->failed = "read failed";
         }
+        return;
+    }
+    if (len == 0) {
+        session->ending = 1;   // the client has gone
+        return;
+    }
+    session->in_len = (size_t)len;
+    session->in_used = 0;
+    input_session(session);
+}
+
+
+// write more of a pending reply, then take the input held back for it
+static void
+output_session(Session* session) {
+    if (netconf_output(&session->netconf) != 0) {
+        session->failed = "write failed";
+        return;
+    }
+    input_session(session);
+}
 
-        if (strstr(buf, "]]>]]>") != NULL) {
 
-            if (close_session == 1) {
-                printf(server_close_reply, message_id); 
-                fflush(NULL);
-                exit(0);
+// end the session and drop it from the registry; the shim exits when
+// its connection closes
+static void
+end_session(uint32_t idx) {
+    Session* session = sessions[idx];
+
+    if (session->in_fd != -1) {
+        log_info("session %u ended after %lld ms%s%s%s", session->netconf.session_id,
+                 (long long)(now_ms() - session->started_ms),
+                 session->failed ? " (" : "", session->failed ? session->failed : "",
+                 session->failed ? ")" : "");
+        if (session->netconf.notify_sent > 0 || session->netconf.notify_lost > 0) {
+            log_info("session %u sent %llu notifications, lost %llu",
+                     session->netconf.session_id,
+                     (unsigned long long)session->netconf.notify_sent,
+                     (unsigned long long)session->netconf.notify_lost);
+        }
+        close(session->in_fd);
+    }
+    if (session->out_fd != -1 && session->out_fd != session->in_fd) {
+        close(session->out_fd);
+    }
+    if (session->keys_fd != -1) {
+        close(session->keys_fd);
+    }
+    close(session->shim_fd);
+    netconf_end(&session->netconf);
+    free(session);
+    sessions[idx] = sessions[--num_sessions];
+}
+
+
+// the daemon: serve sessions handed over on the socket at `path`
+static int // 0=OK, 1=ERROR
+serve(const char* path) {
+    struct sigaction sa;
+    struct pollfd*   fds;
+    uint32_t*        owners;
+    int              listen_fd;
+    nfds_t           num_fds;
+    nfds_t           pos;
+    uint32_t         idx;
+    int              timeout;
+
+    if (log_start() != 0) {
+        fprintf(stderr, "could not start the logger\n");
+        return 1;
+    }
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = on_signal;   // no SA_RESTART, poll() must return
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+    signal(SIGPIPE, SIG_IGN);
+
+    listen_fd = open_session_socket(path);
+    // a pollfd (and its owner) per session fd, plus the socket
+    fds = (struct pollfd*)malloc(sizeof(struct pollfd) * (MAX_SESSIONS * 3 + 1));
+    owners = (uint32_t*)malloc(sizeof(uint32_t) * (MAX_SESSIONS * 3 + 1));
+    if (listen_fd == -1 || fds == NULL || owners == NULL) {
+        log_stop();
+        return 1;
+    }
+    log_info("serving sessions on \"%s\"", path);
+    if (events == NULL) {
+        log_warn("no notification ring, <create-subscription> is not supported");
+    }
+
+    while (!stopping) {
+        // end sessions that are done, or have lost their client or shim
+        for (idx=num_sessions; idx>0; idx--) {
+            Session* session = sessions[idx-1];
+
+            if (session->failed != NULL ||
+                (session->ending && !netconf_pending(&session->netconf))) {
+                end_session(idx-1);
+            }
+        }
+
+        fds[0].fd = listen_fd;
+        fds[0].events = POLLIN;
+        num_fds = 1;
+        timeout = -1;
+        for (idx=0; idx<num_sessions; idx++) {
+            Session* session = sessions[idx];
+
+            if (session->netconf.subscribed) {
+                timeout = NETCONF_NOTIFY_TICK_MSECS;   // to look for new events
             }
 
+            fds[num_fds].fd = session->shim_fd;   // its fds, or its exit
+            fds[num_fds].events = POLLIN;
+            owners[num_fds++] = idx;
+            if (session->in_fd == -1) {
+                continue;
+            }
+            // no more input while a reply is pending
+            if (netconf_pending(&session->netconf)) {
+                fds[num_fds].fd = session->out_fd;
+                fds[num_fds].events = POLLOUT;
+                owners[num_fds++] = idx;
+            } else if (!session->ending) {
+                fds[num_fds].fd = session->in_fd;
+                fds[num_fds].events = POLLIN;
+                owners[num_fds++] = idx;
+            }
+        }
 
+        if (poll(fds, num_fds, timeout) == -1) {
+            continue;   // EINTR, maybe stopping
+        }
+
+        for (pos=1; pos<num_fds; pos++) {
+            Session* session = sessions[owners[pos]];
+
+            if (fds[pos].revents == 0) {
+                continue;
+            }
+            if (fds[pos].fd == session->shim_fd) {
+                if (session->in_fd == -1) {
+                    if (receive_fds(session) != 0) {
+                        session->failed = "no handover";
+                    }
+                } else {
+                    session->failed = "shim exited";   // SSHD ended the session
+                }
+            } else if (fds[pos].events == POLLIN) {
+                read_session(session);
+            } else {
+                output_session(session);
+            }
+        }
+        if (fds[0].revents & POLLIN) {
+            accept_shim(listen_fd);
+        }
+
+        // one batch of new notifications per subscribed session that
+        // isn't still writing something
+        for (idx=0; idx<num_sessions; idx++) {
+            Session* session = sessions[idx];
+
+            if (session->failed == NULL && !session->ending &&
+                netconf_notify(&session->netconf) != 0) {
+                session->failed = "write failed";
+            }
         }
     }
-    exit(0);
+
+    log_info("stopping, %u sessions", num_sessions);
+    while (num_sessions > 0) {
+        end_session(num_sessions - 1);
+    }
+    close(listen_fd);
+    unlink(path);
+    free(fds);
+    free(owners);
+    log_stop();
+    return 0;
 }
 
 
+/*****************************************************************************
+   MAIN
+ *****************************************************************************/
+
+int  // 0=OK, 1=ERROR (the daemon couldn't start, or bad usage)
+main(int argc, char* argv[]) {
+    const char* events_path = NOTIFY_RING_PATH;
+    int         run_daemon = 0;
+    int         opt;
+
+    users[num_users++] = getuid();
+    while ((opt = getopt(argc, argv, "dc:n:u:")) != -1) {
+        switch (opt) {
+        case 'd':
+            run_daemon = 1;
+            break;
+        case 'c':
+            datastore = optarg;
+            break;
+        case 'n':
+            events_path = optarg;
+            break;
+        case 'u': {
+            struct passwd* pwd = getpwnam(optarg);
+            char*          end;
+            long           uid = strtol(optarg, &end, 10);
+
+            if (pwd != NULL) {
+                uid = (long)pwd->pw_uid;
+            } else if (*optarg == '\0' || *end != '\0' || uid < 0) {
+                fprintf(stderr, "no user \"%s\"\n", optarg);
+                return 1;
+            }
+            if (num_users == MAX_USERS) {
+                fprintf(stderr, "at most %d users\n", MAX_USERS - 1);
+                return 1;
+            }
+            if (!user_allowed((uid_t)uid)) {
+                users[num_users++] = (uid_t)uid;
+            }
+            break;
+        }
+        default:
+            fprintf(stderr, "usage: %s [-d] [-c config.xml] [-n events] [-u user]... "
+                    "[socket-path]\n", argv[0]);
+            return 1;
+        }
+    }
+    if (run_daemon) {
+        // without it, sessions just don't offer notifications
+        events = notify_ring_open(events_path, 0);
+        return serve(optind < argc ? argv[optind] : NETCONFD_SOCKET_PATH);
+    }
+    if (optind < argc && hand_over(argv[optind]) == 0) {
+        exit(0);
+    }
+    events = notify_ring_open(events_path, 0);
+    serve_stdio();
+    exit(0);
+}
@@ -0,0 +1,226 @@
+/*****************************************************************************
+Copyright (c) 2014-2016, Juniper Networks, Inc.
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions
+are met:
+
+1. Redistributions of source code must retain the above copyright 
+   notice, this list of conditions and the following disclaimer.
+
+2. Redistributions in binary form must reproduce the above copyright
+   notice, this list of conditions and the following disclaimer in the
+   documentation and/or other materials provided with the distribution.
+
+3. Neither the name of the copyright holder nor the names of its 
+   contributors may be used to endorse or promote products derived 
+   from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS 
+"AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT 
+LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS 
+FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE 
+COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, 
+INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, 
+BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; 
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER 
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT 
+LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN 
+ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE 
+POSSIBILITY OF SUCH DAMAGE.
+ *****************************************************************************/
+
+
+
+/*****************************************************************************
+   OVERVIEW
+
+   This file maintains the shared-memory notification ring described in
+   notify.h.  Whoever opens it first creates it: the file is built under
+   a temporary name and link()ed into place, so nobody ever maps a
+   half-initialized ring, and two creators racing both end up mapping
+   the same one.
+
+   A producer claims a position with an atomic increment of the header's
+   head, then fills that position's slot between two stores of its
+   sequence number.  Positions are claimed in order but may be published
+   out of order, so a reader takes events strictly by position and
+   waits at one that isn't published yet.
+ *****************************************************************************/
+
+
+/*****************************************************************************
+   INCLUDES AND EXTERNS
+ *****************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include "notify.h"
+
+
+/*****************************************************************************
+   LOCAL/STATIC DEFINITIONS
+ *****************************************************************************/
+
+static size_t
+ring_size(void) {
+    return sizeof(NotifyHeader) + NOTIFY_RING_SLOTS * sizeof(NotifyEvent);
+}
+
+
+// make a new, empty ring at `path`, unless someone beat us to it
+static void
+ring_create(const char* path) {
+    char        tmp_path[PATH_MAX];
+    NotifyRing* ring;
+    int         fd;
+
+    snprintf(tmp_path, sizeof(tmp_path), "%s.%d", path, (int)getpid());
+    fd = open(tmp_path, O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+    if (fd == -1) {
+        return;
+    }
+    if (ftruncate(fd, (off_t)ring_size()) != 0) {
+        close(fd);
+        unlink(tmp_path);
+        return;
+    }
+    ring = (NotifyRing*)mmap(NULL, ring_size(), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (ring == MAP_FAILED) {
+        unlink(tmp_path);
+        return;
+    }
+    ring->header.version = NOTIFY_RING_VERSION;
+    ring->header.num_slots = NOTIFY_RING_SLOTS;
+    __atomic_store_n(&ring->header.magic, NOTIFY_RING_MAGIC, __ATOMIC_RELEASE);
+    munmap(ring, ring_size());
+
+    // fails if there's one already, which is then the one to use
+    if (link(tmp_path, path) != 0 && errno != EEXIST) {
+        unlink(tmp_path);
+        return;
+    }
+    unlink(tmp_path);
+}
+
+
+/*****************************************************************************
+   EXTERNS
+ *****************************************************************************/
+
+// map the ring at `path`, creating it if there's none; read-only unless
+// `writable`, which producers need
+NotifyRing* // NULL on error
+notify_ring_open(const char* path, int writable) {
+    struct stat stat_buf;
+    NotifyRing* ring;
+    int         fd;
+
+    fd = open(path, (writable ? O_RDWR : O_RDONLY) | O_CLOEXEC);
+    if (fd == -1 && errno == ENOENT) {
+        ring_create(path);
+        fd = open(path, (writable ? O_RDWR : O_RDONLY) | O_CLOEXEC);
+    }
+    if (fd == -1) {
+        return NULL;
+    }
+    if (fstat(fd, &stat_buf) != 0 || (size_t)stat_buf.st_size != ring_size()) {
+        close(fd);
+        return NULL;
+    }
+    ring = (NotifyRing*)mmap(NULL, ring_size(), writable ? PROT_READ | PROT_WRITE : PROT_READ,
+                             MAP_SHARED, fd, 0);
+    close(fd);
+    if (ring == MAP_FAILED) {
+        return NULL;
+    }
+    if (__atomic_load_n(&ring->header.magic, __ATOMIC_ACQUIRE) != NOTIFY_RING_MAGIC ||
+        ring->header.version != NOTIFY_RING_VERSION ||
+        ring->header.num_slots != NOTIFY_RING_SLOTS) {
+        munmap(ring, ring_size());
+        return NULL;
+    }
+    return ring;
+}
+
+
+void
+notify_ring_close(NotifyRing* ring) {
+    if (ring != NULL) {
+        munmap(ring, ring_size());
+    }
+}
+
+
+// publish one event, an XML element (without the <notification> and
+// <eventTime> around it); never waits
+int // 0=OK, 1=ERROR (too long)
+notify_publish(NotifyRing* ring, const char* event, size_t len) {
+    struct timespec now;
+    NotifyEvent*    slot;
+    uint64_t        pos;
+
+    if (len > NOTIFY_EVENT_MAX) {
+        return 1;
+    }
+    clock_gettime(CLOCK_REALTIME, &now);
+    pos = __atomic_fetch_add(&ring->header.head, 1, __ATOMIC_ACQ_REL);
+    slot = &ring->slots[pos & (NOTIFY_RING_SLOTS - 1)];
+    __atomic_store_n(&slot->seq, 2 * pos + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    slot->time_sec = now.tv_sec;
+    slot->time_nsec = (int32_t)now.tv_nsec;
+    slot->len = (uint32_t)len;
+    memcpy(slot->text, event, len);
+    __atomic_store_n(&slot->seq, 2 * pos + 2, __ATOMIC_RELEASE);
+    return 0;
+}
+
+
+// the position the next event will be published at
+uint64_t
+notify_head(const NotifyRing* ring) {
+    return __atomic_load_n(&ring->header.head, __ATOMIC_ACQUIRE);
+}
+
+
+// the earliest position still in the ring
+uint64_t
+notify_oldest(const NotifyRing* ring) {
+    uint64_t head = notify_head(ring);
+
+    return head > NOTIFY_RING_SLOTS ? head - NOTIFY_RING_SLOTS : 0;
+}
+
+
+// copy out the event at `pos`, without ever blocking its producer
+int // 0=OK, 1=not published yet, 2=gone (overwritten)
+notify_read(const NotifyRing* ring, uint64_t pos, NotifyEvent* copy) {
+    const NotifyEvent* slot = &ring->slots[pos & (NOTIFY_RING_SLOTS - 1)];
+    uint64_t           seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+
+    if (seq > 2 * pos + 2) {
+        return 2;
+    }
+    if (seq != 2 * pos + 2) {
+        return 1;
+    }
+    memcpy(copy, slot, sizeof(NotifyEvent));
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    if (__atomic_load_n(&slot->seq, __ATOMIC_RELAXED) != seq || copy->len > NOTIFY_EVENT_MAX) {
+        return 2;   // overwritten while it was copied
+    }
+    return 0;
+}
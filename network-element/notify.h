@@ -0,0 +1,110 @@
+/*****************************************************************************
+Copyright (c) 2014-2016, Juniper Networks, Inc.
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions
+are met:
+
+1. Redistributions of source code must retain the above copyright 
+   notice, this list of conditions and the following disclaimer.
+
+2. Redistributions in binary form must reproduce the above copyright
+   notice, this list of conditions and the following disclaimer in the
+   documentation and/or other materials provided with the distribution.
+
+3. Neither the name of the copyright holder nor the names of its 
+   contributors may be used to endorse or promote products derived 
+   from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS 
+"AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT 
+LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS 
+FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE 
+COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, 
+INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, 
+BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; 
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER 
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT 
+LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN 
+ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE 
+POSSIBILITY OF SUCH DAMAGE.
+ *****************************************************************************/
+
+
+
+/*****************************************************************************
+   OVERVIEW
+
+   This header file defines the ring buffer of NETCONF event notifications
+   (RFC 5277) that local producers publish into, and that netconfd's
+   subscribed sessions send on to their NMSs.  It is a shared, file-backed
+   memory mapping, like ncchd's status table: any process on the box can
+   publish with notify_publish(), which never waits, and each session
+   reads at its own pace.  The ring keeps the last NOTIFY_RING_SLOTS
+   events, which is what a subscription can replay (<startTime>); a
+   session that falls further behind than that loses the events it
+   missed.
+
+   Each slot is protected by a sequence lock holding its position in the
+   stream (2*pos+1 while it's written, 2*pos+2 once it's published), so a
+   reader can tell an event not yet published from one already
+   overwritten by a later lap.
+ *****************************************************************************/
+
+
+/*****************************************************************************
+   MACROS
+ *****************************************************************************/
+
+#define NOTIFY_RING_PATH     ".netconfd.events"
+#define NOTIFY_RING_MAGIC    0x4e434e46   // "NCNF"
+#define NOTIFY_RING_VERSION  1
+#define NOTIFY_RING_SLOTS    4096         // must be a power of 2
+#define NOTIFY_EVENT_MAX     1000         // bytes of an event's XML, at most
+
+
+/*****************************************************************************
+   STRUCTS
+ *****************************************************************************/
+
+typedef struct NotifyHeader NotifyHeader;
+struct NotifyHeader {
+  uint32_t magic;
+  uint32_t version;
+  uint32_t num_slots;
+  uint32_t pad;
+  uint64_t head;               // the next position to publish at
+  uint8_t  reserved[40];
+};
+
+typedef struct NotifyEvent NotifyEvent;
+struct NotifyEvent {
+  uint64_t seq;                // see above
+  int64_t  time_sec;           // when it was published (epoch)
+  int32_t  time_nsec;
+  uint32_t len;
+  char     text[NOTIFY_EVENT_MAX];   // not NUL-terminated
+};
+
+typedef struct NotifyRing NotifyRing;
+struct NotifyRing {
+  NotifyHeader header;
+  NotifyEvent  slots[];
+};
+
+
+/*****************************************************************************
+   EXTERNS
+ *****************************************************************************/
+
+extern NotifyRing* notify_ring_open(const char* path, int writable);
+extern void        notify_ring_close(NotifyRing* ring);
+
+// producer side
+extern int         notify_publish(NotifyRing* ring, const char* event, size_t len);
+
+// reader side
+extern uint64_t    notify_head(const NotifyRing* ring);
+extern uint64_t    notify_oldest(const NotifyRing* ring);
+extern int         notify_read(const NotifyRing* ring, uint64_t pos, NotifyEvent* copy);
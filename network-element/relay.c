@@ -0,0 +1,293 @@
+/*****************************************************************************
+Copyright (c) 2014-2016, Juniper Networks, Inc.
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions
+are met:
+
+1. Redistributions of source code must retain the above copyright 
+   notice, this list of conditions and the following disclaimer.
+
+2. Redistributions in binary form must reproduce the above copyright
+   notice, this list of conditions and the following disclaimer in the
+   documentation and/or other materials provided with the distribution.
+
+3. Neither the name of the copyright holder nor the names of its 
+   contributors may be used to endorse or promote products derived 
+   from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS 
+"AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT 
+LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS 
+FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE 
+COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, 
+INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, 
+BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; 
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER 
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT 
+LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN 
+ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE 
+POSSIBILITY OF SUCH DAMAGE.
+ *****************************************************************************/
+
+
+
+/*****************************************************************************
+   OVERVIEW
+
+   This file implements the relays declared in relay.h.
+
+   Each direction is a small state machine: splice() from the source
+   socket into the direction's pipe, then from the pipe into the other
+   socket, until either would block.  Once the source reaches EOF and its
+   pipe is empty, the other socket's write side is shut down, and the
+   relay is done when both directions have been shut down.
+
+   splice() is Linux-only; elsewhere relay_supported() is false and
+   verify_incoming_config() rejects relayed apps.
+ *****************************************************************************/
+
+
+/*****************************************************************************
+   INCLUDES AND EXTERNS
+ *****************************************************************************/
+
+#ifdef __linux__
+#define _GNU_SOURCE     // splice(), pipe2()
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <poll.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include "relay.h"
+
+
+/*****************************************************************************
+   LOCAL/STATIC DEFINITIONS
+ *****************************************************************************/
+
+static int64_t
+relay_now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+
+// Connect to the local server.  It's on this box, so unlike the NMS
+// connect this waits (at most RELAY_CONNECT_TIMEOUT_MSECS) for it.
+static int // -1=error (see `error`), connected non-blocking socket otherwise
+connect_local(const char* addr, uint16_t port, char* error, size_t error_size) {
+    struct addrinfo  hints;
+    struct addrinfo* ai_list;
+    struct addrinfo* res;
+    char             port_str[16];
+    int              sockfd = -1;
+    int              n;
+
+    snprintf(port_str, sizeof(port_str), "%u", port);
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    n = getaddrinfo(addr, port_str, &hints, &ai_list);
+    if (n != 0) {
+        snprintf(error, error_size, "local %s: %s", addr, gai_strerror(n));
+        return -1;
+    }
+
+    for (res=ai_list; res!=NULL; res=res->ai_next) {
+        sockfd = socket(res->ai_family, res->ai_socktype, res->ai_protocol);
+        if (sockfd == -1) {
+            continue;
+        }
+        fcntl(sockfd, F_SETFL, fcntl(sockfd, F_GETFL, 0) | O_NONBLOCK);
+        fcntl(sockfd, F_SETFD, FD_CLOEXEC);
+        if (connect(sockfd, res->ai_addr, res->ai_addrlen) == 0) {
+            break;
+        }
+        if (errno == EINPROGRESS) {
+            struct pollfd pfd = { sockfd, POLLOUT, 0 };
+            int           err = 0;
+            socklen_t     len = sizeof(err);
+
+            if (poll(&pfd, 1, RELAY_CONNECT_TIMEOUT_MSECS) == 1 &&
+                getsockopt(sockfd, SOL_SOCKET, SO_ERROR, &err, &len) == 0 && err == 0) {
+                break;
+            }
+            errno = (err != 0) ? err : ETIMEDOUT;
+        }
+        snprintf(error, error_size, "local %s:%u: %s", addr, port, strerror(errno));
+        close(sockfd);
+        sockfd = -1;
+    }
+    freeaddrinfo(ai_list);
+    return sockfd;
+}
+
+
+#ifdef SPLICE_F_MOVE
+// move what can be moved in one direction without blocking
+static int // 0=OK, 1=ERROR
+pump_side(Relay* relay, enum RELAY_SIDE side) {
+    int      dst = relay->fd[!side];
+    int      round;
+
+    for (round=0; round<RELAY_PUMP_ROUNDS; round++) {
+        int     progress = 0;
+        ssize_t n;
+
+        if (!relay->eof[side]) {
+            n = splice(relay->fd[side], NULL, relay->pipe[side][1], NULL,
+                       RELAY_CHUNK, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+            if (n > 0) {
+                relay->queued[side] += n;
+                relay->bytes[side] += n;
+                progress = 1;
+            } else if (n == 0) {
+                relay->eof[side] = 1;
+                progress = 1;
+            } else if (errno != EAGAIN && errno != EINTR) {
+                return 1;
+            }
+        }
+        if (relay->queued[side] > 0) {
+            n = splice(relay->pipe[side][0], NULL, dst, NULL,
+                       relay->queued[side], SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+            if (n > 0) {
+                relay->queued[side] -= n;
+                progress = 1;
+            } else if (n < 0 && errno != EAGAIN && errno != EINTR) {
+                return 1;
+            }
+        }
+        if (!progress) {
+            break;
+        }
+    }
+
+    // pass the EOF on once everything before it has been
+    if (relay->eof[side] && relay->queued[side] == 0 && !relay->shut[side]) {
+        shutdown(dst, SHUT_WR);
+        relay->shut[side] = 1;
+    }
+    return 0;
+}
+#endif
+
+
+/*****************************************************************************
+   INTERFACE
+ *****************************************************************************/
+
+// true if this platform can relay
+int
+relay_supported(void) {
+#ifdef SPLICE_F_MOVE
+    return 1;
+#else
+    return 0;
+#endif
+}
+
+
+// Connect to the local server at addr:port and start relaying the
+// connected NMS socket to it.  Takes ownership of nms_fd on success.
+int // 0=OK, 1=ERROR (see `error`)
+relay_open(Relay** relay, int nms_fd, const char* addr, uint16_t port,
+           char* error, size_t error_size) {
+#ifdef SPLICE_F_MOVE
+    Relay* r;
+    int    local_fd;
+
+    local_fd = connect_local(addr, port, error, error_size);
+    if (local_fd == -1) {
+        return 1;
+    }
+    r = (Relay*)calloc(1, sizeof(Relay));
+    if (r == NULL) {
+        snprintf(error, error_size, "could not alloc relay");
+        close(local_fd);
+        return 1;
+    }
+    if (pipe2(r->pipe[RELAY_NMS], O_NONBLOCK | O_CLOEXEC) != 0) {
+        snprintf(error, error_size, "pipe2() failed: %s", strerror(errno));
+        close(local_fd);
+        free(r);
+        return 1;
+    }
+    if (pipe2(r->pipe[RELAY_LOCAL], O_NONBLOCK | O_CLOEXEC) != 0) {
+        snprintf(error, error_size, "pipe2() failed: %s", strerror(errno));
+        close(r->pipe[RELAY_NMS][0]);
+        close(r->pipe[RELAY_NMS][1]);
+        close(local_fd);
+        free(r);
+        return 1;
+    }
+    fcntl(nms_fd, F_SETFL, fcntl(nms_fd, F_GETFL, 0) | O_NONBLOCK);
+    r->fd[RELAY_NMS] = nms_fd;
+    r->fd[RELAY_LOCAL] = local_fd;
+    r->started_ms = relay_now_ms();
+    *relay = r;
+    return 0;
+#else
+    snprintf(error, error_size, "relaying isn't supported on this platform");
+    return 1;
+#endif
+}
+
+
+// the poll() events the relay waits for on fd[side]
+short
+relay_events(Relay* relay, enum RELAY_SIDE side) {
+    short events = 0;
+
+    // read only into an empty pipe: a pipe can be full well short of
+    // RELAY_CHUNK bytes, and polling for input it has no room for spins
+    if (!relay->eof[side] && relay->queued[side] == 0) {
+        events |= POLLIN;
+    }
+    if (relay->queued[!side] > 0) {
+        events |= POLLOUT;    // the other side's data is waiting for room
+    }
+    return events;
+}
+
+
+// move whatever can be moved, in both directions, without blocking
+int // 0=still open, 1=closed by both ends, 2=ERROR
+relay_pump(Relay* relay) {
+#ifdef SPLICE_F_MOVE
+    if (pump_side(relay, RELAY_NMS) != 0 || pump_side(relay, RELAY_LOCAL) != 0) {
+        return 2;
+    }
+    return (relay->shut[RELAY_NMS] && relay->shut[RELAY_LOCAL]) ? 1 : 0;
+#else
+    return 2;
+#endif
+}
+
+
+// close both sockets and the pipes, discarding anything still queued
+void
+relay_close(Relay* relay) {
+    int side;
+
+    if (relay == NULL) {
+        return;
+    }
+    for (side=0; side<2; side++) {
+        close(relay->fd[side]);
+        close(relay->pipe[side][0]);
+        close(relay->pipe[side][1]);
+    }
+    free(relay);
+}
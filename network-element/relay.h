@@ -0,0 +1,87 @@
+/*****************************************************************************
+Copyright (c) 2014-2016, Juniper Networks, Inc.
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions
+are met:
+
+1. Redistributions of source code must retain the above copyright 
+   notice, this list of conditions and the following disclaimer.
+
+2. Redistributions in binary form must reproduce the above copyright
+   notice, this list of conditions and the following disclaimer in the
+   documentation and/or other materials provided with the distribution.
+
+3. Neither the name of the copyright holder nor the names of its 
+   contributors may be used to endorse or promote products derived 
+   from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS 
+"AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT 
+LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS 
+FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE 
+COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, 
+INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, 
+BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; 
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER 
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT 
+LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN 
+ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE 
+POSSIBILITY OF SUCH DAMAGE.
+ *****************************************************************************/
+
+
+
+/*****************************************************************************
+   OVERVIEW
+
+   This header file declares relays, which carry a call-home session to a
+   NETCONF server already running on the device (e.g. on localhost:830)
+   instead of to a freshly exec'd `sshd -i`.  Bytes move between the two
+   sockets with splice() through a pipe per direction, so they're never
+   copied into ncchd and no process is needed per session.
+
+   Relays are non-blocking and are driven by ncchd's event loop: it polls
+   the fds relay_events() asks for, and calls relay_pump() when they fire.
+ *****************************************************************************/
+
+
+/*****************************************************************************
+   MACROS
+ *****************************************************************************/
+
+#define RELAY_CHUNK             65536   // most one splice() moves
+#define RELAY_PUMP_ROUNDS       16      // so one busy relay can't starve the rest
+#define RELAY_CONNECT_TIMEOUT_MSECS 1000
+
+
+/*****************************************************************************
+   STRUCTS
+ *****************************************************************************/
+
+enum RELAY_SIDE { RELAY_NMS, RELAY_LOCAL };
+
+typedef struct Relay Relay;
+struct Relay {
+  int       fd[2];          // indexed by enum RELAY_SIDE
+  int       pipe[2][2];     // pipe[side] carries fd[side] to the other side
+  uint32_t  queued[2];      // bytes sitting in pipe[side]
+  uint8_t   eof[2];         // fd[side] has been read to EOF
+  uint8_t   shut[2];        // ...and that's been passed on
+  uint64_t  bytes[2];       // relayed from fd[side]
+  int64_t   started_ms;     // monotonic
+};
+
+
+
+/*****************************************************************************
+   EXTERNS
+ *****************************************************************************/
+
+extern int   relay_supported(void);
+extern int   relay_open(Relay** relay, int nms_fd, const char* addr, uint16_t port,
+                        char* error, size_t error_size);
+extern short relay_events(Relay* relay, enum RELAY_SIDE side);
+extern int   relay_pump(Relay* relay);
+extern void  relay_close(Relay* relay);
@@ -0,0 +1,224 @@
+/*****************************************************************************
+Copyright (c) 2014-2016, Juniper Networks, Inc.
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions
+are met:
+
+1. Redistributions of source code must retain the above copyright 
+   notice, this list of conditions and the following disclaimer.
+
+2. Redistributions in binary form must reproduce the above copyright
+   notice, this list of conditions and the following disclaimer in the
+   documentation and/or other materials provided with the distribution.
+
+3. Neither the name of the copyright holder nor the names of its 
+   contributors may be used to endorse or promote products derived 
+   from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS 
+"AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT 
+LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS 
+FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE 
+COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, 
+INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, 
+BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; 
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER 
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT 
+LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN 
+ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE 
+POSSIBILITY OF SUCH DAMAGE.
+ *****************************************************************************/
+
+
+
+/*****************************************************************************
+   OVERVIEW
+
+   This file implements the per-server statistics declared in
+   server_stats.h.
+
+   A server's entry is found by a hash of its address and port, so it
+   follows the server if the list is reordered, and an app keeps at most
+   MAX_SERVER_STATS of them, replacing the least recently updated.  Each
+   connect attempt updates its server's entry: a success folds the time
+   from connect() to the NMS's first byte into an EWMA and clears the
+   failure streak, a failure adds to the failure count and the streak.
+   The counts decay with a half-life of STATS_HALF_LIFE_SECS of wall-clock
+   time, so the history survives restarts but old failures are forgiven.
+
+   A server's score is its response time, divided by its (smoothed)
+   success ratio, and doubled for each failure in the current streak;
+   the lowest score wins.  A server with no entry, or one not updated for
+   STATS_STALE_SECS, scores 0, so new servers are measured before
+   the known-good one is settled on, and stale numbers are refreshed.
+ *****************************************************************************/
+
+
+/*****************************************************************************
+   INCLUDES AND EXTERNS
+ *****************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/types.h>
+#include "ncchd.h"
+#include "server_stats.h"
+
+
+/*****************************************************************************
+   LOCAL/STATIC DEFINITIONS
+ *****************************************************************************/
+
+// FNV-1a of "addr:port", never 0 (which marks an unused entry)
+static uint64_t
+stats_key(const Server* svr) {
+    uint64_t    hash = 14695981039346656037ULL;
+    const char* str = svr->addr;
+    int         idx;
+
+    while (*str != '\0') {
+        hash = (hash ^ (uint8_t)*str++) * 1099511628211ULL;
+    }
+    hash = (hash ^ ':') * 1099511628211ULL;
+    for (idx=0; idx<2; idx++) {
+        hash = (hash ^ ((svr->port >> (idx * 8)) & 0xff)) * 1099511628211ULL;
+    }
+    return hash != 0 ? hash : 1;
+}
+
+
+// 2^(-age/half-life), exact at whole half-lives and linear in between,
+// which is close enough and needs no libm
+static float
+stats_decay(int64_t age_secs) {
+    int64_t halvings;
+    float   factor;
+
+    if (age_secs <= 0) {
+        return 1.0f;
+    }
+    halvings = age_secs / STATS_HALF_LIFE_SECS;
+    if (halvings >= 32) {
+        return 0.0f;
+    }
+    factor = 1.0f / (float)(1u << halvings);
+    return factor * (1.0f - 0.5f * (float)(age_secs % STATS_HALF_LIFE_SECS)
+                                 / STATS_HALF_LIFE_SECS);
+}
+
+
+static int // index into state->servers, -1 if it has none
+stats_find(const PersistedState* state, uint64_t key) {
+    int idx;
+
+    for (idx=0; idx<MAX_SERVER_STATS; idx++) {
+        if (state->servers[idx].key == key) {
+            return idx;
+        }
+    }
+    return -1;
+}
+
+
+/*****************************************************************************
+   EXTERNS
+ *****************************************************************************/
+
+// fold the outcome of a connect attempt to `svr` into `state`
+void
+server_stats_record(PersistedState* state, const Server* svr, int ok,
+                    uint32_t rtt_us, int64_t now) {
+    uint64_t     key = stats_key(svr);
+    int          idx = stats_find(state, key);
+    ServerStats* stats = (idx != -1) ? &(state->servers[idx]) : NULL;
+    float        decay;
+
+    if (stats == NULL) {
+        // take an unused entry, or the one heard from least recently
+        stats = &(state->servers[0]);
+        for (idx=1; idx<MAX_SERVER_STATS && stats->key != 0; idx++) {
+            if (state->servers[idx].key == 0 ||
+                state->servers[idx].updated < stats->updated) {
+                stats = &(state->servers[idx]);
+            }
+        }
+        memset(stats, 0, sizeof(ServerStats));
+        stats->key = key;
+        stats->updated = now;
+    }
+
+    decay = stats_decay(now - stats->updated);
+    stats->successes *= decay;
+    stats->failures *= decay;
+    stats->streak *= decay;
+    stats->updated = now;
+
+    if (ok) {
+        if (rtt_us == 0) {
+            rtt_us = 1;
+        }
+        // EWMA with gain 1/4, so a server that got slower shows it soon
+        stats->rtt_us = (stats->rtt_us == 0) ? rtt_us
+                        : stats->rtt_us - stats->rtt_us / 4 + rtt_us / 4;
+        stats->successes += 1.0f;
+        stats->streak = 0.0f;
+    } else {
+        stats->failures += 1.0f;
+        if (stats->streak < STATS_MAX_STREAK) {
+            stats->streak += 1.0f;
+        }
+    }
+}
+
+
+// lower is better, 0 for a server that hasn't been (recently) measured
+double
+server_stats_score(const PersistedState* state, const Server* svr, int64_t now) {
+    int                idx = stats_find(state, stats_key(svr));
+    const ServerStats* stats = (idx != -1) ? &(state->servers[idx]) : NULL;
+    float              decay;
+    double             ratio;
+    double             score;
+    int                streak;
+
+    if (stats == NULL || now - stats->updated > STATS_STALE_SECS) {
+        return 0.0;
+    }
+    decay = stats_decay(now - stats->updated);
+    ratio = (stats->successes * decay + 1.0) /
+            ((stats->successes + stats->failures) * decay + 2.0);
+    score = (stats->rtt_us != 0 ? stats->rtt_us : STATS_UNREACHED_US) / ratio;
+    for (streak=(int)(stats->streak * decay + 0.5f); streak>0; streak--) {
+        score *= 2.0;
+    }
+    return score;
+}
+
+
+// The best-scoring server, ties going to the first listed.  Skips
+// servers[skip] (pass app->num_servers to skip none) unless it's the only one.
+uint32_t
+server_stats_pick(const Application* app, const PersistedState* state,
+                  uint32_t skip, int64_t now) {
+    uint32_t best = (skip == 0 && app->num_servers > 1) ? 1 : 0;
+    double   best_score = server_stats_score(state, &(app->servers[best]), now);
+    uint32_t svr_idx;
+
+    for (svr_idx=best+1; svr_idx<app->num_servers; svr_idx++) {
+        double score;
+
+        if (svr_idx == skip) {
+            continue;
+        }
+        score = server_stats_score(state, &(app->servers[svr_idx]), now);
+        if (score < best_score) {
+            best = svr_idx;
+            best_score = score;
+        }
+    }
+    return best;
+}
@@ -0,0 +1,67 @@
+/*****************************************************************************
+Copyright (c) 2014-2016, Juniper Networks, Inc.
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions
+are met:
+
+1. Redistributions of source code must retain the above copyright 
+   notice, this list of conditions and the following disclaimer.
+
+2. Redistributions in binary form must reproduce the above copyright
+   notice, this list of conditions and the following disclaimer in the
+   documentation and/or other materials provided with the distribution.
+
+3. Neither the name of the copyright holder nor the names of its 
+   contributors may be used to endorse or promote products derived 
+   from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS 
+"AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT 
+LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS 
+FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE 
+COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, 
+INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, 
+BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; 
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER 
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT 
+LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN 
+ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE 
+POSSIBILITY OF SUCH DAMAGE.
+ *****************************************************************************/
+
+
+
+/*****************************************************************************
+   OVERVIEW
+
+   This header file declares the per-server connect statistics behind the
+   "lowest-latency" start-with strategy.  Each app keeps, in its persisted
+   state, a smoothed response time and decayed success/failure counts for
+   each of its servers, and starts with the one that's been answering
+   fastest and most reliably.
+ *****************************************************************************/
+
+
+/*****************************************************************************
+   MACROS
+ *****************************************************************************/
+
+#define STATS_HALF_LIFE_SECS  3600       // counts halve after this long
+#define STATS_STALE_SECS      (4*3600)   // then the server is measured afresh
+#define STATS_UNREACHED_US    1000000    // response time of a server never reached
+#define STATS_MAX_STREAK      10         // failures in a row counted against it
+
+
+/*****************************************************************************
+   EXTERNS
+ *****************************************************************************/
+
+// needs ncchd.h for Application, Server and PersistedState
+extern void     server_stats_record(PersistedState* state, const Server* svr,
+                                    int ok, uint32_t rtt_us, int64_t now);
+extern double   server_stats_score(const PersistedState* state, const Server* svr,
+                                   int64_t now);
+extern uint32_t server_stats_pick(const Application* app, const PersistedState* state,
+                                  uint32_t skip, int64_t now);
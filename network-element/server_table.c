@@ -0,0 +1,148 @@
+/*****************************************************************************
+Copyright (c) 2014-2016, Juniper Networks, Inc.
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions
+are met:
+
+1. Redistributions of source code must retain the above copyright 
+   notice, this list of conditions and the following disclaimer.
+
+2. Redistributions in binary form must reproduce the above copyright
+   notice, this list of conditions and the following disclaimer in the
+   documentation and/or other materials provided with the distribution.
+
+3. Neither the name of the copyright holder nor the names of its 
+   contributors may be used to endorse or promote products derived 
+   from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS 
+"AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT 
+LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS 
+FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE 
+COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, 
+INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, 
+BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; 
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER 
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT 
+LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN 
+ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE 
+POSSIBILITY OF SUCH DAMAGE.
+ *****************************************************************************/
+
+
+
+/*****************************************************************************
+   OVERVIEW
+
+   This file implements the per-server table declared in server_table.h:
+   open addressing with linear probing, keyed by the address's interned
+   pointer and the port, doubled when half full.  Entries are only ever
+   added (one per distinct server ever configured) until the table is
+   cleared, so there are no tombstones.
+ *****************************************************************************/
+
+
+/*****************************************************************************
+   INCLUDES AND EXTERNS
+ *****************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/types.h>
+#include "ncchd.h"
+#include "server_table.h"
+
+
+/*****************************************************************************
+   LOCAL/STATIC DEFINITIONS
+ *****************************************************************************/
+
+static uint32_t
+server_hash(const char* addr, uint16_t port) {
+    uint64_t hash = (uint64_t)(uintptr_t)addr * 0x9E3779B97F4A7C15ULL;
+    return (uint32_t)((hash >> 32) ^ hash ^ port);
+}
+
+
+static ServerEntry*
+server_entry(const ServerTable* table, char* entries, uint32_t idx) {
+    return (ServerEntry*)(entries + (size_t)idx * table->entry_size);
+}
+
+
+// double the table, rehashing the entries in use
+static int // 0=OK, 1=ERROR
+server_table_grow(ServerTable* table) {
+    uint32_t size = table->size ? table->size * 2 : 64;
+    char*    grown = (char*)calloc(size, table->entry_size);
+    uint32_t idx;
+
+    if (grown == NULL) {
+        return 1;
+    }
+    for (idx=0; idx<table->size; idx++) {
+        ServerEntry* entry = server_entry(table, table->entries, idx);
+        uint32_t     slot;
+
+        if (entry->addr == NULL) {
+            continue;
+        }
+        slot = server_hash(entry->addr, entry->port) & (size - 1);
+        while (server_entry(table, grown, slot)->addr != NULL) {
+            slot = (slot + 1) & (size - 1);
+        }
+        memcpy(server_entry(table, grown, slot), entry, table->entry_size);
+    }
+    free(table->entries);
+    table->entries = grown;
+    table->size = size;
+    return 0;
+}
+
+
+/*****************************************************************************
+   EXTERNS
+ *****************************************************************************/
+
+// the entry for addr:port (interned), added (zeroed but for its
+// ServerEntry) if there's none
+void* // NULL if out of memory
+server_table_find(ServerTable* table, const char* addr, uint16_t port) {
+    ServerEntry* entry;
+    uint32_t     slot;
+
+    if ((table->used + 1) * 2 > table->size && server_table_grow(table) != 0) {
+        return NULL;
+    }
+    slot = server_hash(addr, port) & (table->size - 1);
+    while ((entry = server_entry(table, table->entries, slot))->addr != NULL) {
+        if (entry->addr == addr && entry->port == port) {
+            return entry;
+        }
+        slot = (slot + 1) & (table->size - 1);
+    }
+    memset(entry, 0, table->entry_size);
+    entry->addr = intern_ref(addr);
+    entry->port = port;
+    table->used++;
+    return entry;
+}
+
+
+// forget every server
+void
+server_table_clear(ServerTable* table) {
+    uint32_t idx;
+
+    for (idx=0; idx<table->size; idx++) {
+        intern_release(server_entry(table, table->entries, idx)->addr);
+    }
+    free(table->entries);
+    table->entries = NULL;
+    table->size = 0;
+    table->used = 0;
+}
@@ -0,0 +1,78 @@
+/*****************************************************************************
+Copyright (c) 2014-2016, Juniper Networks, Inc.
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions
+are met:
+
+1. Redistributions of source code must retain the above copyright 
+   notice, this list of conditions and the following disclaimer.
+
+2. Redistributions in binary form must reproduce the above copyright
+   notice, this list of conditions and the following disclaimer in the
+   documentation and/or other materials provided with the distribution.
+
+3. Neither the name of the copyright holder nor the names of its 
+   contributors may be used to endorse or promote products derived 
+   from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS 
+"AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT 
+LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS 
+FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE 
+COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, 
+INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, 
+BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; 
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER 
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT 
+LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN 
+ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE 
+POSSIBILITY OF SUCH DAMAGE.
+ *****************************************************************************/
+
+
+
+/*****************************************************************************
+   OVERVIEW
+
+   This header file declares a table with an entry per server (interned
+   address and port), as ncchd's circuit breakers (breaker.c) and TCP
+   Fast Open state (tcp_profile.c) keep.  Each user's entry type starts
+   with a ServerEntry; the table doesn't lock, its users do.
+ *****************************************************************************/
+
+
+/*****************************************************************************
+   MACROS
+ *****************************************************************************/
+
+// an empty table of `type`s, for a static initializer
+#define SERVER_TABLE_INIT(type)  { NULL, sizeof(type), 0, 0 }
+
+
+/*****************************************************************************
+   STRUCTS
+ *****************************************************************************/
+
+typedef struct ServerEntry ServerEntry;
+struct ServerEntry {
+    const char* addr;           // interned (a reference is held), NULL if unused
+    uint16_t    port;
+};
+
+typedef struct ServerTable ServerTable;
+struct ServerTable {
+    char*    entries;           // `size` of `entry_size` bytes each
+    size_t   entry_size;        // of the user's type, a ServerEntry first
+    uint32_t size;              // power of 2
+    uint32_t used;
+};
+
+
+/*****************************************************************************
+   EXTERNS
+ *****************************************************************************/
+
+extern void* server_table_find(ServerTable* table, const char* addr, uint16_t port);
+extern void  server_table_clear(ServerTable* table);
@@ -0,0 +1,167 @@
+/*****************************************************************************
+Copyright (c) 2014-2016, Juniper Networks, Inc.
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions
+are met:
+
+1. Redistributions of source code must retain the above copyright 
+   notice, this list of conditions and the following disclaimer.
+
+2. Redistributions in binary form must reproduce the above copyright
+   notice, this list of conditions and the following disclaimer in the
+   documentation and/or other materials provided with the distribution.
+
+3. Neither the name of the copyright holder nor the names of its 
+   contributors may be used to endorse or promote products derived 
+   from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS 
+"AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT 
+LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS 
+FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE 
+COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, 
+INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, 
+BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; 
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER 
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT 
+LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN 
+ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE 
+POSSIBILITY OF SUCH DAMAGE.
+ *****************************************************************************/
+
+
+
+/*****************************************************************************
+   OVERVIEW
+
+   This file implements the crypto-profile rendering declared in
+   ssh_profile.h.
+
+   Each list is passed through to sshd as-is, so anything the installed
+   sshd understands, including the "+", "-" and "^" prefixes that modify
+   its default list, can be used.  Since the lists end up in a config
+   file, they are checked to hold only the characters algorithm names
+   are made of: a stray newline would otherwise let config.xml (or
+   `ncchctl upsert`) inject arbitrary sshd_config directives.
+
+   X509KeyAlgorithm is only understood by the PKIX-SSH flavour of sshd
+   that the X.509 host keys need, and a stock OpenSSH sshd refuses to
+   start with it, so an x509-key-algorithm of "none" leaves it out.
+ *****************************************************************************/
+
+
+/*****************************************************************************
+   INCLUDES AND EXTERNS
+ *****************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/types.h>
+#include "ncchd.h"
+#include "ssh_profile.h"
+#include "log.h"
+
+
+/*****************************************************************************
+   LOCAL/STATIC DEFINITIONS
+ *****************************************************************************/
+
+// true if `list` is a non-empty algorithm list
+static int
+valid_list(const char* list) {
+    const char* cur;
+
+    if (*list == '\0') {
+        return 0;
+    }
+    for (cur=list; *cur!='\0'; cur++) {
+        if (strchr("abcdefghijklmnopqrstuvwxyz"
+                   "ABCDEFGHIJKLMNOPQRSTUVWXYZ"
+                   "0123456789@.,_+-^", *cur) == NULL) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+
+// the profile's lists, with their sshd_config keywords and config.xml names
+typedef struct ProfileList ProfileList;
+struct ProfileList {
+  const char *keyword;
+  const char *element;
+  const char *list;
+};
+
+static int  // number of entries filled in
+profile_lists(const SshCryptoProfile* profile, ProfileList* lists) {
+    lists[0] = (ProfileList){ "KexAlgorithms",     "kex",                 profile->kex };
+    lists[1] = (ProfileList){ "Ciphers",           "ciphers",             profile->ciphers };
+    lists[2] = (ProfileList){ "MACs",              "macs",                profile->macs };
+    lists[3] = (ProfileList){ "HostKeyAlgorithms", "host-key-algorithms", profile->host_key_algorithms };
+    lists[4] = (ProfileList){ "X509KeyAlgorithm",  "x509-key-algorithm",
+                              profile->x509_key_algorithm != NULL ?
+                                  profile->x509_key_algorithm : X509_KEY_ALGORITHM_DEFAULT };
+    return 5;
+}
+
+
+/*****************************************************************************
+   EXTERNS
+ *****************************************************************************/
+
+// check the profile can be rendered safely
+int  // 0=OK, 1=ERROR
+ssh_profile_verify(const char* app_name, const SshCryptoProfile* profile) {
+    ProfileList lists[5];
+    int         num_lists = profile_lists(profile, lists);
+    int         idx;
+
+    for (idx=0; idx<num_lists; idx++) {
+        if (lists[idx].list != NULL && !valid_list(lists[idx].list)) {
+            log_error("app \"%s\": crypto-profile %s \"%s\" isn't an algorithm list",
+                      app_name, lists[idx].element, lists[idx].list);
+            return 1;
+        }
+    }
+    if (profile->compression > COMPRESSION_DELAYED) {
+        log_error("app \"%s\": unknown crypto-profile compression %u",
+                  app_name, profile->compression);
+        return 1;
+    }
+    return 0;
+}
+
+
+// write the profile's sshd_config lines to `file`
+void
+ssh_profile_render(const SshCryptoProfile* profile, FILE* file) {
+    ProfileList lists[5];
+    int         num_lists = profile_lists(profile, lists);
+    int         idx;
+
+    for (idx=0; idx<num_lists; idx++) {
+        if (lists[idx].list != NULL && strcmp(lists[idx].list, "none") != 0) {
+            fprintf(file, "%s %s\n", lists[idx].keyword, lists[idx].list);
+        }
+    }
+    if (profile->compression != COMPRESSION_DEFAULT) {
+        fprintf(file, "Compression %s\n", ssh_profile_compression_name(profile->compression));
+    }
+}
+
+
+// the config.xml (and sshd_config) name of a compression setting
+const char*
+ssh_profile_compression_name(uint8_t compression) {
+    switch (compression) {
+        case COMPRESSION_NO:      return "no";
+        case COMPRESSION_YES:     return "yes";
+        case COMPRESSION_DELAYED: return "delayed";
+        default:                  return "default";
+    }
+}
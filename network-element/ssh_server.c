@@ -0,0 +1,856 @@
+/*****************************************************************************
+Copyright (c) 2014-2016, Juniper Networks, Inc.
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions
+are met:
+
+1. Redistributions of source code must retain the above copyright 
+   notice, this list of conditions and the following disclaimer.
+
+2. Redistributions in binary form must reproduce the above copyright
+   notice, this list of conditions and the following disclaimer in the
+   documentation and/or other materials provided with the distribution.
+
+3. Neither the name of the copyright holder nor the names of its 
+   contributors may be used to endorse or promote products derived 
+   from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS 
+"AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT 
+LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS 
+FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE 
+COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, 
+INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, 
+BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; 
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER 
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT 
+LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN 
+ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE 
+POSSIBILITY OF SUCH DAMAGE.
+ *****************************************************************************/
+
+
+
+/*****************************************************************************
+   OVERVIEW
+
+   This file implements the in-process SSH server declared in
+   ssh_server.h, on libssh's server API.
+
+   Host keys are loaded into an ssh_bind, one per distinct combination
+   of host-key files and crypto-profile (see ssh_profile.c), which is
+   kept until ncchd exits and shared by every session (and shard) that
+   uses it.  libssh has no x509v3-* host-key algorithms, so a host-key
+   file's X.509 certificate isn't offered, only its plain key, and the
+   profile's x509-key-algorithm doesn't apply.  The other lists of the
+   profile are given to libssh as they are.
+
+   A session does the key exchange with ssh_handle_key_exchange() in
+   non-blocking mode, then is driven through a per-session ssh_event
+   with callbacks: the NMS may authenticate with a public key listed in
+   the user's authorized_keys file (there's no PAM, so no passwords),
+   open a session channel (or up to max_channels of them), and start
+   the "netconf" subsystem on it, which is then served by netconf.c, a
+   NETCONF session per channel.  Output a channel's window has no room
+   for is kept until it has, up to OUTPUT_MAX bytes; a longer reply (a
+   <get-config>) is taken from netconf.c as that drains, and the NMS's
+   next messages on that channel wait for it.  When a NETCONF session
+   closes, so does its channel, and once none is left open the NMS is
+   expected to hang up.
+
+   There's no equivalent of sshd's ClientAliveInterval, ncchd applies
+   the keep-alive strategy as TCP keep-alives instead, as for relays.
+ *****************************************************************************/
+
+
+/*****************************************************************************
+   INCLUDES AND EXTERNS
+ *****************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <poll.h>
+#include <pthread.h>
+#include <pwd.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#ifdef WITH_LIBSSH
+#include <libssh/libssh.h>
+#include <libssh/server.h>
+#include <libssh/callbacks.h>
+#endif
+#include "ncchd.h"
+#include "netconf.h"
+#include "ssh_profile.h"
+#include "ssh_server.h"
+#include "log.h"
+
+
+/*****************************************************************************
+   MACROS
+ *****************************************************************************/
+
+#define OUTPUT_MAX  262144   // subsystem output kept for the channel, at most
+
+
+/*****************************************************************************
+   LOCAL/STATIC DEFINITIONS
+ *****************************************************************************/
+
+#ifdef WITH_LIBSSH
+
+// an ssh_bind holding a set of host keys and a crypto-profile
+typedef struct Bind Bind;
+struct Bind {
+  Bind             *next;
+  uint32_t          num_host_keys;
+  const char      **host_keys;      // interned
+  SshCryptoProfile  crypto;         // lists interned
+  ssh_bind          bind;
+};
+
+static pthread_mutex_t binds_lock = PTHREAD_MUTEX_INITIALIZER;
+static Bind*           binds = NULL;
+static bool            initialized = false;
+
+// NETCONF session-ids, unique across every shard's sessions
+static _Atomic uint32_t next_session_id = 1;
+
+
+// a session channel, and the NETCONF session on it
+typedef struct Channel Channel;
+struct Channel {
+  SshServer                           *server;
+  ssh_channel                          channel;
+  struct ssh_channel_callbacks_struct  cb;
+  NetconfSession                       netconf;
+  char                                *out;        // subsystem output not yet written
+  size_t                               out_len;
+  char                                *in;         // NMS data held back for a reply
+  size_t                               in_len;
+  size_t                               in_used;
+  size_t                               in_size;
+  uint8_t                              subsystem;  // "netconf" requested...
+  uint8_t                              started;    // ...and its <hello> sent
+  uint8_t                              eof;        // the NMS closed the channel
+};
+
+struct SshServerState {
+  ssh_session                          session;
+  ssh_event                            event;      // NULL until the key exchange is done
+  struct ssh_server_callbacks_struct   server_cb;
+  Channel                             *channels[SSH_SERVER_MAX_CHANNELS];  // NULL once closed
+  uint32_t                             num_open;   // channels not NULL
+  char                                 authorized_keys[PATH_MAX];  // the user's
+  char                                 capability[160];  // for a shared session's <hello>s
+  uint8_t                              shared;
+  uint8_t                              authenticated;
+  uint8_t                              hello_sent; // on some channel
+  uint8_t                              eof;        // the NMS closed the last channel
+  uint8_t                              failed;
+};
+
+
+static int64_t
+ssh_server_now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+
+// give a crypto-profile list to the bind, unless it's left at the default
+static int // 0=OK, 1=ERROR
+bind_option(ssh_bind bind, enum ssh_bind_options_e option, const char* list,
+            const char* element, char* error, size_t error_size) {
+    if (list == NULL || strcmp(list, "none") == 0) {
+        return 0;
+    }
+    if (ssh_bind_options_set(bind, option, list) != SSH_OK) {
+        snprintf(error, error_size, "libssh rejects crypto-profile %s \"%s\"", element, list);
+        return 1;
+    }
+    return 0;
+}
+
+
+// a new bind with `app`'s host keys and crypto-profile loaded
+static Bind* // NULL on error (see `error`)
+bind_new(const Application* app, char* error, size_t error_size) {
+    Bind*    b = (Bind*)calloc(1, sizeof(Bind));
+    bool     process_config = false;
+    uint32_t idx;
+
+    if (b == NULL ||
+        (b->host_keys = (const char**)calloc(app->num_host_keys + 1, sizeof(char*))) == NULL ||
+        (b->bind = ssh_bind_new()) == NULL) {
+        snprintf(error, error_size, "could not alloc ssh_bind");
+        if (b != NULL) {
+            free(b->host_keys);
+        }
+        free(b);
+        return NULL;
+    }
+
+    // everything comes from config.xml, not /etc/ssh/libssh_server_config
+    ssh_bind_options_set(b->bind, SSH_BIND_OPTIONS_PROCESS_CONFIG, &process_config);
+    for (idx=0; idx<app->num_host_keys; idx++) {
+        const char* name = app->host_keys[idx].name;
+        ssh_key     key = NULL;
+        FILE*       file;
+        char        line[128];
+
+        if (ssh_pki_import_privkey_file(name, NULL, NULL, NULL, &key) != SSH_OK) {
+            snprintf(error, error_size, "could not load host key \"%s\"", name);
+            goto failed;
+        }
+        if (ssh_bind_options_set(b->bind, SSH_BIND_OPTIONS_IMPORT_KEY, key) != SSH_OK) {
+            ssh_key_free(key);
+            snprintf(error, error_size, "could not use host key \"%s\"", name);
+            goto failed;
+        }
+        // the bind owns `key` now
+        file = fopen(name, "r");
+        while (file != NULL && fgets(line, sizeof(line), file) != NULL) {
+            if (strstr(line, "-----BEGIN CERTIFICATE-----") != NULL) {
+                log_warn("host key \"%s\": its X.509 certificate isn't offered in-process",
+                         name);
+                break;
+            }
+        }
+        if (file != NULL) {
+            fclose(file);
+        }
+        b->host_keys[idx] = intern_ref(name);
+        b->num_host_keys = idx + 1;
+    }
+    if (bind_option(b->bind, SSH_BIND_OPTIONS_KEY_EXCHANGE, app->crypto.kex,
+                    "kex", error, error_size) != 0 ||
+        bind_option(b->bind, SSH_BIND_OPTIONS_CIPHERS_C_S, app->crypto.ciphers,
+                    "ciphers", error, error_size) != 0 ||
+        bind_option(b->bind, SSH_BIND_OPTIONS_CIPHERS_S_C, app->crypto.ciphers,
+                    "ciphers", error, error_size) != 0 ||
+        bind_option(b->bind, SSH_BIND_OPTIONS_HMAC_C_S, app->crypto.macs,
+                    "macs", error, error_size) != 0 ||
+        bind_option(b->bind, SSH_BIND_OPTIONS_HMAC_S_C, app->crypto.macs,
+                    "macs", error, error_size) != 0 ||
+        bind_option(b->bind, SSH_BIND_OPTIONS_HOSTKEY_ALGORITHMS,
+                    app->crypto.host_key_algorithms,
+                    "host-key-algorithms", error, error_size) != 0) {
+        goto failed;
+    }
+    b->crypto = app->crypto;
+    b->crypto.kex = intern_ref(app->crypto.kex);
+    b->crypto.ciphers = intern_ref(app->crypto.ciphers);
+    b->crypto.macs = intern_ref(app->crypto.macs);
+    b->crypto.host_key_algorithms = intern_ref(app->crypto.host_key_algorithms);
+    b->crypto.x509_key_algorithm = intern_ref(app->crypto.x509_key_algorithm);
+    return b;
+
+failed:
+    for (idx=0; idx<b->num_host_keys; idx++) {
+        intern_release(b->host_keys[idx]);
+    }
+    ssh_bind_free(b->bind);
+    free(b->host_keys);
+    free(b);
+    return NULL;
+}
+
+
+// the bind for `app`'s host keys and crypto-profile, loading them the
+// first time they're used.  Called with binds_lock held.
+static Bind* // NULL on error (see `error`)
+bind_get(const Application* app, char* error, size_t error_size) {
+    Bind*    b;
+    uint32_t idx;
+
+    for (b=binds; b!=NULL; b=b->next) {
+        if (b->num_host_keys != app->num_host_keys ||
+            memcmp(&b->crypto, &app->crypto, sizeof(SshCryptoProfile)) != 0) {
+            continue;
+        }
+        for (idx=0; idx<b->num_host_keys; idx++) {
+            if (b->host_keys[idx] != app->host_keys[idx].name) {
+                break;
+            }
+        }
+        if (idx == b->num_host_keys) {
+            return b;
+        }
+    }
+    if (!initialized) {
+        if (ssh_init() != SSH_OK) {
+            snprintf(error, error_size, "ssh_init() failed");
+            return NULL;
+        }
+        initialized = true;
+    }
+    b = bind_new(app, error, error_size);
+    if (b != NULL) {
+        b->next = binds;
+        binds = b;
+    }
+    return b;
+}
+
+
+// the user's authorized_keys file, per AUTHORIZED_KEYS_ENV
+static int // 0=OK, 1=ERROR (no such user, or too long)
+authorized_keys_path(const char* user, char* path, size_t size) {
+    const char*    pattern = getenv(AUTHORIZED_KEYS_ENV);
+    struct passwd  pwd;
+    struct passwd* found = NULL;
+    char           pwbuf[1024];
+    size_t         len = 0;
+
+    if (getpwnam_r(user, &pwd, pwbuf, sizeof(pwbuf), &found) != 0 || found == NULL) {
+        return 1;
+    }
+    if (pattern == NULL || pattern[0] == '\0') {
+        pattern = ".ssh/authorized_keys";
+    }
+    if (pattern[0] != '/' && pattern[0] != '%') {
+        len = (size_t)snprintf(path, size, "%s/", pwd.pw_dir);
+    }
+    for (; *pattern!='\0' && len<size; pattern++) {
+        const char* token = NULL;
+
+        if (pattern[0] == '%' && pattern[1] == 'h') {
+            token = pwd.pw_dir;
+        } else if (pattern[0] == '%' && pattern[1] == 'u') {
+            token = user;
+        } else if (pattern[0] == '%' && pattern[1] == '%') {
+            token = "%";
+        }
+        if (token != NULL) {
+            len += (size_t)snprintf(path + len, size - len, "%s", token);
+            pattern++;
+        } else {
+            path[len++] = *pattern;
+        }
+    }
+    if (len >= size) {
+        return 1;
+    }
+    path[len] = '\0';
+    return 0;
+}
+
+
+// true if `pubkey` is listed in `path`, an authorized_keys file.  Lines
+// may start with options, the key is found by its type.
+static bool
+key_authorized(const char* path, ssh_key pubkey) {
+    FILE* file = fopen(path, "r");
+    char  line[8192];
+    bool  found = false;
+
+    if (file == NULL) {
+        return false;
+    }
+    while (!found && fgets(line, sizeof(line), file) != NULL) {
+        char* save = NULL;
+        char* token;
+
+        for (token=strtok_r(line, " \t\r\n", &save); token!=NULL;
+             token=strtok_r(NULL, " \t\r\n", &save)) {
+            enum ssh_keytypes_e type;
+            char*               b64;
+            ssh_key             key = NULL;
+
+            if (token[0] == '#') {
+                break;
+            }
+            type = ssh_key_type_from_name(token);
+            if (type == SSH_KEYTYPE_UNKNOWN) {
+                continue;  // an option
+            }
+            b64 = strtok_r(NULL, " \t\r\n", &save);
+            if (b64 != NULL && ssh_pki_import_pubkey_base64(b64, type, &key) == SSH_OK) {
+                found = (ssh_key_cmp(key, pubkey, SSH_KEY_CMP_PUBLIC) == 0);
+                ssh_key_free(key);
+            }
+            break;
+        }
+    }
+    fclose(file);
+    return found;
+}
+
+
+// write as much queued subsystem output as the channel takes
+static void
+flush_output(Channel* ch) {
+    int written;
+
+    if (ch->out_len == 0) {
+        return;
+    }
+    written = ssh_channel_write(ch->channel, ch->out, (uint32_t)ch->out_len);
+    if (written == SSH_ERROR) {
+        ch->server->state->failed = 1;
+        return;
+    }
+    memmove(ch->out, ch->out + written, ch->out_len - (size_t)written);
+    ch->out_len -= (size_t)written;
+    ch->server->bytes[1] += (uint64_t)written;
+}
+
+
+// NetconfWrite, queues as much as there's room for, for the channel
+static ssize_t // -1 on error
+subsystem_write(void* ctx, const struct iovec* iov, int iovcnt) {
+    Channel* ch = (Channel*)ctx;
+    size_t   taken = 0;
+    int      idx;
+
+    if (ch->out == NULL && (ch->out = (char*)malloc(OUTPUT_MAX)) == NULL) {
+        return -1;
+    }
+    for (idx=0; idx<iovcnt && ch->out_len<OUTPUT_MAX; idx++) {
+        size_t len = iov[idx].iov_len;
+
+        if (len > OUTPUT_MAX - ch->out_len) {
+            len = OUTPUT_MAX - ch->out_len;
+        }
+        memcpy(ch->out + ch->out_len, iov[idx].iov_base, len);
+        ch->out_len += len;
+        taken += len;
+    }
+    flush_output(ch);
+    return (ssize_t)taken;
+}
+
+
+// hand netconf.c the NMS's data, until a reply is pending
+static void
+feed_input(Channel* ch) {
+    struct SshServerState* st = ch->server->state;
+    size_t                 used;
+
+    while (ch->in_used < ch->in_len && !netconf_pending(&ch->netconf) &&
+           !ch->netconf.closed && !st->failed) {
+        if (netconf_input(&ch->netconf, ch->in + ch->in_used,
+                          ch->in_len - ch->in_used, &used) == 2) {
+            st->failed = 1;
+        }
+        ch->in_used += used;
+    }
+    if (ch->in_used == ch->in_len) {
+        ch->in_len = ch->in_used = 0;
+    }
+}
+
+
+// close the channel and forget it, telling the NMS unless it's the one
+// that closed it
+static void
+channel_close(struct SshServerState* st, uint32_t idx) {
+    Channel* ch = st->channels[idx];
+
+    if (!ch->eof) {
+        ssh_channel_send_eof(ch->channel);
+        ssh_channel_close(ch->channel);
+    }
+    // libssh may keep the channel until the NMS closes its end too
+    ssh_remove_channel_callbacks(ch->channel, &ch->cb);
+    ssh_channel_free(ch->channel);
+    if (ch->started) {
+        netconf_end(&ch->netconf);
+    }
+    free(ch->out);
+    free(ch->in);
+    free(ch);
+    st->channels[idx] = NULL;
+    st->num_open--;
+}
+
+
+static int
+on_auth_pubkey(ssh_session session, const char* user, struct ssh_key_struct* pubkey,
+               char signature_state, void* userdata) {
+    SshServer*             server = (SshServer*)userdata;
+    struct SshServerState* st = server->state;
+    char                   path[PATH_MAX];
+
+    if ((signature_state != SSH_PUBLICKEY_STATE_NONE &&
+         signature_state != SSH_PUBLICKEY_STATE_VALID) ||
+        authorized_keys_path(user, path, sizeof(path)) != 0 ||
+        !key_authorized(path, pubkey)) {
+        return SSH_AUTH_DENIED;
+    }
+    if (signature_state == SSH_PUBLICKEY_STATE_VALID) {
+        log_info("app \"%s\" session %u: accepted publickey for %s",
+                 server->app_name, server->session_id, user);
+        snprintf(st->authorized_keys, sizeof(st->authorized_keys), "%s", path);
+        st->authenticated = 1;
+        server->marks |= SSH_SERVER_AUTHENTICATED;
+    }
+    return SSH_AUTH_SUCCESS;  // for a probe (no signature), the key would do
+}
+
+
+static int
+on_channel_data(ssh_session session, ssh_channel channel, void* data, uint32_t len,
+                int is_stderr, void* userdata) {
+    Channel*   ch = (Channel*)userdata;
+    SshServer* server = ch->server;
+
+    server->bytes[0] += len;
+    if (!ch->started || ch->netconf.closed) {
+        return (int)len;
+    }
+    if (ch->in_len + len > ch->in_size) {
+        size_t size = (ch->in_len + len) * 2;
+        char*  in;
+
+        if (ch->in_used > 0) {   // make room first
+            memmove(ch->in, ch->in + ch->in_used, ch->in_len - ch->in_used);
+            ch->in_len -= ch->in_used;
+            ch->in_used = 0;
+        }
+        if (ch->in_len + len > ch->in_size) {
+            if ((in = (char*)realloc(ch->in, size)) == NULL) {
+                server->state->failed = 1;
+                return (int)len;
+            }
+            ch->in = in;
+            ch->in_size = size;
+        }
+    }
+    memcpy(ch->in + ch->in_len, data, len);
+    ch->in_len += len;
+    feed_input(ch);
+    return (int)len;
+}
+
+
+static void
+on_channel_eof(ssh_session session, ssh_channel channel, void* userdata) {
+    ((Channel*)userdata)->eof = 1;
+}
+
+
+static int
+on_subsystem_request(ssh_session session, ssh_channel channel, const char* subsystem,
+                     void* userdata) {
+    Channel*   ch = (Channel*)userdata;
+    SshServer* server = ch->server;
+
+    if (strcmp(subsystem, "netconf") != 0 || ch->subsystem) {
+        return 1;
+    }
+    // the <hello> is sent once the request has been answered, see pump
+    ch->subsystem = 1;
+    if (server->deadline_ms != INT64_MAX) {
+        server->marks |= SSH_SERVER_SUBSYSTEM;  // the first
+        server->deadline_ms = INT64_MAX;
+    }
+    return 0;
+}
+
+
+static ssh_channel
+on_channel_open(ssh_session session, void* userdata) {
+    SshServer*             server = (SshServer*)userdata;
+    struct SshServerState* st = server->state;
+    Channel*               ch;
+    uint32_t               idx;
+
+    if (!st->authenticated || server->closing || st->num_open >= server->max_channels) {
+        return NULL;
+    }
+    for (idx=0; idx<SSH_SERVER_MAX_CHANNELS && st->channels[idx]!=NULL; idx++) {
+        // a free slot, there is one as max_channels is at most the maximum
+    }
+    if (idx == SSH_SERVER_MAX_CHANNELS || (ch = (Channel*)calloc(1, sizeof(Channel))) == NULL) {
+        return NULL;
+    }
+    ch->server = server;
+    ch->channel = ssh_channel_new(session);
+    if (ch->channel == NULL) {
+        free(ch);
+        return NULL;
+    }
+    ch->cb.userdata = ch;
+    ch->cb.channel_data_function = on_channel_data;
+    ch->cb.channel_eof_function = on_channel_eof;
+    ch->cb.channel_close_function = on_channel_eof;
+    ch->cb.channel_subsystem_request_function = on_subsystem_request;
+    ssh_callbacks_init(&ch->cb);
+    ssh_set_channel_callbacks(ch->channel, &ch->cb);
+    st->channels[idx] = ch;
+    st->num_open++;
+    return ch->channel;
+}
+
+#endif  // WITH_LIBSSH
+
+
+/*****************************************************************************
+   EXTERNS
+ *****************************************************************************/
+
+int // 1 if ncchd was built with the in-process SSH server, 0 otherwise
+ssh_server_supported(void) {
+#ifdef WITH_LIBSSH
+    return 1;
+#else
+    return 0;
+#endif
+}
+
+
+// Start the server side of SSH on the connected NMS socket, with the
+// app's host keys and crypto-profile.  Takes ownership of nms_fd on success.
+int // 0=OK, 1=ERROR (see `error`)
+ssh_server_open(SshServer** server, int nms_fd, const Application* app,
+                uint32_t session_id, char* error, size_t error_size) {
+#ifdef WITH_LIBSSH
+    SshServer*             s;
+    struct SshServerState* st;
+    Bind*                  b;
+    int                    result;
+
+    s = (SshServer*)calloc(1, sizeof(SshServer));
+    st = (struct SshServerState*)calloc(1, sizeof(struct SshServerState));
+    if (s == NULL || st == NULL || (st->session = ssh_new()) == NULL) {
+        snprintf(error, error_size, "could not alloc ssh session");
+        free(s);
+        free(st);
+        return 1;
+    }
+    s->state = st;
+
+    // the bind's options and keys are copied into the session
+    pthread_mutex_lock(&binds_lock);
+    b = bind_get(app, error, error_size);
+    result = (b != NULL) ? ssh_bind_accept_fd(b->bind, st->session, nms_fd) : SSH_ERROR;
+    if (b != NULL && result != SSH_OK) {
+        snprintf(error, error_size, "ssh_bind_accept_fd() failed: %s", ssh_get_error(b->bind));
+    }
+    pthread_mutex_unlock(&binds_lock);
+    if (result != SSH_OK) {
+        ssh_free(st->session);
+        free(st);
+        free(s);
+        return 1;
+    }
+    if (app->crypto.compression != COMPRESSION_DEFAULT) {
+        ssh_options_set(st->session, SSH_OPTIONS_COMPRESSION,
+                        app->crypto.compression == COMPRESSION_NO ? "no" : "yes");
+    }
+
+    memset(&st->server_cb, 0, sizeof(st->server_cb));
+    st->server_cb.userdata = s;
+    st->server_cb.auth_pubkey_function = on_auth_pubkey;
+    st->server_cb.channel_open_request_session_function = on_channel_open;
+    ssh_callbacks_init(&st->server_cb);
+    ssh_set_server_callbacks(st->session, &st->server_cb);
+    ssh_set_auth_methods(st->session, SSH_AUTH_METHOD_PUBLICKEY);
+    ssh_set_blocking(st->session, 0);
+
+    s->fd = nms_fd;
+    s->started_ms = ssh_server_now_ms();
+    s->deadline_ms = s->started_ms + SSH_SERVER_LOGIN_GRACE_MSECS;
+    s->session_id = session_id;
+    s->max_channels = 1;
+    st->shared = app->shared;
+    s->app_name = intern_ref(app->name);
+    *server = s;
+    return 0;
+#else
+    snprintf(error, error_size, "ncchd was built without the in-process SSH server");
+    return 1;
+#endif
+}
+
+
+// the poll() events the session waits for on `fd`
+short
+ssh_server_events(SshServer* server) {
+#ifdef WITH_LIBSSH
+    // window adjustments for queued output come in as input, so there's
+    // always something to read
+    if (ssh_get_poll_flags(server->state->session) & SSH_WRITE_PENDING) {
+        return POLLIN | POLLOUT;
+    }
+#endif
+    return POLLIN;
+}
+
+
+// move the session along as far as it goes without blocking
+int // 0=still open, 1=closed, 2=ERROR
+ssh_server_pump(SshServer* server) {
+#ifdef WITH_LIBSSH
+    struct SshServerState* st = server->state;
+    uint32_t               idx;
+    int                    status;
+
+    if (st->event == NULL) {
+        int result = ssh_handle_key_exchange(st->session);
+        if (result == SSH_AGAIN) {
+            return 0;
+        }
+        if (result != SSH_OK) {
+            log_info("app \"%s\" session %u: key exchange failed: %s",
+                     server->app_name, server->session_id, ssh_get_error(st->session));
+            return 2;
+        }
+        server->marks |= SSH_SERVER_KEX_DONE;
+        st->event = ssh_event_new();
+        if (st->event == NULL || ssh_event_add_session(st->event, st->session) != SSH_OK) {
+            return 2;
+        }
+    }
+
+    if (ssh_event_dopoll(st->event, 0) == SSH_ERROR && !server->closing) {
+        status = ssh_get_status(st->session);
+        return (status & SSH_CLOSED_ERROR) ? 2 : 1;
+    }
+    for (idx=0; idx<SSH_SERVER_MAX_CHANNELS && !st->failed; idx++) {
+        Channel* ch = st->channels[idx];
+
+        if (ch == NULL) {
+            continue;
+        }
+        if (ch->subsystem && !ch->started) {
+            ch->started = 1;
+            netconf_init(&ch->netconf, atomic_fetch_add(&next_session_id, 1),
+                         subsystem_write, ch);
+            ch->netconf.authorized_keys = st->authorized_keys;
+            if (st->shared) {
+                // as many as the NMS may open now, it's told again in later <hello>s
+                snprintf(st->capability, sizeof(st->capability),
+                         "    <capability>%s?channels=%u</capability>\n",
+                         SSH_SERVER_SHARED_CAPABILITY, server->max_channels);
+                ch->netconf.capabilities = st->capability;
+            }
+            if (netconf_start(&ch->netconf) != 0) {
+                st->failed = 1;
+            }
+            if (!st->hello_sent) {
+                st->hello_sent = 1;
+                server->marks |= SSH_SERVER_HELLO_SENT;
+            }
+        }
+        flush_output(ch);
+        if (ch->started && netconf_pending(&ch->netconf) && ch->out_len < OUTPUT_MAX) {
+            if (netconf_output(&ch->netconf) != 0) {
+                st->failed = 1;
+            }
+            feed_input(ch);
+        }
+        if (ch->eof) {
+            // the NMS is done with the channel
+            st->eof = (st->num_open == 1);
+            channel_close(st, idx);
+        } else if (ch->started && ch->netconf.closed && ch->out_len == 0 &&
+                   !netconf_pending(&ch->netconf)) {
+            // the subsystem exited, as netconfd would after <close-session>
+            channel_close(st, idx);
+        }
+    }
+    if (st->failed) {
+        return 2;
+    }
+
+    status = ssh_get_status(st->session);
+    if (status & (SSH_CLOSED | SSH_CLOSED_ERROR)) {
+        return (status & SSH_CLOSED_ERROR) && !server->closing ? 2 : 1;
+    }
+    if (st->eof) {
+        return 1;  // the NMS is done with the session
+    }
+    if (server->deadline_ms == INT64_MAX && st->num_open == 0 && !server->closing) {
+        // every channel's NETCONF session has closed
+        server->closing = 1;
+        server->deadline_ms = ssh_server_now_ms() + SSH_SERVER_CLOSE_MSECS;
+    }
+    return 0;
+#else
+    return 2;
+#endif
+}
+
+
+// the SSH_SERVER_* marks reached since the last call, for tracing
+uint32_t
+ssh_server_take_marks(SshServer* server) {
+    uint32_t marks = server->marks;
+
+    server->marks = 0;
+    return marks;
+}
+
+
+// end the session (telling the NMS) and close the socket
+void
+ssh_server_close(SshServer* server) {
+    if (server == NULL) {
+        return;
+    }
+#ifdef WITH_LIBSSH
+    struct SshServerState* st = server->state;
+    uint32_t               idx;
+
+    if (st->event != NULL) {
+        ssh_event_remove_session(st->event, st->session);
+        ssh_event_free(st->event);
+    }
+    for (idx=0; idx<SSH_SERVER_MAX_CHANNELS; idx++) {
+        if (st->channels[idx] != NULL) {
+            st->channels[idx]->eof = 1;  // the disconnect says all there is
+            channel_close(st, idx);
+        }
+    }
+    ssh_disconnect(st->session);   // closes `fd`
+    ssh_free(st->session);
+    free(st);
+#endif
+    intern_release(server->app_name);
+    free(server);
+}
+
+
+// free the loaded host keys, at exit
+void
+ssh_server_cleanup(void) {
+#ifdef WITH_LIBSSH
+    pthread_mutex_lock(&binds_lock);
+    while (binds != NULL) {
+        Bind*    b = binds;
+        uint32_t idx;
+
+        binds = b->next;
+        for (idx=0; idx<b->num_host_keys; idx++) {
+            intern_release(b->host_keys[idx]);
+        }
+        intern_release(b->crypto.kex);
+        intern_release(b->crypto.ciphers);
+        intern_release(b->crypto.macs);
+        intern_release(b->crypto.host_key_algorithms);
+        intern_release(b->crypto.x509_key_algorithm);
+        ssh_bind_free(b->bind);
+        free(b->host_keys);
+        free(b);
+    }
+    if (initialized) {
+        ssh_finalize();
+        initialized = false;
+    }
+    pthread_mutex_unlock(&binds_lock);
+#endif
+}
@@ -0,0 +1,122 @@
+/*****************************************************************************
+Copyright (c) 2014-2016, Juniper Networks, Inc.
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions
+are met:
+
+1. Redistributions of source code must retain the above copyright 
+   notice, this list of conditions and the following disclaimer.
+
+2. Redistributions in binary form must reproduce the above copyright
+   notice, this list of conditions and the following disclaimer in the
+   documentation and/or other materials provided with the distribution.
+
+3. Neither the name of the copyright holder nor the names of its 
+   contributors may be used to endorse or promote products derived 
+   from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS 
+"AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT 
+LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS 
+FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE 
+COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, 
+INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, 
+BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; 
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER 
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT 
+LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN 
+ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE 
+POSSIBILITY OF SUCH DAMAGE.
+ *****************************************************************************/
+
+
+
+/*****************************************************************************
+   OVERVIEW
+
+   This header file declares ncchd's in-process SSH server, an optional
+   alternative to exec'ing `sshd -i` for an app's sessions.  It runs the
+   server side of SSH on the connected socket in ncchd itself (using
+   libssh), and serves the "netconf" subsystem in-process too (see
+   netconf.h), so a session costs no fork or exec, and host keys are
+   loaded once rather than by every sshd.
+
+   Like relays (see relay.h), these sessions are non-blocking and driven
+   by ncchd's event loop: it polls `fd` for what ssh_server_events()
+   asks for, calls ssh_server_pump() when it fires, and closes the
+   session once `deadline_ms` passes.
+
+   A session normally serves one NETCONF channel.  One that's shared by
+   several apps (<shared-connection/>, see ncchd.c) accepts up to
+   `max_channels` of them, and says so in each <hello> with the
+   SSH_SERVER_SHARED_CAPABILITY capability, whose "channels" parameter
+   is how many the NMS may open.
+
+   It's built only when ncchd is compiled with WITH_LIBSSH (`make
+   LIBSSH=1`), elsewhere ssh_server_supported() is false and
+   verify_incoming_config() rejects in-process apps.
+ *****************************************************************************/
+
+
+/*****************************************************************************
+   MACROS
+ *****************************************************************************/
+
+#define SSH_SERVER_LOGIN_GRACE_MSECS  120000  // to start the subsystem, as sshd's LoginGraceTime
+#define SSH_SERVER_CLOSE_MSECS        5000    // for the NMS to hang up after <close-session>
+#define SSH_SERVER_MAX_CHANNELS       64      // NETCONF channels on a shared session, at most
+
+#define SSH_SERVER_SHARED_CAPABILITY  "urn:juniper:params:netconf:capability:shared-connection:1.0"
+
+// NMS keys are looked up in this file, which may use sshd's %h (home)
+// and %u (user) tokens and is relative to the home directory unless
+// absolute.  It's also passed to sshd as AuthorizedKeysFile.  The
+// default is sshd's, .ssh/authorized_keys.
+#define AUTHORIZED_KEYS_ENV           "NCCHD_AUTHORIZED_KEYS"
+
+// how far a session has got, see ssh_server_take_marks()
+#define SSH_SERVER_KEX_DONE           0x02
+#define SSH_SERVER_AUTHENTICATED      0x04
+#define SSH_SERVER_SUBSYSTEM          0x08
+#define SSH_SERVER_HELLO_SENT         0x10
+
+
+/*****************************************************************************
+   STRUCTS
+ *****************************************************************************/
+
+struct SshServerState;
+
+typedef struct SshServer SshServer;
+struct SshServer {
+  int                    fd;            // the NMS socket
+  int64_t                started_ms;    // monotonic
+  int64_t                deadline_ms;   // closed then, see the macros above
+  uint64_t               bytes[2];      // NETCONF bytes from the NMS, and to it
+  uint32_t               session_id;    // for log messages
+  uint32_t               max_channels;  // NETCONF channels the NMS may have open, 1
+                                        // unless shared (the owner may change it, up
+                                        // to SSH_SERVER_MAX_CHANNELS)
+  uint8_t                closing;       // <close-session> answered (on every
+                                        // channel), waiting for the NMS to hang up
+  uint32_t               marks;         // SSH_SERVER_* reached, not yet taken
+  const char            *app_name;      // interned
+  struct SshServerState *state;         // the library's side (ssh_server.c)
+};
+
+
+/*****************************************************************************
+   EXTERNS
+ *****************************************************************************/
+
+// needs ncchd.h for Application
+extern int   ssh_server_supported(void);
+extern int   ssh_server_open(SshServer** server, int nms_fd, const Application* app,
+                             uint32_t session_id, char* error, size_t error_size);
+extern short ssh_server_events(SshServer* server);
+extern int   ssh_server_pump(SshServer* server);
+extern uint32_t ssh_server_take_marks(SshServer* server);
+extern void  ssh_server_close(SshServer* server);
+extern void  ssh_server_cleanup(void);
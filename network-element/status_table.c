@@ -0,0 +1,311 @@
+/*****************************************************************************
+Copyright (c) 2014-2016, Juniper Networks, Inc.
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions
+are met:
+
+1. Redistributions of source code must retain the above copyright 
+   notice, this list of conditions and the following disclaimer.
+
+2. Redistributions in binary form must reproduce the above copyright
+   notice, this list of conditions and the following disclaimer in the
+   documentation and/or other materials provided with the distribution.
+
+3. Neither the name of the copyright holder nor the names of its 
+   contributors may be used to endorse or promote products derived 
+   from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS 
+"AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT 
+LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS 
+FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE 
+COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, 
+INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, 
+BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; 
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER 
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT 
+LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN 
+ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE 
+POSSIBILITY OF SUCH DAMAGE.
+ *****************************************************************************/
+
+
+
+/*****************************************************************************
+   OVERVIEW
+
+   This file maintains the shared-memory status table described in
+   status_table.h.  `ncchd` creates the table on startup and assigns
+   each app a slot; from then on only the process maintaining an app's
+   connection writes to that app's slot, always between a matching
+   status_write_begin() and status_write_end() pair.
+
+   Readers (`ncchctl`) map the file read-only and copy slots out with
+   status_read(), retrying whenever the slot's sequence number shows it
+   changed underneath them.
+ *****************************************************************************/
+
+
+/*****************************************************************************
+   INCLUDES AND EXTERNS
+ *****************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include "status_table.h"
+#include "log.h"
+
+
+/*****************************************************************************
+   MACROS
+ *****************************************************************************/
+
+// a reader gives up on a slot after this many torn reads, which only
+// happens if its writer died mid-update
+#define STATUS_READ_MAX_RETRIES 1000
+
+
+/*****************************************************************************
+   LOCAL/STATIC DEFINITIONS
+ *****************************************************************************/
+
+static StatusTable* table = NULL;       // writer's mapping
+static size_t       table_size = 0;
+static uint32_t     free_hint = 0;      // every slot below this is in use
+
+// ncchd's shards allocate and free slots concurrently; each slot is then
+// only ever written by the shard that owns its app
+static pthread_mutex_t slots_lock = PTHREAD_MUTEX_INITIALIZER;
+
+
+/*****************************************************************************
+   WRITER
+ *****************************************************************************/
+
+// Create (replacing any stale one) and map the status table.  The old
+// file is unlinked rather than truncated so that a reader still holding
+// it never sees its mapping shrink underneath it.
+int // 0=OK, 1=ERROR
+status_table_create(const char* path) {
+    int fd;
+
+    table_size = sizeof(StatusHeader) + STATUS_TABLE_MAX_APPS * sizeof(AppStatus);
+
+    unlink(path);
+    fd = open(path, O_RDWR | O_CREAT | O_EXCL, 0644);
+    if (fd == -1) {
+        log_error("could not create status table \"%s\"", path);
+        return 1;
+    }
+    if (ftruncate(fd, table_size) != 0) {
+        log_error("ftruncate(\"%s\") failed", path);
+        close(fd);
+        return 1;
+    }
+    table = (StatusTable*)mmap(NULL, table_size, PROT_READ | PROT_WRITE,
+                               MAP_SHARED, fd, 0);
+    close(fd);
+    if (table == MAP_FAILED) {
+        log_error("mmap(\"%s\") failed", path);
+        table = NULL;
+        return 1;
+    }
+
+    table->header.version = STATUS_TABLE_VERSION;
+    table->header.num_slots = STATUS_TABLE_MAX_APPS;
+    table->header.high_water = 0;
+    free_hint = 0;
+    table->header.daemon_pid = getpid();
+    table->header.started = time(NULL);
+
+    // publish the magic last, readers check it before anything else
+    __atomic_store_n(&table->header.magic, STATUS_TABLE_MAGIC, __ATOMIC_RELEASE);
+    return 0;
+}
+
+
+// unmap and remove the status table, called on graceful shutdown
+void
+status_table_destroy(const char* path) {
+    if (table == NULL) {
+        return;
+    }
+    munmap(table, table_size);
+    table = NULL;
+    unlink(path);
+}
+
+
+// assign the first free slot to the named app.  Searching from free_hint
+// keeps starting a large config linear rather than quadratic.
+int // -1 if table is full or missing, slot index otherwise
+status_slot_alloc(const char* appname) {
+    uint32_t slot;
+
+    if (table == NULL) {
+        return -1;
+    }
+    pthread_mutex_lock(&slots_lock);
+    for (slot=free_hint; slot<table->header.num_slots; slot++) {
+        if (table->slots[slot].state == APP_FREE) {
+            break;
+        }
+    }
+    if (slot == table->header.num_slots) {
+        pthread_mutex_unlock(&slots_lock);
+        log_error("status table full, app \"%s\" has no status slot", appname);
+        return -1;
+    }
+
+    AppStatus* status = &(table->slots[slot]);
+    uint32_t   seq = status->seq;
+
+    // a writer killed mid-update leaves the sequence odd, even it out
+    if (seq & 1) {
+        __atomic_store_n(&status->seq, seq + 1, __ATOMIC_RELAXED);
+    }
+
+    AppStatus fresh;
+    memset(&fresh, 0, sizeof(fresh));
+    snprintf(fresh.name, sizeof(fresh.name), "%s", appname);
+    fresh.state = APP_STARTING;
+    fresh.session_pid = -1;
+    fresh.state_since = time(NULL);
+
+    status = status_write_begin(slot);
+    fresh.seq = status->seq;
+    *status = fresh;
+    status_write_end(status);
+
+    free_hint = slot + 1;
+    if (slot >= table->header.high_water) {
+        __atomic_store_n(&table->header.high_water, slot + 1, __ATOMIC_RELEASE);
+    }
+    pthread_mutex_unlock(&slots_lock);
+    return slot;
+}
+
+
+// give a slot back, once its app is no longer being maintained
+void
+status_slot_free(int slot) {
+    AppStatus* status = status_write_begin(slot);
+    if (status == NULL) {
+        return;
+    }
+    pthread_mutex_lock(&slots_lock);
+    status->state = APP_FREE;
+    status->session_pid = -1;
+    status_write_end(status);
+    if ((uint32_t)slot < free_hint) {
+        free_hint = slot;
+    }
+    pthread_mutex_unlock(&slots_lock);
+}
+
+
+// open a slot for writing.  Must be paired with status_write_end().
+AppStatus* // NULL if there is no such slot
+status_write_begin(int slot) {
+    AppStatus* status;
+
+    if (table == NULL || slot < 0 || (uint32_t)slot >= table->header.num_slots) {
+        return NULL;
+    }
+    status = &(table->slots[slot]);
+    __atomic_store_n(&status->seq, status->seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    return status;
+}
+
+
+// close a slot opened by status_write_begin(), publishing the update
+void
+status_write_end(AppStatus* status) {
+    if (status == NULL) {
+        return;
+    }
+    __atomic_store_n(&status->seq, status->seq + 1, __ATOMIC_RELEASE);
+}
+
+
+/*****************************************************************************
+   READER
+ *****************************************************************************/
+
+// map an existing status table read-only
+StatusTable* // NULL on error
+status_table_map(const char* path, size_t* size) {
+    struct stat  stat_buf;
+    StatusTable* mapped;
+    int          fd;
+
+    fd = open(path, O_RDONLY);
+    if (fd == -1) {
+        return NULL;
+    }
+    if (fstat(fd, &stat_buf) != 0 || (size_t)stat_buf.st_size < sizeof(StatusHeader)) {
+        close(fd);
+        return NULL;
+    }
+    mapped = (StatusTable*)mmap(NULL, stat_buf.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (mapped == MAP_FAILED) {
+        return NULL;
+    }
+    if (__atomic_load_n(&mapped->header.magic, __ATOMIC_ACQUIRE) != STATUS_TABLE_MAGIC ||
+        mapped->header.version != STATUS_TABLE_VERSION ||
+        sizeof(StatusHeader) + mapped->header.num_slots * sizeof(AppStatus) >
+                                                   (size_t)stat_buf.st_size) {
+        munmap(mapped, stat_buf.st_size);
+        return NULL;
+    }
+    *size = stat_buf.st_size;
+    return mapped;
+}
+
+
+// take a consistent snapshot of a slot without ever blocking its writer
+void
+status_read(const AppStatus* slot, AppStatus* copy) {
+    int retries;
+
+    for (retries=0; retries<STATUS_READ_MAX_RETRIES; retries++) {
+        uint32_t seq1 = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+        if (seq1 & 1) {
+            continue;
+        }
+        memcpy(copy, slot, sizeof(AppStatus));
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&slot->seq, __ATOMIC_RELAXED) == seq1) {
+            return;
+        }
+    }
+    // writer is gone, report whatever is there
+    memcpy(copy, slot, sizeof(AppStatus));
+}
+
+
+const char*
+status_state_name(uint8_t state) {
+    switch (state) {
+        case APP_FREE:       return "free";
+        case APP_STARTING:   return "starting";
+        case APP_CONNECTING: return "connecting";
+        case APP_CONNECTED:  return "connected";
+        case APP_RETRY_WAIT: return "retry-wait";
+        case APP_QUEUED:     return "queued";
+    }
+    return "unknown";
+}
@@ -0,0 +1,122 @@
+/*****************************************************************************
+Copyright (c) 2014-2016, Juniper Networks, Inc.
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions
+are met:
+
+1. Redistributions of source code must retain the above copyright 
+   notice, this list of conditions and the following disclaimer.
+
+2. Redistributions in binary form must reproduce the above copyright
+   notice, this list of conditions and the following disclaimer in the
+   documentation and/or other materials provided with the distribution.
+
+3. Neither the name of the copyright holder nor the names of its 
+   contributors may be used to endorse or promote products derived 
+   from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS 
+"AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT 
+LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS 
+FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE 
+COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, 
+INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, 
+BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; 
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER 
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT 
+LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN 
+ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE 
+POSSIBILITY OF SUCH DAMAGE.
+ *****************************************************************************/
+
+
+
+/*****************************************************************************
+   OVERVIEW
+
+   This header file defines the layout of the operational status table
+   that `ncchd` publishes in a shared, file-backed memory mapping, and
+   that `ncchctl` reads.  Each app owns one fixed-size slot, which is
+   protected by a sequence lock: the daemon never waits on a reader, and
+   a reader simply retries if it catches a slot mid-update.
+ *****************************************************************************/
+
+
+/*****************************************************************************
+   MACROS
+ *****************************************************************************/
+
+#define STATUS_TABLE_PATH     ".ncchd.status"
+#define STATUS_TABLE_MAGIC    0x4e434348   // "NCCH"
+#define STATUS_TABLE_VERSION  4
+#define STATUS_TABLE_MAX_APPS 131072       // file is sparse, unused slots cost nothing
+
+
+/*****************************************************************************
+   STRUCTS
+ *****************************************************************************/
+
+enum APP_STATE { APP_FREE, APP_STARTING, APP_CONNECTING, APP_CONNECTED,
+                 APP_RETRY_WAIT, APP_QUEUED };
+
+typedef struct StatusHeader StatusHeader;
+struct StatusHeader {
+  uint32_t magic;
+  uint32_t version;
+  uint32_t num_slots;          // capacity of the table
+  uint32_t high_water;         // no slot at or above this index is in use
+  int32_t  daemon_pid;
+  uint32_t pad;
+  int64_t  started;            // when ncchd started (epoch secs)
+  uint8_t  reserved[32];
+};
+
+typedef struct AppStatus AppStatus;
+struct AppStatus {
+  uint32_t seq;                // odd while the slot is being written
+  uint8_t  state;              // enum APP_STATE
+  uint8_t  pad;
+  uint16_t port;
+  uint32_t svr_idx;            // index into the app's server list
+  uint32_t connects;           // sessions established
+  uint32_t failures;           // failed connect attempts
+  uint32_t migrations;         // sessions moved to a preferred server
+  uint32_t skipped;            // connects not made, the server's circuit was open
+  int32_t  session_pid;        // sshd serving the current session
+  int32_t  last_exit;          // last sshd's exit status, or -signal
+  uint32_t last_session_secs;  // how long the last session lasted
+  uint32_t sessions_ended;     // sshd exits recorded
+  int64_t  state_since;        // epoch secs of the last state change
+  int64_t  connected_since;    // epoch secs the current session started
+  int64_t  last_attempt;       // epoch secs of the last connect attempt
+  char     name[64];
+  char     addr[64];
+  char     last_error[64];
+};
+
+typedef struct StatusTable StatusTable;
+struct StatusTable {
+  StatusHeader header;
+  AppStatus    slots[];
+};
+
+
+
+/*****************************************************************************
+   EXTERNS
+ *****************************************************************************/
+
+// writer side, used by ncchd
+extern int        status_table_create(const char* path);
+extern void       status_table_destroy(const char* path);
+extern int        status_slot_alloc(const char* appname);
+extern void       status_slot_free(int slot);
+extern AppStatus* status_write_begin(int slot);
+extern void       status_write_end(AppStatus* status);
+
+// reader side, used by ncchctl
+extern StatusTable* status_table_map(const char* path, size_t* size);
+extern void         status_read(const AppStatus* slot, AppStatus* copy);
+extern const char*  status_state_name(uint8_t state);
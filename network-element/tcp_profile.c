@@ -0,0 +1,226 @@
+/*****************************************************************************
+Copyright (c) 2014-2016, Juniper Networks, Inc.
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions
+are met:
+
+1. Redistributions of source code must retain the above copyright 
+   notice, this list of conditions and the following disclaimer.
+
+2. Redistributions in binary form must reproduce the above copyright
+   notice, this list of conditions and the following disclaimer in the
+   documentation and/or other materials provided with the distribution.
+
+3. Neither the name of the copyright holder nor the names of its 
+   contributors may be used to endorse or promote products derived 
+   from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS 
+"AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT 
+LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS 
+FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE 
+COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, 
+INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, 
+BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; 
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER 
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT 
+LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN 
+ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE 
+POSSIBILITY OF SUCH DAMAGE.
+ *****************************************************************************/
+
+
+
+/*****************************************************************************
+   OVERVIEW
+
+   This file implements the socket-profiles declared in tcp_profile.h.
+
+   An app's socket-profile is applied to each socket it connects with,
+   before connect(), so the buffer sizes are in place when the window
+   scale is negotiated.  TCP_QUICKACK isn't sticky (the kernel goes back
+   to delayed ACKs on its own), so it's armed again once connected, which
+   covers the SSH handshake's first round trips.
+
+   With TCP Fast Open, connect() sets TCP_FASTOPEN_CONNECT.  If the
+   kernel holds a cookie for the server (it keeps one per server address,
+   in its TCP metrics, from an earlier connect that asked for it),
+   connect() returns at once without sending the SYN, and the socket is
+   handed to sshd: the SYN goes out with sshd's first write, its SSH
+   identification string, so the NMS has it half a round trip after the
+   connect instead of one and a half.  Without a cookie, the connect is
+   an ordinary one that also asks for a cookie, for next time.  The NMS
+   must have Fast Open enabled on its listening socket (and the kernel's
+   net.ipv4.tcp_fastopen allow it) to hand out cookies.
+
+   A deferred connect hasn't shown that the server is reachable when the
+   session starts, so if such a session dies young the server's Fast Open
+   is turned off for FAST_OPEN_OFF_MSECS (doubling per failure, up to
+   FAST_OPEN_MAX_OFF_MSECS) and its next connects are ordinary ones,
+   which the circuit breakers and retries then judge as usual.  That
+   table, one entry per server (address and port, see server_table.h),
+   is shared by the shards and guarded by `table_lock`, as breaker.c's
+   is; it's consulted once per connect attempt.
+ *****************************************************************************/
+
+
+/*****************************************************************************
+   INCLUDES AND EXTERNS
+ *****************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include "ncchd.h"
+#include "tcp_profile.h"
+#include "server_table.h"
+#include "log.h"
+
+
+/*****************************************************************************
+   LOCAL/STATIC DEFINITIONS
+ *****************************************************************************/
+
+typedef struct FastOpen FastOpen;
+struct FastOpen {
+    ServerEntry server;
+    int64_t     off_ms;         // length of the current/last off period, 0 if on
+    int64_t     until_ms;       // off until
+};
+
+static pthread_mutex_t table_lock = PTHREAD_MUTEX_INITIALIZER;
+static ServerTable     table = SERVER_TABLE_INIT(FastOpen);
+
+
+/*****************************************************************************
+   EXTERNS
+ *****************************************************************************/
+
+// set the profile's options on a socket that's about to connect; an
+// option the platform lacks is left at its default
+void
+tcp_profile_apply(const SocketProfile* profile, int fd) {
+    int on = 1;
+    int size;
+
+    if (profile == NULL) {
+        return;
+    }
+    if (profile->nodelay) {
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+    }
+#ifdef TCP_QUICKACK
+    if (profile->quickack) {
+        setsockopt(fd, IPPROTO_TCP, TCP_QUICKACK, &on, sizeof(on));
+    }
+#endif
+    if (profile->send_buffer != 0) {
+        size = (int)profile->send_buffer;
+        setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &size, sizeof(size));
+    }
+    if (profile->receive_buffer != 0) {
+        size = (int)profile->receive_buffer;
+        setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+    }
+}
+
+
+// the socket has connected (or, with Fast Open, is about to)
+void
+tcp_profile_connected(const SocketProfile* profile, int fd) {
+#ifdef TCP_QUICKACK
+    int on = 1;
+
+    if (profile != NULL && profile->quickack) {
+        setsockopt(fd, IPPROTO_TCP, TCP_QUICKACK, &on, sizeof(on));
+    }
+#endif
+}
+
+
+int // 1 if TCP Fast Open can be used for connects on this platform
+tcp_fast_open_supported(void) {
+#ifdef TCP_FASTOPEN_CONNECT
+    return 1;
+#else
+    return 0;
+#endif
+}
+
+
+// make the socket's connect() a Fast Open one
+int // 0=OK, 1=ERROR (it'll be an ordinary connect)
+tcp_fast_open(int fd) {
+#ifdef TCP_FASTOPEN_CONNECT
+    int on = 1;
+
+    return setsockopt(fd, IPPROTO_TCP, TCP_FASTOPEN_CONNECT, &on, sizeof(on)) == 0 ? 0 : 1;
+#else
+    return 1;
+#endif
+}
+
+
+// May a connect to addr:port (interned) use Fast Open now?
+int // 1 if it may, 0 if not
+fast_open_check(const char* addr, uint16_t port, int64_t now) {
+    FastOpen* entry;
+    int       result = 1;
+
+    pthread_mutex_lock(&table_lock);
+    entry = (FastOpen*)server_table_find(&table, addr, port);
+    if (entry != NULL && entry->off_ms != 0 && now < entry->until_ms) {
+        result = 0;
+    }
+    pthread_mutex_unlock(&table_lock);
+    return result;
+}
+
+
+// record how a session whose connect was deferred by Fast Open went
+void
+fast_open_report(const char* addr, uint16_t port, int ok, int64_t now) {
+    FastOpen* entry;
+
+    pthread_mutex_lock(&table_lock);
+    entry = (FastOpen*)server_table_find(&table, addr, port);
+    if (entry == NULL) {
+        // nothing to record it in, so it stays on
+
+    } else if (ok) {
+        entry->off_ms = 0;
+
+    } else {
+        if (entry->off_ms == 0) {
+            entry->off_ms = FAST_OPEN_OFF_MSECS;
+        } else if (now >= entry->until_ms) {
+            entry->off_ms *= 2;
+            if (entry->off_ms > FAST_OPEN_MAX_OFF_MSECS) {
+                entry->off_ms = FAST_OPEN_MAX_OFF_MSECS;
+            }
+        }
+        entry->until_ms = now + entry->off_ms;
+        log_info("server %s:%u: session after a TCP Fast Open connect died young, "
+                 "connecting the usual way for %llds", addr, port,
+                 (long long)(entry->off_ms / 1000));
+    }
+    pthread_mutex_unlock(&table_lock);
+}
+
+
+// forget every server
+void
+fast_open_clear(void) {
+    pthread_mutex_lock(&table_lock);
+    server_table_clear(&table);
+    pthread_mutex_unlock(&table_lock);
+}
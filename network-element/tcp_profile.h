@@ -0,0 +1,65 @@
+/*****************************************************************************
+Copyright (c) 2014-2016, Juniper Networks, Inc.
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions
+are met:
+
+1. Redistributions of source code must retain the above copyright 
+   notice, this list of conditions and the following disclaimer.
+
+2. Redistributions in binary form must reproduce the above copyright
+   notice, this list of conditions and the following disclaimer in the
+   documentation and/or other materials provided with the distribution.
+
+3. Neither the name of the copyright holder nor the names of its 
+   contributors may be used to endorse or promote products derived 
+   from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS 
+"AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT 
+LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS 
+FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE 
+COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, 
+INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, 
+BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; 
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER 
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT 
+LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN 
+ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE 
+POSSIBILITY OF SUCH DAMAGE.
+ *****************************************************************************/
+
+
+
+/*****************************************************************************
+   OVERVIEW
+
+   This header file declares how an app's socket-profile (TCP_NODELAY,
+   TCP_QUICKACK, buffer sizes and TCP Fast Open) is applied to its
+   call-home sockets, and the per-server table that decides when a
+   connect may use TCP Fast Open.
+ *****************************************************************************/
+
+
+/*****************************************************************************
+   MACROS
+ *****************************************************************************/
+
+#define FAST_OPEN_OFF_MSECS      60000    // first time off, doubles per failure
+#define FAST_OPEN_MAX_OFF_MSECS  3600000
+
+
+/*****************************************************************************
+   EXTERNS
+ *****************************************************************************/
+
+// needs ncchd.h for SocketProfile
+extern void tcp_profile_apply(const SocketProfile* profile, int fd);
+extern void tcp_profile_connected(const SocketProfile* profile, int fd);
+extern int  tcp_fast_open_supported(void);
+extern int  tcp_fast_open(int fd);
+extern int  fast_open_check(const char* addr, uint16_t port, int64_t now);
+extern void fast_open_report(const char* addr, uint16_t port, int ok, int64_t now);
+extern void fast_open_clear(void);
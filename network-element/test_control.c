@@ -0,0 +1,235 @@
+/*****************************************************************************
+Copyright (c) 2014-2016, Juniper Networks, Inc.
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions
+are met:
+
+1. Redistributions of source code must retain the above copyright 
+   notice, this list of conditions and the following disclaimer.
+
+2. Redistributions in binary form must reproduce the above copyright
+   notice, this list of conditions and the following disclaimer in the
+   documentation and/or other materials provided with the distribution.
+
+3. Neither the name of the copyright holder nor the names of its 
+   contributors may be used to endorse or promote products derived 
+   from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS 
+"AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT 
+LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS 
+FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE 
+COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, 
+INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, 
+BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; 
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER 
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT 
+LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN 
+ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE 
+POSSIBILITY OF SUCH DAMAGE.
+ *****************************************************************************/
+
+
+
+
+/*****************************************************************************
+   OVERVIEW
+
+   This file checks that ncchd's control socket refuses app names that
+   would put the app's files (.<name>.state, .<name>.sshd_config_file)
+   outside its directory: empty ones, ones starting with '.' (which
+   includes ".."), and ones containing '/'.  A well-formed name is sent
+   too, to show the socket works at all.
+
+   It runs ncchd (see bench_util.c) on a config.xml without apps, then
+   upserts a relay-mode app under each name as `ncchctl upsert` would,
+   and reports, as JSON, each name, ncchd's reply and whether that was
+   the expected one.  It exits 1 if any wasn't.  Usage:
+
+       test_control [path-to-ncchd]
+ *****************************************************************************/
+
+
+/*****************************************************************************
+   INCLUDES AND EXTERNS
+ *****************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <limits.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/un.h>
+#include "bench_util.h"
+
+
+/*****************************************************************************
+   MACROS
+ *****************************************************************************/
+
+#define DEFAULT_NCCHD        "./ncchd"
+#define CONTROL_SOCKET_PATH  ".ncchd.ctl"     // must match ncchd.c
+#define START_SECONDS        5                // for the control socket to appear
+
+
+/*****************************************************************************
+   LOCAL/STATIC DEFINITIONS
+ *****************************************************************************/
+
+typedef struct Case Case;
+struct Case {
+    const char* name;
+    int         ok;    // 1 if ncchd should take the app
+};
+
+static const Case cases[] = {
+    { "",                     0 },
+    { "..",                   0 },
+    { "../escaped",           0 },
+    { "sub/dir",              0 },
+    { ".hidden",              0 },
+    { "app.with-dots_and-1",  1 },
+};
+#define NUM_CASES (sizeof(cases) / sizeof(cases[0]))
+
+
+// send one request and take the reply, as ncchctl does
+static int // 0=OK, 1=ERROR
+control_request(const char* request, char* reply, size_t size) {
+    struct sockaddr_un addr;
+    size_t             len = strlen(request);
+    size_t             reply_len = 0;
+    ssize_t            n;
+    int                fd;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", CONTROL_SOCKET_PATH);
+    fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd == -1 || connect(fd, (struct sockaddr*)&addr, sizeof(addr)) != 0) {
+        if (fd != -1) {
+            close(fd);
+        }
+        return 1;
+    }
+    while (len > 0 && (n = write(fd, request, len)) > 0) {
+        request += n;
+        len -= n;
+    }
+    shutdown(fd, SHUT_WR);  // marks the end of the request
+    while (reply_len < size - 1 && (n = read(fd, reply + reply_len, size - 1 - reply_len)) > 0) {
+        reply_len += n;
+    }
+    reply[reply_len] = '\0';
+    reply[strcspn(reply, "\n")] = '\0';
+    close(fd);
+    return 0;
+}
+
+
+// upsert a relay-mode app called `name`, calling home to a port nothing
+// listens on
+static int // 0=OK, 1=ERROR
+upsert(const char* name, char* reply, size_t size) {
+    char request[1024];
+
+    snprintf(request, sizeof(request),
+             "upsert\n"
+             "<application>\n"
+             "  <name>%s</name>\n"
+             "  <servers><server><address>127.0.0.1</address><port>9</port></server></servers>\n"
+             "  <transport><ssh><host-keys/>"
+             "<relay-to><address>127.0.0.1</address><port>9</port></relay-to>"
+             "</ssh></transport>\n"
+             "  <reconnect-strategy><interval-secs>60</interval-secs></reconnect-strategy>\n"
+             "</application>\n",
+             name);
+    return control_request(request, reply, size);
+}
+
+
+/*****************************************************************************
+   TEST
+ *****************************************************************************/
+
+static int // 0=OK, 1=ERROR
+test_control(const char* ncchd) {
+    char     reply[256];
+    int64_t  deadline;
+    uint32_t idx;
+    int      failed = 0;
+    pid_t    pid;
+
+    pid = bench_start_ncchd(ncchd, "NCCHD_LOG_LEVEL", "info", (char*)NULL);
+    if (pid == -1) {
+        return 1;
+    }
+    deadline = bench_now_ms() + START_SECONDS * 1000;
+    while (access(CONTROL_SOCKET_PATH, F_OK) != 0 && bench_now_ms() < deadline) {
+        usleep(10000);
+    }
+
+    printf("{\"test\": \"control\", \"results\": [\n");
+    for (idx=0; idx<NUM_CASES; idx++) {
+        int took;
+
+        if (upsert(cases[idx].name, reply, sizeof(reply)) != 0) {
+            snprintf(reply, sizeof(reply), "no control socket");
+        }
+        took = (strcmp(reply, "ok") == 0);
+        if (took != cases[idx].ok) {
+            failed = 1;
+        }
+        printf("    {\"name\": \"%s\", \"reply\": \"%s\", \"pass\": %s}%s\n",
+               cases[idx].name, reply, (took == cases[idx].ok) ? "true" : "false",
+               (idx + 1 < NUM_CASES) ? "," : "");
+    }
+    printf("]}\n");
+
+    if (bench_stop_ncchd(pid) != 0) {
+        return 1;
+    }
+    return failed;
+}
+
+
+/*****************************************************************************
+   MAIN
+ *****************************************************************************/
+
+int main(int argc, char* argv[]) {
+    const char* ncchd_arg = DEFAULT_NCCHD;
+    char        ncchd[PATH_MAX];
+    char        dir[] = "/tmp/test_control.XXXXXX";
+    FILE*       file;
+    int         result;
+
+    if (argc > 2) {
+        printf("usage: %s [path-to-ncchd]\n", argv[0]);
+        return 1;
+    }
+    if (argc > 1) {
+        ncchd_arg = argv[1];
+    }
+    if (realpath(ncchd_arg, ncchd) == NULL || access(ncchd, X_OK) != 0) {
+        printf("{\"test\": \"control\", \"error\": \"no ncchd at \\\"%s\\\"\"}\n", ncchd_arg);
+        return 1;
+    }
+    signal(SIGPIPE, SIG_IGN);
+
+    if (bench_scratch_open(dir) != 0 || (file = bench_config_open()) == NULL ||
+        bench_config_close(file) != 0) {
+        printf("{\"test\": \"control\", \"error\": \"could not set up a scratch directory\"}\n");
+        return 1;
+    }
+
+    result = test_control(ncchd);
+    bench_scratch_close(dir, result == 0);
+    return result == 0 ? 0 : 1;
+}